@@ -0,0 +1,299 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "allocator.h"
+#include "lj_alloc.h"
+#ifdef SUSHI_SUPPORT_WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#define ALLOCATOR_ALIGN 16
+#define ALLOCATOR_SMALL_LIMIT 512
+#define ALLOCATOR_BLOCK_LIMIT 65536
+#define ALLOCATOR_SMALL_CLASSES (ALLOCATOR_SMALL_LIMIT / ALLOCATOR_ALIGN)
+#define ALLOCATOR_CLASSES (ALLOCATOR_SMALL_CLASSES + 7)
+
+struct Allocator
+{
+	size_t bytes;
+	size_t peakBytes;
+	size_t limit;
+	unsigned long allocations;
+	unsigned long frees;
+	unsigned long failures;
+	void* first;
+	int creating;
+	int closed;
+	void* heap;
+	unsigned char* arena;
+	size_t arenaSize;
+	size_t arenaUsed;
+	void* freeLists[ALLOCATOR_CLASSES];
+};
+
+// Size classes are 16 byte steps up to 512 bytes, then powers of two up to
+// the largest block that is served from the arena. Lua passes the old size
+// of every block back to the allocator, so the class of a block is always
+// known without keeping a header.
+static int allocator_get_class(size_t size, size_t* classSize)
+{
+	if(size <= ALLOCATOR_SMALL_LIMIT) {
+		int c = (int)((size + ALLOCATOR_ALIGN - 1) / ALLOCATOR_ALIGN);
+		if(c < 1) {
+			c = 1;
+		}
+		*classSize = (size_t)c * ALLOCATOR_ALIGN;
+		return c - 1;
+	}
+	int c = ALLOCATOR_SMALL_CLASSES;
+	size_t v = ALLOCATOR_SMALL_LIMIT * 2;
+	while(v < size) {
+		v *= 2;
+		c++;
+	}
+	*classSize = v;
+	return c;
+}
+
+static int allocator_is_in_arena(Allocator* allocator, void* ptr)
+{
+	return allocator->arena != NULL && (unsigned char*)ptr >= allocator->arena && (unsigned char*)ptr < allocator->arena + allocator->arenaSize;
+}
+
+static void* allocator_arena_alloc(Allocator* allocator, size_t size)
+{
+	if(allocator->arena == NULL || size > ALLOCATOR_BLOCK_LIMIT) {
+		return NULL;
+	}
+	size_t classSize;
+	int c = allocator_get_class(size, &classSize);
+	void* v = allocator->freeLists[c];
+	if(v != NULL) {
+		memcpy(&allocator->freeLists[c], v, sizeof(void*));
+		return v;
+	}
+	if(allocator->arenaSize - allocator->arenaUsed < classSize) {
+		return NULL;
+	}
+	v = allocator->arena + allocator->arenaUsed;
+	allocator->arenaUsed += classSize;
+	return v;
+}
+
+static void allocator_arena_free(Allocator* allocator, void* ptr, size_t size)
+{
+	size_t classSize;
+	int c = allocator_get_class(size, &classSize);
+	memcpy(ptr, &allocator->freeLists[c], sizeof(void*));
+	allocator->freeLists[c] = ptr;
+}
+
+static void allocator_block_free(Allocator* allocator, void* ptr, size_t size)
+{
+	if(allocator_is_in_arena(allocator, ptr)) {
+		allocator_arena_free(allocator, ptr, size);
+	}
+	else {
+		lj_alloc_f(allocator->heap, ptr, size, 0);
+	}
+}
+
+static void* allocator_block_alloc(Allocator* allocator, size_t size)
+{
+	void* v = allocator_arena_alloc(allocator, size);
+	if(v == NULL) {
+		v = lj_alloc_f(allocator->heap, NULL, 0, size);
+	}
+	return v;
+}
+
+static void allocator_destroy(Allocator* allocator)
+{
+	if(allocator->heap != NULL) {
+		lj_alloc_destroy(allocator->heap);
+	}
+	if(allocator->arena != NULL) {
+#ifdef SUSHI_SUPPORT_WIN32
+		VirtualFree(allocator->arena, 0, MEM_RELEASE);
+#else
+		munmap(allocator->arena, allocator->arenaSize);
+#endif
+	}
+	free(allocator);
+}
+
+static void* allocator_alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+	Allocator* allocator = (Allocator*)ud;
+	if(nsize == 0) {
+		if(ptr == NULL) {
+			return NULL;
+		}
+		allocator_block_free(allocator, ptr, osize);
+		allocator->bytes -= osize;
+		allocator->frees++;
+		// The global state is the first block allocated and the last one
+		// freed: this is the end of lua_close.
+		if(ptr == allocator->first) {
+			if(allocator->creating) {
+				allocator->closed = 1;
+			}
+			else {
+				allocator_destroy(allocator);
+			}
+		}
+		return NULL;
+	}
+	if(ptr == NULL) {
+		osize = 0;
+	}
+	if(nsize > osize && allocator->limit > 0 && allocator->bytes + (nsize - osize) > allocator->limit) {
+		allocator->failures++;
+		return NULL;
+	}
+	void* v;
+	if(ptr == NULL) {
+		v = allocator_block_alloc(allocator, nsize);
+		if(v == NULL) {
+			allocator->failures++;
+			return NULL;
+		}
+		if(allocator->first == NULL) {
+			allocator->first = v;
+		}
+		allocator->allocations++;
+	}
+	else if(allocator_is_in_arena(allocator, ptr)) {
+		size_t ocs, ncs;
+		int oc = allocator_get_class(osize, &ocs);
+		if(nsize <= ALLOCATOR_BLOCK_LIMIT && allocator_get_class(nsize, &ncs) == oc) {
+			v = ptr;
+		}
+		else {
+			v = allocator_block_alloc(allocator, nsize);
+			if(v == NULL) {
+				allocator->failures++;
+				return NULL;
+			}
+			memcpy(v, ptr, osize < nsize ? osize : nsize);
+			allocator_arena_free(allocator, ptr, osize);
+		}
+	}
+	else {
+		v = lj_alloc_f(allocator->heap, ptr, osize, nsize);
+		if(v == NULL) {
+			allocator->failures++;
+			return NULL;
+		}
+	}
+	allocator->bytes += nsize;
+	allocator->bytes -= osize;
+	if(allocator->bytes > allocator->peakBytes) {
+		allocator->peakBytes = allocator->bytes;
+	}
+	return v;
+}
+
+static int allocator_panic(lua_State* state)
+{
+	const char* error = lua_tostring(state, -1);
+	fprintf(stderr, "[sushi:error] PANIC: unprotected error in call to Lua API (%s)\n", error ? error : "?");
+	return 0;
+}
+
+lua_State* allocator_new_state(size_t limit, size_t arenaSize, int hugePages)
+{
+	Allocator* allocator = (Allocator*)calloc(1, sizeof(Allocator));
+	if(allocator == NULL) {
+		return NULL;
+	}
+	allocator->limit = limit;
+	allocator->heap = lj_alloc_create();
+	if(allocator->heap == NULL) {
+		free(allocator);
+		return NULL;
+	}
+	if(arenaSize > 0) {
+		arenaSize = (arenaSize + 0x1fffff) & ~(size_t)0x1fffff;
+#ifdef SUSHI_SUPPORT_WIN32
+		void* arena = VirtualAlloc(NULL, arenaSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+		void* arena = mmap(NULL, arenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if(arena == MAP_FAILED) {
+			arena = NULL;
+		}
+#ifdef MADV_HUGEPAGE
+		if(arena != NULL && hugePages) {
+			madvise(arena, arenaSize, MADV_HUGEPAGE);
+		}
+#endif
+#endif
+		if(arena == NULL) {
+			allocator_destroy(allocator);
+			return NULL;
+		}
+		allocator->arena = (unsigned char*)arena;
+		allocator->arenaSize = arenaSize;
+	}
+	allocator->creating = 1;
+	lua_State* state = lua_newstate(allocator_alloc, allocator);
+	allocator->creating = 0;
+	if(state == NULL || allocator->closed) {
+		allocator_destroy(allocator);
+		return NULL;
+	}
+	lua_atpanic(state, allocator_panic);
+	return state;
+}
+
+Allocator* allocator_get(lua_State* state)
+{
+	void* ud = NULL;
+	if(lua_getallocf(state, &ud) != allocator_alloc) {
+		return NULL;
+	}
+	return (Allocator*)ud;
+}
+
+void allocator_get_stats(Allocator* allocator, AllocatorStats* stats)
+{
+	stats->bytes = allocator->bytes;
+	stats->peakBytes = allocator->peakBytes;
+	stats->limit = allocator->limit;
+	stats->allocations = allocator->allocations;
+	stats->frees = allocator->frees;
+	stats->failures = allocator->failures;
+	stats->arenaSize = allocator->arenaSize;
+	stats->arenaUsed = allocator->arenaUsed;
+}
+
+void allocator_set_limit(Allocator* allocator, size_t limit)
+{
+	allocator->limit = limit;
+}
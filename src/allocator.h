@@ -0,0 +1,64 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <stddef.h>
+#include "lua.h"
+
+/*
+ * Memory allocator for interpreter states. Every state gets its own
+ * allocator, which keeps statistics and can enforce a hard limit on the
+ * bytes in use (an allocation that would exceed it fails, which surfaces as
+ * a regular "not enough memory" error in the interpreter). Optionally the
+ * state is backed by an arena: small blocks are carved from one mapping and
+ * recycled through size class free lists, and the whole mapping is released
+ * at once when the state is closed. Larger blocks, and anything that does
+ * not fit once the arena is full, come from a private LuaJIT heap (the same
+ * allocator luaL_newstate would use). The allocator releases itself when
+ * the state is closed.
+ */
+
+typedef struct Allocator Allocator;
+
+typedef struct
+{
+	size_t bytes;
+	size_t peakBytes;
+	size_t limit;
+	unsigned long allocations;
+	unsigned long frees;
+	unsigned long failures;
+	size_t arenaSize;
+	size_t arenaUsed;
+}
+AllocatorStats;
+
+lua_State* allocator_new_state(size_t limit, size_t arenaSize, int hugePages);
+Allocator* allocator_get(lua_State* state);
+void allocator_get_stats(Allocator* allocator, AllocatorStats* stats);
+void allocator_set_limit(Allocator* allocator, size_t limit);
+
+#endif
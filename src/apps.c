@@ -130,10 +130,7 @@ static int execute_install_application(const char* type, const char* app_name, c
 	if(state == NULL) {
 		return -1;
 	}
-	SushiCode* code = (SushiCode*)malloc(sizeof(SushiCode));
-	code->data = (char*)install_application_lz;
-	code->dataSize = install_application_lz_size;
-	code->fileName = "install_application.lz";
+	SushiCode* code = sushi_code_for_buffer((unsigned char*)install_application_lz, install_application_lz_size, "install_application.lz");
 	lua_createtable(state, 3, 0);
 	lua_pushnumber(state, 1);
 	lua_pushstring(state, type);
@@ -0,0 +1,234 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef SUSHI_SUPPORT_WIN32
+#include <windows.h>
+#include <direct.h>
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+#include "lauxlib.h"
+#include "luajit.h"
+#include "zlib.h"
+#include "lz4.h"
+#include "bccache.h"
+
+#define BCCACHE_MAGIC "SUSHIBC1"
+#define BCCACHE_TAG_SIZE 64
+#define BCCACHE_KEY_SIZE (8 + BCCACHE_TAG_SIZE + 8 + 4 + 4)
+#define BCCACHE_HEADER_SIZE (BCCACHE_KEY_SIZE + 4)
+
+typedef struct BccacheKey
+{
+	char tag[BCCACHE_TAG_SIZE];
+	uint64_t length;
+	uint32_t crc;
+	uint32_t hash;
+} BccacheKey;
+
+typedef struct BccacheBuffer
+{
+	unsigned char* data;
+	size_t size;
+	size_t capacity;
+} BccacheBuffer;
+
+// Distinguishes the temporary files of threads storing the same entry
+static volatile long bccache_temp_serial = 0;
+
+static void bccache_put32(unsigned char* p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
+
+static void bccache_make_key(const unsigned char* src, unsigned long srclen, const char* name, BccacheKey* key)
+{
+	memset(key, 0, sizeof(BccacheKey));
+	snprintf(key->tag, BCCACHE_TAG_SIZE, "%s/%s/%d", SUSHI_VERSION, LUAJIT_VERSION, (int)(sizeof(void*) * 8));
+	unsigned int seed = lz4_xxh32((const unsigned char*)key->tag, (long)strlen(key->tag), 0);
+	seed = lz4_xxh32((const unsigned char*)name, (long)strlen(name), seed);
+	key->length = srclen;
+	key->crc = (uint32_t)crc32_z(0L, src, (z_size_t)srclen);
+	key->hash = lz4_xxh32(src, (long)srclen, seed);
+}
+
+static void bccache_make_header(BccacheKey* key, unsigned char* header)
+{
+	memcpy(header, BCCACHE_MAGIC, 8);
+	memcpy(header + 8, key->tag, BCCACHE_TAG_SIZE);
+	bccache_put32(header + 8 + BCCACHE_TAG_SIZE, (uint32_t)(key->length & 0xffffffff));
+	bccache_put32(header + 12 + BCCACHE_TAG_SIZE, (uint32_t)(key->length >> 32));
+	bccache_put32(header + 16 + BCCACHE_TAG_SIZE, key->crc);
+	bccache_put32(header + 20 + BCCACHE_TAG_SIZE, key->hash);
+}
+
+static int bccache_get_path(const char* dir, BccacheKey* key, char* path, size_t pathsize)
+{
+	int n = snprintf(path, pathsize, "%s/bytecode/%08lx%08lx%08lx.bc", dir, (unsigned long)key->hash, (unsigned long)key->crc, (unsigned long)(key->length & 0xffffffff));
+	return n > 0 && (size_t)n < pathsize;
+}
+
+int bccache_load(lua_State* state, const char* dir, const unsigned char* src, unsigned long srclen, const char* name)
+{
+	if(dir == NULL || *dir == 0 || srclen < BCCACHE_MIN_SOURCE_SIZE) {
+		return -1;
+	}
+	BccacheKey key;
+	bccache_make_key(src, srclen, name, &key);
+	char path[PATH_MAX+1];
+	if(bccache_get_path(dir, &key, path, sizeof(path)) == 0) {
+		return -1;
+	}
+	FILE* fp = fopen(path, "rb");
+	if(fp == NULL) {
+		return -1;
+	}
+	struct stat st;
+	if(fstat(fileno(fp), &st) != 0 || st.st_size <= BCCACHE_HEADER_SIZE) {
+		fclose(fp);
+		return -1;
+	}
+	size_t size = (size_t)st.st_size;
+	unsigned char* data = (unsigned char*)malloc(size);
+	if(data == NULL) {
+		fclose(fp);
+		return -1;
+	}
+	size_t got = fread(data, 1, size, fp);
+	fclose(fp);
+	unsigned char header[BCCACHE_HEADER_SIZE];
+	bccache_make_header(&key, header);
+	bccache_put32(header + BCCACHE_KEY_SIZE, (uint32_t)crc32_z(0L, data + BCCACHE_HEADER_SIZE, size - BCCACHE_HEADER_SIZE));
+	if(got != size || memcmp(data, header, BCCACHE_HEADER_SIZE) != 0) {
+		// LuaJIT does not validate bytecode, so anything that does not match
+		// the key and the payload checksum exactly is treated as a miss
+		free(data);
+		return -1;
+	}
+	int r = luaL_loadbuffer(state, (const char*)data + BCCACHE_HEADER_SIZE, size - BCCACHE_HEADER_SIZE, name);
+	free(data);
+	if(r != 0) {
+		lua_pop(state, 1);
+		return -1;
+	}
+	return 0;
+}
+
+static int bccache_writer(lua_State* state, const void* p, size_t sz, void* ud)
+{
+	BccacheBuffer* buffer = (BccacheBuffer*)ud;
+	if(buffer->size + sz > buffer->capacity) {
+		size_t ncap = buffer->capacity * 2;
+		if(ncap < buffer->size + sz) {
+			ncap = buffer->size + sz + 65536;
+		}
+		unsigned char* ndata = (unsigned char*)realloc(buffer->data, ncap);
+		if(ndata == NULL) {
+			return 1;
+		}
+		buffer->data = ndata;
+		buffer->capacity = ncap;
+	}
+	memcpy(buffer->data + buffer->size, p, sz);
+	buffer->size += sz;
+	return 0;
+}
+
+static void bccache_create_directory(const char* path)
+{
+#ifdef SUSHI_SUPPORT_WIN32
+	_mkdir(path);
+#else
+	mkdir(path, 0755);
+#endif
+}
+
+static int bccache_rename(const char* from, const char* to)
+{
+#ifdef SUSHI_SUPPORT_WIN32
+	return MoveFileEx(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#else
+	return rename(from, to);
+#endif
+}
+
+void bccache_store(lua_State* state, const char* dir, const unsigned char* src, unsigned long srclen, const char* name)
+{
+	if(dir == NULL || *dir == 0 || srclen < BCCACHE_MIN_SOURCE_SIZE || lua_isfunction(state, -1) == 0) {
+		return;
+	}
+	BccacheKey key;
+	bccache_make_key(src, srclen, name, &key);
+	char path[PATH_MAX+1];
+	char temp[PATH_MAX+1];
+	if(bccache_get_path(dir, &key, path, sizeof(path)) == 0) {
+		return;
+	}
+	long serial = __sync_add_and_fetch(&bccache_temp_serial, 1);
+#ifdef SUSHI_SUPPORT_WIN32
+	int n = snprintf(temp, sizeof(temp), "%s.%d.%ld.tmp", path, (int)_getpid(), serial);
+#else
+	int n = snprintf(temp, sizeof(temp), "%s.%d.%ld.tmp", path, (int)getpid(), serial);
+#endif
+	if(n < 1 || (size_t)n >= sizeof(temp)) {
+		return;
+	}
+	BccacheBuffer buffer;
+	memset(&buffer, 0, sizeof(BccacheBuffer));
+	if(lua_dump(state, bccache_writer, &buffer) != 0 || buffer.size < 1) {
+		free(buffer.data);
+		return;
+	}
+	char cachedir[PATH_MAX+1];
+	snprintf(cachedir, sizeof(cachedir), "%s/bytecode", dir);
+	bccache_create_directory(dir);
+	bccache_create_directory(cachedir);
+	FILE* fp = fopen(temp, "wb");
+	if(fp == NULL) {
+		free(buffer.data);
+		return;
+	}
+	unsigned char header[BCCACHE_HEADER_SIZE];
+	bccache_make_header(&key, header);
+	bccache_put32(header + BCCACHE_KEY_SIZE, (uint32_t)crc32_z(0L, buffer.data, buffer.size));
+	int ok = fwrite(header, 1, BCCACHE_HEADER_SIZE, fp) == BCCACHE_HEADER_SIZE && fwrite(buffer.data, 1, buffer.size, fp) == buffer.size;
+	if(fclose(fp) != 0) {
+		ok = 0;
+	}
+	free(buffer.data);
+	if(ok == 0 || bccache_rename(temp, path) != 0) {
+		remove(temp);
+	}
+}
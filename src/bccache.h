@@ -0,0 +1,44 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BCCACHE_H
+#define BCCACHE_H
+
+#include "lua.h"
+
+/*
+ * On-disk cache of LuaJIT bytecode for program source code. Cache files live
+ * in a directory of their own and are named by a hash of the source content,
+ * the chunk name and the Sushi/LuaJIT build; each file repeats the full key
+ * and a checksum of the bytecode in its header so that a stale, foreign or
+ * damaged file is never loaded. Files are written to a temporary name and
+ * renamed into place.
+ */
+
+#define BCCACHE_MIN_SOURCE_SIZE 4096
+
+int bccache_load(lua_State* state, const char* dir, const unsigned char* src, unsigned long srclen, const char* name);
+void bccache_store(lua_State* state, const char* dir, const unsigned char* src, unsigned long srclen, const char* name);
+
+#endif
@@ -0,0 +1,168 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "strutil.h"
+
+#define BENCH_SIZE (4 * 1024 * 1024)
+#define BENCH_ROUNDS 50
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* name, double legacy, double current)
+{
+	double mb = (double)BENCH_SIZE * BENCH_ROUNDS / (1024.0 * 1024.0);
+	printf("%-24s legacy %9.1f MB/s   current %9.1f MB/s   speedup %6.2fx\n", name, mb / legacy, mb / current, legacy / current);
+}
+
+static void legacy_to_lower(unsigned char* dst, const unsigned char* src, long len)
+{
+	long n;
+	for(n=0; n<len; n++) {
+		dst[n] = tolower(src[n]);
+	}
+}
+
+static void legacy_to_upper(unsigned char* dst, const unsigned char* src, long len)
+{
+	long n;
+	for(n=0; n<len; n++) {
+		dst[n] = toupper(src[n]);
+	}
+}
+
+static int legacy_compare_ignore_case(const char* s1, const char* s2)
+{
+	int n = 0;
+	while(1) {
+		int s1c = tolower(s1[n]);
+		int s2c = tolower(s2[n]);
+		if(s1c != s2c) {
+			return -1;
+		}
+		if(s1c == 0) {
+			break;
+		}
+		n++;
+	}
+	return 0;
+}
+
+static void legacy_trim(const unsigned char* data, long len, long* start, long* end)
+{
+	long s = 0;
+	long e = len;
+	while(s < e && isspace(data[s])) {
+		s++;
+	}
+	while(e > s && isspace(data[e-1])) {
+		e--;
+	}
+	*start = s;
+	*end = e;
+}
+
+int main(int argc, char** argv)
+{
+	unsigned char* src = (unsigned char*)malloc(BENCH_SIZE + 1);
+	unsigned char* src2 = (unsigned char*)malloc(BENCH_SIZE + 1);
+	unsigned char* dst = (unsigned char*)malloc(BENCH_SIZE + 1);
+	long n;
+	for(n=0; n<BENCH_SIZE; n++) {
+		src[n] = "Content-Type: Text/HTML; Charset=UTF-8\r\n"[n % 40];
+	}
+	src[BENCH_SIZE] = 0;
+	strutil_ascii_to_upper(src2, src, BENCH_SIZE);
+	src2[BENCH_SIZE] = 0;
+	volatile long sink = 0;
+	int r;
+	double t0, legacy, current;
+
+	t0 = now();
+	for(r=0; r<BENCH_ROUNDS; r++) {
+		legacy_to_lower(dst, src, BENCH_SIZE);
+	}
+	legacy = now() - t0;
+	t0 = now();
+	for(r=0; r<BENCH_ROUNDS; r++) {
+		strutil_ascii_to_lower(dst, src, BENCH_SIZE);
+	}
+	current = now() - t0;
+	report("to_lower", legacy, current);
+
+	t0 = now();
+	for(r=0; r<BENCH_ROUNDS; r++) {
+		legacy_to_upper(dst, src, BENCH_SIZE);
+	}
+	legacy = now() - t0;
+	t0 = now();
+	for(r=0; r<BENCH_ROUNDS; r++) {
+		strutil_ascii_to_upper(dst, src, BENCH_SIZE);
+	}
+	current = now() - t0;
+	report("to_upper", legacy, current);
+
+	t0 = now();
+	for(r=0; r<BENCH_ROUNDS; r++) {
+		sink += legacy_compare_ignore_case((const char*)src, (const char*)src2);
+	}
+	legacy = now() - t0;
+	t0 = now();
+	for(r=0; r<BENCH_ROUNDS; r++) {
+		sink += strutil_ascii_compare_ignore_case(src, BENCH_SIZE, src2, BENCH_SIZE);
+	}
+	current = now() - t0;
+	report("compare_ignore_case", legacy, current);
+
+	memset(dst, ' ', BENCH_SIZE);
+	dst[BENCH_SIZE / 2] = 'x';
+	long s, e;
+	t0 = now();
+	for(r=0; r<BENCH_ROUNDS; r++) {
+		legacy_trim(dst, BENCH_SIZE, &s, &e);
+		sink += s + e;
+	}
+	legacy = now() - t0;
+	t0 = now();
+	for(r=0; r<BENCH_ROUNDS; r++) {
+		strutil_ascii_trim(dst, BENCH_SIZE, &s, &e);
+		sink += s + e;
+	}
+	current = now() - t0;
+	report("trim", legacy, current);
+
+	free(src);
+	free(src2);
+	free(dst);
+	return 0;
+}
@@ -0,0 +1,87 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "zbuf.h"
+
+#define BENCH_SIZE (64 * 1024 * 1024)
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill_text(unsigned char* dst, long len)
+{
+	static const char* words[] = { "sushi ", "vm ", "buffer ", "deflate ", "parallel ", "block ", "thread ", "compress ", "stream ", "data\n" };
+	unsigned long seed = 12345;
+	long n = 0;
+	while(n < len) {
+		seed = seed * 1103515245 + 12345;
+		const char* w = words[(seed >> 16) % 10];
+		while(*w && n < len) {
+			dst[n++] = *w++;
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	unsigned char* src = (unsigned char*)malloc(BENCH_SIZE);
+	fill_text(src, BENCH_SIZE);
+	double mb = (double)BENCH_SIZE / (1024.0 * 1024.0);
+	unsigned char* dst = NULL;
+	unsigned long dstlen = 0;
+	double t0 = now();
+	zbuf_deflate(src, BENCH_SIZE, &dst, &dstlen);
+	double single = now() - t0;
+	printf("%-24s %9.1f MB/s   size %lu\n", "zbuf_deflate", mb / single, dstlen);
+	free(dst);
+	int threads;
+	for(threads=1; threads<=16; threads*=2) {
+		t0 = now();
+		if(zbuf_deflate_parallel(src, BENCH_SIZE, ZBUF_FORMAT_ZLIB, -1, threads, &dst, &dstlen) == 0) {
+			printf("zbuf_deflate_parallel failed\n");
+			return 1;
+		}
+		double elapsed = now() - t0;
+		unsigned char* check = NULL;
+		unsigned long checklen = 0;
+		zbuf_inflate(dst, dstlen, &check, &checklen);
+		if(checklen != BENCH_SIZE || memcmp(check, src, BENCH_SIZE) != 0) {
+			printf("zbuf_deflate_parallel round trip failed with %d threads\n", threads);
+			return 1;
+		}
+		printf("parallel %2d threads      %9.1f MB/s   size %lu   speedup %6.2fx\n", threads, mb / elapsed, dstlen, single / elapsed);
+		free(check);
+		free(dst);
+	}
+	free(src);
+	return 0;
+}
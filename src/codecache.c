@@ -0,0 +1,235 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#ifndef SUSHI_SUPPORT_WIN32
+#include <pthread.h>
+#endif
+#include "lauxlib.h"
+#include "lz4.h"
+#include "codecache.h"
+
+// Compiled code is reference counted so that a state can load it without
+// holding the lock while the slot is replaced by another thread
+typedef struct CodecacheCode
+{
+	int refs;
+	size_t size;
+	unsigned char* data;
+} CodecacheCode;
+
+typedef struct CodecacheEntry
+{
+	unsigned int hash;
+	unsigned long srclen;
+	int seen;
+	unsigned char* src;
+	CodecacheCode* code;
+} CodecacheEntry;
+
+typedef struct CodecacheBuffer
+{
+	unsigned char* data;
+	size_t size;
+	size_t capacity;
+} CodecacheBuffer;
+
+static CodecacheEntry entries[CODECACHE_SLOTS];
+static CodecacheStatistics statistics;
+#ifndef SUSHI_SUPPORT_WIN32
+static pthread_mutex_t entries_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void codecache_lock(void)
+{
+#ifndef SUSHI_SUPPORT_WIN32
+	pthread_mutex_lock(&entries_lock);
+#endif
+}
+
+static void codecache_unlock(void)
+{
+#ifndef SUSHI_SUPPORT_WIN32
+	pthread_mutex_unlock(&entries_lock);
+#endif
+}
+
+static unsigned int codecache_hash(const unsigned char* src, unsigned long srclen, const char* name, int kind)
+{
+	unsigned int seed = lz4_xxh32((const unsigned char*)name, (long)strlen(name), (unsigned int)kind);
+	return lz4_xxh32(src, (long)srclen, seed);
+}
+
+// Called with the lock held
+static void codecache_code_release(CodecacheCode* code)
+{
+	if(code != NULL && --code->refs == 0) {
+		free(code->data);
+		free(code);
+	}
+}
+
+static void codecache_entry_free(CodecacheEntry* entry)
+{
+	free(entry->src);
+	codecache_code_release(entry->code);
+	memset(entry, 0, sizeof(CodecacheEntry));
+}
+
+int codecache_load(lua_State* state, const unsigned char* src, unsigned long srclen, const char* name, int kind)
+{
+	if(srclen < 1 || srclen > CODECACHE_MAX_SOURCE_SIZE) {
+		return -1;
+	}
+	unsigned int hash = codecache_hash(src, srclen, name, kind);
+	CodecacheEntry* entry = &entries[hash % CODECACHE_SLOTS];
+	CodecacheCode* code = NULL;
+	codecache_lock();
+	if(entry->code != NULL && entry->hash == hash && entry->srclen == srclen && memcmp(entry->src, src, srclen) == 0) {
+		code = entry->code;
+		code->refs++;
+	}
+	else {
+		statistics.misses++;
+	}
+	codecache_unlock();
+	if(code == NULL) {
+		return -1;
+	}
+	int r = luaL_loadbuffer(state, (const char*)code->data, code->size, name);
+	if(r != 0) {
+		lua_pop(state, 1);
+	}
+	codecache_lock();
+	if(r == 0) {
+		statistics.hits++;
+	}
+	else {
+		statistics.misses++;
+	}
+	codecache_code_release(code);
+	codecache_unlock();
+	return r == 0 ? 0 : -1;
+}
+
+static int codecache_writer(lua_State* state, const void* p, size_t sz, void* ud)
+{
+	CodecacheBuffer* buffer = (CodecacheBuffer*)ud;
+	if(buffer->size + sz > buffer->capacity) {
+		size_t ncap = buffer->capacity * 2;
+		if(ncap < buffer->size + sz) {
+			ncap = buffer->size + sz + 4096;
+		}
+		unsigned char* ndata = (unsigned char*)realloc(buffer->data, ncap);
+		if(ndata == NULL) {
+			return 1;
+		}
+		buffer->data = ndata;
+		buffer->capacity = ncap;
+	}
+	memcpy(buffer->data + buffer->size, p, sz);
+	buffer->size += sz;
+	return 0;
+}
+
+// Called with the function compiled from src on top of the stack. The first
+// call for a given key only marks it as seen; the second one dumps the
+// function and fills the slot.
+void codecache_store(lua_State* state, const unsigned char* src, unsigned long srclen, const char* name, int kind)
+{
+	if(srclen < 1 || srclen > CODECACHE_MAX_SOURCE_SIZE || lua_isfunction(state, -1) == 0) {
+		return;
+	}
+	unsigned int hash = codecache_hash(src, srclen, name, kind);
+	CodecacheEntry* entry = &entries[hash % CODECACHE_SLOTS];
+	codecache_lock();
+	int match = entry->seen && entry->hash == hash && entry->srclen == srclen;
+	if(match == 0 || entry->code != NULL) {
+		if(match == 0) {
+			codecache_entry_free(entry);
+			entry->hash = hash;
+			entry->srclen = srclen;
+			entry->seen = 1;
+		}
+		codecache_unlock();
+		return;
+	}
+	codecache_unlock();
+	CodecacheBuffer buffer;
+	memset(&buffer, 0, sizeof(CodecacheBuffer));
+	unsigned char* copy = (unsigned char*)malloc(srclen);
+	CodecacheCode* code = (CodecacheCode*)malloc(sizeof(CodecacheCode));
+	if(copy == NULL || code == NULL || lua_dump(state, codecache_writer, &buffer) != 0 || buffer.size < 1) {
+		free(copy);
+		free(code);
+		free(buffer.data);
+		return;
+	}
+	memcpy(copy, src, srclen);
+	code->refs = 1;
+	code->size = buffer.size;
+	code->data = buffer.data;
+	codecache_lock();
+	// Another thread may have filled or reused the slot in the meantime
+	if(entry->seen && entry->code == NULL && entry->hash == hash && entry->srclen == srclen) {
+		entry->src = copy;
+		entry->code = code;
+		statistics.stores++;
+		copy = NULL;
+		code = NULL;
+	}
+	codecache_unlock();
+	free(copy);
+	if(code != NULL) {
+		free(code->data);
+		free(code);
+	}
+}
+
+void codecache_get_statistics(CodecacheStatistics* stats)
+{
+	codecache_lock();
+	*stats = statistics;
+	stats->entries = 0;
+	int n;
+	for(n=0; n<CODECACHE_SLOTS; n++) {
+		if(entries[n].code != NULL) {
+			stats->entries++;
+		}
+	}
+	codecache_unlock();
+}
+
+int codecache_load_buffer(lua_State* state, const unsigned char* src, unsigned long srclen, const char* name)
+{
+	if(codecache_load(state, src, srclen, name, 0) == 0) {
+		return 0;
+	}
+	int r = luaL_loadbuffer(state, (const char*)src, srclen, name);
+	if(r == 0 && (srclen < 1 || src[0] != LUA_SIGNATURE[0])) {
+		codecache_store(state, src, srclen, name, 0);
+	}
+	return r;
+}
@@ -0,0 +1,59 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef CODECACHE_H
+#define CODECACHE_H
+
+#include "lua.h"
+
+/*
+ * In-process cache of compiled code, shared by every interpreter state of
+ * the process. Entries are keyed by a hash of the code as given, the chunk
+ * name and a caller supplied kind, and hold the code together with the
+ * LuaJIT bytecode it compiled to, so that new states load the bytecode
+ * instead of parsing the code again. Code is remembered the first time it is
+ * seen and only compiled into the cache when it comes back, so code that is
+ * loaded once per process costs no more than a hash. The cache is a fixed
+ * number of slots and is safe to use from several threads.
+ */
+
+#define CODECACHE_SLOTS 64
+#define CODECACHE_MAX_SOURCE_SIZE (16 * 1024 * 1024)
+
+// Process wide counters: loads served from the cache, lookups that found
+// nothing to load, compiled code added, and the slots currently filled
+typedef struct CodecacheStatistics
+{
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long stores;
+	int entries;
+} CodecacheStatistics;
+
+int codecache_load(lua_State* state, const unsigned char* src, unsigned long srclen, const char* name, int kind);
+void codecache_store(lua_State* state, const unsigned char* src, unsigned long srclen, const char* name, int kind);
+int codecache_load_buffer(lua_State* state, const unsigned char* src, unsigned long srclen, const char* name);
+void codecache_get_statistics(CodecacheStatistics* stats);
+
+#endif
@@ -0,0 +1,159 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "zbuf.h"
+#include "embed.h"
+
+struct Embed
+{
+	MappedFile* file;
+	SappEntry* entries;
+	long count;
+	MappedFileIndex index;
+};
+
+static uint64_t embed_read64be(const unsigned char* p)
+{
+	uint64_t v = 0;
+	int n;
+	for(n=0; n<8; n++) {
+		v = (v << 8) | p[n];
+	}
+	return v;
+}
+
+static void embed_write64be(unsigned char* p, uint64_t v)
+{
+	int n;
+	for(n=7; n>=0; n--) {
+		p[n] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+int embed_read_trailer(const unsigned char* trailer, uint64_t fileSize, uint64_t* codeOffset, uint64_t* codeSize, uint64_t* resourceOffset, uint64_t* resourceSize)
+{
+	if(fileSize < EMBED_TRAILER_SIZE || memcmp(trailer + 32, "SupR", 4) != 0) {
+		return 0;
+	}
+	uint64_t limit = fileSize - EMBED_TRAILER_SIZE;
+	*codeOffset = embed_read64be(trailer);
+	*codeSize = embed_read64be(trailer + 8);
+	*resourceOffset = embed_read64be(trailer + 16);
+	*resourceSize = embed_read64be(trailer + 24);
+	if(*codeOffset > limit || *codeSize > limit - *codeOffset || *resourceOffset > limit || *resourceSize > limit - *resourceOffset) {
+		return 0;
+	}
+	return 1;
+}
+
+void embed_write_trailer(unsigned char* trailer, uint64_t codeOffset, uint64_t codeSize, uint64_t resourceOffset, uint64_t resourceSize)
+{
+	embed_write64be(trailer, codeOffset);
+	embed_write64be(trailer + 8, codeSize);
+	embed_write64be(trailer + 16, resourceOffset);
+	embed_write64be(trailer + 24, resourceSize);
+	memcpy(trailer + 32, "SupR", 4);
+}
+
+void embed_close(Embed* embed)
+{
+	if(embed == NULL) {
+		return;
+	}
+	mappedfile_release(embed->file);
+	mappedfile_index_free(&embed->index);
+	free(embed->entries);
+	free(embed);
+}
+
+Embed* embed_open(const char* path)
+{
+	Embed* embed = (Embed*)calloc(1, sizeof(Embed));
+	if(embed == NULL) {
+		return NULL;
+	}
+	embed->file = mappedfile_open(path, EMBED_TRAILER_SIZE);
+	if(embed->file == NULL) {
+		free(embed);
+		return NULL;
+	}
+	const unsigned char* data = embed->file->data;
+	uint64_t size = embed->file->size;
+	uint64_t codeOffset, codeSize, resourceOffset, resourceSize;
+	if(embed_read_trailer(data + size - EMBED_TRAILER_SIZE, size, &codeOffset, &codeSize, &resourceOffset, &resourceSize) == 0) {
+		embed_close(embed);
+		return NULL;
+	}
+	if(resourceSize > 0) {
+		embed->entries = sapp_read_index(data + resourceOffset, (unsigned long)resourceSize, &embed->count);
+		if(embed->entries == NULL) {
+			embed_close(embed);
+			return NULL;
+		}
+	}
+	if(mappedfile_index_init(&embed->index, embed->count) == 0) {
+		embed_close(embed);
+		return NULL;
+	}
+	long n;
+	for(n=0; n<embed->count; n++) {
+		mappedfile_index_add(&embed->index, embed->entries[n].name, embed->entries[n].namelen, n);
+	}
+	return embed;
+}
+
+MappedFile* embed_get_file(Embed* embed)
+{
+	return embed->file;
+}
+
+long embed_get_count(Embed* embed)
+{
+	return embed->count;
+}
+
+SappEntry* embed_get_entry(Embed* embed, long index)
+{
+	if(index < 0 || index >= embed->count) {
+		return NULL;
+	}
+	return &embed->entries[index];
+}
+
+long embed_find(Embed* embed, const char* name, long namelen)
+{
+	return mappedfile_index_find(&embed->index, name, namelen);
+}
+
+int embed_extract(Embed* embed, long index, unsigned char** dst, unsigned long* dstlen)
+{
+	SappEntry* entry = embed_get_entry(embed, index);
+	if(entry == NULL || (entry->flags & SAPP_FLAG_DEFLATE) == 0) {
+		return 0;
+	}
+	return zbuf_inflate((unsigned char*)entry->data, (unsigned long)entry->size, dst, dstlen);
+}
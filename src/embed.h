@@ -0,0 +1,58 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef EMBED_H
+#define EMBED_H
+
+#include <stdint.h>
+#include "sapp.h"
+#include "mappedfile.h"
+
+/*
+ * Payload appended to the Sushi executable. The original format is the code
+ * followed by an 8 byte footer: "SupP" and the 32 bit (big endian) offset of
+ * the code. The extended format adds a resource table and ends with a 36
+ * byte trailer: the 64 bit (big endian) offset and size of the code, the
+ * offset and size of the resource table, and "SupR". The resource table is
+ * a packed archive (see sapp.h) whose entries may be individually deflated.
+ */
+
+#define EMBED_FOOTER_SIZE 8
+#define EMBED_TRAILER_SIZE 36
+
+typedef struct Embed Embed;
+
+int embed_read_trailer(const unsigned char* trailer, uint64_t fileSize, uint64_t* codeOffset, uint64_t* codeSize, uint64_t* resourceOffset, uint64_t* resourceSize);
+void embed_write_trailer(unsigned char* trailer, uint64_t codeOffset, uint64_t codeSize, uint64_t resourceOffset, uint64_t resourceSize);
+// Resource data points into the mapped file; a reference to it taken with
+// mappedfile_retain keeps that data valid after the Embed is closed.
+Embed* embed_open(const char* path);
+void embed_close(Embed* embed);
+MappedFile* embed_get_file(Embed* embed);
+long embed_get_count(Embed* embed);
+SappEntry* embed_get_entry(Embed* embed, long index);
+long embed_find(Embed* embed, const char* name, long namelen);
+int embed_extract(Embed* embed, long index, unsigned char** dst, unsigned long* dstlen);
+
+#endif
@@ -0,0 +1,354 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include "encoding.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define ENCODING_SSE2 1
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#define ENCODING_X86 1
+#endif
+
+static const char base64_alphabet[2][65] = {
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/",
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"
+};
+
+static const unsigned char base64_decode_table[2][256] = {
+	{
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+		0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+		0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+		0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	},
+	{
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff,
+		0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+		0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0x3f,
+		0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+		0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	}
+};
+
+static const unsigned char hex_decode_table[256] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+#ifdef ENCODING_X86
+static int encoding_ssse3 = -1;
+
+// SSSE3 is not part of the baseline x86-64 target, so the Base64 kernels
+// are compiled for it separately and only used when the CPU has it.
+static int encoding_has_ssse3()
+{
+	int v = encoding_ssse3;
+	if(v < 0) {
+		__builtin_cpu_init();
+		v = __builtin_cpu_supports("ssse3") ? 1 : 0;
+		encoding_ssse3 = v;
+	}
+	return v;
+}
+
+// Encodes 12 bytes into 16 characters per iteration: a shuffle and two
+// multiplies split every three bytes into four 6-bit indices, and each
+// index is turned into a character by adding an offset selected by its
+// range. Returns the number of bytes consumed.
+__attribute__((target("ssse3")))
+static long encoding_base64_encode_ssse3(const unsigned char* src, long len, unsigned char* dst, int variant)
+{
+	const __m128i shuffle = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+	const __m128i offsets = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4,
+		variant == ENCODING_BASE64URL ? '-' - 62 : '+' - 62, variant == ENCODING_BASE64URL ? '_' - 63 : '/' - 63, 0, 0);
+	long n = 0;
+	while(n + 16 <= len) {
+		__m128i in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + n)), shuffle);
+		__m128i hi = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+		__m128i lo = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+		__m128i indices = _mm_or_si128(hi, lo);
+		__m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+		range = _mm_sub_epi8(range, _mm_cmpgt_epi8(indices, _mm_set1_epi8(25)));
+		_mm_storeu_si128((__m128i*)(dst + n / 3 * 4), _mm_add_epi8(indices, _mm_shuffle_epi8(offsets, range)));
+		n += 12;
+	}
+	return n;
+}
+
+// Decodes 16 characters into 12 bytes per iteration. The characters are
+// classified by range; a block with anything outside the alphabet stops
+// the loop and is left to the scalar code, which reports the error.
+// Returns the number of characters consumed.
+__attribute__((target("ssse3")))
+static long encoding_base64_decode_ssse3(const unsigned char* src, long len, unsigned char* dst, int variant)
+{
+	const char c62 = variant == ENCODING_BASE64URL ? '-' : '+';
+	const char c63 = variant == ENCODING_BASE64URL ? '_' : '/';
+	const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	long n = 0;
+	while(n + 16 <= len) {
+		__m128i in = _mm_loadu_si128((const __m128i*)(src + n));
+		__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('A' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), in));
+		__m128i lower = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('a' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), in));
+		__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), in));
+		__m128i is62 = _mm_cmpeq_epi8(in, _mm_set1_epi8(c62));
+		__m128i is63 = _mm_cmpeq_epi8(in, _mm_set1_epi8(c63));
+		__m128i valid = _mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(_mm_or_si128(digit, is62), is63));
+		if(_mm_movemask_epi8(valid) != 0xffff) {
+			break;
+		}
+		__m128i shift = _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')), _mm_and_si128(lower, _mm_set1_epi8(26 - 'a')));
+		shift = _mm_or_si128(shift, _mm_and_si128(digit, _mm_set1_epi8(52 - '0')));
+		shift = _mm_or_si128(shift, _mm_and_si128(is62, _mm_set1_epi8(62 - c62)));
+		shift = _mm_or_si128(shift, _mm_and_si128(is63, _mm_set1_epi8(63 - c63)));
+		__m128i values = _mm_add_epi8(in, shift);
+		// Merge pairs of 6-bit values into 12 bits, then pairs of those into
+		// 24 bits, and gather the three bytes of each group in order
+		__m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+		merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+		merged = _mm_shuffle_epi8(merged, pack);
+		unsigned char* p = dst + n / 4 * 3;
+		_mm_storel_epi64((__m128i*)p, merged);
+		uint32_t last = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(merged, 8));
+		memcpy(p + 8, &last, 4);
+		n += 16;
+	}
+	return n;
+}
+#endif
+
+long encoding_base64_encoded_length(long len, int pad)
+{
+	if(pad) {
+		return (len + 2) / 3 * 4;
+	}
+	return len / 3 * 4 + (len % 3 == 0 ? 0 : len % 3 + 1);
+}
+
+long encoding_base64_encode(const unsigned char* src, long len, unsigned char* dst, int variant, int pad)
+{
+	const char* alphabet = base64_alphabet[variant == ENCODING_BASE64URL ? 1 : 0];
+	unsigned char* p = dst;
+	long n = 0;
+#ifdef ENCODING_X86
+	if(encoding_has_ssse3()) {
+		n = encoding_base64_encode_ssse3(src, len, dst, variant);
+		p += n / 3 * 4;
+	}
+#endif
+	while(n + 3 <= len) {
+		unsigned int v = (src[n] << 16) | (src[n+1] << 8) | src[n+2];
+		p[0] = alphabet[(v >> 18) & 0x3f];
+		p[1] = alphabet[(v >> 12) & 0x3f];
+		p[2] = alphabet[(v >> 6) & 0x3f];
+		p[3] = alphabet[v & 0x3f];
+		p += 4;
+		n += 3;
+	}
+	long rest = len - n;
+	if(rest > 0) {
+		unsigned int v = src[n] << 16;
+		if(rest > 1) {
+			v |= src[n+1] << 8;
+		}
+		*p++ = alphabet[(v >> 18) & 0x3f];
+		*p++ = alphabet[(v >> 12) & 0x3f];
+		if(rest > 1) {
+			*p++ = alphabet[(v >> 6) & 0x3f];
+		}
+		else if(pad) {
+			*p++ = '=';
+		}
+		if(pad) {
+			*p++ = '=';
+		}
+	}
+	return (long)(p - dst);
+}
+
+long encoding_base64_decoded_length(const unsigned char* src, long len)
+{
+	if(len > 0 && src[len-1] == '=') {
+		len--;
+		if(len > 0 && src[len-1] == '=') {
+			len--;
+		}
+	}
+	if(len % 4 == 1) {
+		return -1;
+	}
+	return len / 4 * 3 + (len % 4 == 0 ? 0 : len % 4 - 1);
+}
+
+long encoding_base64_decode(const unsigned char* src, long len, unsigned char* dst, int variant)
+{
+	const unsigned char* table = base64_decode_table[variant == ENCODING_BASE64URL ? 1 : 0];
+	long padding = 0;
+	if(len > 0 && src[len-1] == '=') {
+		padding++;
+		if(len > 1 && src[len-2] == '=') {
+			padding++;
+		}
+		if(len % 4 != 0) {
+			return -1;
+		}
+	}
+	len -= padding;
+	if(len % 4 == 1) {
+		return -1;
+	}
+	unsigned char* p = dst;
+	long n = 0;
+#ifdef ENCODING_X86
+	if(encoding_has_ssse3()) {
+		n = encoding_base64_decode_ssse3(src, len, dst, variant);
+		p += n / 4 * 3;
+	}
+#endif
+	while(n + 4 <= len) {
+		unsigned int a = table[src[n]];
+		unsigned int b = table[src[n+1]];
+		unsigned int c = table[src[n+2]];
+		unsigned int d = table[src[n+3]];
+		if((a | b | c | d) & 0x80) {
+			return -1;
+		}
+		unsigned int v = (a << 18) | (b << 12) | (c << 6) | d;
+		p[0] = (v >> 16) & 0xff;
+		p[1] = (v >> 8) & 0xff;
+		p[2] = v & 0xff;
+		p += 3;
+		n += 4;
+	}
+	long rest = len - n;
+	if(rest > 0) {
+		unsigned int a = table[src[n]];
+		unsigned int b = table[src[n+1]];
+		unsigned int c = rest > 2 ? table[src[n+2]] : 0;
+		if((a | b | c) & 0x80) {
+			return -1;
+		}
+		unsigned int v = (a << 18) | (b << 12) | (c << 6);
+		// Reject encodings whose unused trailing bits are not zero, so that
+		// every decoded value has exactly one valid encoding.
+		if(rest == 2 && (v & 0xffff) != 0) {
+			return -1;
+		}
+		if(rest == 3 && (v & 0xff) != 0) {
+			return -1;
+		}
+		*p++ = (v >> 16) & 0xff;
+		if(rest > 2) {
+			*p++ = (v >> 8) & 0xff;
+		}
+	}
+	return (long)(p - dst);
+}
+
+long encoding_hex_encode(const unsigned char* src, long len, unsigned char* dst, int upper)
+{
+	const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	long n = 0;
+#ifdef ENCODING_SSE2
+	// Each nibble becomes '0' + nibble, plus the distance to the letters
+	// for nibbles that are greater than nine.
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	const __m128i zero = _mm_set1_epi8('0');
+	const __m128i nine = _mm_set1_epi8(9);
+	const __m128i letters = _mm_set1_epi8((upper ? 'A' : 'a') - '0' - 10);
+	while(n + 16 <= len) {
+		__m128i block = _mm_loadu_si128((const __m128i*)(src + n));
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(block, 4), mask);
+		__m128i lo = _mm_and_si128(block, mask);
+		hi = _mm_add_epi8(_mm_add_epi8(hi, zero), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), letters));
+		lo = _mm_add_epi8(_mm_add_epi8(lo, zero), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), letters));
+		_mm_storeu_si128((__m128i*)(dst + n * 2), _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i*)(dst + n * 2 + 16), _mm_unpackhi_epi8(hi, lo));
+		n += 16;
+	}
+#endif
+	for(; n<len; n++) {
+		dst[n*2] = digits[src[n] >> 4];
+		dst[n*2+1] = digits[src[n] & 0x0f];
+	}
+	return len * 2;
+}
+
+long encoding_hex_decode(const unsigned char* src, long len, unsigned char* dst)
+{
+	if(len % 2 != 0) {
+		return -1;
+	}
+	long n;
+	for(n=0; n<len; n+=2) {
+		unsigned char hi = hex_decode_table[src[n]];
+		unsigned char lo = hex_decode_table[src[n+1]];
+		if((hi | lo) & 0x80) {
+			return -1;
+		}
+		dst[n/2] = (hi << 4) | lo;
+	}
+	return len / 2;
+}
@@ -0,0 +1,38 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef ENCODING_H
+#define ENCODING_H
+
+#define ENCODING_BASE64 0
+#define ENCODING_BASE64URL 1
+
+long encoding_base64_encoded_length(long len, int pad);
+long encoding_base64_encode(const unsigned char* src, long len, unsigned char* dst, int variant, int pad);
+long encoding_base64_decoded_length(const unsigned char* src, long len);
+long encoding_base64_decode(const unsigned char* src, long len, unsigned char* dst, int variant);
+long encoding_hex_encode(const unsigned char* src, long len, unsigned char* dst, int upper);
+long encoding_hex_decode(const unsigned char* src, long len, unsigned char* dst);
+
+#endif
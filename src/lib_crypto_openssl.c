@@ -29,6 +29,7 @@
 #include <openssl/rsa.h>
 #include <openssl/bio.h>
 #include "sushi.h"
+#include "lib_util.h"
 
 static SSL_CTX* context = NULL;
 
@@ -130,20 +131,17 @@ int ssl_write(lua_State* state)
 		lua_pushnumber(state, -1);
 		return 1;
 	}
-	void* ptr = luaL_checkudata(state, 3, "_sushi_buffer");
-	if(ptr == NULL) {
-		lua_pushnumber(state, -1);
-		return 1;
-	}
+	long bsz = 0;
+	const unsigned char* ptr = lib_util_check_buffer_data(state, 3, &bsz);
 	long size = luaL_checknumber(state, 4);
-	if(size < 0) {
-		memcpy(&size, ptr, sizeof(long));
+	if(size < 0 || size > bsz) {
+		size = bsz;
 	}
 	if(size == 0) {
 		lua_pushnumber(state, 0);
 		return 1;
 	}
-	int r = SSL_write(ssl, ptr + sizeof(long), size);
+	int r = SSL_write(ssl, ptr, size);
 	if(r == 0) {
 		r = -1;
 	}
@@ -192,25 +190,18 @@ RSA *create_rsa(unsigned char *key, int forPublic)
 
 int rs256_sign(lua_State* state)
 {
-	void* dataptr = luaL_checkudata(state, 2, "_sushi_buffer");
-	if(dataptr == NULL) {
-		lua_pushnil(state);
-		lua_pushstring(state, "null data");
-		return 2;
-	}
 	long size = 0;
-	memcpy(&size, dataptr, sizeof(long));
+	const unsigned char* dataptr = lib_util_check_buffer_data(state, 2, &size);
 	unsigned char *privatekeystr = luaL_checkstring(state, 3);
 	if(privatekeystr == NULL) {
 		lua_pushnil(state);
 		lua_pushstring(state, "null private key");
 		return 2;
 	}
-	unsigned char *datapointer = (unsigned char*)dataptr+sizeof(long);
 	unsigned char *databuff[SHA256_DIGEST_LENGTH];
 	SHA256_CTX ctx;
 	SHA256_Init(&ctx);
-	SHA256_Update(&ctx, datapointer, size);
+	SHA256_Update(&ctx, dataptr, size);
 	SHA256_Final(databuff, &ctx);
 	RSA *privatersa = create_rsa(privatekeystr, 0);
 	if(privatersa == NULL) {
@@ -243,42 +234,28 @@ int rs256_sign(lua_State* state)
 
 int rs256_verify(lua_State* state)
 {
-	void* dataptr = luaL_checkudata(state, 2, "_sushi_buffer");
-	if(dataptr == NULL) {
-		lua_pushnumber(state, 0);
-		lua_pushstring(state, "null data");
-		return 2;
-	}
 	long datasz = 0;
-	memcpy(&datasz, dataptr, sizeof(long));
-	void* sigptr = luaL_checkudata(state, 3, "_sushi_buffer");
-	if(sigptr == NULL) {
-		lua_pushnumber(state, 0);
-		lua_pushstring(state, "null signature");
-		return 2;
-	}
+	const unsigned char* dataptr = lib_util_check_buffer_data(state, 2, &datasz);
 	long sigsz = 0;
-	memcpy(&sigsz, sigptr, sizeof(long));
+	const unsigned char* sigptr = lib_util_check_buffer_data(state, 3, &sigsz);
 	unsigned char *keyptr = luaL_checkstring(state, 4);
 	if(keyptr == NULL) {
 		lua_pushnumber(state, 0);
 		lua_pushstring(state, "null public key");
 		return 2;
 	}
-	unsigned char *datapointer = (unsigned char*)dataptr+sizeof(long);
 	unsigned char *databuff[SHA256_DIGEST_LENGTH];
 	SHA256_CTX ctx;
 	SHA256_Init(&ctx);
-	SHA256_Update(&ctx, datapointer, datasz);
+	SHA256_Update(&ctx, dataptr, datasz);
 	SHA256_Final(databuff, &ctx);
-	unsigned char *signaturepointer = (unsigned char*)sigptr+sizeof(long);
 	RSA *publicrsa = create_rsa(keyptr, 1);
 	if(publicrsa == NULL) {
 		lua_pushnumber(state, 0);
 		lua_pushstring(state, "failed to create RSA");
 		return 2;
 	}
-	int verify = RSA_verify(NID_sha256, databuff, SHA256_DIGEST_LENGTH, signaturepointer, (unsigned int)sigsz, publicrsa);
+	int verify = RSA_verify(NID_sha256, databuff, SHA256_DIGEST_LENGTH, sigptr, (unsigned int)sigsz, publicrsa);
 	if(verify != 1) {
 		lua_pushnumber(state, 0);
 		lua_pushstring(state, ERR_reason_error_string(ERR_get_error()));
@@ -28,15 +28,16 @@
 #include <stdint.h>
 #include <string.h>
 #include "lib_image.h"
+#include "lib_util.h"
 
 typedef struct {
 	png_bytep buffer;
-	png_uint_32 size;
+	png_size_t size;
 } IMAGE_DATA_HOLDER;
 
-static void encode_png_data_to_memory(png_structp png_ptr, png_bytep data, png_uint_32 length) {
+static void encode_png_data_to_memory(png_structp png_ptr, png_bytep data, png_size_t length) {
 	IMAGE_DATA_HOLDER * p = png_get_io_ptr(png_ptr);
-	png_uint_32 nsize = p->size + length;
+	png_size_t nsize = p->size + length;
 	if(p->buffer) {
 		p->buffer = (png_bytep)realloc(p->buffer, nsize);
 	}
@@ -55,18 +56,15 @@ void flush_png(png_structp png_ptr) {
 
 static int encode_png_data(lua_State* state)
 {
-	void* data = luaL_checkudata(state, 2, "_sushi_buffer");
-	if(data == NULL) {
-		lua_pushnil(state);
-		return 1;
-	}
+	long datasize = 0;
+	const unsigned char* data = lib_util_check_buffer_data(state, 2, &datasize);
 	int width = luaL_checkint(state, 3);
 	if(width < 1) {
 		lua_pushnil(state);
 		return 1;
 	}
 	int height = luaL_checkint(state, 4);
-	if(height < 1) {
+	if(height < 1 || data == NULL || datasize / 4 / width < height) {
 		lua_pushnil(state);
 		return 1;
 	}
@@ -82,7 +80,6 @@ static int encode_png_data(lua_State* state)
 		return 1;
 	}
 	png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-	data = data + sizeof(long);
 	int y;
 	int x;
 	png_byte **row_pointers = png_malloc(png_ptr, sizeof(png_byte*) * height);
@@ -91,7 +88,7 @@ static int encode_png_data(lua_State* state)
 		png_byte *row = png_malloc(png_ptr, rowcount);
 		row_pointers[y] = row;
 		for(x = 0; x < rowcount; x++) {
-			row[x] = ((png_byte*)data)[(y * rowcount) + x];
+			row[x] = data[(y * rowcount) + x];
 		}
 	}
 	IMAGE_DATA_HOLDER pdh;
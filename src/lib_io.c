@@ -32,6 +32,8 @@
 #include <string.h>
 #include <limits.h>
 #include "lib_io.h"
+#include "lib_util.h"
+#include "embed.h"
 #ifdef SUSHI_SUPPORT_LINUX
 #include <sys/timerfd.h>
 #endif
@@ -388,12 +390,12 @@ static int read_from_handle(lua_State* state)
 		lua_pushnumber(state, -1);
 		return 1;
 	}
-	int v = read(fd, ptr+sizeof(long), sz);
+	ssize_t v = read(fd, ptr+sizeof(long), (size_t)sz);
 	if(v < 1) {
 		lua_pushnumber(state, -1);
 		return 1;
 	}
-	lua_pushnumber(state, v);
+	lua_pushnumber(state, (lua_Number)v);
 	return 1;
 }
 
@@ -405,24 +407,21 @@ static int write_to_handle(lua_State* state)
 		lua_pushnumber(state, -1);
 		return 1;
 	}
-	void* ptr = luaL_checkudata(state, 2, "_sushi_buffer");
-	if(ptr == NULL) {
-		lua_pushnumber(state, -1);
-		return 1;
-	}
+	long bsz = 0;
+	const unsigned char* ptr = lib_util_check_buffer_data(state, 2, &bsz);
 	long size = luaL_checknumber(state, 3);
-	if(size < 0) {
-		memcpy(&size, ptr, sizeof(long));
+	if(size < 0 || size > bsz) {
+		size = bsz;
 	}
 	if(size == 0) {
 		lua_pushnumber(state, 0);
 		return 1;
 	}
-	int r = write(fd, ptr + sizeof(long), size);
+	ssize_t r = write(fd, ptr, (size_t)size);
 	if(r == 0) {
 		r = -1;
 	}
-	lua_pushnumber(state, r);
+	lua_pushnumber(state, (lua_Number)r);
 	return 1;
 }
 
@@ -437,22 +436,22 @@ static int get_size_for_handle(lua_State* state)
 	}
 	off_t end = lseek(fd, 0, SEEK_END);
 	lseek(fd, original, SEEK_SET);
-	lua_pushnumber(state, end);
+	lua_pushnumber(state, (lua_Number)end);
 	return 1;
 }
 
 static int get_current_position(lua_State* state)
 {
 	int fd = luaL_checknumber(state, 2);
-	lua_pushnumber(state, lseek(fd, 0, SEEK_CUR));
+	lua_pushnumber(state, (lua_Number)lseek(fd, 0, SEEK_CUR));
 	return 1;
 }
 
 static int set_current_position(lua_State* state)
 {
 	int fd = luaL_checknumber(state, 2);
-	long npos = luaL_checknumber(state, 3);
-	lua_pushnumber(state, lseek(fd, npos, SEEK_SET));
+	off_t npos = (off_t)luaL_checknumber(state, 3);
+	lua_pushnumber(state, (lua_Number)lseek(fd, npos, SEEK_SET));
 	return 1;
 }
 
@@ -542,6 +541,148 @@ static int start_timer(lua_State* state)
 	return 1;
 }
 
+// Maps a whole file read-only and returns it as a view, so that files larger
+// than a buffer can hold can still be hashed, searched or sliced without
+// reading them into memory. Empty and unmappable files give nil.
+static int map_file(lua_State* state)
+{
+	const char* path = luaL_checkstring(state, 2);
+	MappedFile* file = mappedfile_open(path, 1);
+	if(file == NULL || file->size > (uint64_t)LONG_MAX) {
+		mappedfile_release(file);
+		lua_pushnil(state);
+		return 1;
+	}
+	lib_util_push_mapped_file_view(state, file, file->data, (long)file->size);
+	mappedfile_release(file);
+	return 1;
+}
+
+static Embed* embedded_resources_check(lua_State* state, int index)
+{
+	Embed** ptr = (Embed**)luaL_checkudata(state, index, "_sushi_embed");
+	if(ptr == NULL) {
+		return NULL;
+	}
+	return *ptr;
+}
+
+static int open_embedded_resources(lua_State* state)
+{
+	const char* path = luaL_optstring(state, 2, NULL);
+	if(path == NULL) {
+		path = sushi_get_executable_path();
+	}
+	Embed* embed = embed_open(path);
+	if(embed == NULL) {
+		lua_pushnil(state);
+		return 1;
+	}
+	Embed** ptr = (Embed**)lua_newuserdata(state, sizeof(Embed*));
+	*ptr = embed;
+	luaL_getmetatable(state, "_sushi_embed");
+	lua_setmetatable(state, -2);
+	return 1;
+}
+
+static int get_embedded_resource_names(lua_State* state)
+{
+	Embed* embed = embedded_resources_check(state, 2);
+	if(embed == NULL) {
+		lua_pushnil(state);
+		return 1;
+	}
+	long count = embed_get_count(embed);
+	lua_createtable(state, (int)count, 0);
+	long n;
+	for(n=0; n<count; n++) {
+		SappEntry* entry = embed_get_entry(embed, n);
+		lua_pushlstring(state, entry->name, entry->namelen);
+		lua_rawseti(state, -2, (int)n + 1);
+	}
+	return 1;
+}
+
+static int unpack_embedded_resource(lua_State* state, void* archive, long index)
+{
+	unsigned char* data = NULL;
+	unsigned long size = 0;
+	if(embed_extract((Embed*)archive, index, &data, &size) == 0) {
+		return 0;
+	}
+	memcpy(lib_util_push_new_buffer(state, (long)size), data, size);
+	free(data);
+	return 1;
+}
+
+// Stored resources are returned as views of the mapped executable; deflated
+// ones are unpacked into a new buffer.
+static int read_embedded_resource(lua_State* state)
+{
+	Embed* embed = embedded_resources_check(state, 2);
+	size_t len = 0;
+	const char* name = luaL_checklstring(state, 3, &len);
+	long index = embed != NULL ? embed_find(embed, name, (long)len) : -1;
+	SappEntry* entry = index >= 0 ? embed_get_entry(embed, index) : NULL;
+	if(entry == NULL) {
+		lua_pushnil(state);
+		return 1;
+	}
+	const unsigned char* stored = (entry->flags & SAPP_FLAG_DEFLATE) == 0 ? entry->data : NULL;
+	lib_util_push_archive_entry(state, embed_get_file(embed), stored, (long)entry->size, unpack_embedded_resource, embed, index);
+	return 1;
+}
+
+// Appends the code and an optional resource archive to the file at the given
+// path (normally a copy of the Sushi executable), followed by the trailer
+// that locates both.
+static int append_embedded_payload(lua_State* state)
+{
+	const char* path = luaL_checkstring(state, 2);
+	long codesize = 0;
+	long ressize = 0;
+	const unsigned char* code = lib_util_check_buffer_data(state, 3, &codesize);
+	const unsigned char* resources = (const unsigned char*)"";
+	if(lua_isnoneornil(state, 4) == 0) {
+		resources = lib_util_check_buffer_data(state, 4, &ressize);
+	}
+	FILE* fp = fopen(path, "ab");
+	if(fp == NULL) {
+		lua_pushboolean(state, 0);
+		return 1;
+	}
+	long offset = -1;
+	if(fseek(fp, 0, SEEK_END) == 0) {
+		offset = ftell(fp);
+	}
+	unsigned char trailer[EMBED_TRAILER_SIZE];
+	embed_write_trailer(trailer, (uint64_t)offset, (uint64_t)codesize, (uint64_t)offset + codesize, (uint64_t)ressize);
+	int ok = offset >= 0 && fwrite(code, 1, codesize, fp) == (size_t)codesize
+		&& fwrite(resources, 1, ressize, fp) == (size_t)ressize
+		&& fwrite(trailer, 1, EMBED_TRAILER_SIZE, fp) == EMBED_TRAILER_SIZE;
+	if(fclose(fp) != 0) {
+		ok = 0;
+	}
+	lua_pushboolean(state, ok);
+	return 1;
+}
+
+static int close_embedded_resources_gc(lua_State* state)
+{
+	Embed** ptr = (Embed**)luaL_checkudata(state, 1, "_sushi_embed");
+	if(ptr != NULL && *ptr != NULL) {
+		embed_close(*ptr);
+		*ptr = NULL;
+	}
+	return 0;
+}
+
+static int close_embedded_resources(lua_State* state)
+{
+	lua_remove(state, 1);
+	return close_embedded_resources_gc(state);
+}
+
 static const luaL_Reg funcs[] = {
 	{ "get_file_info", get_file_info },
 	{ "set_file_mode", set_file_mode },
@@ -568,11 +709,24 @@ static const luaL_Reg funcs[] = {
 	{ "write_to_stdout", write_to_stdout },
 	{ "write_to_stderr", write_to_stderr },
 	{ "start_timer", start_timer },
+	{ "map_file", map_file },
+	{ "open_embedded_resources", open_embedded_resources },
+	{ "get_embedded_resource_names", get_embedded_resource_names },
+	{ "read_embedded_resource", read_embedded_resource },
+	{ "close_embedded_resources", close_embedded_resources },
+	{ "append_embedded_payload", append_embedded_payload },
 	{ NULL, NULL }
 };
 
 void lib_io_init(lua_State* state)
 {
+	// _sushi_embed type
+	luaL_newmetatable(state, "_sushi_embed");
+	lua_pushliteral(state, "__gc");
+	lua_pushcfunction(state, close_embedded_resources_gc);
+	lua_rawset(state, -3);
+	lua_pop(state, 1);
+	// function table
 	luaL_newlib(state, funcs);
 	lua_setglobal(state, "_io");
 }
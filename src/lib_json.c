@@ -0,0 +1,917 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "lib_json.h"
+#include "numconv.h"
+#include "lib_util.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define JSON_SSE2 1
+#endif
+
+// Decoded arrays and objects carry a shared metatable so that they encode
+// back to the same JSON type (notably when empty). Objects parsed with key
+// order preservation get their own metatable holding the key list in __keys,
+// and the names whose value was null (nil in Lua) as a set in __nulls.
+
+#define JSON_MAX_DEPTH 1000
+
+typedef struct
+{
+	const unsigned char* start;
+	const unsigned char* p;
+	const unsigned char* end;
+	int ordered;
+	int exactIntegers;
+	int depth;
+	const char* error;
+} JsonParser;
+
+typedef struct
+{
+	unsigned char* data;
+	size_t size;
+	size_t capacity;
+	int depth;
+	const char* error;
+} JsonWriter;
+
+static int is_json_whitespace(unsigned char c)
+{
+	return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static const unsigned char* skip_whitespace(const unsigned char* p, const unsigned char* end)
+{
+	if(p < end && is_json_whitespace(*p) == 0) {
+		return p;
+	}
+#if defined(JSON_SSE2)
+	const __m128i sp = _mm_set1_epi8(' ');
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i tab = _mm_set1_epi8('\t');
+	while(end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		__m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, nl)), _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, tab)));
+		int mask = ~_mm_movemask_epi8(ws) & 0xffff;
+		if(mask != 0) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 16;
+	}
+#endif
+	while(p < end && is_json_whitespace(*p)) {
+		p++;
+	}
+	return p;
+}
+
+// Finds the first quote, backslash or control character
+static const unsigned char* find_string_special(const unsigned char* p, const unsigned char* end)
+{
+#if defined(JSON_SSE2)
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i ctrl = _mm_set1_epi8(0x1f);
+	while(end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		__m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)), _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl));
+		int mask = _mm_movemask_epi8(special);
+		if(mask != 0) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 16;
+	}
+#endif
+	while(p < end && *p != '"' && *p != '\\' && *p >= 0x20) {
+		p++;
+	}
+	return p;
+}
+
+static int parse_fail(JsonParser* parser, const char* error)
+{
+	parser->error = error;
+	return 0;
+}
+
+static int parse_hex4(const unsigned char* p, unsigned int* value)
+{
+	unsigned int v = 0;
+	int n;
+	for(n = 0; n < 4; n++) {
+		unsigned char c = p[n];
+		v <<= 4;
+		if(c >= '0' && c <= '9') {
+			v |= c - '0';
+		}
+		else if(c >= 'a' && c <= 'f') {
+			v |= c - 'a' + 10;
+		}
+		else if(c >= 'A' && c <= 'F') {
+			v |= c - 'A' + 10;
+		}
+		else {
+			return 0;
+		}
+	}
+	*value = v;
+	return 1;
+}
+
+static int parse_escape(JsonParser* parser, luaL_Buffer* buffer)
+{
+	const unsigned char* p = parser->p + 1;
+	if(p >= parser->end) {
+		return parse_fail(parser, "unterminated string");
+	}
+	unsigned char c = *p++;
+	switch(c) {
+		case '"': luaL_addchar(buffer, '"'); break;
+		case '\\': luaL_addchar(buffer, '\\'); break;
+		case '/': luaL_addchar(buffer, '/'); break;
+		case 'b': luaL_addchar(buffer, '\b'); break;
+		case 'f': luaL_addchar(buffer, '\f'); break;
+		case 'n': luaL_addchar(buffer, '\n'); break;
+		case 'r': luaL_addchar(buffer, '\r'); break;
+		case 't': luaL_addchar(buffer, '\t'); break;
+		case 'u': {
+			unsigned int cp;
+			if(parser->end - p < 4 || parse_hex4(p, &cp) == 0) {
+				return parse_fail(parser, "invalid unicode escape");
+			}
+			p += 4;
+			if(cp >= 0xdc00 && cp <= 0xdfff) {
+				return parse_fail(parser, "invalid unicode escape");
+			}
+			if(cp >= 0xd800 && cp <= 0xdbff) {
+				unsigned int low;
+				if(parser->end - p < 6 || p[0] != '\\' || p[1] != 'u' || parse_hex4(p + 2, &low) == 0 || low < 0xdc00 || low > 0xdfff) {
+					return parse_fail(parser, "invalid unicode escape");
+				}
+				p += 6;
+				cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+			}
+			char utf8[4];
+			int n;
+			if(cp < 0x80) {
+				utf8[0] = (char)cp;
+				n = 1;
+			}
+			else if(cp < 0x800) {
+				utf8[0] = (char)(0xc0 | (cp >> 6));
+				utf8[1] = (char)(0x80 | (cp & 0x3f));
+				n = 2;
+			}
+			else if(cp < 0x10000) {
+				utf8[0] = (char)(0xe0 | (cp >> 12));
+				utf8[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+				utf8[2] = (char)(0x80 | (cp & 0x3f));
+				n = 3;
+			}
+			else {
+				utf8[0] = (char)(0xf0 | (cp >> 18));
+				utf8[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+				utf8[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+				utf8[3] = (char)(0x80 | (cp & 0x3f));
+				n = 4;
+			}
+			luaL_addlstring(buffer, utf8, n);
+			break;
+		}
+		default:
+			return parse_fail(parser, "invalid escape sequence");
+	}
+	parser->p = p;
+	return 1;
+}
+
+static int parse_string(lua_State* state, JsonParser* parser)
+{
+	const unsigned char* begin = parser->p + 1;
+	const unsigned char* p = find_string_special(begin, parser->end);
+	if(p < parser->end && *p == '"') {
+		lua_pushlstring(state, (const char*)begin, p - begin);
+		parser->p = p + 1;
+		return 1;
+	}
+	luaL_Buffer buffer;
+	luaL_buffinit(state, &buffer);
+	for(;;) {
+		luaL_addlstring(&buffer, (const char*)begin, p - begin);
+		parser->p = p;
+		if(p >= parser->end) {
+			return parse_fail(parser, "unterminated string");
+		}
+		if(*p == '"') {
+			break;
+		}
+		if(*p != '\\') {
+			return parse_fail(parser, "control character in string");
+		}
+		if(parse_escape(parser, &buffer) == 0) {
+			return 0;
+		}
+		begin = parser->p;
+		p = find_string_special(begin, parser->end);
+	}
+	luaL_pushresult(&buffer);
+	parser->p++;
+	return 1;
+}
+
+static int parse_number(lua_State* state, JsonParser* parser)
+{
+	const unsigned char* begin = parser->p;
+	const unsigned char* p = begin;
+	const unsigned char* end = parser->end;
+	int integer = 1;
+	if(p < end && *p == '-') {
+		p++;
+	}
+	if(p >= end || *p < '0' || *p > '9') {
+		return parse_fail(parser, "invalid number");
+	}
+	if(*p == '0') {
+		p++;
+	}
+	else {
+		while(p < end && *p >= '0' && *p <= '9') {
+			p++;
+		}
+	}
+	if(p < end && *p == '.') {
+		integer = 0;
+		p++;
+		if(p >= end || *p < '0' || *p > '9') {
+			return parse_fail(parser, "invalid number");
+		}
+		while(p < end && *p >= '0' && *p <= '9') {
+			p++;
+		}
+	}
+	if(p < end && (*p == 'e' || *p == 'E')) {
+		integer = 0;
+		p++;
+		if(p < end && (*p == '+' || *p == '-')) {
+			p++;
+		}
+		if(p >= end || *p < '0' || *p > '9') {
+			return parse_fail(parser, "invalid number");
+		}
+		while(p < end && *p >= '0' && *p <= '9') {
+			p++;
+		}
+	}
+	parser->p = p;
+	double v;
+	if(numconv_parse_double((const char*)begin, p - begin, &v)) {
+		lua_pushnumber(state, v);
+		return 1;
+	}
+	lua_pushlstring(state, (const char*)begin, p - begin);
+	v = lua_tonumber(state, -1);
+	if(integer && parser->exactIntegers && (v > 9007199254740992.0 || v < -9007199254740992.0)) {
+		return 1;
+	}
+	lua_pop(state, 1);
+	lua_pushnumber(state, v);
+	return 1;
+}
+
+static int parse_literal(lua_State* state, JsonParser* parser, const char* literal, int len)
+{
+	if(parser->end - parser->p < len || memcmp(parser->p, literal, len) != 0) {
+		return parse_fail(parser, "invalid literal");
+	}
+	parser->p += len;
+	if(literal[0] == 't') {
+		lua_pushboolean(state, 1);
+	}
+	else if(literal[0] == 'f') {
+		lua_pushboolean(state, 0);
+	}
+	else {
+		lua_pushnil(state);
+	}
+	return 1;
+}
+
+static int parse_value(lua_State* state, JsonParser* parser);
+
+static int parse_array(lua_State* state, JsonParser* parser)
+{
+	lua_newtable(state);
+	luaL_getmetatable(state, JSON_ARRAY_META);
+	lua_setmetatable(state, -2);
+	parser->p = skip_whitespace(parser->p + 1, parser->end);
+	if(parser->p < parser->end && *parser->p == ']') {
+		parser->p++;
+		return 1;
+	}
+	int n = 0;
+	for(;;) {
+		if(parse_value(state, parser) == 0) {
+			return 0;
+		}
+		lua_rawseti(state, -2, ++n);
+		parser->p = skip_whitespace(parser->p, parser->end);
+		if(parser->p >= parser->end) {
+			return parse_fail(parser, "unterminated array");
+		}
+		if(*parser->p == ']') {
+			parser->p++;
+			return 1;
+		}
+		if(*parser->p != ',') {
+			return parse_fail(parser, "expected ',' or ']'");
+		}
+		parser->p++;
+	}
+}
+
+static int parse_object(lua_State* state, JsonParser* parser)
+{
+	lua_newtable(state);
+	int obj = lua_gettop(state);
+	int nkeys = 0;
+	int nulls = 0;
+	if(parser->ordered) {
+		lua_newtable(state);
+	}
+	parser->p = skip_whitespace(parser->p + 1, parser->end);
+	if(parser->p < parser->end && *parser->p == '}') {
+		parser->p++;
+	}
+	else {
+		for(;;) {
+			if(parser->p >= parser->end || *parser->p != '"') {
+				return parse_fail(parser, "expected string key");
+			}
+			if(parse_string(state, parser) == 0) {
+				return 0;
+			}
+			if(parser->ordered) {
+				lua_pushvalue(state, -1);
+				lua_rawseti(state, obj + 1, ++nkeys);
+			}
+			parser->p = skip_whitespace(parser->p, parser->end);
+			if(parser->p >= parser->end || *parser->p != ':') {
+				return parse_fail(parser, "expected ':'");
+			}
+			parser->p = skip_whitespace(parser->p + 1, parser->end);
+			if(parse_value(state, parser) == 0) {
+				return 0;
+			}
+			if(parser->ordered && lua_isnil(state, -1)) {
+				if(nulls == 0) {
+					lua_newtable(state);
+					lua_insert(state, obj + 2);
+					nulls = obj + 2;
+				}
+				lua_pushvalue(state, -2);
+				lua_pushboolean(state, 1);
+				lua_rawset(state, nulls);
+			}
+			lua_rawset(state, obj);
+			parser->p = skip_whitespace(parser->p, parser->end);
+			if(parser->p >= parser->end) {
+				return parse_fail(parser, "unterminated object");
+			}
+			if(*parser->p == '}') {
+				parser->p++;
+				break;
+			}
+			if(*parser->p != ',') {
+				return parse_fail(parser, "expected ',' or '}'");
+			}
+			parser->p = skip_whitespace(parser->p + 1, parser->end);
+		}
+	}
+	if(parser->ordered) {
+		lua_createtable(state, 0, 2);
+		lua_pushvalue(state, obj + 1);
+		lua_setfield(state, -2, "__keys");
+		if(nulls > 0) {
+			lua_pushvalue(state, nulls);
+			lua_setfield(state, -2, "__nulls");
+		}
+		lua_setmetatable(state, obj);
+		lua_pop(state, nulls > 0 ? 2 : 1);
+	}
+	else {
+		luaL_getmetatable(state, JSON_OBJECT_META);
+		lua_setmetatable(state, obj);
+	}
+	return 1;
+}
+
+static int parse_value(lua_State* state, JsonParser* parser)
+{
+	parser->p = skip_whitespace(parser->p, parser->end);
+	if(parser->p >= parser->end) {
+		return parse_fail(parser, "unexpected end of input");
+	}
+	unsigned char c = *parser->p;
+	if(c == '"') {
+		return parse_string(state, parser);
+	}
+	if(c == '{' || c == '[') {
+		if(++parser->depth > JSON_MAX_DEPTH || lua_checkstack(state, 6) == 0) {
+			return parse_fail(parser, "nesting too deep");
+		}
+		int r = c == '{' ? parse_object(state, parser) : parse_array(state, parser);
+		parser->depth--;
+		return r;
+	}
+	if(c == '-' || (c >= '0' && c <= '9')) {
+		return parse_number(state, parser);
+	}
+	if(c == 't') {
+		return parse_literal(state, parser, "true", 4);
+	}
+	if(c == 'f') {
+		return parse_literal(state, parser, "false", 5);
+	}
+	if(c == 'n') {
+		return parse_literal(state, parser, "null", 4);
+	}
+	return parse_fail(parser, "unexpected character");
+}
+
+static int parse(lua_State* state)
+{
+	const unsigned char* data;
+	size_t len = 0;
+	if(lua_type(state, 2) == LUA_TUSERDATA) {
+		long size = 0;
+		data = lib_util_check_buffer_data(state, 2, &size);
+		len = (size_t)size;
+	}
+	else {
+		data = (const unsigned char*)lua_tolstring(state, 2, &len);
+	}
+	if(data == NULL) {
+		lua_pushnil(state);
+		lua_pushstring(state, "no input");
+		return 2;
+	}
+	JsonParser parser;
+	parser.start = data;
+	parser.p = data;
+	parser.end = data + len;
+	parser.ordered = lua_toboolean(state, 3);
+	parser.exactIntegers = lua_toboolean(state, 4);
+	parser.depth = 0;
+	parser.error = NULL;
+	int top = lua_gettop(state);
+	if(parse_value(state, &parser)) {
+		parser.p = skip_whitespace(parser.p, parser.end);
+		if(parser.p == parser.end) {
+			return 1;
+		}
+		parser.error = "unexpected trailing data";
+	}
+	lua_settop(state, top);
+	lua_pushnil(state);
+	lua_pushfstring(state, "%s at offset %d", parser.error, (int)(parser.p - parser.start));
+	return 2;
+}
+
+static int write_reserve(JsonWriter* writer, size_t n)
+{
+	if(writer->size + n <= writer->capacity) {
+		return 1;
+	}
+	size_t nc = writer->capacity < 256 ? 256 : writer->capacity;
+	while(nc < writer->size + n) {
+		nc *= 2;
+	}
+	unsigned char* nd = (unsigned char*)realloc(writer->data, nc);
+	if(nd == NULL) {
+		writer->error = "out of memory";
+		return 0;
+	}
+	writer->data = nd;
+	writer->capacity = nc;
+	return 1;
+}
+
+static int write_bytes(JsonWriter* writer, const void* data, size_t n)
+{
+	if(write_reserve(writer, n) == 0) {
+		return 0;
+	}
+	memcpy(writer->data + writer->size, data, n);
+	writer->size += n;
+	return 1;
+}
+
+static int write_string(JsonWriter* writer, const unsigned char* str, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	// Worst case is six output bytes per input byte
+	if(write_reserve(writer, len * 6 + 2) == 0) {
+		return 0;
+	}
+	unsigned char* out = writer->data + writer->size;
+	const unsigned char* p = str;
+	const unsigned char* end = str + len;
+	*out++ = '"';
+	while(p < end) {
+		const unsigned char* s = find_string_special(p, end);
+		memcpy(out, p, s - p);
+		out += s - p;
+		if(s >= end) {
+			break;
+		}
+		unsigned char c = *s;
+		*out++ = '\\';
+		switch(c) {
+			case '"': *out++ = '"'; break;
+			case '\\': *out++ = '\\'; break;
+			case '\b': *out++ = 'b'; break;
+			case '\f': *out++ = 'f'; break;
+			case '\n': *out++ = 'n'; break;
+			case '\r': *out++ = 'r'; break;
+			case '\t': *out++ = 't'; break;
+			default:
+				*out++ = 'u';
+				*out++ = '0';
+				*out++ = '0';
+				*out++ = hex[c >> 4];
+				*out++ = hex[c & 0xf];
+		}
+		p = s + 1;
+	}
+	*out++ = '"';
+	writer->size = out - writer->data;
+	return 1;
+}
+
+// Integral values that a double holds exactly (up to 2^53) are written
+// without a fraction; anything else uses the shortest round-trip form.
+static int format_number(lua_Number nn, char* v, int size)
+{
+	if(nn >= -9007199254740992.0 && nn <= 9007199254740992.0 && nn == floor(nn)) {
+		return numconv_format_integer((int64_t)nn, v);
+	}
+	return numconv_format_shortest(nn, v, size);
+}
+
+static int write_number(JsonWriter* writer, lua_Number nn)
+{
+	char v[64];
+	if(isfinite(nn) == 0) {
+		return write_bytes(writer, "null", 4);
+	}
+	int n = format_number(nn, v, sizeof(v));
+	return write_bytes(writer, v, n);
+}
+
+static int encode_value(lua_State* state, JsonWriter* writer, int idx);
+
+static int write_key(lua_State* state, JsonWriter* writer, int idx)
+{
+	int tt = lua_type(state, idx);
+	if(tt == LUA_TSTRING) {
+		size_t len;
+		const char* str = lua_tolstring(state, idx, &len);
+		return write_string(writer, (const unsigned char*)str, len);
+	}
+	if(tt == LUA_TNUMBER) {
+		char v[64];
+		int n = format_number(lua_tonumber(state, idx), v, sizeof(v));
+		return write_string(writer, (const unsigned char*)v, n);
+	}
+	writer->error = "unsupported key type";
+	return 0;
+}
+
+static int write_member(lua_State* state, JsonWriter* writer, int keyidx, int validx, int* first)
+{
+	if(*first == 0 && write_bytes(writer, ",", 1) == 0) {
+		return 0;
+	}
+	*first = 0;
+	if(write_key(state, writer, keyidx) == 0 || write_bytes(writer, ":", 1) == 0) {
+		return 0;
+	}
+	return encode_value(state, writer, validx);
+}
+
+// Names listed twice are written once. A listed name without a value is
+// skipped unless it was parsed as null (nulls is 0 when there is no set).
+static int encode_ordered_object(lua_State* state, JsonWriter* writer, int idx, int keys, int nulls)
+{
+	int first = 1;
+	int n = lua_objlen(state, keys);
+	int i;
+	lua_newtable(state);
+	int seen = lua_gettop(state);
+	for(i = 1; i <= n; i++) {
+		lua_rawgeti(state, keys, i);
+		lua_pushvalue(state, -1);
+		lua_rawget(state, seen);
+		int skip = lua_toboolean(state, -1);
+		lua_pop(state, 1);
+		lua_pushvalue(state, -1);
+		lua_pushboolean(state, 1);
+		lua_rawset(state, seen);
+		lua_pushvalue(state, -1);
+		lua_rawget(state, idx);
+		if(skip == 0 && lua_isnil(state, -1)) {
+			skip = 1;
+			if(nulls > 0) {
+				lua_pushvalue(state, -2);
+				lua_rawget(state, nulls);
+				skip = lua_toboolean(state, -1) == 0;
+				lua_pop(state, 1);
+			}
+		}
+		if(skip == 0 && write_member(state, writer, -2, -1, &first) == 0) {
+			return 0;
+		}
+		lua_pop(state, 2);
+	}
+	lua_pushnil(state);
+	while(lua_next(state, idx) != 0) {
+		lua_pushvalue(state, -2);
+		lua_rawget(state, seen);
+		int listed = lua_toboolean(state, -1);
+		lua_pop(state, 1);
+		if(listed == 0 && write_member(state, writer, -2, -1, &first) == 0) {
+			return 0;
+		}
+		lua_pop(state, 1);
+	}
+	lua_pop(state, 1);
+	return 1;
+}
+
+static int encode_table(lua_State* state, JsonWriter* writer, int idx)
+{
+	int isarray = -1;
+	if(lua_getmetatable(state, idx)) {
+		lua_getfield(state, -1, "__keys");
+		if(lua_istable(state, -1)) {
+			int keys = lua_gettop(state);
+			lua_getfield(state, -2, "__nulls");
+			int nulls = lua_istable(state, -1) ? keys + 1 : 0;
+			if(write_bytes(writer, "{", 1) == 0 || encode_ordered_object(state, writer, idx, keys, nulls) == 0) {
+				return 0;
+			}
+			lua_pop(state, 3);
+			return write_bytes(writer, "}", 1);
+		}
+		lua_pop(state, 1);
+		luaL_getmetatable(state, JSON_ARRAY_META);
+		if(lua_rawequal(state, -1, -2)) {
+			isarray = 1;
+		}
+		lua_pop(state, 1);
+		luaL_getmetatable(state, JSON_OBJECT_META);
+		if(lua_rawequal(state, -1, -2)) {
+			isarray = 0;
+		}
+		lua_pop(state, 2);
+	}
+	int n = lua_objlen(state, idx);
+	if(isarray < 0) {
+		isarray = 0;
+		if(n > 0) {
+			int count = 0;
+			isarray = 1;
+			lua_pushnil(state);
+			while(lua_next(state, idx) != 0) {
+				lua_pop(state, 1);
+				lua_Number key = lua_type(state, -1) == LUA_TNUMBER ? lua_tonumber(state, -1) : 0;
+				if(key < 1 || key > n || key != (int)key) {
+					isarray = 0;
+					lua_pop(state, 1);
+					break;
+				}
+				count++;
+			}
+			if(count != n) {
+				isarray = 0;
+			}
+		}
+	}
+	int first = 1;
+	if(isarray) {
+		int i;
+		if(write_bytes(writer, "[", 1) == 0) {
+			return 0;
+		}
+		for(i = 1; i <= n; i++) {
+			if(i > 1 && write_bytes(writer, ",", 1) == 0) {
+				return 0;
+			}
+			lua_rawgeti(state, idx, i);
+			if(encode_value(state, writer, lua_gettop(state)) == 0) {
+				return 0;
+			}
+			lua_pop(state, 1);
+		}
+		return write_bytes(writer, "]", 1);
+	}
+	if(write_bytes(writer, "{", 1) == 0) {
+		return 0;
+	}
+	lua_pushnil(state);
+	while(lua_next(state, idx) != 0) {
+		if(write_member(state, writer, -2, -1, &first) == 0) {
+			return 0;
+		}
+		lua_pop(state, 1);
+	}
+	return write_bytes(writer, "}", 1);
+}
+
+static int encode_value(lua_State* state, JsonWriter* writer, int idx)
+{
+	if(idx < 0) {
+		idx = lua_gettop(state) + idx + 1;
+	}
+	switch(lua_type(state, idx)) {
+		case LUA_TNIL:
+			return write_bytes(writer, "null", 4);
+		case LUA_TBOOLEAN:
+			return lua_toboolean(state, idx) ? write_bytes(writer, "true", 4) : write_bytes(writer, "false", 5);
+		case LUA_TNUMBER:
+			return write_number(writer, lua_tonumber(state, idx));
+		case LUA_TSTRING: {
+			size_t len;
+			const char* str = lua_tolstring(state, idx, &len);
+			return write_string(writer, (const unsigned char*)str, len);
+		}
+		case LUA_TTABLE: {
+			if(++writer->depth > JSON_MAX_DEPTH || lua_checkstack(state, 8) == 0) {
+				writer->error = "nesting too deep or reference cycle";
+				return 0;
+			}
+			int r = encode_table(state, writer, idx);
+			writer->depth--;
+			return r;
+		}
+	}
+	writer->error = "unsupported value type";
+	return 0;
+}
+
+static int encode_common(lua_State* state, int tobuffer)
+{
+	JsonWriter writer;
+	memset(&writer, 0, sizeof(writer));
+	int top = lua_gettop(state);
+	if(top < 2) {
+		lua_pushnil(state);
+	}
+	if(encode_value(state, &writer, 2) == 0) {
+		free(writer.data);
+		lua_settop(state, top);
+		lua_pushnil(state);
+		lua_pushstring(state, writer.error);
+		return 2;
+	}
+	lua_settop(state, top);
+	if(tobuffer) {
+		long size = (long)writer.size;
+		void* ptr = lua_newuserdata(state, sizeof(long) + writer.size);
+		luaL_getmetatable(state, "_sushi_buffer");
+		lua_setmetatable(state, -2);
+		memcpy(ptr, &size, sizeof(long));
+		if(writer.size > 0) {
+			memcpy((unsigned char*)ptr + sizeof(long), writer.data, writer.size);
+		}
+	}
+	else {
+		lua_pushlstring(state, (const char*)writer.data, writer.size);
+	}
+	free(writer.data);
+	return 1;
+}
+
+static int encode(lua_State* state)
+{
+	return encode_common(state, 0);
+}
+
+static int encode_to_buffer(lua_State* state)
+{
+	return encode_common(state, 1);
+}
+
+static int mark_with_metatable(lua_State* state, const char* name)
+{
+	luaL_checktype(state, 2, LUA_TTABLE);
+	luaL_getmetatable(state, name);
+	lua_setmetatable(state, 2);
+	lua_pushvalue(state, 2);
+	return 1;
+}
+
+static int mark_as_array(lua_State* state)
+{
+	return mark_with_metatable(state, JSON_ARRAY_META);
+}
+
+static int mark_as_object(lua_State* state)
+{
+	return mark_with_metatable(state, JSON_OBJECT_META);
+}
+
+static int get_object_keys(lua_State* state)
+{
+	luaL_checktype(state, 2, LUA_TTABLE);
+	lua_newtable(state);
+	int result = lua_gettop(state);
+	int n = 0;
+	lua_newtable(state);
+	int seen = lua_gettop(state);
+	if(lua_getmetatable(state, 2)) {
+		lua_getfield(state, -1, "__keys");
+		if(lua_istable(state, -1)) {
+			int keys = lua_gettop(state);
+			int count = lua_objlen(state, keys);
+			int i;
+			for(i = 1; i <= count; i++) {
+				lua_rawgeti(state, keys, i);
+				lua_pushvalue(state, -1);
+				lua_rawget(state, seen);
+				if(lua_toboolean(state, -1) == 0) {
+					lua_pushvalue(state, -2);
+					lua_pushboolean(state, 1);
+					lua_rawset(state, seen);
+					lua_pushvalue(state, -2);
+					lua_rawseti(state, result, ++n);
+				}
+				lua_pop(state, 2);
+			}
+		}
+		lua_pop(state, 2);
+	}
+	lua_pushnil(state);
+	while(lua_next(state, 2) != 0) {
+		lua_pop(state, 1);
+		lua_pushvalue(state, -1);
+		lua_rawget(state, seen);
+		if(lua_toboolean(state, -1) == 0) {
+			lua_pushvalue(state, -2);
+			lua_rawseti(state, result, ++n);
+		}
+		lua_pop(state, 1);
+	}
+	lua_pop(state, 1);
+	return 1;
+}
+
+static const luaL_Reg funcs[] = {
+	{ "parse", parse },
+	{ "encode", encode },
+	{ "encode_to_buffer", encode_to_buffer },
+	{ "mark_as_array", mark_as_array },
+	{ "mark_as_object", mark_as_object },
+	{ "get_object_keys", get_object_keys },
+	{ NULL, NULL }
+};
+
+void lib_json_init_types(lua_State* state)
+{
+	luaL_newmetatable(state, JSON_ARRAY_META);
+	lua_pop(state, 1);
+	luaL_newmetatable(state, JSON_OBJECT_META);
+	lua_pop(state, 1);
+}
+
+void lib_json_init(lua_State* state)
+{
+	luaL_newlib(state, funcs);
+	lua_setglobal(state, "_json");
+}
@@ -0,0 +1,768 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "lib_msgpack.h"
+#include "lib_json.h"
+#include "lib_util.h"
+
+// MessagePack (_msgpack) and CBOR (_cbor) codecs between Lua values and
+// _sushi_buffer. Integral numbers that fit in 64 bits are written as
+// integers and everything else as 64-bit floats. Buffers map to binary
+// strings. Arrays and maps share the JSON metatables so that empty
+// containers keep their type across a round trip.
+
+#define PACK_MSGPACK 0
+#define PACK_CBOR 1
+#define PACK_MAX_DEPTH 1000
+
+#define UNPACK_OK 0
+#define UNPACK_INCOMPLETE 1
+#define UNPACK_INVALID 2
+
+typedef struct
+{
+	unsigned char* data;
+	size_t size;
+	size_t capacity;
+	int growable;
+	int format;
+	int depth;
+} PackWriter;
+
+typedef struct
+{
+	const unsigned char* p;
+	const unsigned char* end;
+	int format;
+	int depth;
+	int status;
+} PackReader;
+
+static int pack_reserve(PackWriter* writer, size_t n)
+{
+	if(writer->size + n <= writer->capacity) {
+		return 1;
+	}
+	if(writer->growable == 0) {
+		return 0;
+	}
+	size_t nc = writer->capacity < 256 ? 256 : writer->capacity;
+	while(nc < writer->size + n) {
+		nc *= 2;
+	}
+	unsigned char* nd = (unsigned char*)realloc(writer->data, nc);
+	if(nd == NULL) {
+		return 0;
+	}
+	writer->data = nd;
+	writer->capacity = nc;
+	return 1;
+}
+
+static int pack_bytes(PackWriter* writer, const void* data, size_t n)
+{
+	if(pack_reserve(writer, n) == 0) {
+		return 0;
+	}
+	memcpy(writer->data + writer->size, data, n);
+	writer->size += n;
+	return 1;
+}
+
+static int pack_byte_and_be(PackWriter* writer, unsigned char type, uint64_t value, int width)
+{
+	if(pack_reserve(writer, 1 + width) == 0) {
+		return 0;
+	}
+	unsigned char* out = writer->data + writer->size;
+	int n;
+	out[0] = type;
+	for(n = width; n > 0; n--) {
+		out[n] = (unsigned char)(value & 0xff);
+		value >>= 8;
+	}
+	writer->size += 1 + width;
+	return 1;
+}
+
+static int cbor_header(PackWriter* writer, int major, uint64_t value)
+{
+	unsigned char mt = (unsigned char)(major << 5);
+	if(value < 24) {
+		return pack_byte_and_be(writer, mt | (unsigned char)value, 0, 0);
+	}
+	if(value <= 0xff) {
+		return pack_byte_and_be(writer, mt | 24, value, 1);
+	}
+	if(value <= 0xffff) {
+		return pack_byte_and_be(writer, mt | 25, value, 2);
+	}
+	if(value <= 0xffffffffULL) {
+		return pack_byte_and_be(writer, mt | 26, value, 4);
+	}
+	return pack_byte_and_be(writer, mt | 27, value, 8);
+}
+
+static int pack_integer(PackWriter* writer, int64_t v)
+{
+	if(writer->format == PACK_CBOR) {
+		if(v >= 0) {
+			return cbor_header(writer, 0, (uint64_t)v);
+		}
+		return cbor_header(writer, 1, (uint64_t)(-1 - v));
+	}
+	if(v >= 0) {
+		if(v < 128) {
+			return pack_byte_and_be(writer, (unsigned char)v, 0, 0);
+		}
+		if(v <= 0xff) {
+			return pack_byte_and_be(writer, 0xcc, (uint64_t)v, 1);
+		}
+		if(v <= 0xffff) {
+			return pack_byte_and_be(writer, 0xcd, (uint64_t)v, 2);
+		}
+		if(v <= 0xffffffffLL) {
+			return pack_byte_and_be(writer, 0xce, (uint64_t)v, 4);
+		}
+		return pack_byte_and_be(writer, 0xcf, (uint64_t)v, 8);
+	}
+	if(v >= -32) {
+		return pack_byte_and_be(writer, (unsigned char)(v & 0xff), 0, 0);
+	}
+	if(v >= -128) {
+		return pack_byte_and_be(writer, 0xd0, (uint64_t)v & 0xff, 1);
+	}
+	if(v >= -32768) {
+		return pack_byte_and_be(writer, 0xd1, (uint64_t)v & 0xffff, 2);
+	}
+	if(v >= -2147483647LL - 1) {
+		return pack_byte_and_be(writer, 0xd2, (uint64_t)v & 0xffffffffULL, 4);
+	}
+	return pack_byte_and_be(writer, 0xd3, (uint64_t)v, 8);
+}
+
+static int pack_number(PackWriter* writer, lua_Number nn)
+{
+	if(nn == floor(nn) && nn >= -9223372036854775808.0 && nn < 9223372036854775808.0 && (nn != 0 || signbit(nn) == 0)) {
+		return pack_integer(writer, (int64_t)nn);
+	}
+	uint64_t bits;
+	double d = nn;
+	memcpy(&bits, &d, sizeof(bits));
+	return pack_byte_and_be(writer, writer->format == PACK_CBOR ? 0xfb : 0xcb, bits, 8);
+}
+
+static int pack_string(PackWriter* writer, const void* data, size_t len, int binary)
+{
+	int r;
+	if(writer->format == PACK_CBOR) {
+		r = cbor_header(writer, binary ? 2 : 3, len);
+	}
+	else if((uint64_t)len > 0xffffffffULL) {
+		// MessagePack lengths are at most 32 bits
+		return 0;
+	}
+	else if(binary) {
+		if(len <= 0xff) {
+			r = pack_byte_and_be(writer, 0xc4, len, 1);
+		}
+		else if(len <= 0xffff) {
+			r = pack_byte_and_be(writer, 0xc5, len, 2);
+		}
+		else {
+			r = pack_byte_and_be(writer, 0xc6, len, 4);
+		}
+	}
+	else {
+		if(len < 32) {
+			r = pack_byte_and_be(writer, (unsigned char)(0xa0 | len), 0, 0);
+		}
+		else if(len <= 0xff) {
+			r = pack_byte_and_be(writer, 0xd9, len, 1);
+		}
+		else if(len <= 0xffff) {
+			r = pack_byte_and_be(writer, 0xda, len, 2);
+		}
+		else {
+			r = pack_byte_and_be(writer, 0xdb, len, 4);
+		}
+	}
+	return r && pack_bytes(writer, data, len);
+}
+
+static int pack_container(PackWriter* writer, int map, size_t n)
+{
+	if(writer->format == PACK_CBOR) {
+		return cbor_header(writer, map ? 5 : 4, n);
+	}
+	if(n < 16) {
+		return pack_byte_and_be(writer, (unsigned char)((map ? 0x80 : 0x90) | n), 0, 0);
+	}
+	if(n <= 0xffff) {
+		return pack_byte_and_be(writer, map ? 0xde : 0xdc, n, 2);
+	}
+	if((uint64_t)n > 0xffffffffULL) {
+		return 0;
+	}
+	return pack_byte_and_be(writer, map ? 0xdf : 0xdd, n, 4);
+}
+
+static int pack_value(lua_State* state, PackWriter* writer, int idx);
+
+static int pack_table(lua_State* state, PackWriter* writer, int idx)
+{
+	int isarray = -1;
+	if(lua_getmetatable(state, idx)) {
+		luaL_getmetatable(state, JSON_ARRAY_META);
+		if(lua_rawequal(state, -1, -2)) {
+			isarray = 1;
+		}
+		lua_pop(state, 2);
+	}
+	int n = lua_objlen(state, idx);
+	size_t count = 0;
+	lua_pushnil(state);
+	while(lua_next(state, idx) != 0) {
+		lua_pop(state, 1);
+		if(isarray < 0 && lua_type(state, -1) == LUA_TNUMBER) {
+			lua_Number key = lua_tonumber(state, -1);
+			if(key < 1 || key > n || key != (int)key) {
+				isarray = 0;
+			}
+		}
+		else if(isarray < 0) {
+			isarray = 0;
+		}
+		count++;
+	}
+	if(isarray < 0) {
+		isarray = n > 0 && count == (size_t)n;
+	}
+	if(isarray) {
+		int i;
+		if(pack_container(writer, 0, n) == 0) {
+			return 0;
+		}
+		for(i = 1; i <= n; i++) {
+			lua_rawgeti(state, idx, i);
+			if(pack_value(state, writer, lua_gettop(state)) == 0) {
+				return 0;
+			}
+			lua_pop(state, 1);
+		}
+		return 1;
+	}
+	if(pack_container(writer, 1, count) == 0) {
+		return 0;
+	}
+	lua_pushnil(state);
+	while(lua_next(state, idx) != 0) {
+		int top = lua_gettop(state);
+		if(pack_value(state, writer, top - 1) == 0 || pack_value(state, writer, top) == 0) {
+			return 0;
+		}
+		lua_pop(state, 1);
+	}
+	return 1;
+}
+
+static int pack_value(lua_State* state, PackWriter* writer, int idx)
+{
+	int cbor = writer->format == PACK_CBOR;
+	switch(lua_type(state, idx)) {
+		case LUA_TNIL:
+			return pack_byte_and_be(writer, cbor ? 0xf6 : 0xc0, 0, 0);
+		case LUA_TBOOLEAN:
+			if(lua_toboolean(state, idx)) {
+				return pack_byte_and_be(writer, cbor ? 0xf5 : 0xc3, 0, 0);
+			}
+			return pack_byte_and_be(writer, cbor ? 0xf4 : 0xc2, 0, 0);
+		case LUA_TNUMBER:
+			return pack_number(writer, lua_tonumber(state, idx));
+		case LUA_TSTRING: {
+			size_t len;
+			const char* str = lua_tolstring(state, idx, &len);
+			return pack_string(writer, str, len, 0);
+		}
+		case LUA_TUSERDATA: {
+			long size = 0;
+			const unsigned char* data = lib_util_test_buffer_data(state, idx, &size);
+			if(data == NULL) {
+				return 0;
+			}
+			return pack_string(writer, data, (size_t)size, 1);
+		}
+		case LUA_TTABLE: {
+			if(++writer->depth > PACK_MAX_DEPTH || lua_checkstack(state, 6) == 0) {
+				return 0;
+			}
+			int r = pack_table(state, writer, idx);
+			writer->depth--;
+			return r;
+		}
+	}
+	return 0;
+}
+
+static int pack_writer_gc(lua_State* state)
+{
+	PackWriter* writer = (PackWriter*)lua_touserdata(state, 1);
+	if(writer != NULL) {
+		free(writer->data);
+		writer->data = NULL;
+	}
+	return 0;
+}
+
+static int encode_common(lua_State* state, int format)
+{
+	int top = lua_gettop(state);
+	if(top < 2) {
+		lua_pushnil(state);
+	}
+	// The writer lives in a userdata so that its data is released even when
+	// an error is raised while the value is walked
+	PackWriter* writer = (PackWriter*)lua_newuserdata(state, sizeof(PackWriter));
+	memset(writer, 0, sizeof(PackWriter));
+	writer->growable = 1;
+	writer->format = format;
+	luaL_getmetatable(state, "_sushi_pack_writer");
+	lua_setmetatable(state, -2);
+	if(pack_value(state, writer, 2) == 0) {
+		free(writer->data);
+		writer->data = NULL;
+		lua_settop(state, top);
+		lua_pushnil(state);
+		return 1;
+	}
+	long size = (long)writer->size;
+	void* ptr = lua_newuserdata(state, sizeof(long) + writer->size);
+	luaL_getmetatable(state, "_sushi_buffer");
+	lua_setmetatable(state, -2);
+	memcpy(ptr, &size, sizeof(long));
+	memcpy((unsigned char*)ptr + sizeof(long), writer->data, writer->size);
+	free(writer->data);
+	writer->data = NULL;
+	return 1;
+}
+
+static int encode_to_buffer_common(lua_State* state, int format)
+{
+	void* ptr = luaL_checkudata(state, 3, "_sushi_buffer");
+	long size;
+	memcpy(&size, ptr, sizeof(long));
+	long offset = luaL_optnumber(state, 4, 0);
+	if(offset < 0 || offset > size) {
+		lua_pushnumber(state, -1);
+		return 1;
+	}
+	PackWriter writer;
+	memset(&writer, 0, sizeof(writer));
+	writer.data = (unsigned char*)ptr + sizeof(long) + offset;
+	writer.capacity = (size_t)(size - offset);
+	writer.format = format;
+	int top = lua_gettop(state);
+	int r = pack_value(state, &writer, 2);
+	lua_settop(state, top);
+	lua_pushnumber(state, r ? (lua_Number)writer.size : -1);
+	return 1;
+}
+
+static int unpack_fail(PackReader* reader, int status)
+{
+	reader->status = status;
+	return 0;
+}
+
+static int unpack_need(PackReader* reader, uint64_t n)
+{
+	if((uint64_t)(reader->end - reader->p) < n) {
+		reader->status = UNPACK_INCOMPLETE;
+		return 0;
+	}
+	return 1;
+}
+
+static uint64_t unpack_be(PackReader* reader, int width)
+{
+	uint64_t v = 0;
+	int n;
+	for(n = 0; n < width; n++) {
+		v = (v << 8) | reader->p[n];
+	}
+	reader->p += width;
+	return v;
+}
+
+static double unpack_float(uint64_t bits, int width)
+{
+	if(width == 8) {
+		double d;
+		memcpy(&d, &bits, sizeof(d));
+		return d;
+	}
+	if(width == 4) {
+		uint32_t b32 = (uint32_t)bits;
+		float f;
+		memcpy(&f, &b32, sizeof(f));
+		return f;
+	}
+	// IEEE 754 half precision, only used by CBOR
+	int exp = (int)((bits >> 10) & 0x1f);
+	int mant = (int)(bits & 0x3ff);
+	double v;
+	if(exp == 0) {
+		v = ldexp(mant, -24);
+	}
+	else if(exp != 31) {
+		v = ldexp(mant + 1024, exp - 25);
+	}
+	else {
+		v = mant == 0 ? INFINITY : NAN;
+	}
+	return (bits & 0x8000) ? -v : v;
+}
+
+static int unpack_value(lua_State* state, PackReader* reader);
+
+static int unpack_string(lua_State* state, PackReader* reader, uint64_t len, int binary)
+{
+	if(unpack_need(reader, len) == 0) {
+		return 0;
+	}
+	if(binary) {
+		long size = (long)len;
+		void* ptr = lua_newuserdata(state, sizeof(long) + (size_t)len);
+		luaL_getmetatable(state, "_sushi_buffer");
+		lua_setmetatable(state, -2);
+		memcpy(ptr, &size, sizeof(long));
+		memcpy((unsigned char*)ptr + sizeof(long), reader->p, (size_t)len);
+	}
+	else {
+		lua_pushlstring(state, (const char*)reader->p, (size_t)len);
+	}
+	reader->p += len;
+	return 1;
+}
+
+static int unpack_container(lua_State* state, PackReader* reader, uint64_t n, int map, int indefinite)
+{
+	if(++reader->depth > PACK_MAX_DEPTH || lua_checkstack(state, 6) == 0) {
+		return unpack_fail(reader, UNPACK_INVALID);
+	}
+	uint64_t avail = (uint64_t)(reader->end - reader->p);
+	int hint = (int)(n < avail ? n : avail);
+	lua_createtable(state, map ? 0 : hint, map ? hint : 0);
+	luaL_getmetatable(state, map ? JSON_OBJECT_META : JSON_ARRAY_META);
+	lua_setmetatable(state, -2);
+	int tbl = lua_gettop(state);
+	uint64_t i;
+	for(i = 0; indefinite || i < n; i++) {
+		if(indefinite) {
+			if(unpack_need(reader, 1) == 0) {
+				return 0;
+			}
+			if(*reader->p == 0xff) {
+				reader->p++;
+				break;
+			}
+		}
+		if(map) {
+			if(unpack_value(state, reader) == 0 || unpack_value(state, reader) == 0) {
+				return 0;
+			}
+			if(lua_isnil(state, tbl + 1) || (lua_type(state, tbl + 1) == LUA_TNUMBER && isnan(lua_tonumber(state, tbl + 1)))) {
+				lua_pop(state, 2);
+				continue;
+			}
+			lua_rawset(state, tbl);
+		}
+		else {
+			if(unpack_value(state, reader) == 0) {
+				return 0;
+			}
+			lua_rawseti(state, tbl, (int)(i + 1));
+		}
+	}
+	reader->depth--;
+	return 1;
+}
+
+static int unpack_msgpack(lua_State* state, PackReader* reader)
+{
+	if(unpack_need(reader, 1) == 0) {
+		return 0;
+	}
+	unsigned char c = *reader->p++;
+	if(c < 0x80) {
+		lua_pushnumber(state, c);
+		return 1;
+	}
+	if(c >= 0xe0) {
+		lua_pushnumber(state, (signed char)c);
+		return 1;
+	}
+	if(c >= 0xa0 && c <= 0xbf) {
+		return unpack_string(state, reader, c & 0x1f, 0);
+	}
+	if(c >= 0x80 && c <= 0x8f) {
+		return unpack_container(state, reader, c & 0x0f, 1, 0);
+	}
+	if(c >= 0x90 && c <= 0x9f) {
+		return unpack_container(state, reader, c & 0x0f, 0, 0);
+	}
+	static const signed char widths[] = {
+		0, -1, 0, 0, 1, 2, 4, -1, -1, -1, 4, 8, 1, 2, 4, 8,
+		1, 2, 4, 8, -1, -1, -1, -1, -1, 1, 2, 4, 2, 4, 2, 4
+	};
+	int width = widths[c - 0xc0];
+	if(width < 0) {
+		return unpack_fail(reader, UNPACK_INVALID);
+	}
+	if(unpack_need(reader, width) == 0) {
+		return 0;
+	}
+	uint64_t v = unpack_be(reader, width);
+	switch(c) {
+		case 0xc0: lua_pushnil(state); return 1;
+		case 0xc2: lua_pushboolean(state, 0); return 1;
+		case 0xc3: lua_pushboolean(state, 1); return 1;
+		case 0xc4: case 0xc5: case 0xc6: return unpack_string(state, reader, v, 1);
+		case 0xca: case 0xcb: lua_pushnumber(state, unpack_float(v, width)); return 1;
+		case 0xcc: case 0xcd: case 0xce: case 0xcf: lua_pushnumber(state, (lua_Number)v); return 1;
+		case 0xd0: lua_pushnumber(state, (int8_t)v); return 1;
+		case 0xd1: lua_pushnumber(state, (int16_t)v); return 1;
+		case 0xd2: lua_pushnumber(state, (int32_t)v); return 1;
+		case 0xd3: lua_pushnumber(state, (lua_Number)(int64_t)v); return 1;
+		case 0xd9: case 0xda: case 0xdb: return unpack_string(state, reader, v, 0);
+		case 0xdc: case 0xdd: return unpack_container(state, reader, v, 0, 0);
+		case 0xde: case 0xdf: return unpack_container(state, reader, v, 1, 0);
+	}
+	return unpack_fail(reader, UNPACK_INVALID);
+}
+
+static int unpack_cbor_chunks(lua_State* state, PackReader* reader, int major)
+{
+	luaL_Buffer buffer;
+	luaL_buffinit(state, &buffer);
+	for(;;) {
+		if(unpack_need(reader, 1) == 0) {
+			return 0;
+		}
+		unsigned char c = *reader->p++;
+		if(c == 0xff) {
+			break;
+		}
+		int info = c & 0x1f;
+		if((c >> 5) != major || info > 27) {
+			return unpack_fail(reader, UNPACK_INVALID);
+		}
+		uint64_t len = info;
+		if(info >= 24) {
+			int width = 1 << (info - 24);
+			if(unpack_need(reader, width) == 0) {
+				return 0;
+			}
+			len = unpack_be(reader, width);
+		}
+		if(unpack_need(reader, len) == 0) {
+			return 0;
+		}
+		luaL_addlstring(&buffer, (const char*)reader->p, (size_t)len);
+		reader->p += len;
+	}
+	luaL_pushresult(&buffer);
+	if(major == 2) {
+		size_t len;
+		const char* str = lua_tolstring(state, -1, &len);
+		long size = (long)len;
+		void* ptr = lua_newuserdata(state, sizeof(long) + len);
+		luaL_getmetatable(state, "_sushi_buffer");
+		lua_setmetatable(state, -2);
+		memcpy(ptr, &size, sizeof(long));
+		memcpy((unsigned char*)ptr + sizeof(long), str, len);
+		lua_remove(state, -2);
+	}
+	return 1;
+}
+
+static int unpack_cbor(lua_State* state, PackReader* reader)
+{
+	if(unpack_need(reader, 1) == 0) {
+		return 0;
+	}
+	unsigned char c = *reader->p++;
+	int major = c >> 5;
+	int info = c & 0x1f;
+	uint64_t v = info;
+	if(info >= 24 && info <= 27) {
+		int width = 1 << (info - 24);
+		if(unpack_need(reader, width) == 0) {
+			return 0;
+		}
+		v = unpack_be(reader, width);
+	}
+	else if(info > 27 && (info != 31 || major < 2 || major == 6)) {
+		return unpack_fail(reader, UNPACK_INVALID);
+	}
+	int indefinite = info == 31;
+	switch(major) {
+		case 0:
+			lua_pushnumber(state, (lua_Number)v);
+			return 1;
+		case 1:
+			lua_pushnumber(state, -1.0 - (lua_Number)v);
+			return 1;
+		case 2:
+		case 3:
+			if(indefinite) {
+				return unpack_cbor_chunks(state, reader, major);
+			}
+			return unpack_string(state, reader, v, major == 2);
+		case 4:
+		case 5:
+			return unpack_container(state, reader, v, major == 5, indefinite);
+		case 6: {
+			if(++reader->depth > PACK_MAX_DEPTH) {
+				return unpack_fail(reader, UNPACK_INVALID);
+			}
+			int r = unpack_value(state, reader);
+			reader->depth--;
+			return r;
+		}
+	}
+	if(info == 20 || info == 21) {
+		lua_pushboolean(state, info == 21);
+		return 1;
+	}
+	if(info == 22 || info == 23) {
+		lua_pushnil(state);
+		return 1;
+	}
+	if(info >= 25 && info <= 27) {
+		lua_pushnumber(state, unpack_float(v, 1 << (info - 24)));
+		return 1;
+	}
+	return unpack_fail(reader, UNPACK_INVALID);
+}
+
+static int unpack_value(lua_State* state, PackReader* reader)
+{
+	return reader->format == PACK_CBOR ? unpack_cbor(state, reader) : unpack_msgpack(state, reader);
+}
+
+static int decode_common(lua_State* state, int format)
+{
+	const unsigned char* data;
+	size_t len = 0;
+	if(lua_type(state, 2) == LUA_TUSERDATA) {
+		long size = 0;
+		data = lib_util_check_buffer_data(state, 2, &size);
+		len = (size_t)size;
+	}
+	else {
+		data = (const unsigned char*)lua_tolstring(state, 2, &len);
+	}
+	long offset = luaL_optnumber(state, 3, 0);
+	if(data == NULL || offset < 0 || (size_t)offset > len) {
+		lua_pushnil(state);
+		lua_pushnumber(state, -2);
+		return 2;
+	}
+	PackReader reader;
+	reader.p = data + offset;
+	reader.end = data + len;
+	reader.format = format;
+	reader.depth = 0;
+	reader.status = UNPACK_OK;
+	int top = lua_gettop(state);
+	if(unpack_value(state, &reader) == 0) {
+		lua_settop(state, top);
+		lua_pushnil(state);
+		lua_pushnumber(state, reader.status == UNPACK_INCOMPLETE ? -1 : -2);
+		return 2;
+	}
+	lua_pushnumber(state, (lua_Number)(reader.p - data));
+	return 2;
+}
+
+static int msgpack_encode(lua_State* state)
+{
+	return encode_common(state, PACK_MSGPACK);
+}
+
+static int msgpack_encode_to_buffer(lua_State* state)
+{
+	return encode_to_buffer_common(state, PACK_MSGPACK);
+}
+
+static int msgpack_decode(lua_State* state)
+{
+	return decode_common(state, PACK_MSGPACK);
+}
+
+static int cbor_encode(lua_State* state)
+{
+	return encode_common(state, PACK_CBOR);
+}
+
+static int cbor_encode_to_buffer(lua_State* state)
+{
+	return encode_to_buffer_common(state, PACK_CBOR);
+}
+
+static int cbor_decode(lua_State* state)
+{
+	return decode_common(state, PACK_CBOR);
+}
+
+static const luaL_Reg msgpack_funcs[] = {
+	{ "encode", msgpack_encode },
+	{ "encode_to_buffer", msgpack_encode_to_buffer },
+	{ "decode", msgpack_decode },
+	{ NULL, NULL }
+};
+
+static const luaL_Reg cbor_funcs[] = {
+	{ "encode", cbor_encode },
+	{ "encode_to_buffer", cbor_encode_to_buffer },
+	{ "decode", cbor_decode },
+	{ NULL, NULL }
+};
+
+void lib_msgpack_init(lua_State* state)
+{
+	luaL_newmetatable(state, "_sushi_pack_writer");
+	lua_pushcfunction(state, pack_writer_gc);
+	lua_setfield(state, -2, "__gc");
+	lua_pop(state, 1);
+	luaL_newlib(state, msgpack_funcs);
+	lua_setglobal(state, "_msgpack");
+	luaL_newlib(state, cbor_funcs);
+	lua_setglobal(state, "_cbor");
+}
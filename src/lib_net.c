@@ -28,6 +28,7 @@
 #include <sys/types.h>
 #include <errno.h>
 #include "lib_net.h"
+#include "lib_util.h"
 
 #if defined(SUSHI_SUPPORT_LINUX)
 #include <sys/socket.h>
@@ -73,14 +74,11 @@ static int send_udp_data(lua_State* state)
 		lua_pushnumber(state, -1);
 		return 1;
 	}
-	void* ptr = luaL_checkudata(state, 2, "_sushi_buffer");
-	if(ptr == NULL) {
-		lua_pushnumber(state, -1);
-		return 1;
-	}
+	long bsz = 0;
+	const unsigned char* ptr = lib_util_check_buffer_data(state, 2, &bsz);
 	long size = luaL_checknumber(state, 3);
-	if(size < 0) {
-		memcpy(&size, ptr, sizeof(long));
+	if(size < 0 || size > bsz) {
+		size = bsz;
 	}
 	if(size == 0) {
 		lua_pushnumber(state, 0);
@@ -108,7 +106,7 @@ static int send_udp_data(lua_State* state)
 	if(broadcastFlag == 1) {
 		setsockopt(fd, SOL_SOCKET, SO_BROADCAST, (void*)&broadcastFlag, sizeof(int));
 	}
-	int r = sendto(fd, ptr + sizeof(long), size, 0, (struct sockaddr*)(&server_addr), sizeof(struct sockaddr_in));
+	int r = sendto(fd, ptr, size, 0, (struct sockaddr*)(&server_addr), sizeof(struct sockaddr_in));
 	if(broadcastFlag == 1) {
 		broadcastFlag = 0;
 		setsockopt(fd, SOL_SOCKET, SO_BROADCAST, (void*)&broadcastFlag, sizeof(int));
@@ -135,7 +133,7 @@ static int read_udp_data(lua_State* state)
 	}
 	long bsz;
 	memcpy(&bsz, ptr, sizeof(long));
-	int size = luaL_checknumber(state, 3);
+	long size = luaL_checknumber(state, 3);
 	if(size < 0 || size > bsz) {
 		size = bsz;
 	}
@@ -415,7 +413,7 @@ static int read_from_tcp_socket(lua_State* state)
 	}
 	long bsz;
 	memcpy(&bsz, ptr, sizeof(long));
-	int size = luaL_checknumber(state, 3);
+	long size = luaL_checknumber(state, 3);
 	if(size < 0 || size > bsz) {
 		size = bsz;
 	}
@@ -425,7 +423,7 @@ static int read_from_tcp_socket(lua_State* state)
 	}
 	int timeout = luaL_checknumber(state, 4);
 	// FIXME: Handle timeout
-	int r = read(fd, ptr+sizeof(long), size);
+	ssize_t r = read(fd, ptr+sizeof(long), (size_t)size);
 	if(r > 0) {
 		; // all good
 	}
@@ -449,24 +447,21 @@ static int write_to_tcp_socket(lua_State* state)
 		lua_pushnumber(state, -1);
 		return 1;
 	}
-	void* ptr = luaL_checkudata(state, 2, "_sushi_buffer");
-	if(ptr == NULL) {
-		lua_pushnumber(state, -1);
-		return 1;
-	}
+	long bsz = 0;
+	const unsigned char* ptr = lib_util_check_buffer_data(state, 2, &bsz);
 	long size = luaL_checknumber(state, 3);
-	if(size < 0) {
-		memcpy(&size, ptr, sizeof(long));
+	if(size < 0 || size > bsz) {
+		size = bsz;
 	}
 	if(size == 0) {
 		lua_pushnumber(state, 0);
 		return 1;
 	}
-	int r = write(fd, ptr + sizeof(long), size);
+	ssize_t r = write(fd, ptr, (size_t)size);
 	if(r == 0) {
 		r = -1;
 	}
-	lua_pushnumber(state, r);
+	lua_pushnumber(state, (lua_Number)r);
 	return 1;
 }
 
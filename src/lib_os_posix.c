@@ -32,6 +32,8 @@
 #include <unistd.h>
 #include <pthread.h>
 #include "lib_os.h"
+#include "codecache.h"
+#include "lib_util.h"
 
 #define SIGMAX 64
 
@@ -479,16 +481,10 @@ int execute_in_thread(lua_State* state)
 		lua_pushnumber(state, -1);
 		return 1;
 	}
-	void* inputptr = NULL;
+	const unsigned char* inputptr = NULL;
 	long inputsize = 0;
 	if(lua_isuserdata(state, 4)) {
-		inputptr = luaL_checkudata(state, 4, "_sushi_buffer");
-		if(inputptr == NULL) {
-			lua_pushnumber(state, -1);
-			return 1;
-		}
-		memcpy(&inputsize, inputptr, sizeof(long));
-		inputptr += sizeof(long);
+		inputptr = lib_util_check_buffer_data(state, 4, &inputsize);
 	}
 	long withPipe = luaL_checknumber(state, 5);
 	long reuseInterpreter = luaL_checknumber(state, 6);
@@ -509,7 +505,7 @@ int execute_in_thread(lua_State* state)
 	lua_pushnil(nstate);
 	lua_setglobal(nstate, "_args");
 	// load the given code and push it as function on top of the stack
-	if(luaL_loadbuffer(nstate, fcode, strlen(fcode), "__code__") != 0) {
+	if(codecache_load_buffer(nstate, (const unsigned char*)fcode, (unsigned long)strlen(fcode), "__code__") != 0) {
 		sushi_error("Failed to load code buffer: `%s'", sushi_error_to_string(nstate));
 		lua_pushnumber(state, -1);
 		return 1;
@@ -31,7 +31,12 @@
 #include <ctype.h>
 #include <stdint.h>
 #include "lib_util.h"
+#include "strutil.h"
+#include "encoding.h"
+#include "numconv.h"
+#include "zlib.h"
 #include "zbuf.h"
+#include "lz4.h"
 #ifdef SUSHI_SUPPORT_LINUX
 #include <arpa/inet.h>
 #include <endian.h>
@@ -57,6 +62,104 @@ static int is_system_little_endian()
 
 // FIXME: Fix all string operations to properly process as UTF8
 
+static void get_search_range(lua_State* state, int sidx, int eidx, long len, long* start, long* end)
+{
+	long s = luaL_optlong(state, sidx, 0);
+	long e = luaL_optlong(state, eidx, -1);
+	if(s < 0) {
+		s = 0;
+	}
+	if(e < 0 || e > len) {
+		e = len;
+	}
+	*start = s;
+	*end = e;
+}
+
+static unsigned char* get_buffer_data(lua_State* state, int idx, long* size)
+{
+	void* ptr = luaL_checkudata(state, idx, "_sushi_buffer");
+	if(ptr == NULL) {
+		*size = 0;
+		return NULL;
+	}
+	memcpy(size, ptr, sizeof(long));
+	return (unsigned char*)ptr + sizeof(long);
+}
+
+static const unsigned char* get_view_data(SushiMappedView* view, long* size)
+{
+	if(view->data == NULL && view->produce != NULL) {
+		int (*produce)(SushiMappedView* view) = view->produce;
+		view->produce = NULL;
+		if(produce(view) == 0) {
+			view->data = NULL;
+		}
+	}
+	if(view->data == NULL) {
+		*size = 0;
+		return (const unsigned char*)"";
+	}
+	*size = view->size;
+	return view->data;
+}
+
+// Buffers and mapped views are interchangeable for everything that only
+// reads the bytes
+const unsigned char* lib_util_check_buffer_data(lua_State* state, int idx, long* size)
+{
+	SushiMappedView* view = (SushiMappedView*)luaL_testudata(state, idx, SUSHI_MAPPED_VIEW);
+	if(view != NULL) {
+		return get_view_data(view, size);
+	}
+	return get_buffer_data(state, idx, size);
+}
+
+const unsigned char* lib_util_test_buffer_data(lua_State* state, int idx, long* size)
+{
+	SushiMappedView* view = (SushiMappedView*)luaL_testudata(state, idx, SUSHI_MAPPED_VIEW);
+	if(view != NULL) {
+		return get_view_data(view, size);
+	}
+	void* ptr = luaL_testudata(state, idx, "_sushi_buffer");
+	if(ptr == NULL) {
+		*size = 0;
+		return NULL;
+	}
+	memcpy(size, ptr, sizeof(long));
+	return (const unsigned char*)ptr + sizeof(long);
+}
+
+static const unsigned char* get_string_or_buffer_data(lua_State* state, int idx, long* size)
+{
+	if(lua_type(state, idx) == LUA_TUSERDATA) {
+		return lib_util_check_buffer_data(state, idx, size);
+	}
+	size_t len = 0;
+	const char* str = lua_tolstring(state, idx, &len);
+	*size = (long)len;
+	return (const unsigned char*)str;
+}
+
+unsigned char* lib_util_push_new_buffer(lua_State* state, long size)
+{
+	void* ptr = lua_newuserdata(state, sizeof(long) + (size_t)size);
+	luaL_getmetatable(state, "_sushi_buffer");
+	lua_setmetatable(state, -2);
+	memcpy(ptr, &size, sizeof(long));
+	return (unsigned char*)ptr + sizeof(long);
+}
+
+static void push_search_result(lua_State* state, long result, long start)
+{
+	if(result < 0) {
+		lua_pushnumber(state, -1);
+	}
+	else {
+		lua_pushnumber(state, start + result);
+	}
+}
+
 static int set_buffer_byte_lua_syntax(lua_State* state)
 {
 	void* ptr = luaL_checkudata(state, 1, "_sushi_buffer");
@@ -93,69 +196,50 @@ static int set_buffer_byte(lua_State* state)
 
 static int get_buffer_byte_lua_syntax(lua_State* state)
 {
-	void* ptr = luaL_checkudata(state, 1, "_sushi_buffer");
-	if(ptr == NULL) {
-		lua_pushnumber(state, 0);
-		return 1;
-	}
+	long sz = 0;
+	const unsigned char* data = lib_util_check_buffer_data(state, 1, &sz);
 	long offset = luaL_checklong(state, 2) - 1;
-	long sz;
-	memcpy(&sz, ptr, sizeof(long));
-	if(offset < 0 || offset >= sz) {
+	if(data == NULL || offset < 0 || offset >= sz) {
 		lua_pushnumber(state, 0);
 		return 1;
 	}
-	lua_pushnumber(state, (int)((unsigned char*)ptr)[sizeof(long) + offset]);
+	lua_pushnumber(state, (int)data[offset]);
 	return 1;
 }
 
 static int get_buffer_byte(lua_State* state)
 {
-	void* ptr = luaL_checkudata(state, 2, "_sushi_buffer");
-	if(ptr == NULL) {
-		lua_pushnumber(state, 0);
-		return 1;
-	}
+	long sz = 0;
+	const unsigned char* data = lib_util_check_buffer_data(state, 2, &sz);
 	long offset = luaL_checklong(state, 3);
-	long sz;
-	memcpy(&sz, ptr, sizeof(long));
-	if(offset < 0 || offset >= sz) {
+	if(data == NULL || offset < 0 || offset >= sz) {
 		lua_pushnumber(state, 0);
 		return 1;
 	}
-	lua_pushnumber(state, (int)((unsigned char*)ptr)[sizeof(long) + offset]);
+	lua_pushnumber(state, (int)data[offset]);
 	return 1;
 }
 
 static int get_buffer_size(lua_State* state)
 {
-	void* ptr = luaL_checkudata(state, 2, "_sushi_buffer");
-	if(ptr == NULL) {
-		lua_pushnumber(state, 0);
-		return 1;
-	}
 	long size = 0;
-	memcpy(&size, ptr, sizeof(long));
+	lib_util_check_buffer_data(state, 2, &size);
 	lua_pushnumber(state, size);
 	return 1;
 }
 
 static int get_buffer_size_lua_syntax(lua_State* state)
 {
-	void* ptr = luaL_checkudata(state, 1, "_sushi_buffer");
-	if(ptr == NULL) {
-		lua_pushnumber(state, 0);
-		return 1;
-	}
 	long size = 0;
-	memcpy(&size, ptr, sizeof(long));
+	lib_util_check_buffer_data(state, 1, &size);
 	lua_pushnumber(state, size);
 	return 1;
 }
 
 static int copy_buffer_bytes(lua_State* state)
 {
-	void* src = luaL_checkudata(state, 2, "_sushi_buffer");
+	long srcsz = 0;
+	const unsigned char* src = lib_util_check_buffer_data(state, 2, &srcsz);
 	if(src == NULL) {
 		return 0;
 	}
@@ -175,9 +259,7 @@ static int copy_buffer_bytes(lua_State* state)
 	if(size < 1) {
 		return 0;
 	}
-	long srcsz;
 	long dstsz;
-	memcpy(&srcsz, src, sizeof(long));
 	memcpy(&dstsz, dst, sizeof(long));
 	if(soffset + size > srcsz) {
 		size = srcsz - soffset;
@@ -185,8 +267,10 @@ static int copy_buffer_bytes(lua_State* state)
 	if(doffset + size > dstsz) {
 		size = dstsz - doffset;
 	}
-	size_t sz = sizeof(long);
-	memmove(dst + sz + doffset, src + sz + soffset, size);
+	if(size < 1) {
+		return 0;
+	}
+	memmove((unsigned char*)dst + sizeof(long) + doffset, src + soffset, size);
 	return 0;
 }
 
@@ -207,7 +291,7 @@ static int allocate_buffer(lua_State* state)
 static int is_buffer(lua_State* state)
 {
 	void* ptr = luaL_testudata(state, 2, "_sushi_buffer");
-	if(ptr == NULL) {
+	if(ptr == NULL && luaL_testudata(state, 2, SUSHI_MAPPED_VIEW) == NULL) {
 		lua_pushboolean(state, 0);
 	}
 	else {
@@ -485,13 +569,27 @@ static int network_bytes_to_host64(lua_State* state)
 
 static int convert_to_integer(lua_State* state)
 {
-	int n = luaL_checknumber(state, 2);
-	lua_pushnumber(state, n);
+	// Truncate through a 64-bit integer so that sizes and file offsets above
+	// 2GB survive the conversion; values outside that range are kept as is.
+	lua_Number v = luaL_checknumber(state, 2);
+	if(v > -9223372036854775808.0 && v < 9223372036854775808.0) {
+		v = (lua_Number)(int64_t)v;
+	}
+	lua_pushnumber(state, v);
 	return 1;
 }
 
 static int to_number(lua_State* state)
 {
+	if(lua_type(state, 2) == LUA_TSTRING) {
+		size_t len;
+		const char* str = lua_tolstring(state, 2, &len);
+		double v;
+		if(numconv_parse_double(str, (long)len, &v)) {
+			lua_pushnumber(state, v);
+			return 1;
+		}
+	}
 	lua_pushnumber(state, lua_tonumber(state, 2));
 	return 1;
 }
@@ -509,40 +607,66 @@ static int get_string_length(lua_State* state)
 	return 1;
 }
 
+static long get_utf8_character_count_legacy(const char* str, size_t len)
+{
+	long v = 0;
+	long n = 0;
+	while(n < len) {
+		unsigned char c = (unsigned char)str[n];
+		if(c <= 0x7F) {
+			n ++;
+			v ++;
+		}
+		else if(c >= 0xF0) {
+			v ++;
+			n += 4;
+		}
+		else if(c >= 0xE0) {
+			v ++;
+			n += 3;
+		}
+		else if(c >= 0xC0) {
+			v ++;
+			n += 2;
+		}
+		else {
+			n ++;
+		}
+	}
+	return v;
+}
+
 static int get_utf8_character_count(lua_State* state)
 {
 	size_t len = 0;
 	const char* str = lua_tolstring(state, 2, &len);
 	if(str == NULL) {
 		lua_pushnumber(state, 0);
+		return 1;
+	}
+	const unsigned char* data = (const unsigned char*)str;
+	long first = strutil_find_byte_above(data, (long)len, 0x7f);
+	if(first < 0) {
+		lua_pushnumber(state, len);
+	}
+	else if(strutil_utf8_validate(data + first, (long)len - first)) {
+		lua_pushnumber(state, first + strutil_utf8_count(data + first, (long)len - first));
 	}
 	else {
-		long v = 0;
-		long n = 0;
-		while(n < len) {
-			unsigned char c = (unsigned char)str[n];
-			if(c <= 0x7F) {
-				n ++;
-				v ++;
-			}
-			else if(c >= 0xF0) {
-				v ++;
-				n += 4;
-			}
-			else if(c >= 0xE0) {
-				v ++;
-				n += 3;
-			}
-			else if(c >= 0xC0) {
-				v ++;
-				n += 2;
-			}
-			else {
-				n ++;
-			}
-		}
-		lua_pushnumber(state, v);
+		lua_pushnumber(state, get_utf8_character_count_legacy(str, len));
+	}
+	return 1;
+}
+
+static int is_valid_utf8(lua_State* state)
+{
+	long len = 0;
+	const unsigned char* data = get_string_or_buffer_data(state, 2, &len);
+	if(data == NULL) {
+		lua_pushboolean(state, 0);
+		return 1;
 	}
+	lua_pushboolean(state, strutil_utf8_validate(data, len));
 	return 1;
 }
 
@@ -579,47 +703,54 @@ static int create_hex_string_for_integer(lua_State* state)
 static int create_decimal_string_for_integer(lua_State* state)
 {
 	long cc = luaL_checknumber(state, 2);
-	char v[512];
-	memset(v, 0, 512);
-	snprintf(v, 511, "%ld", cc);
-	lua_pushstring(state, v);
+	char v[32];
+	int n = numconv_format_integer(cc, v);
+	lua_pushlstring(state, v, n);
 	return 1;
 }
 
-static int create_string_for_float(lua_State* state)
+static int push_trimmed_decimal_string(lua_State* state, char* v, int n)
 {
-	double cc = luaL_checknumber(state, 2);
-	char v[512];
-	memset(v, 0, 512);
-	snprintf(v, 511, "%.14f", cc);
-	int p = strlen(v) - 1;
-	while(p >= 0 && v[p] == '0') {
-		if(p > 0 && v[p-1] == '.') {
-			break;
+	if(n < 0) {
+		lua_pushnil(state);
+		return 1;
+	}
+	if(memchr(v, '.', n) != NULL) {
+		while(n > 1 && v[n-1] == '0' && v[n-2] != '.') {
+			n--;
 		}
-		v[p] = 0;
-		p--;
 	}
-	lua_pushstring(state, v);
+	lua_pushlstring(state, v, n);
 	return 1;
 }
 
+static int create_string_for_float(lua_State* state)
+{
+	double cc = luaL_checknumber(state, 2);
+	char v[512];
+	int n = numconv_format_fixed(cc, 14, v, sizeof(v));
+	return push_trimmed_decimal_string(state, v, n);
+}
+
 static int create_string_for_double_with_decimals(lua_State* state)
 {
 	double cc = luaL_checknumber(state, 2);
 	int dc = luaL_checknumber(state, 3);
 	char v[512];
-	memset(v, 0, 512);
-	snprintf(v, 511, "%.*f", dc, cc);
-	int p = strlen(v) - 1;
-	while(p >= 0 && v[p] == '0') {
-		if(p > 0 && v[p-1] == '.') {
-			break;
-		}
-		v[p] = 0;
-		p--;
+	int n = numconv_format_fixed(cc, dc, v, sizeof(v));
+	return push_trimmed_decimal_string(state, v, n);
+}
+
+static int create_shortest_string_for_double(lua_State* state)
+{
+	double cc = luaL_checknumber(state, 2);
+	char v[64];
+	int n = numconv_format_shortest(cc, v, sizeof(v));
+	if(n < 0) {
+		lua_pushnil(state);
+		return 1;
 	}
-	lua_pushstring(state, v);
+	lua_pushlstring(state, v, n);
 	return 1;
 }
 
@@ -648,11 +779,11 @@ static int string_starts_with(lua_State* state)
 		lua_pushboolean(state, 0);
 		return 1;
 	}
-	if(offset >= s1len) {
+	if(offset < 0 || offset >= s1len || s2len > s1len - offset) {
 		lua_pushboolean(state, 0);
 		return 1;
 	}
-	if(strncmp(s1 + offset, s2, strlen(s2)) != 0) {
+	if(memcmp(s1 + offset, s2, s2len) != 0) {
 		lua_pushboolean(state, 0);
 		return 1;
 	}
@@ -660,182 +791,551 @@ static int string_starts_with(lua_State* state)
 	return 1;
 }
 
-static int compare_string_ignore_case(lua_State* state)
+static int string_starts_with_ignore_case(lua_State* state)
 {
-	const char* s1 = luaL_checkstring(state, 2);
-	const char* s2 = luaL_checkstring(state, 3);
-	if(s1 == NULL || s2 == NULL) {
-		lua_pushnil(state);
+	size_t s1len;
+	size_t s2len;
+	const char* s1 = lua_tolstring(state, 2, &s1len);
+	const char* s2 = lua_tolstring(state, 3, &s2len);
+	long offset = luaL_optlong(state, 4, 0);
+	if(s1 == NULL || s2 == NULL || offset < 0 || offset >= s1len) {
+		lua_pushboolean(state, 0);
 		return 1;
 	}
-	int v = 0;
-	int n = 0;
-	while(1) {
-		int s1c = tolower(s1[n]);
-		int s2c = tolower(s2[n]);
-		if(s1c < s2c) {
-			v = -1;
-			break;
-		}
-		if(s1c > s2c) {
-			v = -1;
-			break;
-		}
-		if(s1c == 0) {
-			break;
-		}
-		n++;
-	}
-	lua_pushnumber(state, v);
+	lua_pushboolean(state, strutil_ascii_starts_with_ignore_case((const unsigned char*)s1 + offset, (long)s1len - offset, (const unsigned char*)s2, (long)s2len));
 	return 1;
 }
 
-static int change_string_to_lowercase(lua_State* state)
+static int buffer_starts_with(lua_State* state)
 {
-	size_t len = 0;
-	const char* str = lua_tolstring(state, 2, &len);
-	if(str != NULL && len > 0) {
-		char* v = (char*)malloc(len);
-		size_t n;
-		for(n=0; n<len; n++) {
-			v[n] = tolower(str[n]);
-		}
-		lua_pushlstring(state, v, len);
-		free(v);
+	long size = 0;
+	unsigned char* data = get_buffer_data(state, 2, &size);
+	long plen = 0;
+	const unsigned char* prefix = get_string_or_buffer_data(state, 3, &plen);
+	long offset = luaL_optlong(state, 4, 0);
+	int ignoreCase = lua_toboolean(state, 5);
+	if(data == NULL || prefix == NULL || offset < 0 || offset > size || plen > size - offset) {
+		lua_pushboolean(state, 0);
+		return 1;
+	}
+	if(ignoreCase) {
+		lua_pushboolean(state, strutil_ascii_starts_with_ignore_case(data + offset, size - offset, prefix, plen));
 	}
 	else {
-		lua_pushstring(state, "");
+		lua_pushboolean(state, memcmp(data + offset, prefix, (size_t)plen) == 0);
 	}
 	return 1;
 }
 
-static int change_string_to_uppercase(lua_State* state)
+static int compare_string_ignore_case(lua_State* state)
 {
-	size_t len = 0;
-	const char* str = lua_tolstring(state, 2, &len);
-	if(str != NULL && len > 0) {
-		char* v = (char*)malloc(len);
-		size_t n;
-		for(n=0; n<len; n++) {
-			v[n] = toupper(str[n]);
-		}
-		lua_pushlstring(state, v, len);
-		free(v);
-	}
-	else {
-		lua_pushstring(state, "");
+	size_t s1len;
+	size_t s2len;
+	const char* s1 = luaL_checklstring(state, 2, &s1len);
+	const char* s2 = luaL_checklstring(state, 3, &s2len);
+	if(s1 == NULL || s2 == NULL) {
+		lua_pushnil(state);
+		return 1;
 	}
+	lua_pushnumber(state, strutil_ascii_compare_ignore_case((const unsigned char*)s1, (long)s1len, (const unsigned char*)s2, (long)s2len));
 	return 1;
 }
 
-static int get_substring(lua_State* state)
+static int compare_buffer_ignore_case(lua_State* state)
 {
-	size_t slen;
-	const char* str = lua_tolstring(state, 2, &slen);
-	if(str == NULL) {
+	long size = 0;
+	unsigned char* data = get_buffer_data(state, 2, &size);
+	long olen = 0;
+	const unsigned char* other = get_string_or_buffer_data(state, 3, &olen);
+	if(data == NULL || other == NULL) {
 		lua_pushnil(state);
 		return 1;
 	}
-	long start = luaL_checknumber(state, 3);
-	long end = luaL_checknumber(state, 4);
-	int ccpos = 0;
-	int sbyte = 0;
-	int ebyte = 0;
-	for(int n=0; n <= slen; n++) {
-		unsigned char c = (unsigned char)str[n];
-		if(ccpos == start) {
-			sbyte = n;
-		}
-		ebyte = n;
-		if(ccpos == end){
-			break;
-		}
-		if(c >= TWO_BYTES_SEQ_START && c <= TWO_BYTES_SEQ_END) {
-			n++;
+	long start, end;
+	get_search_range(state, 4, 5, size, &start, &end);
+	if(start > end) {
+		start = end;
+	}
+	lua_pushnumber(state, strutil_ascii_compare_ignore_case(data + start, end - start, other, olen));
+	return 1;
+}
+
+static int change_string_case(lua_State* state, int upper)
+{
+	size_t len = 0;
+	const char* str = lua_tolstring(state, 2, &len);
+	if(str == NULL || len < 1) {
+		lua_pushstring(state, "");
+		return 1;
+	}
+	luaL_Buffer b;
+	luaL_buffinit(state, &b);
+	size_t n = 0;
+	while(n < len) {
+		size_t chunk = len - n;
+		if(chunk > LUAL_BUFFERSIZE) {
+			chunk = LUAL_BUFFERSIZE;
 		}
-		else if(c >= THREE_BYTES_SEQ_START && c <= THREE_BYTES_SEQ_END) {
-			n = n + 2;
+		unsigned char* dst = (unsigned char*)luaL_prepbuffer(&b);
+		if(upper) {
+			strutil_ascii_to_upper(dst, (const unsigned char*)str + n, (long)chunk);
 		}
-		else if(c >= FOUR_BYTES_SEQ_START && c <= FOUR_BYTES_SEQ_END) {
-			n = n + 3;
+		else {
+			strutil_ascii_to_lower(dst, (const unsigned char*)str + n, (long)chunk);
 		}
-		ccpos++;
-	}
-	long len = ebyte - sbyte;
-	if(len > 0) {
-		lua_pushlstring(state, str + sbyte, len);
-	}
-	else {
-		lua_pushstring(state, "");
+		luaL_addsize(&b, chunk);
+		n += chunk;
 	}
+	luaL_pushresult(&b);
 	return 1;
 }
 
-static int get_index_of_character(lua_State* state)
+static int change_string_to_lowercase(lua_State* state)
 {
-	size_t len;
-	const char* str = lua_tolstring(state, 2, &len);
-	if(str == NULL) {
-		lua_pushnumber(state, -1);
-		return 1;
+	return change_string_case(state, 0);
+}
+
+static int change_string_to_uppercase(lua_State* state)
+{
+	return change_string_case(state, 1);
+}
+
+static int change_buffer_case(lua_State* state, int upper)
+{
+	long size = 0;
+	unsigned char* data = get_buffer_data(state, 2, &size);
+	if(data == NULL) {
+		return 0;
 	}
-	long c = luaL_checknumber(state, 3);
-	long start = luaL_checknumber(state, 4);
-	if(start < 0) {
-		start = 0;
+	long start, end;
+	get_search_range(state, 3, 4, size, &start, &end);
+	if(start >= end) {
+		return 0;
 	}
-	if(start >= len) {
-		lua_pushnumber(state, -1);
-		return 1;
+	if(upper) {
+		strutil_ascii_to_upper(data + start, data + start, end - start);
 	}
-	char* p = strchr((const char*)(str + start), (int)c);
-	if(p == NULL) {
-		lua_pushnumber(state, -1);
-		return 1;
+	else {
+		strutil_ascii_to_lower(data + start, data + start, end - start);
 	}
-	lua_pushnumber(state, (int)(p - str));
-	return 1;
+	return 0;
 }
 
-static int get_index_of_substring(lua_State* state)
+static int change_buffer_to_lowercase(lua_State* state)
 {
-	size_t len;
+	return change_buffer_case(state, 0);
+}
+
+static int change_buffer_to_uppercase(lua_State* state)
+{
+	return change_buffer_case(state, 1);
+}
+
+static int trim_string(lua_State* state)
+{
+	size_t len = 0;
 	const char* str = lua_tolstring(state, 2, &len);
 	if(str == NULL) {
-		lua_pushnumber(state, -1);
-		return 1;
-	}
-	size_t sslen;
-	const char* ss = lua_tolstring(state, 3, &sslen);
-	if(ss == NULL || *ss == 0) {
-		lua_pushnumber(state, -1);
+		lua_pushnil(state);
 		return 1;
 	}
-	long start = luaL_checknumber(state, 4);
-	if(start < 0) {
-		start = 0;
-	}
-	if(start >= len) {
-		lua_pushnumber(state, -1);
-		return 1;
+	long start, end;
+	strutil_ascii_trim((const unsigned char*)str, (long)len, &start, &end);
+	if(start == 0 && end == len) {
+		lua_pushvalue(state, 2);
 	}
-	const char* p = str + start;
-	while(*p != 0) {
-		if(!strncmp(p, ss, sslen)) {
-			lua_pushnumber(state, (int)(p - str));
-			return 1;
-		}
-		p++;
+	else {
+		lua_pushlstring(state, str + start, end - start);
 	}
-	lua_pushnumber(state, -1);
 	return 1;
 }
 
-static int convert_string_to_buffer(lua_State* state)
+static int get_trimmed_range(lua_State* state)
 {
-	size_t size;
-	const char* str = luaL_checklstring(state, 2, &size);
-	if(str == NULL) {
+	long size = 0;
+	const unsigned char* data = get_string_or_buffer_data(state, 2, &size);
+	if(data == NULL) {
+		lua_pushnumber(state, 0);
+		lua_pushnumber(state, 0);
+		return 2;
+	}
+	long start, end;
+	get_search_range(state, 3, 4, size, &start, &end);
+	if(start > end) {
+		start = end;
+	}
+	long ts, te;
+	strutil_ascii_trim(data + start, end - start, &ts, &te);
+	lua_pushnumber(state, start + ts);
+	lua_pushnumber(state, start + te);
+	return 2;
+}
+
+#define UTF8_INDEX_STRIDE 32
+#define UTF8_INDEX_SLOTS 4
+#define UTF8_INDEX_MINIMUM 64
+
+// Character positions of recently used strings are remembered as byte
+// offsets of every UTF8_INDEX_STRIDE'th character, so that loops that
+// take substrings of the same string do not rescan it from the start.
+// Each cached string is referenced from the registry, which keeps its
+// address valid for as long as it stays in the cache.
+
+typedef struct
+{
+	const char* str;
+	int ref;
+	int ascii;
+	long count;
+	long* checkpoints;
+}
+Utf8Index;
+
+typedef struct
+{
+	Utf8Index slots[UTF8_INDEX_SLOTS];
+	int next;
+}
+Utf8IndexCache;
+
+static char utf8_index_cache_key;
+
+static int get_utf8_sequence_length(unsigned char c)
+{
+	if(c >= TWO_BYTES_SEQ_START && c <= TWO_BYTES_SEQ_END) {
+		return 2;
+	}
+	if(c >= THREE_BYTES_SEQ_START && c <= THREE_BYTES_SEQ_END) {
+		return 3;
+	}
+	if(c >= FOUR_BYTES_SEQ_START && c <= FOUR_BYTES_SEQ_END) {
+		return 4;
+	}
+	return 1;
+}
+
+static int utf8_index_cache_gc(lua_State* state)
+{
+	Utf8IndexCache* cache = (Utf8IndexCache*)lua_touserdata(state, 1);
+	int n;
+	for(n=0; n<UTF8_INDEX_SLOTS; n++) {
+		free(cache->slots[n].checkpoints);
+		cache->slots[n].checkpoints = NULL;
+	}
+	return 0;
+}
+
+static Utf8IndexCache* get_utf8_index_cache(lua_State* state)
+{
+	lua_pushlightuserdata(state, &utf8_index_cache_key);
+	lua_rawget(state, LUA_REGISTRYINDEX);
+	Utf8IndexCache* cache = (Utf8IndexCache*)lua_touserdata(state, -1);
+	lua_pop(state, 1);
+	if(cache != NULL) {
+		return cache;
+	}
+	cache = (Utf8IndexCache*)lua_newuserdata(state, sizeof(Utf8IndexCache));
+	memset(cache, 0, sizeof(Utf8IndexCache));
+	int n;
+	for(n=0; n<UTF8_INDEX_SLOTS; n++) {
+		cache->slots[n].ref = LUA_NOREF;
+	}
+	lua_newtable(state);
+	lua_pushliteral(state, "__gc");
+	lua_pushcfunction(state, utf8_index_cache_gc);
+	lua_rawset(state, -3);
+	lua_setmetatable(state, -2);
+	lua_pushlightuserdata(state, &utf8_index_cache_key);
+	lua_insert(state, -2);
+	lua_rawset(state, LUA_REGISTRYINDEX);
+	return cache;
+}
+
+static void build_utf8_index(Utf8Index* index, const char* str, size_t slen)
+{
+	index->str = str;
+	index->ascii = 0;
+	index->count = 0;
+	index->checkpoints = NULL;
+	if(strutil_find_byte_above((const unsigned char*)str, (long)slen, TWO_BYTES_SEQ_START - 1) < 0) {
+		index->ascii = 1;
+		index->count = (long)slen + 1;
+		return;
+	}
+	long size = (long)slen / UTF8_INDEX_STRIDE + 2;
+	index->checkpoints = (long*)malloc(sizeof(long) * size);
+	long ccpos = 0;
+	long n = 0;
+	while(n <= (long)slen) {
+		if(ccpos % UTF8_INDEX_STRIDE == 0) {
+			index->checkpoints[ccpos / UTF8_INDEX_STRIDE] = n;
+		}
+		n += get_utf8_sequence_length((unsigned char)str[n]);
+		ccpos++;
+	}
+	index->count = ccpos;
+}
+
+static Utf8Index* get_utf8_index(lua_State* state, int idx, const char* str, size_t slen)
+{
+	Utf8IndexCache* cache = get_utf8_index_cache(state);
+	int n;
+	for(n=0; n<UTF8_INDEX_SLOTS; n++) {
+		if(cache->slots[n].str == str && cache->slots[n].ref != LUA_NOREF) {
+			return &cache->slots[n];
+		}
+	}
+	Utf8Index* index = &cache->slots[cache->next];
+	cache->next = (cache->next + 1) % UTF8_INDEX_SLOTS;
+	if(index->ref != LUA_NOREF) {
+		luaL_unref(state, LUA_REGISTRYINDEX, index->ref);
+		index->ref = LUA_NOREF;
+	}
+	free(index->checkpoints);
+	build_utf8_index(index, str, slen);
+	lua_pushvalue(state, idx);
+	index->ref = luaL_ref(state, LUA_REGISTRYINDEX);
+	return index;
+}
+
+static long get_utf8_index_offset(Utf8Index* index, long ccpos)
+{
+	if(index->ascii) {
+		return ccpos;
+	}
+	long n = index->checkpoints[ccpos / UTF8_INDEX_STRIDE];
+	long steps = ccpos % UTF8_INDEX_STRIDE;
+	while(steps-- > 0) {
+		n += get_utf8_sequence_length((unsigned char)index->str[n]);
+	}
+	return n;
+}
+
+static int get_substring(lua_State* state)
+{
+	size_t slen;
+	const char* str = lua_tolstring(state, 2, &slen);
+	if(str == NULL) {
+		lua_pushnil(state);
+		return 1;
+	}
+	long start = luaL_checknumber(state, 3);
+	long end = luaL_checknumber(state, 4);
+	long sbyte = 0;
+	long ebyte = 0;
+	if(slen < UTF8_INDEX_MINIMUM) {
+		long ccpos = 0;
+		for(long n=0; n <= slen; n++) {
+			if(ccpos == start) {
+				sbyte = n;
+			}
+			ebyte = n;
+			if(ccpos == end){
+				break;
+			}
+			n += get_utf8_sequence_length((unsigned char)str[n]) - 1;
+			ccpos++;
+		}
+	}
+	else {
+		Utf8Index* index = get_utf8_index(state, 2, str, slen);
+		long last = index->count - 1;
+		if(end < 0 || end > last) {
+			end = last;
+		}
+		if(start >= 0 && start <= end) {
+			sbyte = get_utf8_index_offset(index, start);
+		}
+		ebyte = get_utf8_index_offset(index, end);
+	}
+	long len = ebyte - sbyte;
+	if(len > 0) {
+		lua_pushlstring(state, str + sbyte, len);
+	}
+	else {
+		lua_pushstring(state, "");
+	}
+	return 1;
+}
+
+static int get_index_of_character(lua_State* state)
+{
+	size_t len;
+	const char* str = lua_tolstring(state, 2, &len);
+	if(str == NULL) {
+		lua_pushnumber(state, -1);
+		return 1;
+	}
+	long c = luaL_checknumber(state, 3);
+	long start, end;
+	get_search_range(state, 4, 5, (long)len, &start, &end);
+	if(start >= end) {
+		lua_pushnumber(state, -1);
+		return 1;
+	}
+	push_search_result(state, strutil_find_byte((const unsigned char*)str + start, end - start, (unsigned char)c), start);
+	return 1;
+}
+
+static int get_index_of_any_character(lua_State* state)
+{
+	size_t len;
+	const char* str = lua_tolstring(state, 2, &len);
+	if(str == NULL) {
+		lua_pushnumber(state, -1);
+		return 1;
+	}
+	size_t setlen;
+	const char* set = lua_tolstring(state, 3, &setlen);
+	if(set == NULL || setlen < 1) {
+		lua_pushnumber(state, -1);
+		return 1;
+	}
+	long start, end;
+	get_search_range(state, 4, 5, (long)len, &start, &end);
+	if(start >= end) {
+		lua_pushnumber(state, -1);
+		return 1;
+	}
+	push_search_result(state, strutil_find_any_byte((const unsigned char*)str + start, end - start, (const unsigned char*)set, (long)setlen), start);
+	return 1;
+}
+
+static int get_index_of_substring(lua_State* state)
+{
+	size_t len;
+	const char* str = lua_tolstring(state, 2, &len);
+	if(str == NULL) {
+		lua_pushnumber(state, -1);
+		return 1;
+	}
+	size_t sslen;
+	const char* ss = lua_tolstring(state, 3, &sslen);
+	if(ss == NULL || sslen < 1) {
+		lua_pushnumber(state, -1);
+		return 1;
+	}
+	long start, end;
+	get_search_range(state, 4, 5, (long)len, &start, &end);
+	if(start >= end) {
+		lua_pushnumber(state, -1);
+		return 1;
+	}
+	push_search_result(state, strutil_find_bytes((const unsigned char*)str + start, end - start, (const unsigned char*)ss, (long)sslen), start);
+	return 1;
+}
+
+static int get_buffer_index_of_byte(lua_State* state)
+{
+	long size = 0;
+	unsigned char* data = get_buffer_data(state, 2, &size);
+	long c = luaL_checknumber(state, 3);
+	long start, end;
+	get_search_range(state, 4, 5, size, &start, &end);
+	if(data == NULL || start >= end) {
+		lua_pushnumber(state, -1);
+		return 1;
+	}
+	push_search_result(state, strutil_find_byte(data + start, end - start, (unsigned char)c), start);
+	return 1;
+}
+
+static int get_buffer_index_of_any_byte(lua_State* state)
+{
+	long size = 0;
+	unsigned char* data = get_buffer_data(state, 2, &size);
+	long setlen = 0;
+	const unsigned char* set = get_string_or_buffer_data(state, 3, &setlen);
+	long start, end;
+	get_search_range(state, 4, 5, size, &start, &end);
+	if(data == NULL || set == NULL || setlen < 1 || start >= end) {
+		lua_pushnumber(state, -1);
+		return 1;
+	}
+	push_search_result(state, strutil_find_any_byte(data + start, end - start, set, setlen), start);
+	return 1;
+}
+
+static int get_buffer_index_of_bytes(lua_State* state)
+{
+	long size = 0;
+	unsigned char* data = get_buffer_data(state, 2, &size);
+	long nlen = 0;
+	const unsigned char* needle = get_string_or_buffer_data(state, 3, &nlen);
+	long start, end;
+	get_search_range(state, 4, 5, size, &start, &end);
+	if(data == NULL || needle == NULL || nlen < 1 || start >= end) {
+		lua_pushnumber(state, -1);
+		return 1;
+	}
+	push_search_result(state, strutil_find_bytes(data + start, end - start, needle, nlen), start);
+	return 1;
+}
+
+static void split_to_table(lua_State* state, const unsigned char* data, long len, const unsigned char* set, long setlen)
+{
+	lua_newtable(state);
+	int n = 1;
+	long pos = 0;
+	while(1) {
+		long r = -1;
+		if(pos < len) {
+			r = strutil_find_any_byte(data + pos, len - pos, set, setlen);
+		}
+		if(r < 0) {
+			lua_pushlstring(state, (const char*)data + pos, len - pos);
+			lua_rawseti(state, -2, n);
+			break;
+		}
+		lua_pushlstring(state, (const char*)data + pos, r);
+		lua_rawseti(state, -2, n++);
+		pos += r + 1;
+	}
+}
+
+static int split_string(lua_State* state)
+{
+	size_t len;
+	const char* str = lua_tolstring(state, 2, &len);
+	size_t setlen;
+	const char* set = lua_tolstring(state, 3, &setlen);
+	if(str == NULL || set == NULL || setlen < 1) {
+		lua_pushnil(state);
+		return 1;
+	}
+	long start, end;
+	get_search_range(state, 4, 5, (long)len, &start, &end);
+	if(start > end) {
+		start = end;
+	}
+	split_to_table(state, (const unsigned char*)str + start, end - start, (const unsigned char*)set, (long)setlen);
+	return 1;
+}
+
+static int split_buffer(lua_State* state)
+{
+	long size = 0;
+	unsigned char* data = get_buffer_data(state, 2, &size);
+	long setlen = 0;
+	const unsigned char* set = get_string_or_buffer_data(state, 3, &setlen);
+	if(data == NULL || set == NULL || setlen < 1) {
+		lua_pushnil(state);
+		return 1;
+	}
+	long start, end;
+	get_search_range(state, 4, 5, size, &start, &end);
+	if(start > end) {
+		start = end;
+	}
+	split_to_table(state, data + start, end - start, set, setlen);
+	return 1;
+}
+
+static int convert_string_to_buffer(lua_State* state)
+{
+	size_t size;
+	const char* str = luaL_checklstring(state, 2, &size);
+	if(str == NULL) {
 		lua_pushnil(state);
 		return 1;
 	}
@@ -851,15 +1351,10 @@ static int convert_string_to_buffer(lua_State* state)
 
 static int convert_buffer_to_string(lua_State* state)
 {
-	void* ptr = luaL_checkudata(state, 2, "_sushi_buffer");
-	if(ptr == NULL) {
-		lua_pushnil(state);
-		return 1;
-	}
 	long size = 0;
-	memcpy(&size, ptr, sizeof(long));
-	if(size > 0) {
-		lua_pushlstring(state, (const char*)(ptr+sizeof(long)), size);
+	const unsigned char* data = lib_util_check_buffer_data(state, 2, &size);
+	if(data != NULL && size > 0) {
+		lua_pushlstring(state, (const char*)data, size);
 	}
 	else {
 		lua_pushstring(state, "");
@@ -869,60 +1364,217 @@ static int convert_buffer_to_string(lua_State* state)
 
 static int convert_buffer_ascii_to_string(lua_State* state)
 {
-	void* ptr = luaL_checkudata(state, 2, "_sushi_buffer");
-	if(ptr == NULL) {
+	long size = 0;
+	const unsigned char* data = get_buffer_data(state, 2, &size);
+	if(data == NULL) {
 		lua_pushnil(state);
 		return 1;
 	}
-	long size = 0;
-	memcpy(&size, ptr, sizeof(long));
-	unsigned char *pointer = (unsigned char*)ptr;
-	long fsize = size;
-	pointer = pointer + sizeof(long);
-	for(int i = 0; i < size; i++) {
-		if(*pointer > 127){
-			fsize++;
+	luaL_Buffer b;
+	luaL_buffinit(state, &b);
+	long n = 0;
+	while(n < size) {
+		long consumed = 0;
+		unsigned char* dst = (unsigned char*)luaL_prepbuffer(&b);
+		long written = strutil_latin1_to_utf8(data + n, size - n, dst, LUAL_BUFFERSIZE, &consumed);
+		luaL_addsize(&b, written);
+		n += consumed;
+	}
+	luaL_pushresult(&b);
+	return 1;
+}
+
+static int encode_base64_variant(lua_State* state, int variant, int pad)
+{
+	long len = 0;
+	const unsigned char* data = get_string_or_buffer_data(state, 2, &len);
+	if(data == NULL) {
+		lua_pushnil(state);
+		return 1;
+	}
+	long olen = encoding_base64_encoded_length(len, pad);
+	if(olen < 1) {
+		lua_pushstring(state, "");
+		return 1;
+	}
+	luaL_Buffer b;
+	luaL_buffinit(state, &b);
+	long n = 0;
+	while(n < len) {
+		long chunk = len - n;
+		if(chunk > LUAL_BUFFERSIZE / 4 * 3) {
+			chunk = LUAL_BUFFERSIZE / 4 * 3;
 		}
-		pointer++;
-	}
-	unsigned char *out = (unsigned char *)malloc(fsize);
-	pointer = (unsigned char*)ptr + sizeof(long);
-	int x;
-	for(x = 0; x < fsize; x++) {
-		if(*pointer < 128) {
-			out[x] = *pointer;
+		unsigned char* dst = (unsigned char*)luaL_prepbuffer(&b);
+		luaL_addsize(&b, encoding_base64_encode(data + n, chunk, dst, variant, n + chunk == len ? pad : 0));
+		n += chunk;
+	}
+	luaL_pushresult(&b);
+	return 1;
+}
+
+static int encode_base64(lua_State* state)
+{
+	return encode_base64_variant(state, ENCODING_BASE64, 1);
+}
+
+static int encode_base64url(lua_State* state)
+{
+	return encode_base64_variant(state, ENCODING_BASE64URL, lua_toboolean(state, 3));
+}
+
+static int decode_base64_variant(lua_State* state, int variant)
+{
+	long len = 0;
+	const unsigned char* data = get_string_or_buffer_data(state, 2, &len);
+	if(data == NULL) {
+		lua_pushnil(state);
+		return 1;
+	}
+	long olen = encoding_base64_decoded_length(data, len);
+	if(olen < 0) {
+		lua_pushnil(state);
+		return 1;
+	}
+	if(lua_isuserdata(state, 3)) {
+		long size = 0;
+		unsigned char* dst = get_buffer_data(state, 3, &size);
+		long offset = luaL_optlong(state, 4, 0);
+		if(dst == NULL || offset < 0 || offset > size || olen > size - offset) {
+			lua_pushnumber(state, -1);
+			return 1;
 		}
-		else {
-			out[x] = 0xc0 | (*pointer >> 6);
-			out[++x] = 0x80 | (*pointer & 0x3f);
+		lua_pushnumber(state, encoding_base64_decode(data, len, dst + offset, variant));
+		return 1;
+	}
+	unsigned char* dst = lib_util_push_new_buffer(state, olen);
+	if(encoding_base64_decode(data, len, dst, variant) != olen) {
+		lua_pop(state, 1);
+		lua_pushnil(state);
+	}
+	return 1;
+}
+
+static int decode_base64(lua_State* state)
+{
+	return decode_base64_variant(state, ENCODING_BASE64);
+}
+
+static int decode_base64url(lua_State* state)
+{
+	return decode_base64_variant(state, ENCODING_BASE64URL);
+}
+
+static int encode_hex(lua_State* state)
+{
+	long len = 0;
+	const unsigned char* data = get_string_or_buffer_data(state, 2, &len);
+	if(data == NULL) {
+		lua_pushnil(state);
+		return 1;
+	}
+	int upper = lua_toboolean(state, 3);
+	luaL_Buffer b;
+	luaL_buffinit(state, &b);
+	long n = 0;
+	while(n < len) {
+		long chunk = len - n;
+		if(chunk > LUAL_BUFFERSIZE / 2) {
+			chunk = LUAL_BUFFERSIZE / 2;
 		}
-		pointer++;
+		unsigned char* dst = (unsigned char*)luaL_prepbuffer(&b);
+		luaL_addsize(&b, encoding_hex_encode(data + n, chunk, dst, upper));
+		n += chunk;
 	}
-	if(fsize > 0) {
-		lua_pushlstring(state, (const char*)out, fsize);
+	luaL_pushresult(&b);
+	return 1;
+}
+
+static int decode_hex(lua_State* state)
+{
+	long len = 0;
+	const unsigned char* data = get_string_or_buffer_data(state, 2, &len);
+	if(data == NULL || len % 2 != 0) {
+		lua_pushnil(state);
+		return 1;
 	}
-	else {
-		lua_pushstring(state, "");
+	if(lua_isuserdata(state, 3)) {
+		long size = 0;
+		unsigned char* dst = get_buffer_data(state, 3, &size);
+		long offset = luaL_optlong(state, 4, 0);
+		if(dst == NULL || offset < 0 || offset > size || len / 2 > size - offset) {
+			lua_pushnumber(state, -1);
+			return 1;
+		}
+		lua_pushnumber(state, encoding_hex_decode(data, len, dst + offset));
+		return 1;
+	}
+	unsigned char* dst = lib_util_push_new_buffer(state, len / 2);
+	if(encoding_hex_decode(data, len, dst) < 0) {
+		lua_pop(state, 1);
+		lua_pushnil(state);
 	}
 	return 1;
 }
 
-static int sushi_deflate(lua_State* state)
+static const unsigned char* get_checksum_range(lua_State* state, long* size)
 {
-	void* ptr = luaL_checkudata(state, 2, "_sushi_buffer");
-	if(ptr == NULL) {
+	long len = 0;
+	const unsigned char* data = get_string_or_buffer_data(state, 2, &len);
+	if(data == NULL) {
+		return NULL;
+	}
+	long offset = luaL_optlong(state, 3, 0);
+	long count = luaL_optlong(state, 4, -1);
+	if(offset < 0 || offset > len) {
+		return NULL;
+	}
+	if(count < 0 || count > len - offset) {
+		count = len - offset;
+	}
+	*size = count;
+	return data + offset;
+}
+
+static int sushi_crc32(lua_State* state)
+{
+	long size = 0;
+	const unsigned char* data = get_checksum_range(state, &size);
+	if(data == NULL) {
+		lua_pushnil(state);
+		return 1;
+	}
+	uLong initial = (uLong)luaL_optnumber(state, 5, 0);
+	lua_pushnumber(state, (lua_Number)crc32_z(initial, data, (z_size_t)size));
+	return 1;
+}
+
+static int sushi_adler32(lua_State* state)
+{
+	long size = 0;
+	const unsigned char* data = get_checksum_range(state, &size);
+	if(data == NULL) {
 		lua_pushnil(state);
 		return 1;
 	}
+	uLong initial = (uLong)luaL_optnumber(state, 5, 1);
+	lua_pushnumber(state, (lua_Number)adler32_z(initial, data, (z_size_t)size));
+	return 1;
+}
+
+static int sushi_deflate(lua_State* state)
+{
 	long size = 0;
-	memcpy(&size, ptr, sizeof(long));
+	const unsigned char* ptr = lib_util_check_buffer_data(state, 2, &size);
 	if(size < 1) {
 		lua_pushnil(state);
 		return 1;
 	}
 	unsigned char* result = NULL;
 	unsigned long resultlen = 0;
-	zbuf_deflate(ptr+sizeof(long), size, &result, &resultlen);
+	if(zbuf_deflate_limit((unsigned char*)ptr, size, LIB_UTIL_MAX_BUFFER_SIZE, &result, &resultlen) == ZBUF_TOO_LARGE) {
+		return luaL_error(state, "deflate result is too large for a buffer");
+	}
 	if(result == NULL) {
 		lua_pushnil(state);
 		return 1;
@@ -932,31 +1584,24 @@ static int sushi_deflate(lua_State* state)
 		lua_pushnil(state);
 		return 1;
 	}
-	void* rptr = lua_newuserdata(state, sizeof(long) + (size_t)resultlen);
-	luaL_getmetatable(state, "_sushi_buffer");
-	lua_setmetatable(state, -2);
-	memcpy(rptr, &resultlen, sizeof(long));
-	memcpy(rptr+sizeof(long), result, resultlen);
+	memcpy(lib_util_push_new_buffer(state, (long)resultlen), result, resultlen);
 	free(result);
 	return 1;
 }
 
 static int sushi_inflate(lua_State* state)
 {
-	void* ptr = luaL_checkudata(state, 2, "_sushi_buffer");
-	if(ptr == NULL) {
-		lua_pushnil(state);
-		return 1;
-	}
 	long size = 0;
-	memcpy(&size, ptr, sizeof(long));
+	const unsigned char* ptr = lib_util_check_buffer_data(state, 2, &size);
 	if(size < 1) {
 		lua_pushnil(state);
 		return 1;
 	}
 	unsigned char* result = NULL;
 	unsigned long resultlen = 0;
-	zbuf_inflate(ptr+sizeof(long), size, &result, &resultlen);
+	if(zbuf_inflate_limit((unsigned char*)ptr, size, LIB_UTIL_MAX_BUFFER_SIZE, &result, &resultlen) == ZBUF_TOO_LARGE) {
+		return luaL_error(state, "inflate result is too large for a buffer");
+	}
 	if(result == NULL) {
 		lua_pushnil(state);
 		return 1;
@@ -966,15 +1611,344 @@ static int sushi_inflate(lua_State* state)
 		lua_pushnil(state);
 		return 1;
 	}
-	void* rptr = lua_newuserdata(state, sizeof(long) + (size_t)resultlen);
-	luaL_getmetatable(state, "_sushi_buffer");
-	lua_setmetatable(state, -2);
-	memcpy(rptr, &resultlen, sizeof(long));
-	memcpy(rptr+sizeof(long), result, resultlen);
+	memcpy(lib_util_push_new_buffer(state, (long)resultlen), result, resultlen);
 	free(result);
 	return 1;
 }
 
+static int sushi_deflate_parallel(lua_State* state)
+{
+	long size = 0;
+	const unsigned char* ptr = lib_util_check_buffer_data(state, 2, &size);
+	int threads = (int)luaL_optnumber(state, 3, 0);
+	int format = (int)luaL_optnumber(state, 4, ZBUF_FORMAT_ZLIB);
+	int level = (int)luaL_optnumber(state, 5, -1);
+	unsigned char* result = NULL;
+	unsigned long resultlen = 0;
+	if(zbuf_deflate_parallel((unsigned char*)ptr, size, format, level, threads, &result, &resultlen) == 0) {
+		lua_pushnil(state);
+		return 1;
+	}
+	if(resultlen > LIB_UTIL_MAX_BUFFER_SIZE) {
+		free(result);
+		return luaL_error(state, "deflate result is too large for a buffer");
+	}
+	memcpy(lib_util_push_new_buffer(state, (long)resultlen), result, resultlen);
+	free(result);
+	return 1;
+}
+
+static int sushi_lz4_compress(lua_State* state)
+{
+	long size = 0;
+	const unsigned char* ptr = lib_util_check_buffer_data(state, 2, &size);
+	long cap = lz4_frame_bound(size);
+	unsigned char* result = (unsigned char*)malloc(cap);
+	if(result == NULL) {
+		lua_pushnil(state);
+		return 1;
+	}
+	long resultlen = lz4_frame_compress(ptr, size, result, cap);
+	if(resultlen < 0) {
+		free(result);
+		lua_pushnil(state);
+		return 1;
+	}
+	memcpy(lib_util_push_new_buffer(state, resultlen), result, resultlen);
+	free(result);
+	return 1;
+}
+
+static int sushi_lz4_decompress(lua_State* state)
+{
+	long size = 0;
+	const unsigned char* ptr = lib_util_check_buffer_data(state, 2, &size);
+	unsigned char* result = NULL;
+	long resultlen = 0;
+	if(lz4_frame_decompress(ptr, size, &result, &resultlen) == 0) {
+		lua_pushnil(state);
+		return 1;
+	}
+	memcpy(lib_util_push_new_buffer(state, resultlen), result, resultlen);
+	free(result);
+	return 1;
+}
+
+static int sushi_lz4_compress_block(lua_State* state)
+{
+	long size = 0;
+	const unsigned char* ptr = lib_util_check_buffer_data(state, 2, &size);
+	long cap = lz4_compress_bound(size);
+	unsigned char* result = (unsigned char*)malloc(cap);
+	if(result == NULL) {
+		lua_pushnil(state);
+		return 1;
+	}
+	long resultlen = lz4_compress_block(ptr, size, result, cap);
+	if(resultlen < 0) {
+		free(result);
+		lua_pushnil(state);
+		return 1;
+	}
+	memcpy(lib_util_push_new_buffer(state, resultlen), result, resultlen);
+	free(result);
+	return 1;
+}
+
+static int sushi_lz4_decompress_block(lua_State* state)
+{
+	long size = 0;
+	const unsigned char* ptr = lib_util_check_buffer_data(state, 2, &size);
+	long originalSize = (long)luaL_checknumber(state, 3);
+	if(originalSize < 0) {
+		lua_pushnil(state);
+		return 1;
+	}
+	unsigned char* dst = lib_util_push_new_buffer(state, originalSize);
+	if(lz4_decompress_block(ptr, size, dst, originalSize) != originalSize) {
+		lua_pop(state, 1);
+		lua_pushnil(state);
+	}
+	return 1;
+}
+
+static ZbufStream* check_compression_stream(lua_State* state, int index)
+{
+	ZbufStream** ptr = (ZbufStream**)luaL_checkudata(state, index, "_sushi_zstream");
+	if(ptr == NULL) {
+		return NULL;
+	}
+	return *ptr;
+}
+
+static int push_compression_stream(lua_State* state, ZbufStream* stream)
+{
+	if(stream == NULL) {
+		lua_pushnil(state);
+		return 1;
+	}
+	ZbufStream** ptr = (ZbufStream**)lua_newuserdata(state, sizeof(ZbufStream*));
+	*ptr = stream;
+	luaL_getmetatable(state, "_sushi_zstream");
+	lua_setmetatable(state, -2);
+	return 1;
+}
+
+static int close_compression_stream_gc(lua_State* state)
+{
+	ZbufStream** ptr = (ZbufStream**)luaL_checkudata(state, 1, "_sushi_zstream");
+	if(ptr != NULL && *ptr != NULL) {
+		zbuf_stream_free(*ptr);
+		*ptr = NULL;
+	}
+	return 0;
+}
+
+static int close_compression_stream(lua_State* state)
+{
+	lua_remove(state, 1);
+	return close_compression_stream_gc(state);
+}
+
+static int create_deflate_stream(lua_State* state)
+{
+	int format = (int)luaL_optnumber(state, 2, ZBUF_FORMAT_ZLIB);
+	int level = (int)luaL_optnumber(state, 3, -1);
+	int strategy = (int)luaL_optnumber(state, 4, 0);
+	return push_compression_stream(state, zbuf_stream_create_deflate(format, level, strategy));
+}
+
+static int create_inflate_stream(lua_State* state)
+{
+	int format = (int)luaL_optnumber(state, 2, ZBUF_FORMAT_ZLIB);
+	return push_compression_stream(state, zbuf_stream_create_inflate(format));
+}
+
+// Shared implementation of feed/flush/finish: (stream, data, size, out, offset).
+// Without an output buffer, all pending output is returned as a new buffer.
+// With one, as much as fits is copied at the offset and the byte count is
+// returned; the rest stays pending and is drained by the next call.
+static int process_compression_stream(lua_State* state, int mode)
+{
+	ZbufStream* stream = check_compression_stream(state, 2);
+	if(stream == NULL) {
+		lua_pushnil(state);
+		return 1;
+	}
+	const unsigned char* data = NULL;
+	long size = 0;
+	if(lua_isnoneornil(state, 3) == 0) {
+		data = lib_util_check_buffer_data(state, 3, &size);
+		long sz = (long)luaL_optnumber(state, 4, -1);
+		if(sz >= 0 && sz < size) {
+			size = sz;
+		}
+	}
+	if(zbuf_stream_process(stream, data, (unsigned long)size, mode) == 0) {
+		lua_pushnil(state);
+		return 1;
+	}
+	unsigned char* out = NULL;
+	unsigned long outlen = zbuf_stream_get_output(stream, &out);
+	if(lua_isnoneornil(state, 5) == 0) {
+		void* dptr = luaL_checkudata(state, 5, "_sushi_buffer");
+		long dsize = 0;
+		memcpy(&dsize, dptr, sizeof(long));
+		long offset = (long)luaL_optnumber(state, 6, 0);
+		if(offset < 0 || offset > dsize) {
+			lua_pushnil(state);
+			return 1;
+		}
+		unsigned long n = (unsigned long)(dsize - offset);
+		if(n > outlen) {
+			n = outlen;
+		}
+		memcpy((unsigned char*)dptr + sizeof(long) + offset, out, n);
+		zbuf_stream_consume_output(stream, n);
+		lua_pushnumber(state, n);
+		return 1;
+	}
+	if(outlen > LIB_UTIL_MAX_BUFFER_SIZE) {
+		// stays pending, to be drained into output buffers
+		return luaL_error(state, "pending output is too large for a buffer");
+	}
+	memcpy(lib_util_push_new_buffer(state, (long)outlen), out, outlen);
+	zbuf_stream_consume_output(stream, outlen);
+	return 1;
+}
+
+static int feed_compression_stream(lua_State* state)
+{
+	return process_compression_stream(state, ZBUF_FEED);
+}
+
+static int flush_compression_stream(lua_State* state)
+{
+	return process_compression_stream(state, ZBUF_FLUSH);
+}
+
+static int finish_compression_stream(lua_State* state)
+{
+	return process_compression_stream(state, ZBUF_FINISH);
+}
+
+static int get_compression_stream_pending_size(lua_State* state)
+{
+	ZbufStream* stream = check_compression_stream(state, 2);
+	unsigned char* out = NULL;
+	lua_pushnumber(state, stream != NULL ? zbuf_stream_get_output(stream, &out) : 0);
+	return 1;
+}
+
+static void init_compression_stream_type(lua_State* state)
+{
+	luaL_newmetatable(state, "_sushi_zstream");
+	lua_pushliteral(state, "__gc");
+	lua_pushcfunction(state, close_compression_stream_gc);
+	lua_rawset(state, -3);
+	lua_pop(state, 1);
+}
+
+static int release_mapped_view_gc(lua_State* state)
+{
+	SushiMappedView* view = (SushiMappedView*)luaL_checkudata(state, 1, SUSHI_MAPPED_VIEW);
+	if(view->release != NULL) {
+		view->release(view->owner);
+	}
+	memset(view, 0, sizeof(SushiMappedView));
+	return 0;
+}
+
+// Views may be created (for example for _code) before _util is opened, so
+// the metatable is set up by whoever needs it first.
+static void push_mapped_view_metatable(lua_State* state)
+{
+	static const luaL_Reg viewMethods[] = {
+		{ "__gc", release_mapped_view_gc },
+		{ "__index", get_buffer_byte_lua_syntax },
+		{ "__len", get_buffer_size_lua_syntax },
+		{ NULL, NULL }
+	};
+	if(luaL_newmetatable(state, SUSHI_MAPPED_VIEW)) {
+		luaL_register(state, NULL, viewMethods);
+	}
+}
+
+void lib_util_push_mapped_view(lua_State* state, const unsigned char* data, long size, void (*release)(void* owner), void* owner)
+{
+	SushiMappedView* view = (SushiMappedView*)lua_newuserdata(state, sizeof(SushiMappedView));
+	view->data = data;
+	view->size = size;
+	view->release = release;
+	view->owner = owner;
+	view->produce = NULL;
+	push_mapped_view_metatable(state);
+	lua_setmetatable(state, -2);
+}
+
+// The data is produced by the callback on first access; a failing callback
+// leaves an empty view
+void lib_util_push_produced_view(lua_State* state, int (*produce)(SushiMappedView* view), void (*release)(void* owner), void* owner)
+{
+	lib_util_push_mapped_view(state, NULL, 0, release, owner);
+	SushiMappedView* view = (SushiMappedView*)lua_touserdata(state, -1);
+	view->produce = produce;
+}
+
+static void release_mapped_file_view(void* owner)
+{
+	mappedfile_release((MappedFile*)owner);
+}
+
+void lib_util_push_mapped_file_view(lua_State* state, MappedFile* file, const unsigned char* data, long size)
+{
+	mappedfile_retain(file);
+	lib_util_push_mapped_view(state, data, size, release_mapped_file_view, file);
+}
+
+// Content stored as is in the mapped file is pushed as a view that keeps
+// the mapping alive; anything else is left to the unpack callback.
+void lib_util_push_archive_entry(lua_State* state, MappedFile* file, const unsigned char* data, long size, int (*unpack)(lua_State* state, void* archive, long index), void* archive, long index)
+{
+	if(data != NULL) {
+		lib_util_push_mapped_file_view(state, file, data, size);
+		return;
+	}
+	int top = lua_gettop(state);
+	if(unpack(state, archive, index) == 0) {
+		lua_settop(state, top);
+		lua_pushnil(state);
+	}
+}
+
+static int is_mapped_view(lua_State* state)
+{
+	lua_pushboolean(state, luaL_testudata(state, 2, SUSHI_MAPPED_VIEW) != NULL);
+	return 1;
+}
+
+static int get_mapped_view_size(lua_State* state)
+{
+	long size = 0;
+	get_view_data((SushiMappedView*)luaL_checkudata(state, 2, SUSHI_MAPPED_VIEW), &size);
+	lua_pushnumber(state, size);
+	return 1;
+}
+
+static int convert_mapped_view_to_buffer(lua_State* state)
+{
+	long size = 0;
+	const unsigned char* data = get_view_data((SushiMappedView*)luaL_checkudata(state, 2, SUSHI_MAPPED_VIEW), &size);
+	if(size > 0) {
+		memcpy(lib_util_push_new_buffer(state, size), data, size);
+	}
+	else {
+		lib_util_push_new_buffer(state, 0);
+	}
+	return 1;
+}
+
+
 static void init_buffer_type(lua_State* state)
 {
 	static const luaL_Reg bufferMethods[] = {
@@ -1013,31 +1987,76 @@ static const luaL_Reg funcs[] = {
 	{ "to_number", to_number },
 	{ "get_string_length", get_string_length },
 	{ "get_utf8_character_count", get_utf8_character_count },
+	{ "is_valid_utf8", is_valid_utf8 },
 	{ "create_string_for_byte", create_string_for_byte },
 	{ "create_octal_string_for_integer", create_octal_string_for_integer },
 	{ "create_hex_string_for_integer", create_hex_string_for_integer },
 	{ "create_decimal_string_for_integer", create_decimal_string_for_integer },
 	{ "create_string_for_float", create_string_for_float },
 	{ "create_string_for_double_with_decimals", create_string_for_double_with_decimals },
+	{ "create_shortest_string_for_double", create_shortest_string_for_double },
 	{ "get_byte_from_string", get_byte_from_string },
 	{ "string_starts_with", string_starts_with },
+	{ "string_starts_with_ignore_case", string_starts_with_ignore_case },
+	{ "buffer_starts_with", buffer_starts_with },
 	{ "compare_string_ignore_case", compare_string_ignore_case },
+	{ "compare_buffer_ignore_case", compare_buffer_ignore_case },
 	{ "change_string_to_lowercase", change_string_to_lowercase },
 	{ "change_string_to_uppercase", change_string_to_uppercase },
+	{ "change_buffer_to_lowercase", change_buffer_to_lowercase },
+	{ "change_buffer_to_uppercase", change_buffer_to_uppercase },
+	{ "trim_string", trim_string },
+	{ "get_trimmed_range", get_trimmed_range },
 	{ "get_substring", get_substring },
 	{ "get_index_of_character", get_index_of_character },
 	{ "get_index_of_substring", get_index_of_substring },
+	{ "get_index_of_any_character", get_index_of_any_character },
+	{ "get_buffer_index_of_byte", get_buffer_index_of_byte },
+	{ "get_buffer_index_of_bytes", get_buffer_index_of_bytes },
+	{ "get_buffer_index_of_any_byte", get_buffer_index_of_any_byte },
+	{ "split_string", split_string },
+	{ "split_buffer", split_buffer },
 	{ "convert_string_to_buffer", convert_string_to_buffer },
 	{ "convert_buffer_to_string", convert_buffer_to_string },
 	{ "convert_buffer_ascii_to_string", convert_buffer_ascii_to_string },
+	{ "encode_base64", encode_base64 },
+	{ "encode_base64url", encode_base64url },
+	{ "decode_base64", decode_base64 },
+	{ "decode_base64url", decode_base64url },
+	{ "encode_hex", encode_hex },
+	{ "decode_hex", decode_hex },
+	{ "is_mapped_view", is_mapped_view },
+	{ "get_mapped_view_size", get_mapped_view_size },
+	{ "convert_mapped_view_to_buffer", convert_mapped_view_to_buffer },
+	{ "crc32", sushi_crc32 },
+	{ "adler32", sushi_adler32 },
 	{ "deflate", sushi_deflate },
 	{ "inflate", sushi_inflate },
+	{ "deflate_parallel", sushi_deflate_parallel },
+	{ "lz4_compress", sushi_lz4_compress },
+	{ "lz4_decompress", sushi_lz4_decompress },
+	{ "lz4_compress_block", sushi_lz4_compress_block },
+	{ "lz4_decompress_block", sushi_lz4_decompress_block },
+	{ "create_deflate_stream", create_deflate_stream },
+	{ "create_inflate_stream", create_inflate_stream },
+	{ "feed_compression_stream", feed_compression_stream },
+	{ "flush_compression_stream", flush_compression_stream },
+	{ "finish_compression_stream", finish_compression_stream },
+	{ "get_compression_stream_pending_size", get_compression_stream_pending_size },
+	{ "close_compression_stream", close_compression_stream },
 	{ NULL, NULL }
 };
 
+void lib_util_init_types(lua_State* state)
+{
+	init_buffer_type(state);
+	init_compression_stream_type(state);
+	push_mapped_view_metatable(state);
+	lua_pop(state, 1);
+}
+
 void lib_util_init(lua_State* state)
 {
 	luaL_newlib(state, funcs);
 	lua_setglobal(state, "_util");
-	init_buffer_type(state);
 }
@@ -26,7 +26,44 @@
 #define LIB_UTIL_H
 
 #include "sushi.h"
+#include "mappedfile.h"
 
+#define SUSHI_MAPPED_VIEW "_sushi_mapped"
+
+// A read-only view of memory owned by something else (for example a memory
+// mapped file); release is called with owner when the view is collected.
+// A view may also start out empty with a produce function that fills in
+// data and size (and may replace release and owner) on first access.
+typedef struct SushiMappedView
+{
+	const unsigned char* data;
+	long size;
+	void (*release)(void* owner);
+	void* owner;
+	int (*produce)(struct SushiMappedView* view);
+} SushiMappedView;
+
+// Types shared by all libraries; registered in every state before any of
+// the library tables.
+void lib_util_init_types(lua_State* state);
 void lib_util_init(lua_State* state);
+void lib_util_push_mapped_view(lua_State* state, const unsigned char* data, long size, void (*release)(void* owner), void* owner);
+void lib_util_push_produced_view(lua_State* state, int (*produce)(SushiMappedView* view), void (*release)(void* owner), void* owner);
+// Largest buffer that can be allocated; LuaJIT caps a userdata at
+// 0x7fffff00 bytes, including the size field in front of the data.
+#define LIB_UTIL_MAX_BUFFER_SIZE (0x7fffff00L - (long)sizeof(long))
+
+// Pushes a new buffer of the given size and returns its data.
+unsigned char* lib_util_push_new_buffer(lua_State* state, long size);
+// Pushes a view of data within a mapped file, holding a reference to it.
+void lib_util_push_mapped_file_view(lua_State* state, MappedFile* file, const unsigned char* data, long size);
+// Pushes an entry of an archive in a mapped file: a view of data when it
+// is not NULL, otherwise whatever unpack pushes (nil if it returns 0).
+void lib_util_push_archive_entry(lua_State* state, MappedFile* file, const unsigned char* data, long size, int (*unpack)(lua_State* state, void* archive, long index), void* archive, long index);
+// Data of a buffer or a mapped view (read-only); raises an error for any
+// other value. The test variant returns NULL instead. An empty view gives
+// a valid pointer with size 0, so NULL always means "not a buffer".
+const unsigned char* lib_util_check_buffer_data(lua_State* state, int idx, long* size);
+const unsigned char* lib_util_test_buffer_data(lua_State* state, int idx, long* size);
 
 #endif
@@ -29,6 +29,10 @@
 #include "lj_err.h"
 #include "lmarshal.h"
 #include "lib_vm.h"
+#include "sapp.h"
+#include "allocator.h"
+#include "codecache.h"
+#include "lib_util.h"
 #define luaL_getn(L,i) ((int)lua_objlen(L,i))
 #define luaL_setn(L,i,j) ((void)0)
 #define aux_getn(L,n) (luaL_checktype(L,n,5), luaL_getn(L,n))
@@ -63,6 +67,79 @@ static int run_garbage_collector(lua_State* state)
 	return 0;
 }
 
+// Returns the state of the interpreter given at the index, or the calling
+// state itself when there is no interpreter there.
+static lua_State* get_target_state(lua_State* state, int index)
+{
+	if(lua_isnoneornil(state, index)) {
+		return state;
+	}
+	void* ptr = luaL_checkudata(state, index, "_sushi_interpreter");
+	lua_State* nstate = NULL;
+	memcpy(&nstate, ptr, sizeof(lua_State*));
+	return nstate;
+}
+
+static int get_memory_statistics(lua_State* state)
+{
+	lua_State* target = get_target_state(state, 2);
+	Allocator* allocator = target ? allocator_get(target) : NULL;
+	if(allocator == NULL) {
+		lua_pushnil(state);
+		return 1;
+	}
+	AllocatorStats stats;
+	allocator_get_stats(allocator, &stats);
+	lua_createtable(state, 0, 8);
+	lua_pushnumber(state, (lua_Number)stats.bytes);
+	lua_setfield(state, -2, "bytes");
+	lua_pushnumber(state, (lua_Number)stats.peakBytes);
+	lua_setfield(state, -2, "peak_bytes");
+	lua_pushnumber(state, (lua_Number)stats.limit);
+	lua_setfield(state, -2, "limit");
+	lua_pushnumber(state, (lua_Number)stats.allocations);
+	lua_setfield(state, -2, "allocations");
+	lua_pushnumber(state, (lua_Number)stats.frees);
+	lua_setfield(state, -2, "frees");
+	lua_pushnumber(state, (lua_Number)stats.failures);
+	lua_setfield(state, -2, "failures");
+	lua_pushnumber(state, (lua_Number)stats.arenaSize);
+	lua_setfield(state, -2, "arena_size");
+	lua_pushnumber(state, (lua_Number)stats.arenaUsed);
+	lua_setfield(state, -2, "arena_used");
+	return 1;
+}
+
+static int get_code_cache_statistics(lua_State* state)
+{
+	CodecacheStatistics stats;
+	codecache_get_statistics(&stats);
+	lua_createtable(state, 0, 4);
+	lua_pushnumber(state, (lua_Number)stats.hits);
+	lua_setfield(state, -2, "hits");
+	lua_pushnumber(state, (lua_Number)stats.misses);
+	lua_setfield(state, -2, "misses");
+	lua_pushnumber(state, (lua_Number)stats.stores);
+	lua_setfield(state, -2, "stores");
+	lua_pushnumber(state, stats.entries);
+	lua_setfield(state, -2, "entries");
+	return 1;
+}
+
+static int set_memory_limit(lua_State* state)
+{
+	lua_Number limit = luaL_checknumber(state, 2);
+	lua_State* target = get_target_state(state, 3);
+	Allocator* allocator = target ? allocator_get(target) : NULL;
+	if(allocator == NULL || limit < 0) {
+		lua_pushboolean(state, 0);
+		return 1;
+	}
+	allocator_set_limit(allocator, (size_t)limit);
+	lua_pushboolean(state, 1);
+	return 1;
+}
+
 static int create_destructor(lua_State* state)
 {
 	void* ud = lua_newuserdata(state, 1);
@@ -108,6 +185,13 @@ static int get_global(lua_State* state)
 
 static int set_metatable(lua_State* state)
 {
+	// A new metatable on the globals table would drop the hook that
+	// produces lazy globals, so any that are still pending are produced now
+	if(lua_rawequal(state, 2, LUA_GLOBALSINDEX)) {
+		int top = lua_gettop(state);
+		sushi_resolve_lazy_globals(state);
+		lua_settop(state, top);
+	}
 	lua_setmetatable(state, 2);
 	return 1;
 }
@@ -171,8 +255,8 @@ static int get_datatype_info(lua_State* state)
 		return 1;
 	}
 	if(tt == LUA_TUSERDATA) {
-		void* ptr = luaL_testudata(state, 2, "_sushi_buffer");
-		if(ptr != NULL) {
+		long size = 0;
+		if(lib_util_test_buffer_data(state, 2, &size) != NULL) {
 			lua_pushstring(state, "buffer");
 		}
 		else {
@@ -584,21 +668,59 @@ static int bitwise_right_shift(lua_State* state)
 	return 1;
 }
 
-static int execute_program(lua_State* ostate)
+// Creates the state of a nested interpreter. A table of library names at
+// the given index creates a minimal interpreter with only those libraries.
+// The options table after it may set memory_limit, arena_size and
+// huge_pages for the new state.
+static lua_State* create_interpreter_state(lua_State* state, int index)
 {
-	void* ptr = luaL_checkudata(ostate, 2, "_sushi_buffer");
-	if(ptr == NULL) {
-		lua_pushnumber(ostate, -1);
-		return 1;
+	SushiStateOptions options;
+	memset(&options, 0, sizeof(SushiStateOptions));
+	if(lua_istable(state, index + 1)) {
+		lua_getfield(state, index + 1, "memory_limit");
+		options.memoryLimit = (unsigned long)lua_tonumber(state, -1);
+		lua_getfield(state, index + 1, "arena_size");
+		options.arenaSize = (unsigned long)lua_tonumber(state, -1);
+		lua_getfield(state, index + 1, "huge_pages");
+		options.hugePages = lua_toboolean(state, -1);
+		lua_pop(state, 3);
+	}
+	if(lua_istable(state, index) == 0) {
+		return sushi_create_new_state_with_options(&options);
+	}
+	int count = (int)lua_objlen(state, index);
+	const char** names = (const char**)malloc(sizeof(const char*) * (count + 1));
+	if(names == NULL) {
+		return NULL;
+	}
+	int n;
+	for(n=0; n<count; n++) {
+		lua_rawgeti(state, index, n + 1);
+		// The strings stay referenced by the table while they are in use
+		names[n] = lua_type(state, -1) == LUA_TSTRING ? lua_tostring(state, -1) : NULL;
+		lua_pop(state, 1);
+		if(names[n] == NULL) {
+			free(names);
+			sushi_error("Library names must be strings");
+			return NULL;
+		}
 	}
+	names[count] = NULL;
+	options.libraries = names;
+	lua_State* nstate = sushi_create_new_state_with_options(&options);
+	free(names);
+	return nstate;
+}
+
+static int execute_program(lua_State* ostate)
+{
 	long sz = 0;
-	memcpy(&sz, ptr, sizeof(long));	
-	ptr += sizeof(long);
+	const unsigned char* ptr = lib_util_check_buffer_data(ostate, 2, &sz);
     const char *name = luaL_checkstring(ostate, 3);
 	if(name == NULL) {
 		name = "__code__";
 	}
-	lua_State* nstate = sushi_create_new_state();
+	lua_State* nstate = create_interpreter_state(ostate, 5);
 	if(nstate == NULL) {
 		lua_pushnumber(ostate, -1);
 		return 1;
@@ -621,6 +743,9 @@ static int execute_program(lua_State* ostate)
 	code.data = (unsigned char*)ptr;
 	code.dataSize = sz;
 	code.fileName = (char*)name;
+	code.mapping = NULL;
+	code.mappingSize = 0;
+	code.cacheBytecode = 0;
 	int rv = sushi_execute_program(nstate, &code);
 	lua_gc(nstate, LUA_GCCOLLECT, 0);
 	lua_close(nstate);
@@ -644,38 +769,139 @@ static int parse_to_function(lua_State* state)
 	return 1;
 }
 
+// (object, constants, version): version 1 writes the old format, which is
+// larger but can still be read by older releases; the default is 2.
 static int serialize_object(lua_State* state)
 {
-	char* buf;
-	unsigned long len;
 	lua_remove(state, 1);
-	mar_encode(state, &buf, &len);
-	lua_pushlstring(state, buf, len);
-	free(buf);
-	return 1;
+	int version = (int)luaL_optnumber(state, 3, 2);
+	if(lua_gettop(state) > 2) {
+		lua_settop(state, 2);
+	}
+	if(version == 1) {
+		char* buf;
+		unsigned long len;
+		mar_encode(state, &buf, &len);
+		lua_pushlstring(state, buf, len);
+		free(buf);
+		return 1;
+	}
+	if(version != 2) {
+		return luaL_error(state, "unsupported serialization version %d", version);
+	}
+	return mar_encode_v2(state);
+}
+
+static int serialize_object_to_buffer(lua_State* state)
+{
+	lua_remove(state, 1);
+	return mar_encode_v2_to_buffer(state);
+}
+
+static int serialize_object_to_handle(lua_State* state)
+{
+	lua_remove(state, 1);
+	int fd = luaL_checknumber(state, 1);
+	int compress = lua_toboolean(state, 4);
+	if(fd < 0) {
+		lua_pushnumber(state, -1);
+		return 1;
+	}
+	lua_remove(state, 1);
+	return mar_encode_v2_to_handle(state, fd, compress);
+}
+
+static int unserialize_object_from_handle(lua_State* state)
+{
+	lua_remove(state, 1);
+	int fd = luaL_checknumber(state, 1);
+	if(fd < 0) {
+		lua_pushnil(state);
+		return 1;
+	}
+	return mar_decode_v2_from_handle(state, fd);
 }
 
 static int unserialize_object(lua_State* state)
 {
-    size_t len;
+	size_t len;
+	const char* buf;
 	lua_remove(state, 1);
-    const char *buf = luaL_checklstring(state, 1, &len);
+	if(lua_type(state, 1) == LUA_TUSERDATA) {
+		long size = 0;
+		buf = (const char*)lib_util_check_buffer_data(state, 1, &size);
+		len = (size_t)size;
+	}
+	else {
+		buf = luaL_checklstring(state, 1, &len);
+	}
 	return mar_decode(state, buf, len);
 }
 
-int prepare_interpreter(lua_State* state)
+static int create_program_archive(lua_State* state)
 {
-	// parameters
-	void* codeptr = luaL_checkudata(state, 2, "_sushi_buffer");
-	if(codeptr == NULL) {
+	luaL_checktype(state, 2, LUA_TTABLE);
+	long count = (long)lua_objlen(state, 2);
+	SappEntry* entries = (SappEntry*)calloc(count > 0 ? count : 1, sizeof(SappEntry));
+	if(entries == NULL) {
+		lua_pushnil(state);
+		return 1;
+	}
+	long n;
+	for(n=0; n<count; n++) {
+		lua_rawgeti(state, 2, n + 1);
+		if(lua_istable(state, -1) == 0) {
+			lua_pop(state, 1);
+			break;
+		}
+		size_t len = 0;
+		lua_getfield(state, -1, "name");
+		entries[n].name = lua_tolstring(state, -1, &len);
+		entries[n].namelen = (long)len;
+		lua_pop(state, 1);
+		lua_getfield(state, -1, "code");
+		if(lua_type(state, -1) == LUA_TSTRING) {
+			entries[n].data = (const unsigned char*)lua_tolstring(state, -1, &len);
+			entries[n].size = len;
+		}
+		else {
+			long size = 0;
+			entries[n].data = lib_util_test_buffer_data(state, -1, &size);
+			entries[n].size = (uint64_t)size;
+		}
+		lua_pop(state, 1);
+		lua_getfield(state, -1, "compress");
+		entries[n].flags = lua_toboolean(state, -1) ? SAPP_FLAG_DEFLATE : 0;
+		lua_pop(state, 2);
+		if(entries[n].name == NULL || entries[n].data == NULL) {
+			break;
+		}
+	}
+	unsigned char* dst = NULL;
+	unsigned long dstlen = 0;
+	if(n < count || sapp_write(entries, count, &dst, &dstlen) == 0) {
+		free(entries);
 		lua_pushnil(state);
 		return 1;
 	}
+	free(entries);
+	void* ptr = lua_newuserdata(state, sizeof(long) + (size_t)dstlen);
+	luaL_getmetatable(state, "_sushi_buffer");
+	lua_setmetatable(state, -2);
+	long size = (long)dstlen;
+	memcpy(ptr, &size, sizeof(long));
+	memcpy(ptr + sizeof(long), dst, dstlen);
+	free(dst);
+	return 1;
+}
+
+int prepare_interpreter(lua_State* state)
+{
+	// parameters
 	long codesize = 0;
-	memcpy(&codesize, codeptr, sizeof(long));
-	codeptr += sizeof(long);
+	const unsigned char* codeptr = lib_util_check_buffer_data(state, 2, &codesize);
 	// create new lua state
-	lua_State* nstate = sushi_create_new_state();
+	lua_State* nstate = create_interpreter_state(state, 3);
 	if(nstate == NULL) {
 		lua_pushnil(state);
 		return 1;
@@ -752,6 +978,9 @@ static const luaL_Reg funcs[] = {
 	{ "get_program_path", get_program_path },
 	{ "get_program_arguments", get_program_arguments },
 	{ "run_garbage_collector", run_garbage_collector },
+	{ "get_memory_statistics", get_memory_statistics },
+	{ "set_memory_limit", set_memory_limit },
+	{ "get_code_cache_statistics", get_code_cache_statistics },
 	{ "create_destructor", create_destructor },
 	{ "unpack_array", unpack_array },
 	{ "get_global", get_global },
@@ -781,7 +1010,11 @@ static const luaL_Reg funcs[] = {
 	{ "execute_program", execute_program },
 	{ "parse_to_function", parse_to_function },
 	{ "serialize_object", serialize_object },
+	{ "serialize_object_to_buffer", serialize_object_to_buffer },
 	{ "unserialize_object", unserialize_object },
+	{ "serialize_object_to_handle", serialize_object_to_handle },
+	{ "unserialize_object_from_handle", unserialize_object_from_handle },
+	{ "create_program_archive", create_program_archive },
 	{ "prepare_interpreter", prepare_interpreter },
 	{ "close_interpreter", close_interpreter },
 	{ NULL, NULL }
@@ -23,10 +23,15 @@
  */
 
 #include <time.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include "zip.h"
 #include "unzip.h"
 #include "lib_zip.h"
+#include "lib_util.h"
+#include "zipmap.h"
+#include "zipbatch.h"
 
 #if defined(SUSHI_SUPPORT_LINUX) || defined(SUSHI_SUPPORT_MACOS)
 # define ZIP_VERSIONMADEBY 0x031e
@@ -117,16 +122,12 @@ int zip_write_to_file(lua_State* state)
 		lua_pushboolean(state, 0);
 		return 1;
 	}
-	void* ptr = luaL_checkudata(state, 3, "_sushi_buffer");
-	if(ptr == NULL) {
-		lua_pushboolean(state, 0);
-		return 1;
-	}
+	long bsz = 0;
+	const unsigned char* ptr = lib_util_check_buffer_data(state, 3, &bsz);
 	long sz = (long)luaL_checknumber(state, 4);
-	if(sz < 0) {
-		memcpy(&sz, ptr, sizeof(long));
+	if(sz < 0 || sz > bsz) {
+		sz = bsz;
 	}
-	ptr += sizeof(long);
 	if(zipWriteInFileInZip(zip, ptr, sz) != ZIP_OK) {
 		lua_pushboolean(state, 0);
 		return 1;
@@ -363,12 +364,200 @@ int zip_read_close(lua_State* state)
 	return zip_read_close_gc(state);
 }
 
+static Zipmap* zip_map_check(lua_State* state, int index)
+{
+	Zipmap** ptr = (Zipmap**)luaL_checkudata(state, index, "_sushi_zipmap");
+	if(ptr == NULL) {
+		return NULL;
+	}
+	return *ptr;
+}
+
+int zip_map_open(lua_State* state)
+{
+	const char* file = luaL_checkstring(state, 2);
+	Zipmap* map = zipmap_open(file);
+	if(map == NULL) {
+		lua_pushnil(state);
+		return 1;
+	}
+	Zipmap** ptr = (Zipmap**)lua_newuserdata(state, sizeof(Zipmap*));
+	*ptr = map;
+	luaL_getmetatable(state, "_sushi_zipmap");
+	lua_setmetatable(state, -2);
+	return 1;
+}
+
+int zip_map_get_entry_count(lua_State* state)
+{
+	Zipmap* map = zip_map_check(state, 2);
+	lua_pushnumber(state, map != NULL ? zipmap_get_entry_count(map) : 0);
+	return 1;
+}
+
+int zip_map_get_entry_info(lua_State* state)
+{
+	Zipmap* map = zip_map_check(state, 2);
+	if(map == NULL) {
+		lua_pushnil(state);
+		return 1;
+	}
+	ZipmapEntry* entry = zipmap_get_entry(map, (long)luaL_checknumber(state, 3));
+	if(entry == NULL) {
+		lua_pushnil(state);
+		return 1;
+	}
+	lua_pushlstring(state, entry->name, entry->namelen);
+	lua_pushnumber(state, (lua_Number)entry->compressedSize);
+	lua_pushnumber(state, (lua_Number)entry->uncompressedSize);
+	lua_pushnumber(state, entry->mode);
+	return 4;
+}
+
+int zip_map_find_entry(lua_State* state)
+{
+	Zipmap* map = zip_map_check(state, 2);
+	size_t len = 0;
+	const char* name = luaL_checklstring(state, 3, &len);
+	lua_pushnumber(state, map != NULL ? zipmap_find(map, name, (long)len) : -1);
+	return 1;
+}
+
+static int zip_map_unpack_entry(lua_State* state, void* archive, long index)
+{
+	Zipmap* map = (Zipmap*)archive;
+	unsigned char* dst = lib_util_push_new_buffer(state, (long)zipmap_get_entry(map, index)->uncompressedSize);
+	return zipmap_extract(map, index, dst);
+}
+
+// Returns STORED entries as a zero-copy view into the mapping and inflates
+// DEFLATED entries straight into a buffer of the recorded size. Both work
+// with every function that only reads buffer contents.
+int zip_map_read_entry(lua_State* state)
+{
+	Zipmap* map = zip_map_check(state, 2);
+	if(map == NULL) {
+		lua_pushnil(state);
+		return 1;
+	}
+	long index = -1;
+	if(lua_type(state, 3) == LUA_TNUMBER) {
+		index = (long)lua_tonumber(state, 3);
+	}
+	else {
+		size_t len = 0;
+		const char* name = luaL_checklstring(state, 3, &len);
+		index = zipmap_find(map, name, (long)len);
+	}
+	ZipmapEntry* entry = zipmap_get_entry(map, index);
+	const unsigned char* data = zipmap_get_entry_data(map, index);
+	if(entry == NULL || data == NULL || entry->uncompressedSize > (uint64_t)LONG_MAX) {
+		lua_pushnil(state);
+		return 1;
+	}
+	const unsigned char* stored = entry->method == ZIPMAP_STORED && entry->compressedSize == entry->uncompressedSize ? data : NULL;
+	lib_util_push_archive_entry(state, zipmap_get_file(map), stored, (long)entry->uncompressedSize, zip_map_unpack_entry, map, index);
+	return 1;
+}
+
+int zip_map_close_gc(lua_State* state)
+{
+	Zipmap** ptr = (Zipmap**)luaL_checkudata(state, 1, "_sushi_zipmap");
+	if(ptr != NULL && *ptr != NULL) {
+		zipmap_close(*ptr);
+		*ptr = NULL;
+	}
+	return 0;
+}
+
+int zip_map_close(lua_State* state)
+{
+	lua_remove(state, 1);
+	return zip_map_close_gc(state);
+}
+
+static int zip_get_batch_entry(lua_State* state, int index, ZipbatchEntry* entry)
+{
+	memset(entry, 0, sizeof(ZipbatchEntry));
+	if(lua_type(state, index) != LUA_TTABLE) {
+		return 0;
+	}
+	lua_getfield(state, index, "name");
+	// Only string values are anchored by the entry table; a number
+	// would be converted to a temporary string popped with the field
+	if(lua_type(state, -1) == LUA_TSTRING) {
+		entry->name = lua_tostring(state, -1);
+	}
+	lua_pop(state, 1);
+	lua_getfield(state, index, "level");
+	entry->level = (int)luaL_optnumber(state, -1, -1);
+	lua_pop(state, 1);
+	lua_getfield(state, index, "mode");
+	entry->mode = (long)luaL_optnumber(state, -1, -1);
+	lua_pop(state, 1);
+	lua_getfield(state, index, "timestamp");
+	entry->timestamp = (long)luaL_optnumber(state, -1, -1);
+	lua_pop(state, 1);
+	lua_getfield(state, index, "path");
+	if(lua_type(state, -1) == LUA_TSTRING) {
+		entry->path = lua_tostring(state, -1);
+	}
+	lua_pop(state, 1);
+	lua_getfield(state, index, "data");
+	if(lua_type(state, -1) == LUA_TUSERDATA) {
+		long size = 0;
+		entry->data = lib_util_test_buffer_data(state, -1, &size);
+		entry->size = (uint64_t)size;
+	}
+	else if(lua_type(state, -1) == LUA_TSTRING) {
+		size_t len = 0;
+		entry->data = (const unsigned char*)lua_tolstring(state, -1, &len);
+		entry->size = (uint64_t)len;
+	}
+	lua_pop(state, 1);
+	if(entry->name == NULL || entry->name[0] == 0) {
+		return 0;
+	}
+	if(entry->path == NULL && entry->data == NULL) {
+		return 0;
+	}
+	return 1;
+}
+
+int zip_write_archive(lua_State* state)
+{
+	const char* file = luaL_checkstring(state, 2);
+	luaL_checktype(state, 3, LUA_TTABLE);
+	int threads = (int)luaL_optnumber(state, 4, 0);
+	long count = (long)lua_objlen(state, 3);
+	ZipbatchEntry* entries = malloc((count > 0 ? count : 1) * sizeof(ZipbatchEntry));
+	if(entries == NULL) {
+		lua_pushboolean(state, 0);
+		return 1;
+	}
+	long n;
+	for(n=0; n<count; n++) {
+		lua_rawgeti(state, 3, n + 1);
+		int ok = zip_get_batch_entry(state, lua_gettop(state), &entries[n]);
+		lua_pop(state, 1);
+		if(ok == 0) {
+			free(entries);
+			lua_pushboolean(state, 0);
+			return 1;
+		}
+	}
+	lua_pushboolean(state, zipbatch_write(file, entries, count, threads));
+	free(entries);
+	return 1;
+}
+
 static const luaL_Reg funcs[] = {
 	{ "write_open", zip_write_open },
 	{ "write_start_file", zip_write_start_file },
 	{ "write_to_file", zip_write_to_file },
 	{ "write_end_file", zip_write_end_file },
 	{ "write_close", zip_write_close },
+	{ "write_archive", zip_write_archive },
 	{ "read_open", zip_read_open },
 	{ "read_first", zip_read_first },
 	{ "read_next", zip_read_next },
@@ -377,6 +566,12 @@ static const luaL_Reg funcs[] = {
 	{ "read_get_file_data", zip_read_get_file_data },
 	{ "read_close_file", zip_read_close_file },
 	{ "read_close", zip_read_close },
+	{ "map_open", zip_map_open },
+	{ "map_get_entry_count", zip_map_get_entry_count },
+	{ "map_get_entry_info", zip_map_get_entry_info },
+	{ "map_find_entry", zip_map_find_entry },
+	{ "map_read_entry", zip_map_read_entry },
+	{ "map_close", zip_map_close },
 	{ NULL, NULL }
 };
 
@@ -394,6 +589,12 @@ void lib_zip_init(lua_State* state)
 	lua_pushcfunction(state, zip_read_close_gc);
 	lua_rawset(state, -3);
 	lua_pop(state, 1);
+	// _sushi_zipmap type
+	luaL_newmetatable(state, "_sushi_zipmap");
+	lua_pushliteral(state, "__gc");
+	lua_pushcfunction(state, zip_map_close_gc);
+	lua_rawset(state, -3);
+	lua_pop(state, 1);
 	// function table
 	luaL_newlib(state, funcs);
 	lua_setglobal(state, "_zip");
@@ -36,6 +36,13 @@
 #include "lua.h"
 #include "lualib.h"
 #include "lauxlib.h"
+#include "zlib.h"
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include <errno.h>
 
 #define MAR_TREF 1
 #define MAR_TVAL 2
@@ -439,6 +446,912 @@ static int mar_decode_table(lua_State *L, const char* buf, size_t len, size_t *i
     return 1;
 }
 
+/*
+ * Format version 2: a two byte header (MAR2_MAGIC, MAR2_VERSION) followed by
+ * one value. Lengths, references and integral numbers are LEB128 varints,
+ * doubles are little-endian, tables are written inline with their array and
+ * hash sizes up front (so decoding can presize them) and every string is
+ * entered into a string table so that repeated keys are written as a short
+ * reference.
+ * Cycle detection uses a C hash keyed by object identity.
+ *
+ * Encoding and decoding can also stream to or from a file descriptor in
+ * MAR2_CHUNK sized pieces, optionally through zlib, so that memory use does
+ * not depend on the size of the object graph (only on its largest string).
+ * On a descriptor the stream is cut into frames, each a four byte little
+ * endian length followed by that many bytes, and ends with an empty frame.
+ * The reader never asks for more than the current frame holds, so it stops
+ * exactly at the end of the object and the next reader of a pipe or socket
+ * sees the bytes that follow.
+ */
+
+#define MAR2_MAGIC   0x8f
+#define MAR2_VERSION 2
+#define MAR2_MAX_DEPTH 1000
+#define MAR2_CHUNK   65536
+
+#define MAR2_NIL     0
+#define MAR2_FALSE   1
+#define MAR2_TRUE    2
+#define MAR2_INT     3
+#define MAR2_DOUBLE  4
+#define MAR2_STR     5
+#define MAR2_STRREF  6
+#define MAR2_TABLE   7
+#define MAR2_REF     8
+#define MAR2_FUNC    9
+#define MAR2_USR     10
+#define MAR2_BUF     11
+
+typedef struct mar2_Map {
+    const void **keys;
+    uint32_t *vals;
+    size_t cap;
+    size_t count;
+} mar2_Map;
+
+typedef struct mar2_Encoder {
+    unsigned char *data;
+    size_t size;
+    size_t head;
+    mar2_Map seen;
+    mar2_Map strings;
+    uint32_t next_ref;
+    uint32_t next_str;
+    int anchor;
+    int anchored;
+    int depth;
+    int fd;
+    int compress;
+    int zinit;
+    z_stream zs;
+    unsigned char *zout;
+    double written;
+} mar2_Encoder;
+
+typedef struct mar2_Decoder {
+    const unsigned char *p;
+    const unsigned char *end;
+    int seen;
+    int strings;
+    int next_ref;
+    int next_str;
+    int depth;
+    int fd;
+    int compress;
+    int zinit;
+    int eof;
+    int last;
+    uint32_t frame;
+    z_stream zs;
+    unsigned char *buf;
+    size_t cap;
+    unsigned char *zin;
+} mar2_Decoder;
+
+static void mar2_map_free(mar2_Map *map)
+{
+    free(map->keys);
+    free(map->vals);
+    map->keys = NULL;
+    map->vals = NULL;
+    map->cap = 0;
+    map->count = 0;
+}
+
+static size_t mar2_hash(const void *key, size_t cap)
+{
+    uint64_t h = (uint64_t)(uintptr_t)key;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (size_t)h & (cap - 1);
+}
+
+static int mar2_map_get(mar2_Map *map, const void *key, uint32_t *val)
+{
+    size_t i;
+    if (map->cap == 0) return 0;
+    for (i = mar2_hash(key, map->cap); map->keys[i] != NULL; i = (i + 1) & (map->cap - 1)) {
+        if (map->keys[i] == key) {
+            *val = map->vals[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void mar2_map_put(lua_State *L, mar2_Map *map, const void *key, uint32_t val)
+{
+    size_t i;
+    if ((map->count + 1) * 2 > map->cap) {
+        mar2_Map nm;
+        nm.cap = map->cap ? map->cap * 2 : 64;
+        nm.count = 0;
+        nm.keys = calloc(nm.cap, sizeof(void*));
+        nm.vals = malloc(nm.cap * sizeof(uint32_t));
+        if (!nm.keys || !nm.vals) {
+            mar2_map_free(&nm);
+            luaL_error(L, "Out of memory!");
+        }
+        for (i = 0; i < map->cap; i++) {
+            if (map->keys[i] != NULL) {
+                size_t j = mar2_hash(map->keys[i], nm.cap);
+                while (nm.keys[j] != NULL) j = (j + 1) & (nm.cap - 1);
+                nm.keys[j] = map->keys[i];
+                nm.vals[j] = map->vals[i];
+                nm.count++;
+            }
+        }
+        mar2_map_free(map);
+        *map = nm;
+    }
+    i = mar2_hash(key, map->cap);
+    while (map->keys[i] != NULL) i = (i + 1) & (map->cap - 1);
+    map->keys[i] = key;
+    map->vals[i] = val;
+    map->count++;
+}
+
+static void mar2_encoder_free(mar2_Encoder *enc)
+{
+    free(enc->data);
+    enc->data = NULL;
+    free(enc->zout);
+    enc->zout = NULL;
+    if (enc->zinit) {
+        deflateEnd(&enc->zs);
+        enc->zinit = 0;
+    }
+    mar2_map_free(&enc->seen);
+    mar2_map_free(&enc->strings);
+}
+
+static int mar2_encoder_gc(lua_State *L)
+{
+    mar2_encoder_free((mar2_Encoder*)lua_touserdata(L, 1));
+    return 0;
+}
+
+static void mar2_write_all(lua_State *L, mar2_Encoder *enc, const unsigned char *data, size_t len)
+{
+    while (len > 0) {
+        int n = (int)write(enc->fd, data, len > MAR2_CHUNK ? MAR2_CHUNK : len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) luaL_error(L, "write failed");
+        data += n;
+        len -= n;
+        enc->written += n;
+    }
+}
+
+/* writes len bytes as frames; a zero len writes the terminating frame */
+static void mar2_write_fd(lua_State *L, mar2_Encoder *enc, const unsigned char *data, size_t len)
+{
+    do {
+        size_t part = len > MAR2_CHUNK ? MAR2_CHUNK : len;
+        unsigned char frame[4];
+        frame[0] = (unsigned char)part;
+        frame[1] = (unsigned char)(part >> 8);
+        frame[2] = (unsigned char)(part >> 16);
+        frame[3] = (unsigned char)(part >> 24);
+        mar2_write_all(L, enc, frame, 4);
+        mar2_write_all(L, enc, data, part);
+        data += part;
+        len -= part;
+    } while (len > 0);
+}
+
+static void mar2_sink(lua_State *L, mar2_Encoder *enc, const unsigned char *data, size_t len, int finish)
+{
+    if (!enc->compress) {
+        if (len > 0) mar2_write_fd(L, enc, data, len);
+        return;
+    }
+    do {
+        size_t part = len > MAR2_CHUNK ? MAR2_CHUNK : len;
+        enc->zs.next_in = (Bytef*)data;
+        enc->zs.avail_in = (uInt)part;
+        data += part;
+        len -= part;
+        do {
+            enc->zs.next_out = enc->zout;
+            enc->zs.avail_out = MAR2_CHUNK;
+            if (deflate(&enc->zs, finish && len == 0 ? Z_FINISH : Z_NO_FLUSH) == Z_STREAM_ERROR) {
+                luaL_error(L, "compression failed");
+            }
+            if (enc->zs.avail_out < MAR2_CHUNK) {
+                mar2_write_fd(L, enc, enc->zout, MAR2_CHUNK - enc->zs.avail_out);
+            }
+        } while (enc->zs.avail_out == 0);
+    } while (len > 0);
+}
+
+static void mar2_flush(lua_State *L, mar2_Encoder *enc)
+{
+    if (enc->head > 0) {
+        mar2_sink(L, enc, enc->data, enc->head, 0);
+        enc->head = 0;
+    }
+}
+
+static void mar2_reserve(lua_State *L, mar2_Encoder *enc, size_t len)
+{
+    if (enc->fd >= 0 && enc->size - enc->head < len) {
+        mar2_flush(L, enc);
+    }
+    if (enc->size - enc->head < len) {
+        size_t new_size = enc->size ? enc->size * 2 : 4096;
+        unsigned char *nd;
+        while (new_size - enc->head < len) new_size *= 2;
+        if (!(nd = realloc(enc->data, new_size))) luaL_error(L, "Out of memory!");
+        enc->data = nd;
+        enc->size = new_size;
+    }
+}
+
+static void mar2_write(lua_State *L, mar2_Encoder *enc, const void *src, size_t len)
+{
+    if (enc->fd >= 0 && len > MAR2_CHUNK / 2) {
+        mar2_flush(L, enc);
+        mar2_sink(L, enc, src, len, 0);
+        return;
+    }
+    mar2_reserve(L, enc, len);
+    memcpy(enc->data + enc->head, src, len);
+    enc->head += len;
+}
+
+static void mar2_write_tag(lua_State *L, mar2_Encoder *enc, int tag)
+{
+    mar2_reserve(L, enc, 1);
+    enc->data[enc->head++] = (unsigned char)tag;
+}
+
+static void mar2_write_varint(lua_State *L, mar2_Encoder *enc, uint64_t v)
+{
+    unsigned char *out;
+    mar2_reserve(L, enc, 10);
+    out = enc->data + enc->head;
+    while (v >= 0x80) {
+        *out++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *out++ = (unsigned char)v;
+    enc->head = out - enc->data;
+}
+
+static void mar2_write_tag_varint(lua_State *L, mar2_Encoder *enc, int tag, uint64_t v)
+{
+    mar2_write_tag(L, enc, tag);
+    mar2_write_varint(L, enc, v);
+}
+
+static int mar2_dump_writer(lua_State *L, const void *p, size_t sz, void *ud)
+{
+    luaL_addlstring((luaL_Buffer*)ud, (const char*)p, sz);
+    return 0;
+}
+
+static int mar2_is_buffer(lua_State *L, int val)
+{
+    int r = 0;
+    if (lua_getmetatable(L, val)) {
+        luaL_getmetatable(L, "_sushi_buffer");
+        r = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+    }
+    return r;
+}
+
+static void mar2_encode_value(lua_State *L, mar2_Encoder *enc, int val);
+
+/* The seen and string maps are keyed by address, so everything entered into
+ * them is kept alive in the anchor table until encoding is done; otherwise a
+ * temporary (an upvalue table, a __persist result) could be collected and its
+ * address reused by a later object. */
+static void mar2_anchor(lua_State *L, mar2_Encoder *enc, int val)
+{
+    lua_pushvalue(L, val);
+    lua_rawseti(L, enc->anchor, ++enc->anchored);
+}
+
+static void mar2_encode_persist(lua_State *L, mar2_Encoder *enc, int val)
+{
+    mar2_write_tag(L, enc, MAR2_USR);
+    lua_pushvalue(L, val);
+    lua_call(L, 1, 1);
+    if (!lua_isfunction(L, -1)) {
+        luaL_error(L, "__persist must return a function");
+    }
+    mar2_encode_value(L, enc, lua_gettop(L));
+    lua_pop(L, 1);
+}
+
+static int mar2_is_array_key(lua_State *L, int idx, int n)
+{
+    lua_Number k;
+    if (n == 0 || lua_type(L, idx) != LUA_TNUMBER) return 0;
+    k = lua_tonumber(L, idx);
+    return k >= 1 && k <= n && k == (int)k;
+}
+
+static void mar2_encode_table(lua_State *L, mar2_Encoder *enc, int val)
+{
+    int n = (int)lua_objlen(L, val);
+    uint64_t nhash = 0;
+    int i;
+    lua_pushnil(L);
+    while (lua_next(L, val) != 0) {
+        lua_pop(L, 1);
+        if (!mar2_is_array_key(L, -1, n)) nhash++;
+    }
+    mar2_write_tag_varint(L, enc, MAR2_TABLE, (uint64_t)n);
+    mar2_write_varint(L, enc, nhash);
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti(L, val, i);
+        mar2_encode_value(L, enc, lua_gettop(L));
+        lua_pop(L, 1);
+    }
+    lua_pushnil(L);
+    while (lua_next(L, val) != 0) {
+        int top = lua_gettop(L);
+        if (!mar2_is_array_key(L, top - 1, n)) {
+            mar2_encode_value(L, enc, top - 1);
+            mar2_encode_value(L, enc, top);
+        }
+        lua_pop(L, 1);
+    }
+}
+
+static void mar2_encode_value(lua_State *L, mar2_Encoder *enc, int val)
+{
+    int val_type = lua_type(L, val);
+    uint32_t ref;
+    switch (val_type) {
+    case LUA_TNIL:
+    case LUA_TBOOLEAN: {
+        int tag = val_type == LUA_TNIL ? MAR2_NIL : (lua_toboolean(L, val) ? MAR2_TRUE : MAR2_FALSE);
+        mar2_write_tag(L, enc, tag);
+        break;
+    }
+    case LUA_TNUMBER: {
+        lua_Number num_val = lua_tonumber(L, val);
+        if (num_val >= -9007199254740992.0 && num_val <= 9007199254740992.0 && num_val == (lua_Number)(int64_t)num_val
+            && (num_val != 0 || 1 / num_val > 0)) {
+            int64_t iv = (int64_t)num_val;
+            mar2_write_tag_varint(L, enc, MAR2_INT, ((uint64_t)iv << 1) ^ (uint64_t)(iv >> 63));
+        }
+        else {
+            unsigned char out[9];
+            uint64_t bits;
+            double d = num_val;
+            int i;
+            memcpy(&bits, &d, sizeof(bits));
+            out[0] = MAR2_DOUBLE;
+            for (i = 1; i <= 8; i++) {
+                out[i] = (unsigned char)(bits & 0xff);
+                bits >>= 8;
+            }
+            mar2_write(L, enc, out, 9);
+        }
+        break;
+    }
+    case LUA_TSTRING: {
+        size_t l;
+        const char *str_val = lua_tolstring(L, val, &l);
+        if (mar2_map_get(&enc->strings, str_val, &ref)) {
+            mar2_write_tag_varint(L, enc, MAR2_STRREF, ref);
+        }
+        else {
+            mar2_anchor(L, enc, val);
+            mar2_map_put(L, &enc->strings, str_val, enc->next_str++);
+            mar2_write_tag_varint(L, enc, MAR2_STR, l);
+            mar2_write(L, enc, str_val, l);
+        }
+        break;
+    }
+    case LUA_TTABLE:
+    case LUA_TFUNCTION:
+    case LUA_TUSERDATA: {
+        const void *ptr = lua_topointer(L, val);
+        if (mar2_map_get(&enc->seen, ptr, &ref)) {
+            mar2_write_tag_varint(L, enc, MAR2_REF, ref);
+            break;
+        }
+        if (++enc->depth > MAR2_MAX_DEPTH || !lua_checkstack(L, 8)) {
+            luaL_error(L, "object graph nested too deeply");
+        }
+        mar2_anchor(L, enc, val);
+        mar2_map_put(L, &enc->seen, ptr, enc->next_ref++);
+        if (val_type == LUA_TFUNCTION) {
+            lua_Debug ar;
+            luaL_Buffer b;
+            const char *code;
+            size_t l;
+            int i;
+            lua_pushvalue(L, val);
+            lua_getinfo(L, ">nuS", &ar);
+            if (ar.what[0] != 'L') {
+                luaL_error(L, "attempt to persist a C function '%s'", ar.name);
+            }
+            lua_pushvalue(L, val);
+            luaL_buffinit(L, &b);
+            lua_dump(L, mar2_dump_writer, &b);
+            luaL_pushresult(&b);
+            code = lua_tolstring(L, -1, &l);
+            mar2_write_tag_varint(L, enc, MAR2_FUNC, l);
+            mar2_write(L, enc, code, l);
+            lua_pop(L, 2);
+            lua_newtable(L);
+            for (i = 1; i <= ar.nups; i++) {
+                lua_getupvalue(L, val, i);
+                lua_rawseti(L, -2, i);
+            }
+            mar2_encode_value(L, enc, lua_gettop(L));
+            lua_pop(L, 1);
+        }
+        else if (val_type == LUA_TUSERDATA && mar2_is_buffer(L, val)) {
+            long size;
+            memcpy(&size, lua_touserdata(L, val), sizeof(long));
+            mar2_write_tag_varint(L, enc, MAR2_BUF, (uint64_t)size);
+            mar2_write(L, enc, (unsigned char*)lua_touserdata(L, val) + sizeof(long), (size_t)size);
+        }
+        else if (luaL_getmetafield(L, val, "__persist")) {
+            mar2_encode_persist(L, enc, val);
+        }
+        else if (val_type == LUA_TTABLE) {
+            mar2_encode_table(L, enc, val);
+        }
+        else {
+            luaL_error(L, "attempt to encode userdata (no __persist hook)");
+        }
+        enc->depth--;
+        break;
+    }
+    default:
+        luaL_error(L, "invalid value type (%s)", lua_typename(L, val_type));
+    }
+}
+
+#define MAR2_TO_STRING 0
+#define MAR2_TO_BUFFER 1
+#define MAR2_TO_HANDLE 2
+
+static int mar2_encode(lua_State *L, int mode, int fd, int compress)
+{
+    const unsigned char header[2] = { MAR2_MAGIC, MAR2_VERSION };
+    size_t idx, len;
+    mar2_Encoder *enc;
+
+    if (lua_isnone(L, 1)) {
+        lua_pushnil(L);
+    }
+    if (lua_isnoneornil(L, 2)) {
+        lua_newtable(L);
+    }
+    else if (!lua_istable(L, 2)) {
+        luaL_error(L, "bad argument #2 to encode (expected table)");
+    }
+    lua_settop(L, 2);
+
+    enc = lua_newuserdata(L, sizeof(mar2_Encoder));
+    memset(enc, 0, sizeof(mar2_Encoder));
+    enc->fd = -1;
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, mar2_encoder_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_newtable(L);
+    enc->anchor = lua_gettop(L);
+
+    if (mode == MAR2_TO_HANDLE) {
+        enc->fd = fd;
+        mar2_reserve(L, enc, MAR2_CHUNK);
+        if (compress) {
+            if (!(enc->zout = malloc(MAR2_CHUNK))) luaL_error(L, "Out of memory!");
+            if (deflateInit(&enc->zs, Z_DEFAULT_COMPRESSION) != Z_OK) luaL_error(L, "compression failed");
+            enc->zinit = 1;
+            enc->compress = 1;
+        }
+    }
+
+    len = lua_objlen(L, 2);
+    for (idx = 1; idx <= len; idx++) {
+        lua_rawgeti(L, 2, idx);
+        if (lua_istable(L, -1) || lua_isfunction(L, -1) || lua_isuserdata(L, -1)) {
+            mar2_map_put(L, &enc->seen, lua_topointer(L, -1), (uint32_t)idx);
+        }
+        lua_pop(L, 1);
+    }
+    enc->next_ref = (uint32_t)len + 1;
+
+    mar2_write(L, enc, header, 2);
+    mar2_encode_value(L, enc, 1);
+
+    if (mode == MAR2_TO_HANDLE) {
+        mar2_flush(L, enc);
+        if (enc->compress) {
+            mar2_sink(L, enc, NULL, 0, 1);
+        }
+        mar2_write_fd(L, enc, NULL, 0);
+        lua_pushnumber(L, enc->written);
+    }
+    else if (mode == MAR2_TO_BUFFER) {
+        long size = (long)enc->head;
+        void *ptr = lua_newuserdata(L, sizeof(long) + enc->head);
+        luaL_getmetatable(L, "_sushi_buffer");
+        lua_setmetatable(L, -2);
+        memcpy(ptr, &size, sizeof(long));
+        memcpy((unsigned char*)ptr + sizeof(long), enc->data, enc->head);
+    }
+    else {
+        lua_pushlstring(L, (const char*)enc->data, enc->head);
+    }
+    mar2_encoder_free(enc);
+    lua_replace(L, 1);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static void mar2_decoder_free(mar2_Decoder *dec)
+{
+    free(dec->buf);
+    dec->buf = NULL;
+    free(dec->zin);
+    dec->zin = NULL;
+    if (dec->zinit) {
+        inflateEnd(&dec->zs);
+        dec->zinit = 0;
+    }
+}
+
+static int mar2_decoder_gc(lua_State *L)
+{
+    mar2_decoder_free((mar2_Decoder*)lua_touserdata(L, 1));
+    return 0;
+}
+
+static size_t mar2_read_fd(lua_State *L, int fd, unsigned char *dst, size_t room)
+{
+    while (1) {
+        int n = (int)read(fd, dst, room > MAR2_CHUNK ? MAR2_CHUNK : room);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) luaL_error(L, "read failed");
+        return (size_t)n;
+    }
+}
+
+/* reads from the current frame only; returns 0 after the terminating frame */
+static size_t mar2_read_frame(lua_State *L, mar2_Decoder *dec, unsigned char *dst, size_t room)
+{
+    size_t n;
+    while (dec->frame == 0) {
+        unsigned char frame[4];
+        size_t have = 0;
+        if (dec->last) return 0;
+        while (have < 4) {
+            n = mar2_read_fd(L, dec->fd, frame + have, 4 - have);
+            if (n == 0) luaL_error(L, "unexpected end of stream");
+            have += n;
+        }
+        dec->frame = (uint32_t)frame[0] | ((uint32_t)frame[1] << 8) | ((uint32_t)frame[2] << 16) | ((uint32_t)frame[3] << 24);
+        if (dec->frame == 0) dec->last = 1;
+    }
+    n = mar2_read_fd(L, dec->fd, dst, room > dec->frame ? dec->frame : room);
+    if (n == 0) luaL_error(L, "unexpected end of stream");
+    dec->frame -= (uint32_t)n;
+    return n;
+}
+
+static size_t mar2_source(lua_State *L, mar2_Decoder *dec, unsigned char *dst, size_t room)
+{
+    if (!dec->compress) {
+        return mar2_read_frame(L, dec, dst, room);
+    }
+    while (!dec->eof) {
+        int r;
+        size_t produced;
+        if (dec->zs.avail_in == 0) {
+            dec->zs.next_in = dec->zin;
+            dec->zs.avail_in = (uInt)mar2_read_frame(L, dec, dec->zin, MAR2_CHUNK);
+            if (dec->zs.avail_in == 0) luaL_error(L, "unexpected end of stream");
+        }
+        dec->zs.next_out = dst;
+        dec->zs.avail_out = (uInt)(room > MAR2_CHUNK ? MAR2_CHUNK : room);
+        produced = dec->zs.avail_out;
+        r = inflate(&dec->zs, Z_NO_FLUSH);
+        if (r == Z_STREAM_END) dec->eof = 1;
+        else if (r != Z_OK && r != Z_BUF_ERROR) luaL_error(L, "bad compressed data");
+        produced -= dec->zs.avail_out;
+        if (produced > 0) return produced;
+    }
+    return 0;
+}
+
+static void mar2_need(lua_State *L, mar2_Decoder *dec, uint64_t n)
+{
+    size_t have;
+    if ((uint64_t)(dec->end - dec->p) >= n) return;
+    if (dec->fd < 0) luaL_error(L, "bad code");
+    have = dec->end - dec->p;
+    if (have > 0 && dec->p != dec->buf) memmove(dec->buf, dec->p, have);
+    if (n > dec->cap) {
+        size_t nc = dec->cap * 2;
+        unsigned char *nb;
+        if (nc < n) nc = (size_t)n;
+        if (!(nb = realloc(dec->buf, nc))) luaL_error(L, "Out of memory!");
+        dec->buf = nb;
+        dec->cap = nc;
+    }
+    dec->p = dec->buf;
+    dec->end = dec->buf + have;
+    while ((uint64_t)(dec->end - dec->p) < n) {
+        size_t got = mar2_source(L, dec, dec->buf + (dec->end - dec->p), dec->cap - (dec->end - dec->p));
+        if (got == 0) luaL_error(L, "unexpected end of stream");
+        dec->end += got;
+    }
+}
+
+static int mar2_size_hint(lua_State *L, mar2_Decoder *dec, uint64_t n)
+{
+    if (dec->fd >= 0) return n < MAR2_CHUNK ? (int)n : MAR2_CHUNK;
+    if (n > (uint64_t)(dec->end - dec->p)) luaL_error(L, "bad code");
+    return (int)n;
+}
+
+static uint64_t mar2_read_varint(lua_State *L, mar2_Decoder *dec)
+{
+    uint64_t v = 0;
+    int shift = 0;
+    while (1) {
+        unsigned char c;
+        if (shift > 63) luaL_error(L, "bad code");
+        mar2_need(L, dec, 1);
+        c = *dec->p++;
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) return v;
+        shift += 7;
+    }
+}
+
+static const unsigned char *mar2_read_bytes(lua_State *L, mar2_Decoder *dec, uint64_t len)
+{
+    const unsigned char *p;
+    mar2_need(L, dec, len);
+    p = dec->p;
+    dec->p += len;
+    return p;
+}
+
+static void mar2_decode_value(lua_State *L, mar2_Decoder *dec)
+{
+    int tag;
+    mar2_need(L, dec, 1);
+    tag = *dec->p++;
+    switch (tag) {
+    case MAR2_NIL:
+        lua_pushnil(L);
+        break;
+    case MAR2_FALSE:
+    case MAR2_TRUE:
+        lua_pushboolean(L, tag == MAR2_TRUE);
+        break;
+    case MAR2_INT: {
+        uint64_t v = mar2_read_varint(L, dec);
+        lua_pushnumber(L, (lua_Number)((int64_t)(v >> 1) ^ -(int64_t)(v & 1)));
+        break;
+    }
+    case MAR2_DOUBLE: {
+        const unsigned char *p = mar2_read_bytes(L, dec, 8);
+        uint64_t bits = 0;
+        double d;
+        int i;
+        for (i = 7; i >= 0; i--) bits = (bits << 8) | p[i];
+        memcpy(&d, &bits, sizeof(d));
+        lua_pushnumber(L, d);
+        break;
+    }
+    case MAR2_STR: {
+        uint64_t l = mar2_read_varint(L, dec);
+        const unsigned char *p = mar2_read_bytes(L, dec, l);
+        lua_pushlstring(L, (const char*)p, (size_t)l);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, dec->strings, dec->next_str++);
+        break;
+    }
+    case MAR2_STRREF: {
+        uint64_t ref = mar2_read_varint(L, dec);
+        if (ref >= (uint64_t)dec->next_str) luaL_error(L, "bad code");
+        lua_rawgeti(L, dec->strings, (int)ref);
+        break;
+    }
+    case MAR2_REF: {
+        uint64_t ref = mar2_read_varint(L, dec);
+        if (ref < 1 || ref >= (uint64_t)dec->next_ref) luaL_error(L, "bad code");
+        lua_rawgeti(L, dec->seen, (int)ref);
+        break;
+    }
+    case MAR2_TABLE:
+    case MAR2_FUNC:
+    case MAR2_USR:
+    case MAR2_BUF: {
+        int ref = dec->next_ref++;
+        if (++dec->depth > MAR2_MAX_DEPTH || !lua_checkstack(L, 8)) {
+            luaL_error(L, "object graph nested too deeply");
+        }
+        if (tag == MAR2_TABLE) {
+            uint64_t n = mar2_read_varint(L, dec);
+            uint64_t nhash = mar2_read_varint(L, dec);
+            uint64_t i;
+            int tbl;
+            lua_createtable(L, mar2_size_hint(L, dec, n), mar2_size_hint(L, dec, nhash));
+            tbl = lua_gettop(L);
+            lua_pushvalue(L, tbl);
+            lua_rawseti(L, dec->seen, ref);
+            for (i = 1; i <= n; i++) {
+                mar2_decode_value(L, dec);
+                lua_rawseti(L, tbl, (int)i);
+            }
+            for (i = 0; i < nhash; i++) {
+                mar2_decode_value(L, dec);
+                if (lua_isnil(L, -1)) luaL_error(L, "bad code");
+                mar2_decode_value(L, dec);
+                lua_rawset(L, tbl);
+            }
+        }
+        else if (tag == MAR2_FUNC) {
+            uint64_t l = mar2_read_varint(L, dec);
+            const unsigned char *p = mar2_read_bytes(L, dec, l);
+            int i, nups;
+            if (luaL_loadbuffer(L, (const char*)p, (size_t)l, "=marshal") != 0) {
+                lua_error(L);
+            }
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, dec->seen, ref);
+            mar2_decode_value(L, dec);
+            if (!lua_istable(L, -1)) luaL_error(L, "bad code");
+            nups = (int)lua_objlen(L, -1);
+            for (i = 1; i <= nups; i++) {
+                lua_rawgeti(L, -1, i);
+                lua_setupvalue(L, -3, i);
+            }
+            lua_pop(L, 1);
+        }
+        else if (tag == MAR2_USR) {
+            mar2_decode_value(L, dec);
+            if (!lua_isfunction(L, -1)) luaL_error(L, "bad code");
+            lua_call(L, 0, 1);
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, dec->seen, ref);
+        }
+        else {
+            uint64_t l = mar2_read_varint(L, dec);
+            const unsigned char *p = mar2_read_bytes(L, dec, l);
+            long size = (long)l;
+            void *ptr = lua_newuserdata(L, sizeof(long) + (size_t)l);
+            luaL_getmetatable(L, "_sushi_buffer");
+            lua_setmetatable(L, -2);
+            memcpy(ptr, &size, sizeof(long));
+            memcpy((unsigned char*)ptr + sizeof(long), p, (size_t)l);
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, dec->seen, ref);
+        }
+        dec->depth--;
+        break;
+    }
+    default:
+        luaL_error(L, "bad code");
+    }
+}
+
+static void mar2_decode_init(lua_State *L, mar2_Decoder *dec)
+{
+    size_t idx, len;
+
+    if (lua_isnoneornil(L, 2)) {
+        lua_newtable(L);
+    }
+    else if (!lua_istable(L, 2)) {
+        luaL_error(L, "bad argument #2 to decode (expected table)");
+    }
+    lua_settop(L, 2);
+
+    len = lua_objlen(L, 2);
+    lua_newtable(L);
+    for (idx = 1; idx <= len; idx++) {
+        lua_rawgeti(L, 2, idx);
+        lua_rawseti(L, SEEN_IDX, idx);
+    }
+    lua_newtable(L);
+
+    dec->seen = SEEN_IDX;
+    dec->strings = SEEN_IDX + 1;
+    dec->next_ref = (int)len + 1;
+    dec->next_str = 0;
+    dec->depth = 0;
+}
+
+static int mar2_decode_finish(lua_State *L)
+{
+    lua_replace(L, 2);
+    lua_settop(L, 2);
+    lua_remove(L, 1);
+    return 1;
+}
+
+static int mar2_decode(lua_State *L, const char *s, unsigned long l)
+{
+    mar2_Decoder dec;
+
+    if (l < 2 || (unsigned char)s[1] != MAR2_VERSION) luaL_error(L, "bad header");
+    memset(&dec, 0, sizeof(dec));
+    mar2_decode_init(L, &dec);
+    dec.fd = -1;
+    dec.p = (const unsigned char*)s + 2;
+    dec.end = (const unsigned char*)s + l;
+    mar2_decode_value(L, &dec);
+    return mar2_decode_finish(L);
+}
+
+int mar_encode_v2(lua_State* L)
+{
+    return mar2_encode(L, MAR2_TO_STRING, -1, 0);
+}
+
+int mar_encode_v2_to_buffer(lua_State* L)
+{
+    return mar2_encode(L, MAR2_TO_BUFFER, -1, 0);
+}
+
+int mar_encode_v2_to_handle(lua_State* L, int fd, int compress)
+{
+    return mar2_encode(L, MAR2_TO_HANDLE, fd, compress);
+}
+
+int mar_decode_v2_from_handle(lua_State* L, int fd)
+{
+    mar2_Decoder *dec;
+    unsigned char first;
+
+    dec = lua_newuserdata(L, sizeof(mar2_Decoder));
+    memset(dec, 0, sizeof(mar2_Decoder));
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, mar2_decoder_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_insert(L, 1);
+    lua_remove(L, 2);
+    /* stack is now: decoder, constants; the decoder keeps slot 1 */
+    mar2_decode_init(L, dec);
+    dec->fd = fd;
+    dec->cap = MAR2_CHUNK;
+    if (!(dec->buf = malloc(dec->cap))) luaL_error(L, "Out of memory!");
+    dec->p = dec->end = dec->buf;
+
+    /* a zlib stream starts with 0x78, a raw stream with the magic byte */
+    if (mar2_read_frame(L, dec, &first, 1) != 1) luaL_error(L, "unexpected end of stream");
+    if (first == 0x78) {
+        if (!(dec->zin = malloc(MAR2_CHUNK))) luaL_error(L, "Out of memory!");
+        if (inflateInit(&dec->zs) != Z_OK) luaL_error(L, "bad compressed data");
+        dec->zinit = 1;
+        dec->compress = 1;
+        dec->zin[0] = first;
+        dec->zs.next_in = dec->zin;
+        dec->zs.avail_in = 1;
+        mar2_need(L, dec, 1);
+        first = *dec->p++;
+    }
+    if (first != MAR2_MAGIC) luaL_error(L, "bad header");
+    mar2_need(L, dec, 1);
+    if (*dec->p++ != MAR2_VERSION) luaL_error(L, "bad header");
+    mar2_decode_value(L, dec);
+    /* consume the rest of the message up to its terminating frame */
+    while (mar2_read_frame(L, dec, dec->buf, dec->cap) > 0);
+    mar2_decoder_free(dec);
+    return mar2_decode_finish(L);
+}
+
 int mar_encode(lua_State* L, unsigned char** rbuf, unsigned long* rlen)
 {
     const unsigned char m = MAR_MAGIC;
@@ -490,6 +1403,7 @@ int mar_decode(lua_State* L, const char* s, unsigned long l)
     const char *p;
 
     if (l < 1) luaL_error(L, "bad header");
+    if (*(unsigned char *)s == MAR2_MAGIC) return mar2_decode(L, s, l);
     if (*(unsigned char *)s++ != MAR_MAGIC) luaL_error(L, "bad magic");
     l -= 1;
 
@@ -3,5 +3,9 @@
 
 int mar_encode(lua_State* L, char** rbuf, unsigned long* rlen);
 int mar_decode(lua_State* L, const char* buf, unsigned long len);
+int mar_encode_v2(lua_State* L);
+int mar_encode_v2_to_buffer(lua_State* L);
+int mar_encode_v2_to_handle(lua_State* L, int fd, int compress);
+int mar_decode_v2_from_handle(lua_State* L, int fd);
 
 #endif
@@ -0,0 +1,447 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "lz4.h"
+
+#define LZ4_MINMATCH 4
+#define LZ4_MFLIMIT 12
+#define LZ4_LASTLITERALS 5
+#define LZ4_MAX_DISTANCE 65535
+#define LZ4_HASH_LOG 12
+#define LZ4_SKIP_TRIGGER 6
+
+#define LZ4_FRAME_MAGIC 0x184D2204
+#define LZ4_FRAME_HEADER_SIZE 15
+#define LZ4_FRAME_BLOCK_ID 7
+#define LZ4_FRAME_BLOCK_SIZE (4 * 1024 * 1024)
+
+#define XXH_PRIME1 2654435761U
+#define XXH_PRIME2 2246822519U
+#define XXH_PRIME3 3266489917U
+#define XXH_PRIME4 668265263U
+#define XXH_PRIME5 374761393U
+
+static uint32_t lz4_read32(const unsigned char* p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static uint64_t lz4_read64(const unsigned char* p)
+{
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+static uint32_t lz4_read_le32(const unsigned char* p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void lz4_write_le32(unsigned char* p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
+
+static uint32_t lz4_rotl(uint32_t v, int n)
+{
+	return (v << n) | (v >> (32 - n));
+}
+
+static uint32_t lz4_hash(uint32_t sequence)
+{
+	return (sequence * XXH_PRIME1) >> (32 - LZ4_HASH_LOG);
+}
+
+unsigned int lz4_xxh32(const unsigned char* src, long srclen, unsigned int seed)
+{
+	const unsigned char* p = src;
+	const unsigned char* end = src + srclen;
+	uint32_t h;
+	if(srclen >= 16) {
+		uint32_t v1 = seed + XXH_PRIME1 + XXH_PRIME2;
+		uint32_t v2 = seed + XXH_PRIME2;
+		uint32_t v3 = seed;
+		uint32_t v4 = seed - XXH_PRIME1;
+		while(p + 16 <= end) {
+			v1 = lz4_rotl(v1 + lz4_read_le32(p) * XXH_PRIME2, 13) * XXH_PRIME1;
+			v2 = lz4_rotl(v2 + lz4_read_le32(p + 4) * XXH_PRIME2, 13) * XXH_PRIME1;
+			v3 = lz4_rotl(v3 + lz4_read_le32(p + 8) * XXH_PRIME2, 13) * XXH_PRIME1;
+			v4 = lz4_rotl(v4 + lz4_read_le32(p + 12) * XXH_PRIME2, 13) * XXH_PRIME1;
+			p += 16;
+		}
+		h = lz4_rotl(v1, 1) + lz4_rotl(v2, 7) + lz4_rotl(v3, 12) + lz4_rotl(v4, 18);
+	}
+	else {
+		h = seed + XXH_PRIME5;
+	}
+	h += (uint32_t)srclen;
+	while(p + 4 <= end) {
+		h = lz4_rotl(h + lz4_read_le32(p) * XXH_PRIME3, 17) * XXH_PRIME4;
+		p += 4;
+	}
+	while(p < end) {
+		h = lz4_rotl(h + (*p++) * XXH_PRIME5, 11) * XXH_PRIME1;
+	}
+	h ^= h >> 15;
+	h *= XXH_PRIME2;
+	h ^= h >> 13;
+	h *= XXH_PRIME3;
+	h ^= h >> 16;
+	return h;
+}
+
+long lz4_compress_bound(long srclen)
+{
+	if(srclen < 0) {
+		return 0;
+	}
+	return srclen + srclen / 255 + 16;
+}
+
+static unsigned char* lz4_write_length(unsigned char* op, long len)
+{
+	while(len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (unsigned char)len;
+	return op;
+}
+
+static unsigned char* lz4_write_sequence(unsigned char* op, const unsigned char* literals, long litlen, long offset, long matchlen)
+{
+	unsigned char* token = op++;
+	unsigned char t;
+	if(litlen >= 15) {
+		t = 15 << 4;
+		op = lz4_write_length(op, litlen - 15);
+	}
+	else {
+		t = (unsigned char)(litlen << 4);
+	}
+	memcpy(op, literals, litlen);
+	op += litlen;
+	if(matchlen > 0) {
+		*op++ = offset & 0xff;
+		*op++ = (offset >> 8) & 0xff;
+		matchlen -= LZ4_MINMATCH;
+		if(matchlen >= 15) {
+			t |= 15;
+			op = lz4_write_length(op, matchlen - 15);
+		}
+		else {
+			t |= (unsigned char)matchlen;
+		}
+	}
+	*token = t;
+	return op;
+}
+
+long lz4_compress_block(const unsigned char* src, long srclen, unsigned char* dst, long dstcap)
+{
+	if(src == NULL || dst == NULL || srclen < 0 || dstcap < lz4_compress_bound(srclen)) {
+		return -1;
+	}
+	const unsigned char* anchor = src;
+	const unsigned char* iend = src + srclen;
+	unsigned char* op = dst;
+	if(srclen > LZ4_MFLIMIT) {
+		uint32_t table[1 << LZ4_HASH_LOG];
+		const unsigned char* ip = src + 1;
+		const unsigned char* mflimit = iend - LZ4_MFLIMIT;
+		const unsigned char* matchlimit = iend - LZ4_LASTLITERALS;
+		memset(table, 0, sizeof(table));
+		while(ip < mflimit) {
+			uint32_t sequence = lz4_read32(ip);
+			uint32_t h = lz4_hash(sequence);
+			const unsigned char* ref = src + table[h];
+			table[h] = (uint32_t)(ip - src);
+			if(ip - ref > LZ4_MAX_DISTANCE || lz4_read32(ref) != sequence) {
+				// step faster through data that does not compress
+				ip += 1 + ((ip - anchor) >> LZ4_SKIP_TRIGGER);
+				continue;
+			}
+			while(ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+			const unsigned char* mp = ip + LZ4_MINMATCH;
+			const unsigned char* rp = ref + LZ4_MINMATCH;
+			while(mp + 8 <= matchlimit && lz4_read64(mp) == lz4_read64(rp)) {
+				mp += 8;
+				rp += 8;
+			}
+			while(mp < matchlimit && *mp == *rp) {
+				mp++;
+				rp++;
+			}
+			op = lz4_write_sequence(op, anchor, ip - anchor, ip - ref, mp - ip);
+			table[lz4_hash(lz4_read32(mp - 2))] = (uint32_t)(mp - 2 - src);
+			ip = anchor = mp;
+		}
+	}
+	op = lz4_write_sequence(op, anchor, iend - anchor, 0, 0);
+	return op - dst;
+}
+
+// Decodes one block into dst. Matches may reach back to base, which lets
+// linked frame blocks refer to the output of the blocks before them.
+static long lz4_decode(const unsigned char* src, long srclen, unsigned char* base, unsigned char* dst, long dstcap)
+{
+	const unsigned char* ip = src;
+	const unsigned char* iend = src + srclen;
+	unsigned char* op = dst;
+	unsigned char* oend = dst + dstcap;
+	if(srclen < 1) {
+		return -1;
+	}
+	while(1) {
+		unsigned int token = *ip++;
+		size_t litlen = token >> 4;
+		if(litlen == 15) {
+			unsigned int b;
+			do {
+				if(ip >= iend) {
+					return -1;
+				}
+				b = *ip++;
+				litlen += b;
+			}
+			while(b == 255);
+		}
+		if(litlen > (size_t)(iend - ip) || litlen > (size_t)(oend - op)) {
+			return -1;
+		}
+		memcpy(op, ip, litlen);
+		op += litlen;
+		ip += litlen;
+		if(ip == iend) {
+			break;
+		}
+		if(iend - ip < 2) {
+			return -1;
+		}
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if(offset == 0 || offset > (size_t)(op - base)) {
+			return -1;
+		}
+		size_t matchlen = token & 15;
+		if(matchlen == 15) {
+			unsigned int b;
+			do {
+				if(ip >= iend) {
+					return -1;
+				}
+				b = *ip++;
+				matchlen += b;
+			}
+			while(b == 255);
+		}
+		matchlen += LZ4_MINMATCH;
+		if(matchlen > (size_t)(oend - op)) {
+			return -1;
+		}
+		// copy in doubling, non-overlapping spans; each span is a whole
+		// number of periods so overlapping matches repeat correctly
+		const unsigned char* mp = op - offset;
+		while(matchlen > 0) {
+			size_t n = (size_t)(op - mp);
+			if(n > matchlen) {
+				n = matchlen;
+			}
+			memcpy(op, mp, n);
+			op += n;
+			matchlen -= n;
+		}
+		if(ip >= iend) {
+			return -1;
+		}
+	}
+	return op - dst;
+}
+
+long lz4_decompress_block(const unsigned char* src, long srclen, unsigned char* dst, long dstcap)
+{
+	if(src == NULL || dst == NULL || srclen < 1 || dstcap < 0) {
+		return -1;
+	}
+	return lz4_decode(src, srclen, dst, dst, dstcap);
+}
+
+long lz4_frame_bound(long srclen)
+{
+	long nblocks = srclen / LZ4_FRAME_BLOCK_SIZE + 1;
+	return LZ4_FRAME_HEADER_SIZE + nblocks * 4 + lz4_compress_bound(LZ4_FRAME_BLOCK_SIZE) * (srclen / LZ4_FRAME_BLOCK_SIZE) + lz4_compress_bound(srclen % LZ4_FRAME_BLOCK_SIZE) + 8;
+}
+
+long lz4_frame_compress(const unsigned char* src, long srclen, unsigned char* dst, long dstcap)
+{
+	if(src == NULL || dst == NULL || srclen < 0 || dstcap < lz4_frame_bound(srclen)) {
+		return -1;
+	}
+	unsigned char* op = dst;
+	uint64_t contentsize = (uint64_t)srclen;
+	int i;
+	lz4_write_le32(op, LZ4_FRAME_MAGIC);
+	// version 01, independent blocks, content size and content checksum
+	op[4] = 0x40 | 0x20 | 0x08 | 0x04;
+	op[5] = LZ4_FRAME_BLOCK_ID << 4;
+	for(i=0; i<8; i++) {
+		op[6 + i] = (contentsize >> (i * 8)) & 0xff;
+	}
+	op[14] = (lz4_xxh32(op + 4, 10, 0) >> 8) & 0xff;
+	op += LZ4_FRAME_HEADER_SIZE;
+	long offset = 0;
+	while(offset < srclen) {
+		long len = srclen - offset;
+		if(len > LZ4_FRAME_BLOCK_SIZE) {
+			len = LZ4_FRAME_BLOCK_SIZE;
+		}
+		long clen = lz4_compress_block(src + offset, len, op + 4, lz4_compress_bound(len));
+		if(clen < 0 || clen >= len) {
+			memcpy(op + 4, src + offset, len);
+			lz4_write_le32(op, (uint32_t)len | 0x80000000U);
+			clen = len;
+		}
+		else {
+			lz4_write_le32(op, (uint32_t)clen);
+		}
+		op += 4 + clen;
+		offset += len;
+	}
+	lz4_write_le32(op, 0);
+	lz4_write_le32(op + 4, lz4_xxh32(src, srclen, 0));
+	op += 8;
+	return op - dst;
+}
+
+int lz4_frame_decompress(const unsigned char* src, long srclen, unsigned char** dstbuf, long* dstlen)
+{
+	if(src == NULL || dstbuf == NULL || dstlen == NULL || srclen < 7 || lz4_read_le32(src) != LZ4_FRAME_MAGIC) {
+		return 0;
+	}
+	*dstbuf = NULL;
+	*dstlen = 0;
+	int flg = src[4];
+	int bd = src[5];
+	if((flg >> 6) != 1 || (flg & 0x02) != 0 || (bd & 0x8f) != 0 || ((bd >> 4) & 7) < 4) {
+		return 0;
+	}
+	long hdrlen = 6 + ((flg & 0x08) ? 8 : 0) + ((flg & 0x01) ? 4 : 0);
+	if(srclen < hdrlen + 1 || src[hdrlen] != ((lz4_xxh32(src + 4, hdrlen - 4, 0) >> 8) & 0xff)) {
+		return 0;
+	}
+	long blockmax = 1L << (8 + 2 * ((bd >> 4) & 7));
+	long hascsize = (flg & 0x08) != 0;
+	uint64_t csize = 0;
+	if(hascsize) {
+		int i;
+		for(i=0; i<8; i++) {
+			csize |= (uint64_t)src[6 + i] << (i * 8);
+		}
+		// lz4 cannot expand data by more than 255 times
+		if(csize > (uint64_t)srclen * 255) {
+			return 0;
+		}
+	}
+	const unsigned char* ip = src + hdrlen + 1;
+	const unsigned char* iend = src + srclen;
+	long cap = hascsize ? (long)csize : srclen * 4;
+	long len = 0;
+	unsigned char* out = malloc(cap > 0 ? cap : 1);
+	if(out == NULL) {
+		return 0;
+	}
+	while(1) {
+		if(iend - ip < 4) {
+			break;
+		}
+		uint32_t bsize = lz4_read_le32(ip);
+		ip += 4;
+		if(bsize == 0) {
+			if((flg & 0x04) != 0) {
+				if(iend - ip < 4 || lz4_read_le32(ip) != lz4_xxh32(out, len, 0)) {
+					break;
+				}
+			}
+			if(hascsize && (uint64_t)len != csize) {
+				break;
+			}
+			*dstbuf = out;
+			*dstlen = len;
+			return 1;
+		}
+		int raw = (bsize & 0x80000000U) != 0;
+		bsize &= 0x7fffffffU;
+		if((long)bsize > blockmax || (long)bsize > iend - ip) {
+			break;
+		}
+		if(hascsize == 0 && cap - len < blockmax) {
+			long ncap = cap * 2;
+			while(ncap - len < blockmax) {
+				ncap *= 2;
+			}
+			unsigned char* nout = realloc(out, ncap);
+			if(nout == NULL) {
+				break;
+			}
+			out = nout;
+			cap = ncap;
+		}
+		long room = cap - len < blockmax ? cap - len : blockmax;
+		if(raw) {
+			if((long)bsize > room) {
+				break;
+			}
+			memcpy(out + len, ip, bsize);
+			len += bsize;
+		}
+		else {
+			long n = lz4_decode(ip, bsize, out, out + len, room);
+			if(n < 0) {
+				break;
+			}
+			len += n;
+		}
+		ip += bsize;
+		if((flg & 0x10) != 0) {
+			if(iend - ip < 4 || lz4_read_le32(ip) != lz4_xxh32(ip - bsize, bsize, 0)) {
+				break;
+			}
+			ip += 4;
+		}
+	}
+	free(out);
+	return 0;
+}
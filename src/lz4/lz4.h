@@ -0,0 +1,45 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LZ4_H
+#define LZ4_H
+
+/*
+ * LZ4 block and frame format codec. The block format is the raw LZ4
+ * sequence stream; the frame format adds the standard 0x184D2204 header,
+ * block framing and xxHash32 content checksum, and is interoperable with
+ * the reference lz4 tools.
+ */
+
+long lz4_compress_bound(long srclen);
+long lz4_compress_block(const unsigned char* src, long srclen, unsigned char* dst, long dstcap);
+long lz4_decompress_block(const unsigned char* src, long srclen, unsigned char* dst, long dstcap);
+
+long lz4_frame_bound(long srclen);
+long lz4_frame_compress(const unsigned char* src, long srclen, unsigned char* dst, long dstcap);
+int lz4_frame_decompress(const unsigned char* src, long srclen, unsigned char** dstbuf, long* dstlen);
+
+unsigned int lz4_xxh32(const unsigned char* src, long srclen, unsigned int seed);
+
+#endif
@@ -38,6 +38,8 @@
 #include <limits.h>
 #include "argutil.h"
 #include "apps.h"
+#include "zygote.h"
+#include "timing.h"
 
 static int is_offline = 0;
 static int is_cloud = 0;
@@ -232,7 +234,9 @@ static int sushi_main_file(const char* fileName, int processArgc, const char** p
 	}
 	else {
 		if(!strcmp(fileName, "-")) {
+			double t0 = timing_now();
 			code = sushi_code_read_from_stdin();
+			timing_add("code_read", t0);
 			if(code == NULL) {
 				sushi_error("Failed while reading code from standard input.");
 				return -1;
@@ -246,7 +250,9 @@ static int sushi_main_file(const char* fileName, int processArgc, const char** p
 				argutil_argv_free(nv);
 				return v;
 			}
+			double t0 = timing_now();
 			code = sushi_code_read_from_file(fileName);
+			timing_add("code_read", t0);
 			if(code == NULL) {
 				sushi_error("Failed to read code file: `%s'", fileName);
 				return -1;
@@ -270,6 +276,25 @@ static int sushi_main_install(const char* appname)
 	return 0;
 }
 
+static int sushi_main_zygote(const char* socketPath, const char* target)
+{
+	char buffer[PATH_MAX+1];
+	const char* fileName = target;
+	if(is_app_name(target)) {
+		fileName = apps_get_executable_file(target, buffer, PATH_MAX, is_offline == 1 ? 0 : 1);
+		if(fileName == NULL) {
+			sushi_error("Application not found: `%s'", target);
+			return -1;
+		}
+	}
+	SushiCode* code = sushi_code_read_from_file(fileName);
+	if(code == NULL) {
+		sushi_error("Failed to read code file: `%s'", fileName);
+		return -1;
+	}
+	return zygote_serve(socketPath, code);
+}
+
 static const char* _get_environment_variable(const char* name)
 {
 #ifdef SUSHI_SUPPORT_WIN32
@@ -325,6 +350,25 @@ static void initialize_configuration()
 	if(offline && !strcasecmp(offline, "1")) {
 		is_offline = 1;
 	}
+	const char* nobccache = _get_environment_variable("SUSHI_NO_BYTECODE_CACHE");
+	if(nobccache && !strcasecmp(nobccache, "1")) {
+		sushi_set_bytecode_cache_enabled(0);
+	}
+	const char* memoryLimit = _get_environment_variable("SUSHI_MEMORY_LIMIT");
+	if(memoryLimit && *memoryLimit) {
+		char* end = NULL;
+		unsigned long limit = strtoul(memoryLimit, &end, 10);
+		if(end != NULL && (*end == 'k' || *end == 'K')) {
+			limit *= 1024;
+		}
+		else if(end != NULL && (*end == 'm' || *end == 'M')) {
+			limit *= 1024 * 1024;
+		}
+		else if(end != NULL && (*end == 'g' || *end == 'G')) {
+			limit *= 1024UL * 1024 * 1024;
+		}
+		sushi_set_default_memory_limit(limit);
+	}
 	const char* cloud = _get_environment_variable("SUSHI_CLOUD");
 	if(cloud && !strcasecmp(cloud, "1")) {
 		is_cloud = 1;
@@ -343,24 +387,42 @@ static void show_usage(const char* v0)
 	// printf("  -cloud, --cloud                              Compile scripts in the cloud\n");
 	printf("  -p, -profile, --profile <dir>                Specify path to profile directory\n");
 	printf("  -profiler-output, --profiler-output          Specify an output file for profiling output\n");
+	printf("  -timing-output, --timing-output <file|->     Write a startup phase timing report (JSON) to a file or stderr\n");
 	printf("  -apps, --apps <dir>                          Specify the directory where applications are saved\n");
 	printf("  -stdin                                       Read program to execute from stdin\n");
 	printf("  -f, -file, --file <file> <args>              Specify the filename of a program to execute\n");
 	printf("  -a, -app, --app <name-version> <args>        Specify the name and version of application to execute\n");
+	printf("  -zygote, --zygote <socket> <file|name-version>  Keep a loaded program ready to serve -connect requests\n");
+	printf("  -connect, --connect <socket> <args>          Execute the program of a zygote with the given arguments\n");
 	printf("  <file|name-version> <args>                   Execute a file or application\n");
 	printf("\n");
 }
 
 int main(int c, const char** v)
 {
+	// The origin of the total in the timing report. Phases are only
+	// recorded once there is an output, so that is set up first.
+	timing_start();
+	timing_set_output(_get_environment_variable("SUSHI_TIMING_OUTPUT"));
+	// A zygote client only relays its request, so skip all initialization
+	if(c > 1 && (!strcasecmp(v[1], "-connect") || !strcasecmp(v[1], "--connect")) && !strcasecmp(get_app_name(v[0]), "sushi")) {
+		if(c < 3) {
+			sushi_error("Missing parameter for `%s'", v[1]);
+			return -1;
+		}
+		return zygote_connect(v[2], c, v, 3);
+	}
 	sushi_init_libraries();
+	double t0 = timing_now();
 	initialize_configuration();
+	timing_add("configuration", t0);
 #if defined(SUSHI_SUPPORT_LINUX) || defined(SUSHI_SUPPORT_MACOS)
 	signal(SIGPIPE, SIG_IGN);
 	// FIXME: Handle SIGINT, SIGTERM
 #endif
 	// Special scenario 1: If the app code is embedded in the executable
 	{
+		t0 = timing_now();
 		const char* ep = sushi_get_executable_path();
 		if(ep == NULL) {
 			char* rp = sushi_get_real_path(v[0]);
@@ -370,6 +432,7 @@ int main(int c, const char** v)
 			}
 		}
 		SushiCode* code = sushi_code_read_from_executable(ep);
+		timing_add("executable_lookup", t0);
 		if(sushi_has_errors()) {
 			return -1;
 		}
@@ -386,7 +449,9 @@ int main(int c, const char** v)
 				sushi_error("Failed to find code file for app: `%s'", appname);
 				return -1;
 			}
+			t0 = timing_now();
 			SushiCode* code = sushi_code_read_from_file(filename);
+			timing_add("code_read", t0);
 			if(code == NULL) {
 				sushi_error("Failed to read code file: `%s'", filename);
 				return -1;
@@ -460,6 +525,19 @@ int main(int c, const char** v)
 				profiler_output = file;
 				continue;
 			}
+			if(!strcasecmp(v[n], "-timing-output") || !strcasecmp(v[n], "--timing-output")) {
+				const char* file = NULL;
+				n++;
+				if(n < c) {
+					file = v[n];
+				}
+				if(file == NULL) {
+					sushi_error("Missing parameter for `%s'", v[n-1]);
+					return -1;
+				}
+				timing_set_output(file);
+				continue;
+			}
 			if(!strcasecmp(v[n], "-apps") || !strcasecmp(v[n], "--apps")) {
 				const char* dir = NULL;
 				n++;
@@ -503,6 +581,13 @@ int main(int c, const char** v)
 				n++;
 				return sushi_main_app(appName, c, v, n);
 			}
+			if(!strcasecmp(v[n], "-zygote") || !strcasecmp(v[n], "--zygote")) {
+				if(n + 2 >= c) {
+					sushi_error("Missing parameter for `%s'", v[n]);
+					return -1;
+				}
+				return sushi_main_zygote(v[n+1], v[n+2]);
+			}
 			if(!strcasecmp(v[n], "--")) {
 				acceptOptions = 0;
 				continue;
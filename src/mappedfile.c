@@ -0,0 +1,176 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "mappedfile.h"
+#ifdef SUSHI_SUPPORT_WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+MappedFile* mappedfile_open(const char* path, uint64_t minimumSize)
+{
+	if(path == NULL) {
+		return NULL;
+	}
+	MappedFile* mf = (MappedFile*)calloc(1, sizeof(MappedFile));
+	if(mf == NULL) {
+		return NULL;
+	}
+	mf->refs = 1;
+#ifdef SUSHI_SUPPORT_WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE) {
+		free(mf);
+		return NULL;
+	}
+	LARGE_INTEGER size;
+	if(GetFileSizeEx(file, &size) == 0 || (uint64_t)size.QuadPart < minimumSize || size.QuadPart == 0) {
+		CloseHandle(file);
+		free(mf);
+		return NULL;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if(mapping == NULL) {
+		CloseHandle(file);
+		free(mf);
+		return NULL;
+	}
+	mf->data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if(mf->data == NULL) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		free(mf);
+		return NULL;
+	}
+	mf->file = file;
+	mf->mapping = mapping;
+	mf->size = (uint64_t)size.QuadPart;
+#else
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		free(mf);
+		return NULL;
+	}
+	struct stat st;
+	if(fstat(fd, &st) != 0 || S_ISREG(st.st_mode) == 0 || (uint64_t)st.st_size < minimumSize || st.st_size == 0) {
+		close(fd);
+		free(mf);
+		return NULL;
+	}
+	void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED) {
+		free(mf);
+		return NULL;
+	}
+	mf->data = (const unsigned char*)data;
+	mf->size = (uint64_t)st.st_size;
+#endif
+	return mf;
+}
+
+void mappedfile_retain(MappedFile* file)
+{
+	file->refs++;
+}
+
+void mappedfile_release(MappedFile* file)
+{
+	if(file == NULL || --file->refs > 0) {
+		return;
+	}
+#ifdef SUSHI_SUPPORT_WIN32
+	UnmapViewOfFile(file->data);
+	CloseHandle((HANDLE)file->mapping);
+	CloseHandle((HANDLE)file->file);
+#else
+	munmap((void*)file->data, (size_t)file->size);
+#endif
+	free(file);
+}
+
+static uint32_t mappedfile_hash(const char* name, long namelen)
+{
+	uint32_t h = 2166136261U;
+	long n;
+	for(n=0; n<namelen; n++) {
+		h = (h ^ (unsigned char)name[n]) * 16777619U;
+	}
+	return h;
+}
+
+int mappedfile_index_init(MappedFileIndex* index, long count)
+{
+	long slots = 16;
+	while(slots < count * 2) {
+		slots *= 2;
+	}
+	index->slots = (MappedFileName*)malloc(slots * sizeof(MappedFileName));
+	if(index->slots == NULL) {
+		return 0;
+	}
+	index->mask = slots - 1;
+	long n;
+	for(n=0; n<slots; n++) {
+		index->slots[n].value = -1;
+	}
+	return 1;
+}
+
+void mappedfile_index_add(MappedFileIndex* index, const char* name, long namelen, long value)
+{
+	long slot = mappedfile_hash(name, namelen) & index->mask;
+	while(index->slots[slot].value >= 0) {
+		slot = (slot + 1) & index->mask;
+	}
+	index->slots[slot].name = name;
+	index->slots[slot].namelen = namelen;
+	index->slots[slot].value = value;
+}
+
+long mappedfile_index_find(MappedFileIndex* index, const char* name, long namelen)
+{
+	long slot = mappedfile_hash(name, namelen) & index->mask;
+	while(index->slots[slot].value >= 0) {
+		MappedFileName* entry = &index->slots[slot];
+		if(entry->namelen == namelen && memcmp(entry->name, name, namelen) == 0) {
+			return entry->value;
+		}
+		slot = (slot + 1) & index->mask;
+	}
+	return -1;
+}
+
+void mappedfile_index_free(MappedFileIndex* index)
+{
+	free(index->slots);
+	index->slots = NULL;
+}
@@ -0,0 +1,73 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <stdint.h>
+
+/*
+ * A reference counted read-only memory mapping of a whole file, shared by
+ * the readers of archives that hand out views of their content, and a hash
+ * index for looking up the entries of such an archive by name.
+ */
+
+typedef struct MappedFile
+{
+	const unsigned char* data;
+	uint64_t size;
+	int refs;
+#ifdef SUSHI_SUPPORT_WIN32
+	void* file;
+	void* mapping;
+#endif
+} MappedFile;
+
+typedef struct MappedFileName
+{
+	const char* name;
+	long namelen;
+	long value;
+} MappedFileName;
+
+typedef struct MappedFileIndex
+{
+	MappedFileName* slots;
+	long mask;
+} MappedFileIndex;
+
+// Maps the regular file at path, failing for files shorter than minimumSize.
+// The mapping starts with one reference and is unmapped with the last one.
+MappedFile* mappedfile_open(const char* path, uint64_t minimumSize);
+void mappedfile_retain(MappedFile* file);
+void mappedfile_release(MappedFile* file);
+
+// The names are not copied and must outlive the index. Lookups return the
+// value stored with the first matching name, or -1.
+int mappedfile_index_init(MappedFileIndex* index, long count);
+void mappedfile_index_add(MappedFileIndex* index, const char* name, long namelen, long value);
+long mappedfile_index_find(MappedFileIndex* index, const char* name, long namelen);
+void mappedfile_index_free(MappedFileIndex* index);
+
+#endif
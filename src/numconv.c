@@ -0,0 +1,542 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "numconv.h"
+
+// Shortest round-trip formatting uses the Grisu2 algorithm (Loitsch, "Printing
+// Floating-Point Numbers Quickly and Accurately with Integers"). Fixed decimal
+// formatting and parsing produce exactly the same results as printf("%.*f")
+// and the LuaJIT number scanner; inputs outside the exact fast paths are
+// handed over to those.
+
+static const char digit_pairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static const uint64_t pow10_u64[] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+	100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+	10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+	100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+
+static const double pow10_double[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static const uint64_t cached_powers_f[] = {
+	0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL, 0xcf42894a5dce35eaULL,
+	0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL, 0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL,
+	0xbe5691ef416bd60cULL, 0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+	0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL, 0xc21094364dfb5637ULL,
+	0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL, 0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL,
+	0xb23867fb2a35b28eULL, 0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+	0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL, 0xb5b5ada8aaff80b8ULL,
+	0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL, 0x964e858c91ba2655ULL, 0xdff9772470297ebdULL,
+	0xa6dfbd9fb8e5b88fULL, 0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+	0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL, 0xaa242499697392d3ULL,
+	0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL, 0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL,
+	0x9c40000000000000ULL, 0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+	0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL, 0x9f4f2726179a2245ULL,
+	0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL, 0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL,
+	0x924d692ca61be758ULL, 0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+	0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL, 0x952ab45cfa97a0b3ULL,
+	0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL, 0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL,
+	0x88fcf317f22241e2ULL, 0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+	0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL, 0x8bab8eefb6409c1aULL,
+	0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL, 0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL,
+	0x80444b5e7aa7cf85ULL, 0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+	0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+};
+
+static const short cached_powers_e[] = {
+	-1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927,
+	-901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635, -608,
+	-582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316, -289,
+	-263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+	56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+	375, 402, 428, 455, 481, 508, 534, 561, 588, 614, 641, 667,
+	694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986,
+	1013, 1039, 1066
+};
+
+static int write_u64(uint64_t v, char* buffer)
+{
+	char tmp[20];
+	int n = 20;
+	while(v >= 100) {
+		const char* d = digit_pairs + (v % 100) * 2;
+		v /= 100;
+		tmp[--n] = d[1];
+		tmp[--n] = d[0];
+	}
+	if(v >= 10) {
+		const char* d = digit_pairs + v * 2;
+		tmp[--n] = d[1];
+		tmp[--n] = d[0];
+	}
+	else {
+		tmp[--n] = (char)('0' + v);
+	}
+	memcpy(buffer, tmp + n, 20 - n);
+	return 20 - n;
+}
+
+static void write_u64_padded(uint64_t v, char* buffer, int width)
+{
+	int n = width;
+	while(n > 0) {
+		buffer[--n] = (char)('0' + v % 10);
+		v /= 10;
+	}
+}
+
+int numconv_format_integer(int64_t value, char* buffer)
+{
+	uint64_t uv = (uint64_t)value;
+	int n = 0;
+	if(value < 0) {
+		buffer[n++] = '-';
+		uv = 0 - uv;
+	}
+	n += write_u64(uv, buffer + n);
+	buffer[n] = 0;
+	return n;
+}
+
+static int format_fixed_printf(double value, int decimals, char* buffer, int size)
+{
+	int r = snprintf(buffer, size, "%.*f", decimals, value);
+	if(r < 0 || r >= size) {
+		return -1;
+	}
+	return r;
+}
+
+int numconv_format_fixed(double value, int decimals, char* buffer, int size)
+{
+#if defined(__SIZEOF_INT128__)
+	if(decimals < 0 || decimals > 22 || isfinite(value) == 0 || size < 64) {
+		return format_fixed_printf(value, decimals, buffer, size);
+	}
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	int bexp = (int)((bits >> 52) & 0x7ff);
+	uint64_t m = bits & 0xfffffffffffffULL;
+	int e;
+	if(bexp == 0) {
+		e = -1074;
+	}
+	else {
+		m |= 1ULL << 52;
+		e = bexp - 1075;
+	}
+	if(e > 74) {
+		return format_fixed_printf(value, decimals, buffer, size);
+	}
+	// q holds round(|value| * 10^decimals), computed exactly with ties to even
+	unsigned __int128 q;
+	if(e >= 0) {
+		q = (unsigned __int128)m << e;
+	}
+	else {
+		unsigned __int128 p = (unsigned __int128)m * pow10_u64[decimals > 19 ? 19 : decimals];
+		if(decimals > 19) {
+			p *= pow10_u64[decimals - 19];
+		}
+		int k = -e;
+		if(k >= 128) {
+			q = 0;
+		}
+		else {
+			q = p >> k;
+			unsigned __int128 r = p & ((((unsigned __int128)1) << k) - 1);
+			unsigned __int128 half = ((unsigned __int128)1) << (k - 1);
+			if(r > half || (r == half && (q & 1))) {
+				q++;
+			}
+		}
+	}
+	char digits[48];
+	int nd;
+	uint64_t hi = (uint64_t)(q / 10000000000000000000ULL);
+	uint64_t lo = (uint64_t)(q % 10000000000000000000ULL);
+	if(hi > 0) {
+		nd = write_u64(hi, digits);
+		write_u64_padded(lo, digits + nd, 19);
+		nd += 19;
+	}
+	else {
+		nd = write_u64(lo, digits);
+	}
+	int n = 0;
+	if(bits >> 63) {
+		buffer[n++] = '-';
+	}
+	if(e >= 0) {
+		memcpy(buffer + n, digits, nd);
+		n += nd;
+		if(decimals > 0) {
+			buffer[n++] = '.';
+			memset(buffer + n, '0', decimals);
+			n += decimals;
+		}
+		buffer[n] = 0;
+		return n;
+	}
+	int intdigits = nd - decimals;
+	if(intdigits <= 0) {
+		buffer[n++] = '0';
+	}
+	else {
+		memcpy(buffer + n, digits, intdigits);
+		n += intdigits;
+	}
+	if(decimals > 0) {
+		buffer[n++] = '.';
+		if(intdigits < 0) {
+			memset(buffer + n, '0', -intdigits);
+			n += -intdigits;
+			memcpy(buffer + n, digits, nd);
+			n += nd;
+		}
+		else {
+			memcpy(buffer + n, digits + intdigits, decimals);
+			n += decimals;
+		}
+	}
+	buffer[n] = 0;
+	return n;
+#else
+	return format_fixed_printf(value, decimals, buffer, size);
+#endif
+}
+
+typedef struct {
+	uint64_t f;
+	int e;
+} DiyFp;
+
+static DiyFp diyfp_multiply(DiyFp a, DiyFp b)
+{
+	const uint64_t m32 = 0xffffffffULL;
+	uint64_t ah = a.f >> 32, al = a.f & m32;
+	uint64_t bh = b.f >> 32, bl = b.f & m32;
+	uint64_t hh = ah * bh, lh = al * bh, hl = ah * bl, ll = al * bl;
+	uint64_t tmp = (ll >> 32) + (hl & m32) + (lh & m32);
+	tmp += 1ULL << 31;
+	DiyFp r;
+	r.f = hh + (hl >> 32) + (lh >> 32) + (tmp >> 32);
+	r.e = a.e + b.e + 64;
+	return r;
+}
+
+static DiyFp diyfp_normalize(DiyFp v)
+{
+	while((v.f & (1ULL << 63)) == 0) {
+		v.f <<= 1;
+		v.e--;
+	}
+	return v;
+}
+
+static void grisu_round(char* buffer, int len, uint64_t delta, uint64_t rest, uint64_t tenkappa, uint64_t wpw)
+{
+	while(rest < wpw && delta - rest >= tenkappa && (rest + tenkappa < wpw || wpw - rest > rest + tenkappa - wpw)) {
+		buffer[len - 1]--;
+		rest += tenkappa;
+	}
+}
+
+static void grisu_digit_gen(DiyFp w, DiyFp mp, uint64_t delta, char* buffer, int* len, int* k)
+{
+	int shift = -mp.e;
+	uint64_t one = 1ULL << shift;
+	uint64_t wpw = mp.f - w.f;
+	uint32_t p1 = (uint32_t)(mp.f >> shift);
+	uint64_t p2 = mp.f & (one - 1);
+	int kappa = 1;
+	while(kappa < 10 && p1 >= pow10_u64[kappa]) {
+		kappa++;
+	}
+	*len = 0;
+	while(kappa > 0) {
+		uint32_t div = (uint32_t)pow10_u64[kappa - 1];
+		uint32_t d = p1 / div;
+		p1 %= div;
+		if(d || *len) {
+			buffer[(*len)++] = (char)('0' + d);
+		}
+		kappa--;
+		uint64_t rest = ((uint64_t)p1 << shift) + p2;
+		if(rest <= delta) {
+			*k += kappa;
+			grisu_round(buffer, *len, delta, rest, pow10_u64[kappa] << shift, wpw);
+			return;
+		}
+	}
+	for(;;) {
+		p2 *= 10;
+		delta *= 10;
+		char d = (char)(p2 >> shift);
+		if(d || *len) {
+			buffer[(*len)++] = (char)('0' + d);
+		}
+		p2 &= one - 1;
+		kappa--;
+		if(p2 < delta) {
+			*k += kappa;
+			int index = -kappa;
+			grisu_round(buffer, *len, delta, p2, one, index < 20 ? wpw * pow10_u64[index] : 0);
+			return;
+		}
+	}
+}
+
+static void grisu2(double value, char* buffer, int* len, int* k)
+{
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	int bexp = (int)((bits >> 52) & 0x7ff);
+	DiyFp v;
+	v.f = bits & 0xfffffffffffffULL;
+	if(bexp != 0) {
+		v.f += 1ULL << 52;
+		v.e = bexp - 1075;
+	}
+	else {
+		v.e = -1074;
+	}
+	DiyFp plus;
+	plus.f = (v.f << 1) + 1;
+	plus.e = v.e - 1;
+	while((plus.f & (1ULL << 53)) == 0) {
+		plus.f <<= 1;
+		plus.e--;
+	}
+	plus.f <<= 10;
+	plus.e -= 10;
+	DiyFp minus;
+	if(v.f == (1ULL << 52)) {
+		minus.f = (v.f << 2) - 1;
+		minus.e = v.e - 2;
+	}
+	else {
+		minus.f = (v.f << 1) - 1;
+		minus.e = v.e - 1;
+	}
+	minus.f <<= minus.e - plus.e;
+	minus.e = plus.e;
+	double dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+	int ck = (int)dk;
+	if(ck != dk) {
+		ck++;
+	}
+	unsigned int index = (unsigned int)((ck >> 3) + 1);
+	*k = -(-348 + (int)(index << 3));
+	DiyFp cmk;
+	cmk.f = cached_powers_f[index];
+	cmk.e = cached_powers_e[index];
+	DiyFp w = diyfp_multiply(diyfp_normalize(v), cmk);
+	DiyFp wp = diyfp_multiply(plus, cmk);
+	DiyFp wm = diyfp_multiply(minus, cmk);
+	wm.f++;
+	wp.f--;
+	grisu_digit_gen(w, wp, wp.f - wm.f, buffer, len, k);
+}
+
+static int write_exponent(int k, char* buffer)
+{
+	int n = 0;
+	buffer[n++] = 'e';
+	if(k < 0) {
+		buffer[n++] = '-';
+		k = -k;
+	}
+	if(k >= 100) {
+		buffer[n++] = (char)('0' + k / 100);
+		k %= 100;
+		buffer[n++] = digit_pairs[k * 2];
+		buffer[n++] = digit_pairs[k * 2 + 1];
+	}
+	else if(k >= 10) {
+		buffer[n++] = digit_pairs[k * 2];
+		buffer[n++] = digit_pairs[k * 2 + 1];
+	}
+	else {
+		buffer[n++] = (char)('0' + k);
+	}
+	return n;
+}
+
+static int prettify(char* buffer, int len, int k)
+{
+	int kk = len + k;
+	if(len <= kk && kk <= 21) {
+		memset(buffer + len, '0', kk - len);
+		buffer[kk] = '.';
+		buffer[kk + 1] = '0';
+		return kk + 2;
+	}
+	if(0 < kk && kk <= 21) {
+		memmove(buffer + kk + 1, buffer + kk, len - kk);
+		buffer[kk] = '.';
+		return len + 1;
+	}
+	if(-6 < kk && kk <= 0) {
+		int offset = 2 - kk;
+		memmove(buffer + offset, buffer, len);
+		buffer[0] = '0';
+		buffer[1] = '.';
+		memset(buffer + 2, '0', offset - 2);
+		return len + offset;
+	}
+	if(len == 1) {
+		return 1 + write_exponent(kk - 1, buffer + 1);
+	}
+	memmove(buffer + 2, buffer + 1, len - 1);
+	buffer[1] = '.';
+	return len + 1 + write_exponent(kk - 1, buffer + len + 1);
+}
+
+int numconv_format_shortest(double value, char* buffer, int size)
+{
+	if(size < 32) {
+		return -1;
+	}
+	if(isfinite(value) == 0) {
+		int r = snprintf(buffer, size, "%f", value);
+		return r < 0 || r >= size ? -1 : r;
+	}
+	int n = 0;
+	if(signbit(value)) {
+		buffer[n++] = '-';
+		value = -value;
+	}
+	if(value == 0) {
+		memcpy(buffer + n, "0.0", 4);
+		return n + 3;
+	}
+	int len, k;
+	grisu2(value, buffer + n, &len, &k);
+	n += prettify(buffer + n, len, k);
+	buffer[n] = 0;
+	return n;
+}
+
+int numconv_parse_double(const char* str, long len, double* result)
+{
+	long i = 0;
+	int neg = 0;
+	if(i < len && str[i] == '-') {
+		neg = 1;
+		i++;
+	}
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int exp10 = 0;
+	int seen = 0;
+	while(i < len && str[i] >= '0' && str[i] <= '9') {
+		if(digits > 0 || str[i] != '0') {
+			if(digits >= 19) {
+				return 0;
+			}
+			mantissa = mantissa * 10 + (uint64_t)(str[i] - '0');
+			digits++;
+		}
+		seen = 1;
+		i++;
+	}
+	if(i < len && str[i] == '.') {
+		i++;
+		while(i < len && str[i] >= '0' && str[i] <= '9') {
+			if(digits > 0 || str[i] != '0') {
+				if(digits >= 19) {
+					return 0;
+				}
+				mantissa = mantissa * 10 + (uint64_t)(str[i] - '0');
+				digits++;
+			}
+			exp10--;
+			seen = 1;
+			i++;
+		}
+	}
+	if(seen == 0) {
+		return 0;
+	}
+	if(i < len && (str[i] == 'e' || str[i] == 'E')) {
+		i++;
+		int eneg = 0;
+		if(i < len && (str[i] == '-' || str[i] == '+')) {
+			eneg = str[i] == '-';
+			i++;
+		}
+		if(i >= len || str[i] < '0' || str[i] > '9') {
+			return 0;
+		}
+		int ev = 0;
+		while(i < len && str[i] >= '0' && str[i] <= '9') {
+			if(ev > 10000) {
+				return 0;
+			}
+			ev = ev * 10 + (str[i] - '0');
+			i++;
+		}
+		exp10 += eneg ? -ev : ev;
+	}
+	if(i != len) {
+		return 0;
+	}
+	// Exact when both the mantissa and the power of ten are representable
+	// (Clinger's fast path), since the single operation is correctly rounded.
+	double v;
+	if(mantissa == 0) {
+		v = 0.0;
+	}
+	else if(mantissa > (1ULL << 53) || exp10 < -22 || exp10 > 22) {
+		return 0;
+	}
+	else if(exp10 < 0) {
+		v = (double)mantissa / pow10_double[-exp10];
+	}
+	else {
+		v = (double)mantissa * pow10_double[exp10];
+	}
+	*result = neg ? -v : v;
+	return 1;
+}
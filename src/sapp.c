@@ -0,0 +1,166 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "zbuf.h"
+#include "sapp.h"
+
+static uint32_t sapp_read32(const unsigned char* p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t sapp_read64(const unsigned char* p)
+{
+	return (uint64_t)sapp_read32(p) | ((uint64_t)sapp_read32(p + 4) << 32);
+}
+
+static unsigned char* sapp_put32(unsigned char* p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+	return p + 4;
+}
+
+static unsigned char* sapp_put64(unsigned char* p, uint64_t v)
+{
+	p = sapp_put32(p, (uint32_t)(v & 0xffffffff));
+	return sapp_put32(p, (uint32_t)(v >> 32));
+}
+
+int sapp_is_archive(const unsigned char* data, unsigned long size)
+{
+	return data != NULL && size >= 12 && data[0] == 0x00 && data[1] == 0x73 && data[2] == 0x61 && data[3] == 0x70;
+}
+
+SappEntry* sapp_read_index(const unsigned char* data, unsigned long size, long* count)
+{
+	*count = 0;
+	if(sapp_is_archive(data, size) == 0 || sapp_read32(data + 4) != SAPP_VERSION) {
+		return NULL;
+	}
+	uint32_t n = sapp_read32(data + 8);
+	if(n > (size - 12) / 24) {
+		return NULL;
+	}
+	SappEntry* entries = (SappEntry*)malloc((n > 0 ? n : 1) * sizeof(SappEntry));
+	if(entries == NULL) {
+		return NULL;
+	}
+	unsigned long pos = 12;
+	uint32_t i;
+	for(i=0; i<n; i++) {
+		if(size - pos < 4) {
+			break;
+		}
+		uint32_t namelen = sapp_read32(data + pos);
+		pos += 4;
+		if(namelen > size - pos || size - pos - namelen < 20) {
+			break;
+		}
+		entries[i].name = (const char*)data + pos;
+		entries[i].namelen = (long)namelen;
+		pos += namelen;
+		entries[i].flags = (int)sapp_read32(data + pos);
+		uint64_t offset = sapp_read64(data + pos + 4);
+		uint64_t len = sapp_read64(data + pos + 12);
+		pos += 20;
+		if(offset > size || len > size - offset) {
+			break;
+		}
+		entries[i].data = data + offset;
+		entries[i].size = len;
+	}
+	if(i < n) {
+		free(entries);
+		return NULL;
+	}
+	*count = (long)n;
+	return entries;
+}
+
+int sapp_write(SappEntry* entries, long count, unsigned char** dst, unsigned long* dstlen)
+{
+	*dst = NULL;
+	*dstlen = 0;
+	unsigned char** packed = (unsigned char**)calloc(count > 0 ? count : 1, sizeof(unsigned char*));
+	unsigned long* packedlen = (unsigned long*)calloc(count > 0 ? count : 1, sizeof(unsigned long));
+	if(packed == NULL || packedlen == NULL) {
+		free(packed);
+		free(packedlen);
+		return 0;
+	}
+	int ok = 1;
+	uint64_t total = 12;
+	long n;
+	for(n=0; n<count && ok; n++) {
+		if(entries[n].flags & SAPP_FLAG_DEFLATE) {
+			ok = entries[n].size > 0 && zbuf_deflate((unsigned char*)entries[n].data, (unsigned long)entries[n].size, &packed[n], &packedlen[n]);
+		}
+		else {
+			packedlen[n] = (unsigned long)entries[n].size;
+		}
+		total += 24 + (uint64_t)entries[n].namelen + packedlen[n];
+	}
+	if(ok) {
+		*dst = (unsigned char*)malloc((size_t)total);
+		ok = *dst != NULL;
+	}
+	if(ok) {
+		unsigned char* p = *dst;
+		*p++ = 0x00;
+		*p++ = 0x73;
+		*p++ = 0x61;
+		*p++ = 0x70;
+		p = sapp_put32(p, SAPP_VERSION);
+		p = sapp_put32(p, (uint32_t)count);
+		uint64_t offset = 12;
+		for(n=0; n<count; n++) {
+			offset += 24 + (uint64_t)entries[n].namelen;
+		}
+		for(n=0; n<count; n++) {
+			p = sapp_put32(p, (uint32_t)entries[n].namelen);
+			memcpy(p, entries[n].name, entries[n].namelen);
+			p += entries[n].namelen;
+			p = sapp_put32(p, (uint32_t)(entries[n].flags & SAPP_FLAG_DEFLATE));
+			p = sapp_put64(p, offset);
+			p = sapp_put64(p, packedlen[n]);
+			offset += packedlen[n];
+		}
+		for(n=0; n<count; n++) {
+			memcpy(p, packed[n] != NULL ? packed[n] : entries[n].data, packedlen[n]);
+			p += packedlen[n];
+		}
+		*dstlen = (unsigned long)total;
+	}
+	for(n=0; n<count; n++) {
+		free(packed[n]);
+	}
+	free(packed);
+	free(packedlen);
+	return ok;
+}
@@ -0,0 +1,57 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SAPP_H
+#define SAPP_H
+
+#include <stdint.h>
+
+/*
+ * Packed program archive: an index followed by independently loadable code
+ * chunks. The chunk with an empty name is the program itself; every other
+ * chunk is named by the (dotted) global it defines, for example "app.Main",
+ * and is only loaded when that global is first accessed.
+ *
+ * Layout (little endian): the marker "\0sap", a 32 bit format version and
+ * entry count, then per entry a 32 bit name length, the name, 32 bit flags,
+ * and 64 bit offset and size of the chunk relative to the marker.
+ */
+
+#define SAPP_VERSION 1
+#define SAPP_FLAG_DEFLATE 1
+
+typedef struct SappEntry
+{
+	const char* name;
+	long namelen;
+	int flags;
+	const unsigned char* data;
+	uint64_t size;
+} SappEntry;
+
+int sapp_is_archive(const unsigned char* data, unsigned long size);
+SappEntry* sapp_read_index(const unsigned char* data, unsigned long size, long* count);
+int sapp_write(SappEntry* entries, long count, unsigned char** dst, unsigned long* dstlen);
+
+#endif
@@ -0,0 +1,413 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+#include <ctype.h>
+#include "strutil.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define STRUTIL_SSE2 1
+#endif
+
+long strutil_find_byte(const unsigned char* data, long len, unsigned char c)
+{
+	if(data == NULL || len < 1) {
+		return -1;
+	}
+	const unsigned char* p = (const unsigned char*)memchr(data, c, (size_t)len);
+	if(p == NULL) {
+		return -1;
+	}
+	return (long)(p - data);
+}
+
+long strutil_find_bytes(const unsigned char* data, long len, const unsigned char* needle, long nlen)
+{
+	if(data == NULL || needle == NULL || nlen < 1 || nlen > len) {
+		return -1;
+	}
+	if(nlen == 1) {
+		return strutil_find_byte(data, len, needle[0]);
+	}
+	long n = 0;
+	long last = len - nlen;
+#ifdef STRUTIL_SSE2
+	// Compare the first and last bytes of the needle against sixteen
+	// candidate positions at once, and only verify the positions where
+	// both of them match.
+	const __m128i vfirst = _mm_set1_epi8((char)needle[0]);
+	const __m128i vlast = _mm_set1_epi8((char)needle[nlen-1]);
+	while(n + 15 <= last) {
+		__m128i bf = _mm_loadu_si128((const __m128i*)(data + n));
+		__m128i bl = _mm_loadu_si128((const __m128i*)(data + n + nlen - 1));
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(bf, vfirst), _mm_cmpeq_epi8(bl, vlast)));
+		while(mask != 0) {
+			int bit = __builtin_ctz(mask);
+			if(memcmp(data + n + bit + 1, needle + 1, (size_t)(nlen - 2)) == 0) {
+				return n + bit;
+			}
+			mask &= mask - 1;
+		}
+		n += 16;
+	}
+#endif
+	while(n <= last) {
+		const unsigned char* p = (const unsigned char*)memchr(data + n, needle[0], (size_t)(last - n + 1));
+		if(p == NULL) {
+			return -1;
+		}
+		n = (long)(p - data);
+		if(memcmp(p + 1, needle + 1, (size_t)(nlen - 1)) == 0) {
+			return n;
+		}
+		n++;
+	}
+	return -1;
+}
+
+long strutil_find_any_byte(const unsigned char* data, long len, const unsigned char* set, long setlen)
+{
+	if(data == NULL || set == NULL || len < 1 || setlen < 1) {
+		return -1;
+	}
+	if(setlen == 1) {
+		return strutil_find_byte(data, len, set[0]);
+	}
+	long n = 0;
+#ifdef STRUTIL_SSE2
+	if(setlen <= 16) {
+		__m128i vset[16];
+		long i;
+		for(i=0; i<setlen; i++) {
+			vset[i] = _mm_set1_epi8((char)set[i]);
+		}
+		while(n + 16 <= len) {
+			__m128i block = _mm_loadu_si128((const __m128i*)(data + n));
+			__m128i hits = _mm_cmpeq_epi8(block, vset[0]);
+			for(i=1; i<setlen; i++) {
+				hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, vset[i]));
+			}
+			unsigned int mask = (unsigned int)_mm_movemask_epi8(hits);
+			if(mask != 0) {
+				return n + __builtin_ctz(mask);
+			}
+			n += 16;
+		}
+	}
+#endif
+	unsigned char table[256];
+	memset(table, 0, 256);
+	long i;
+	for(i=0; i<setlen; i++) {
+		table[set[i]] = 1;
+	}
+	for(; n<len; n++) {
+		if(table[data[n]]) {
+			return n;
+		}
+	}
+	return -1;
+}
+
+long strutil_find_byte_above(const unsigned char* data, long len, unsigned char limit)
+{
+	if(data == NULL || len < 1) {
+		return -1;
+	}
+	long n = 0;
+#ifdef STRUTIL_SSE2
+	// Saturating subtraction leaves a non-zero byte only where the input
+	// is greater than the limit.
+	const __m128i vlimit = _mm_set1_epi8((char)limit);
+	const __m128i zero = _mm_setzero_si128();
+	while(n + 16 <= len) {
+		__m128i block = _mm_loadu_si128((const __m128i*)(data + n));
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(block, vlimit), zero)) ^ 0xffff;
+		if(mask != 0) {
+			return n + __builtin_ctz(mask);
+		}
+		n += 16;
+	}
+#endif
+	for(; n<len; n++) {
+		if(data[n] > limit) {
+			return n;
+		}
+	}
+	return -1;
+}
+
+int strutil_utf8_validate(const unsigned char* data, long len)
+{
+	if(data == NULL || len < 1) {
+		return 1;
+	}
+	long n = 0;
+	while(n < len) {
+		long skip = strutil_find_byte_above(data + n, len - n, 0x7f);
+		if(skip < 0) {
+			return 1;
+		}
+		n += skip;
+		unsigned char c = data[n];
+		long need;
+		unsigned char lo = 0x80;
+		unsigned char hi = 0xbf;
+		if(c >= 0xc2 && c <= 0xdf) {
+			need = 1;
+		}
+		else if(c >= 0xe0 && c <= 0xef) {
+			need = 2;
+			if(c == 0xe0) {
+				lo = 0xa0;
+			}
+			else if(c == 0xed) {
+				hi = 0x9f;
+			}
+		}
+		else if(c >= 0xf0 && c <= 0xf4) {
+			need = 3;
+			if(c == 0xf0) {
+				lo = 0x90;
+			}
+			else if(c == 0xf4) {
+				hi = 0x8f;
+			}
+		}
+		else {
+			return 0;
+		}
+		if(n + need >= len) {
+			return 0;
+		}
+		if(data[n+1] < lo || data[n+1] > hi) {
+			return 0;
+		}
+		long i;
+		for(i=2; i<=need; i++) {
+			if((data[n+i] & 0xc0) != 0x80) {
+				return 0;
+			}
+		}
+		n += need + 1;
+	}
+	return 1;
+}
+
+long strutil_utf8_count(const unsigned char* data, long len)
+{
+	if(data == NULL || len < 1) {
+		return 0;
+	}
+	long v = 0;
+	long n = 0;
+#ifdef STRUTIL_SSE2
+	// Every byte that is not a continuation byte (10xxxxxx) starts a
+	// character. Continuation bytes are the only ones that are less than
+	// -64 when interpreted as signed.
+	const __m128i threshold = _mm_set1_epi8((char)0xc0);
+	while(n + 16 <= len) {
+		__m128i block = _mm_loadu_si128((const __m128i*)(data + n));
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmplt_epi8(block, threshold));
+		v += 16 - __builtin_popcount(mask);
+		n += 16;
+	}
+#endif
+	for(; n<len; n++) {
+		if((data[n] & 0xc0) != 0x80) {
+			v++;
+		}
+	}
+	return v;
+}
+
+long strutil_latin1_to_utf8(const unsigned char* src, long srclen, unsigned char* dst, long dstlen, long* consumed)
+{
+	long s = 0;
+	long d = 0;
+	while(s < srclen && d < dstlen) {
+		long ascii = strutil_find_byte_above(src + s, srclen - s, 0x7f);
+		if(ascii < 0) {
+			ascii = srclen - s;
+		}
+		if(ascii > dstlen - d) {
+			ascii = dstlen - d;
+		}
+		memcpy(dst + d, src + s, (size_t)ascii);
+		s += ascii;
+		d += ascii;
+		while(s < srclen && src[s] > 0x7f) {
+			if(d + 2 > dstlen) {
+				break;
+			}
+			dst[d++] = 0xc0 | (src[s] >> 6);
+			dst[d++] = 0x80 | (src[s] & 0x3f);
+			s++;
+		}
+		if(s < srclen && src[s] > 0x7f) {
+			break;
+		}
+	}
+	if(consumed != NULL) {
+		*consumed = s;
+	}
+	return d;
+}
+
+#ifdef STRUTIL_SSE2
+static inline __m128i strutil_sse2_in_range(__m128i block, char lo, unsigned char span)
+{
+	__m128i shifted = _mm_sub_epi8(block, _mm_set1_epi8(lo));
+	return _mm_cmpeq_epi8(_mm_min_epu8(shifted, _mm_set1_epi8((char)span)), shifted);
+}
+
+static inline __m128i strutil_sse2_to_lower(__m128i block)
+{
+	return _mm_or_si128(block, _mm_and_si128(strutil_sse2_in_range(block, 'A', 25), _mm_set1_epi8(0x20)));
+}
+
+static inline unsigned int strutil_sse2_whitespace_mask(__m128i block)
+{
+	__m128i ws = _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(' ')), strutil_sse2_in_range(block, '\t', '\r' - '\t'));
+	return (unsigned int)_mm_movemask_epi8(ws);
+}
+#endif
+
+static inline int strutil_is_ascii_space(unsigned char c)
+{
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+void strutil_ascii_to_lower(unsigned char* dst, const unsigned char* src, long len)
+{
+	long n = 0;
+#ifdef STRUTIL_SSE2
+	while(n + 16 <= len) {
+		__m128i block = _mm_loadu_si128((const __m128i*)(src + n));
+		_mm_storeu_si128((__m128i*)(dst + n), strutil_sse2_to_lower(block));
+		n += 16;
+	}
+#endif
+	for(; n<len; n++) {
+		unsigned char c = src[n];
+		dst[n] = (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+	}
+}
+
+void strutil_ascii_to_upper(unsigned char* dst, const unsigned char* src, long len)
+{
+	long n = 0;
+#ifdef STRUTIL_SSE2
+	while(n + 16 <= len) {
+		__m128i block = _mm_loadu_si128((const __m128i*)(src + n));
+		__m128i flip = _mm_and_si128(strutil_sse2_in_range(block, 'a', 25), _mm_set1_epi8(0x20));
+		_mm_storeu_si128((__m128i*)(dst + n), _mm_xor_si128(block, flip));
+		n += 16;
+	}
+#endif
+	for(; n<len; n++) {
+		unsigned char c = src[n];
+		dst[n] = (c >= 'a' && c <= 'z') ? c & ~0x20 : c;
+	}
+}
+
+static long strutil_ascii_mismatch_ignore_case(const unsigned char* s1, const unsigned char* s2, long len)
+{
+	long n = 0;
+#ifdef STRUTIL_SSE2
+	while(n + 16 <= len) {
+		__m128i b1 = strutil_sse2_to_lower(_mm_loadu_si128((const __m128i*)(s1 + n)));
+		__m128i b2 = strutil_sse2_to_lower(_mm_loadu_si128((const __m128i*)(s2 + n)));
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(b1, b2)) ^ 0xffff;
+		if(mask != 0) {
+			return n + __builtin_ctz(mask);
+		}
+		n += 16;
+	}
+#endif
+	for(; n<len; n++) {
+		if(tolower(s1[n]) != tolower(s2[n])) {
+			return n;
+		}
+	}
+	return -1;
+}
+
+int strutil_ascii_compare_ignore_case(const unsigned char* s1, long s1len, const unsigned char* s2, long s2len)
+{
+	long len = s1len < s2len ? s1len : s2len;
+	long n = strutil_ascii_mismatch_ignore_case(s1, s2, len);
+	if(n >= 0) {
+		return tolower(s1[n]) < tolower(s2[n]) ? -1 : 1;
+	}
+	if(s1len < s2len) {
+		return -1;
+	}
+	if(s1len > s2len) {
+		return 1;
+	}
+	return 0;
+}
+
+int strutil_ascii_starts_with_ignore_case(const unsigned char* data, long len, const unsigned char* prefix, long plen)
+{
+	if(plen > len) {
+		return 0;
+	}
+	return strutil_ascii_mismatch_ignore_case(data, prefix, plen) < 0;
+}
+
+void strutil_ascii_trim(const unsigned char* data, long len, long* start, long* end)
+{
+	long s = 0;
+	long e = len;
+#ifdef STRUTIL_SSE2
+	while(s + 16 <= e) {
+		unsigned int mask = strutil_sse2_whitespace_mask(_mm_loadu_si128((const __m128i*)(data + s))) ^ 0xffff;
+		if(mask != 0) {
+			s += __builtin_ctz(mask);
+			break;
+		}
+		s += 16;
+	}
+#endif
+	while(s < e && strutil_is_ascii_space(data[s])) {
+		s++;
+	}
+#ifdef STRUTIL_SSE2
+	while(e - 16 >= s) {
+		unsigned int mask = strutil_sse2_whitespace_mask(_mm_loadu_si128((const __m128i*)(data + e - 16))) ^ 0xffff;
+		if(mask != 0) {
+			e -= 16 - (32 - __builtin_clz(mask));
+			break;
+		}
+		e -= 16;
+	}
+#endif
+	while(e > s && strutil_is_ascii_space(data[e-1])) {
+		e--;
+	}
+	*start = s;
+	*end = e;
+}
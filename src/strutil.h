@@ -0,0 +1,42 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef STRUTIL_H
+#define STRUTIL_H
+
+long strutil_find_byte(const unsigned char* data, long len, unsigned char c);
+long strutil_find_bytes(const unsigned char* data, long len, const unsigned char* needle, long nlen);
+long strutil_find_any_byte(const unsigned char* data, long len, const unsigned char* set, long setlen);
+long strutil_find_byte_above(const unsigned char* data, long len, unsigned char limit);
+int strutil_utf8_validate(const unsigned char* data, long len);
+long strutil_utf8_count(const unsigned char* data, long len);
+long strutil_latin1_to_utf8(const unsigned char* src, long srclen, unsigned char* dst, long dstlen, long* consumed);
+
+void strutil_ascii_to_lower(unsigned char* dst, const unsigned char* src, long len);
+void strutil_ascii_to_upper(unsigned char* dst, const unsigned char* src, long len);
+int strutil_ascii_compare_ignore_case(const unsigned char* s1, long s1len, const unsigned char* s2, long s2len);
+int strutil_ascii_starts_with_ignore_case(const unsigned char* data, long len, const unsigned char* prefix, long plen);
+void strutil_ascii_trim(const unsigned char* data, long len, long* start, long* end);
+
+#endif
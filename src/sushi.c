@@ -30,6 +30,10 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <stdint.h>
+#ifndef SUSHI_SUPPORT_WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
 #ifdef SUSHI_SUPPORT_LINUX
 #include <arpa/inet.h>
 #endif
@@ -43,7 +47,9 @@
 #include "lib_bcrypt.h"
 #include "lib_crypto.h"
 #include "lib_io.h"
+#include "lib_json.h"
 #include "lib_math.h"
+#include "lib_msgpack.h"
 #include "lib_net.h"
 #include "lib_os.h"
 #include "lib_util.h"
@@ -52,10 +58,19 @@
 #include "lib_zip.h"
 #include "lib_image.h"
 #include "zbuf.h"
+#include "lz4.h"
+#include "bccache.h"
+#include "codecache.h"
+#include "sapp.h"
+#include "embed.h"
+#include "timing.h"
+#include "allocator.h"
 
 static int errors = 0;
 static const char* executable_path = NULL;
 static char* profile_directory = NULL;
+static int bytecode_cache_enabled = 1;
+static unsigned long default_memory_limit = 0;
 
 const char* sushi_get_profile_directory()
 {
@@ -198,36 +213,221 @@ int sushi_has_errors()
 
 void sushi_init_libraries()
 {
+	double t0 = timing_now();
 	lib_crypto_global_init();
+	timing_add("init_libraries", t0);
 }
 
-static void init_libraries_for_state(lua_State* state)
+typedef struct SushiLibrary
 {
-	lib_bcrypt_init(state);
-	lib_crypto_init(state);
-	lib_io_init(state);
-	lib_math_init(state);
-	lib_net_init(state);
-	lib_os_init(state);
-	lib_util_init(state);
-	lib_vm_init(state);
-	lib_mod_init(state);
-	lib_zip_init(state);
-	lib_image_init(state);
+	const char* name;
+	void (*init)(lua_State* state);
+} SushiLibrary;
+
+static const SushiLibrary libraries[] = {
+	{ "_bcrypt", lib_bcrypt_init },
+	{ "_crypto", lib_crypto_init },
+	{ "_io", lib_io_init },
+	{ "_json", lib_json_init },
+	{ "_math", lib_math_init },
+	{ "_msgpack", lib_msgpack_init },
+	{ "_cbor", lib_msgpack_init },
+	{ "_net", lib_net_init },
+	{ "_os", lib_os_init },
+	{ "_util", lib_util_init },
+	{ "_vm", lib_vm_init },
+	{ "_mod", lib_mod_init },
+	{ "_zip", lib_zip_init },
+	{ "_image", lib_image_init },
+	{ NULL, NULL }
+};
+
+static const SushiLibrary* find_library(const char* name)
+{
+	const SushiLibrary* library;
+	for(library=libraries; library->name != NULL; library++) {
+		if(!strcmp(library->name, name)) {
+			return library;
+		}
+	}
+	return NULL;
+}
+
+// Fills the stubs of every library that shares the given init function
+// (one init may register several libraries) from the tables it created.
+static void fill_library_stubs(lua_State* state, const SushiLibrary* loaded)
+{
+	const SushiLibrary* library;
+	lua_getfield(state, LUA_REGISTRYINDEX, "_sushi_library_stubs");
+	int stubs = lua_gettop(state);
+	for(library=libraries; library->name != NULL; library++) {
+		if(library->init != loaded->init) {
+			continue;
+		}
+		lua_pushstring(state, library->name);
+		lua_rawget(state, stubs);
+		int stub = lua_gettop(state);
+		lua_pushstring(state, library->name);
+		lua_rawget(state, LUA_GLOBALSINDEX);
+		int table = lua_gettop(state);
+		if(lua_istable(state, stub) && lua_istable(state, table) && lua_rawequal(state, stub, table) == 0) {
+			// Fields already assigned through the stub are kept
+			lua_pushnil(state);
+			while(lua_next(state, table) != 0) {
+				lua_pushvalue(state, -2);
+				lua_rawget(state, stub);
+				if(lua_isnil(state, -1)) {
+					lua_pop(state, 1);
+					lua_pushvalue(state, -2);
+					lua_insert(state, -2);
+					lua_rawset(state, stub);
+				}
+				else {
+					lua_pop(state, 2);
+				}
+			}
+			if(lua_getmetatable(state, table) == 0) {
+				lua_pushnil(state);
+			}
+			lua_setmetatable(state, stub);
+			lua_pushstring(state, library->name);
+			lua_pushvalue(state, stub);
+			lua_rawset(state, LUA_GLOBALSINDEX);
+		}
+		if(lua_istable(state, stub)) {
+			lua_pushvalue(state, stub);
+			lua_pushnil(state);
+			lua_rawset(state, stubs);
+		}
+		lua_pushstring(state, library->name);
+		lua_pushnil(state);
+		lua_rawset(state, stubs);
+		lua_settop(state, stubs);
+	}
+	lua_pop(state, 1);
+}
+
+// __index of an unloaded library stub: creates the library, moves its
+// functions into the stub and removes the stub's metatable, so from then on
+// the stub is the library table itself.
+static int load_library(lua_State* state)
+{
+	lua_getfield(state, LUA_REGISTRYINDEX, "_sushi_library_stubs");
+	lua_pushvalue(state, 1);
+	lua_rawget(state, -2);
+	const SushiLibrary* library = (const SushiLibrary*)lua_touserdata(state, -1);
+	lua_pop(state, 2);
+	if(library == NULL) {
+		lua_pushnil(state);
+		return 1;
+	}
+	double t0 = timing_now();
+	library->init(state);
+	fill_library_stubs(state, library);
+	timing_add("init_state_library", t0);
+	lua_pushvalue(state, 2);
+	lua_rawget(state, 1);
+	return 1;
+}
+
+// Every library is registered up front as an empty stub table; the library
+// itself is only created when a program first looks something up in it.
+// With names given, only those libraries are made available at all.
+static int init_libraries_for_state(lua_State* state, const char** names)
+{
+	const SushiLibrary* library;
+	int n;
+	if(names != NULL) {
+		for(n=0; names[n] != NULL; n++) {
+			if(find_library(names[n]) == NULL) {
+				sushi_error("Unknown library: `%s'", names[n]);
+				return -1;
+			}
+		}
+	}
+	lib_util_init_types(state);
+	lib_json_init_types(state);
+	// Stubs are found both by name (to fill them) and by table (from the
+	// shared __index)
+	lua_newtable(state);
+	int stubs = lua_gettop(state);
+	lua_createtable(state, 0, 1);
+	int meta = lua_gettop(state);
+	lua_pushcfunction(state, load_library);
+	lua_setfield(state, meta, "__index");
+	for(library=libraries; library->name != NULL; library++) {
+		if(names != NULL) {
+			for(n=0; names[n] != NULL; n++) {
+				if(!strcmp(names[n], library->name)) {
+					break;
+				}
+			}
+			if(names[n] == NULL) {
+				continue;
+			}
+		}
+		lua_newtable(state);
+		lua_pushvalue(state, meta);
+		lua_setmetatable(state, -2);
+		lua_pushstring(state, library->name);
+		lua_pushvalue(state, -2);
+		lua_rawset(state, stubs);
+		lua_pushvalue(state, -1);
+		lua_pushlightuserdata(state, (void*)library);
+		lua_rawset(state, stubs);
+		lua_setglobal(state, library->name);
+	}
+	lua_pop(state, 1);
+	lua_setfield(state, LUA_REGISTRYINDEX, "_sushi_library_stubs");
 	lua_pushvalue(state ,(-10002));
 	lua_setglobal(state ,"_g");
+	return 0;
 }
 
 lua_State* sushi_create_new_state()
 {
-	lua_State* nstate = luaL_newstate();
+	return sushi_create_new_state_with_options(NULL);
+}
+
+lua_State* sushi_create_new_state_with_libraries(const char** names)
+{
+	SushiStateOptions options;
+	memset(&options, 0, sizeof(SushiStateOptions));
+	options.libraries = names;
+	return sushi_create_new_state_with_options(&options);
+}
+
+lua_State* sushi_create_new_state_with_options(const SushiStateOptions* options)
+{
+	double t0 = timing_now();
+	unsigned long limit = default_memory_limit;
+	if(options != NULL && options->memoryLimit > 0) {
+		limit = options->memoryLimit;
+	}
+	lua_State* nstate = allocator_new_state(limit, options ? options->arenaSize : 0, options ? options->hugePages : 0);
 	if(nstate == NULL) {
 		return NULL;
 	}
-	init_libraries_for_state(nstate);
+	double t1 = timing_now();
+	if(init_libraries_for_state(nstate, options ? options->libraries : NULL) != 0) {
+		lua_close(nstate);
+		return NULL;
+	}
+	timing_add("init_state_libraries", t1);
+	timing_add("create_state", t0);
 	return nstate;
 }
 
+void sushi_set_default_memory_limit(unsigned long limit)
+{
+	default_memory_limit = limit;
+}
+
+void sushi_set_bytecode_cache_enabled(int enabled)
+{
+	bytecode_cache_enabled = enabled;
+}
+
 void sushi_set_executable_path(const char* path)
 {
 	executable_path = path;
@@ -297,6 +497,9 @@ SushiCode* sushi_code_for_buffer(unsigned char* data, unsigned long dataSize, ch
 	vv->data = data;
 	vv->dataSize = dataSize;
 	vv->fileName = fileName;
+	vv->mapping = NULL;
+	vv->mappingSize = 0;
+	vv->cacheBytecode = 0;
 	return vv;
 }
 
@@ -325,6 +528,70 @@ SushiCode* sushi_code_read_from_stdin()
 	vv->data = (unsigned char*)v;
 	vv->dataSize = (unsigned long)sz;
 	vv->fileName = strdup("<stdin>");
+	vv->mapping = NULL;
+	vv->mappingSize = 0;
+	vv->cacheBytecode = 0;
+	return vv;
+}
+
+static void sushi_code_unmap(void* mapping, unsigned long size)
+{
+#ifdef SUSHI_SUPPORT_WIN32
+	UnmapViewOfFile(mapping);
+#else
+	munmap(mapping, (size_t)size);
+#endif
+}
+
+// Maps the first offset+size bytes of the file read-only and points the
+// code data at offset. Only the pages that are actually read get paged in.
+// The mapping is handed to the state for _code and lives as long as the
+// state does; the program file must therefore not be truncated or rewritten
+// in place while it runs (replace it by renaming a new file over it
+// instead), or reading _code raises SIGBUS.
+static SushiCode* sushi_code_map_file(const char* path, unsigned long offset, unsigned long size)
+{
+	if(size < 1) {
+		return NULL;
+	}
+	unsigned long total = offset + size;
+#ifdef SUSHI_SUPPORT_WIN32
+	HANDLE file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE) {
+		return NULL;
+	}
+	HANDLE fmap = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if(fmap == NULL) {
+		return NULL;
+	}
+	void* mapping = MapViewOfFile(fmap, FILE_MAP_READ, 0, 0, (SIZE_T)total);
+	CloseHandle(fmap);
+	if(mapping == NULL) {
+		return NULL;
+	}
+#else
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		return NULL;
+	}
+	void* mapping = mmap(NULL, (size_t)total, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(mapping == MAP_FAILED) {
+		return NULL;
+	}
+#endif
+	SushiCode* vv = (SushiCode*)malloc(sizeof(SushiCode));
+	if(vv == NULL) {
+		sushi_code_unmap(mapping, total);
+		return NULL;
+	}
+	vv->data = (unsigned char*)mapping + offset;
+	vv->dataSize = size;
+	vv->fileName = NULL;
+	vv->mapping = mapping;
+	vv->mappingSize = total;
+	vv->cacheBytecode = 1;
 	return vv;
 }
 
@@ -345,11 +612,16 @@ SushiCode* sushi_code_read_from_file(const char* path)
 		free(rpath);
 		return NULL;
 	}
-	int sz = st.st_size;
-	if(sz < 1) {
+	unsigned long sz = (unsigned long)st.st_size;
+	if(st.st_size < 1 || (off_t)sz != st.st_size) {
 		free(rpath);
 		return NULL;
 	}
+	SushiCode* mapped = sushi_code_map_file(rpath, 0, sz);
+	if(mapped != NULL) {
+		mapped->fileName = rpath;
+		return mapped;
+	}
 	FILE* fp = fopen(rpath, "rb");
 	if(fp == NULL) {
 		free(rpath);
@@ -377,6 +649,9 @@ SushiCode* sushi_code_read_from_file(const char* path)
 	vv->data = (unsigned char*)v;
 	vv->dataSize = sz;
 	vv->fileName = rpath;
+	vv->mapping = NULL;
+	vv->mappingSize = 0;
+	vv->cacheBytecode = 1;
 	return vv;
 }
 
@@ -402,22 +677,44 @@ SushiCode* sushi_code_read_from_executable(const char* exepath)
 		fclose(fp);
 		return NULL;
 	}
-	if(buf[0] != 'S' || buf[1] != 'u' || buf[2] != 'p' || buf[3] != 'P') {
+	long n = 0;
+	long codesize = 0;
+	if(buf[0] == 'S' && buf[1] == 'u' && buf[2] == 'p' && buf[3] == 'P') {
+		uint32_t offset = 0;
+		memcpy(&offset, buf+4, 4);
+		n = (long)ntohl(offset);
+		codesize = footerpos - n;
+	}
+	else if(buf[4] == 'S' && buf[5] == 'u' && buf[6] == 'p' && buf[7] == 'R') {
+		unsigned char trailer[EMBED_TRAILER_SIZE];
+		uint64_t codeOffset, codeSize, resourceOffset, resourceSize;
+		if(fseek(fp, -EMBED_TRAILER_SIZE, SEEK_END) != 0 || fread(trailer, 1, EMBED_TRAILER_SIZE, fp) != EMBED_TRAILER_SIZE
+			|| embed_read_trailer(trailer, (uint64_t)footerpos + EMBED_FOOTER_SIZE, &codeOffset, &codeSize, &resourceOffset, &resourceSize) == 0) {
+			sushi_error("Failed to read executable trailer: `%s'", exepath);
+			fclose(fp);
+			return NULL;
+		}
+		n = (long)codeOffset;
+		codesize = (long)codeSize;
+	}
+	if(codesize < 1) {
 		fclose(fp);
 		return NULL;
 	}
-	uint32_t n = 0;
-	memcpy(&n, buf+4, 4);
-	n = ntohl(n);
-	long codesize = footerpos - (long)n;
+	SushiCode* mapped = sushi_code_map_file(exepath, n, (unsigned long)codesize);
+	if(mapped != NULL) {
+		fclose(fp);
+		mapped->fileName = strdup(exepath);
+		return mapped;
+	}
 	if(fseek(fp, n, SEEK_SET) != 0) {
-		sushi_error("Failed to seek to position %u in executable: `%s': Corrupted content", n, exepath);
+		sushi_error("Failed to seek to position %ld in executable: `%s': Corrupted content", n, exepath);
 		fclose(fp);
 		return NULL;
 	}
 	char* data = (char*)malloc(codesize);
 	if(fread(data, 1, codesize, fp) != codesize) {
-		sushi_error("Failed to read %u bytes in position %u in executable: `%s': Corrupted content", codesize, n, exepath);
+		sushi_error("Failed to read %ld bytes in position %ld in executable: `%s': Corrupted content", codesize, n, exepath);
 		free(data);
 		fclose(fp);
 		return NULL;
@@ -431,6 +728,9 @@ SushiCode* sushi_code_read_from_executable(const char* exepath)
 	vv->data = (unsigned char*)data;
 	vv->dataSize = codesize;
 	vv->fileName = strdup(exepath);
+	vv->mapping = NULL;
+	vv->mappingSize = 0;
+	vv->cacheBytecode = 1;
 	return vv;
 }
 
@@ -439,7 +739,10 @@ SushiCode* sushi_code_free(SushiCode* code)
 	if(code == NULL) {
 		return NULL;
 	}
-	if(code->data) {
+	if(code->mapping) {
+		sushi_code_unmap(code->mapping, code->mappingSize);
+	}
+	else if(code->data) {
 		free(code->data);
 	}
 	if(code->fileName) {
@@ -449,12 +752,655 @@ SushiCode* sushi_code_free(SushiCode* code)
 	return NULL;
 }
 
+#define SUSHI_CODE_RAW 0
+#define SUSHI_CODE_DEFLATE 1
+#define SUSHI_CODE_LZ4 2
+#define SUSHI_CODE_READ_CHUNK 65536
+
+// The data a program was loaded from, kept so that the _code global can
+// view it. Mapped code is handed over as is; any other code
+// is copied into the userdata in its original (possibly compressed) form.
+typedef struct SushiCodeSource
+{
+	const unsigned char* data;
+	unsigned long size;
+	void* mapping;
+	unsigned long mappingSize;
+	int format;
+} SushiCodeSource;
+
+typedef struct SushiCodeReader
+{
+	ZbufStream* stream;
+	const unsigned char* src;
+	unsigned long srclen;
+	unsigned long pos;
+	unsigned long pending;
+	int failed;
+	int first;
+	double inflateTime;
+} SushiCodeReader;
+
+// The __index installed on the globals table while lazy globals are
+// pending. It is a Lua function so that reads of undefined globals stay
+// compiled; only pending names call into C. An __index that was already set
+// is chained to.
+static const char sushi_lazy_index_source[] =
+	"local pending, resolve, previous = ...\n"
+	"if previous == nil then\n"
+	"\treturn function(t, k) if pending[k] ~= nil then return resolve(t, k) end end\n"
+	"end\n"
+	"return function(t, k)\n"
+	"\tif pending[k] ~= nil then return resolve(t, k) end\n"
+	"\treturn previous(t, k)\n"
+	"end\n";
+
+static int sushi_lazy_previous_table(lua_State* state)
+{
+	lua_pushvalue(state, 2);
+	lua_gettable(state, lua_upvalueindex(1));
+	return 1;
+}
+
+// Puts back the __index that was there before the hook was installed.
+static void sushi_lazy_globals_uninstall(lua_State* state)
+{
+	int top = lua_gettop(state);
+	lua_getfield(state, LUA_REGISTRYINDEX, "_sushi_lazy_metatable");
+	if(lua_getmetatable(state, LUA_GLOBALSINDEX) && lua_rawequal(state, -1, -2)) {
+		lua_pushliteral(state, "__index");
+		lua_getfield(state, LUA_REGISTRYINDEX, "_sushi_lazy_previous");
+		lua_rawset(state, -3);
+	}
+	lua_settop(state, top);
+	lua_pushnil(state);
+	lua_setfield(state, LUA_REGISTRYINDEX, "_sushi_lazy_globals");
+	lua_pushnil(state);
+	lua_setfield(state, LUA_REGISTRYINDEX, "_sushi_lazy_metatable");
+	lua_pushnil(state);
+	lua_setfield(state, LUA_REGISTRYINDEX, "_sushi_lazy_previous");
+}
+
+static void sushi_lazy_global_produce(lua_State* state, int pending, int key)
+{
+	lua_pushvalue(state, key);
+	lua_rawget(state, pending);
+	lua_pushvalue(state, key);
+	lua_pushnil(state);
+	lua_rawset(state, pending);
+	lua_call(state, 0, 1);
+	lua_pushvalue(state, key);
+	lua_pushvalue(state, -2);
+	lua_rawset(state, LUA_GLOBALSINDEX);
+}
+
+static int sushi_lazy_global_resolve(lua_State* state)
+{
+	lua_getfield(state, LUA_REGISTRYINDEX, "_sushi_lazy_globals");
+	int pending = lua_gettop(state);
+	lua_pushvalue(state, 2);
+	lua_rawget(state, pending);
+	int found = lua_isnil(state, -1) == 0;
+	lua_pop(state, 1);
+	if(found == 0) {
+		lua_pushnil(state);
+		return 1;
+	}
+	sushi_lazy_global_produce(state, pending, 2);
+	lua_pushnil(state);
+	if(lua_next(state, pending) == 0) {
+		sushi_lazy_globals_uninstall(state);
+	}
+	else {
+		lua_pop(state, 2);
+	}
+	return 1;
+}
+
+// Registers the function on top of the stack (and pops it) as the producer
+// of the named global; it is called on the first read of that global. The
+// hook on the globals table is removed again once nothing is pending.
+void sushi_set_lazy_global(lua_State* state, const char* name)
+{
+	lua_getfield(state, LUA_REGISTRYINDEX, "_sushi_lazy_globals");
+	if(lua_istable(state, -1) == 0) {
+		lua_pop(state, 1);
+		lua_newtable(state);
+		int pending = lua_gettop(state);
+		if(lua_getmetatable(state, LUA_GLOBALSINDEX) == 0) {
+			lua_newtable(state);
+			lua_pushvalue(state, -1);
+			lua_setmetatable(state, LUA_GLOBALSINDEX);
+		}
+		int meta = lua_gettop(state);
+		if(codecache_load_buffer(state, (const unsigned char*)sushi_lazy_index_source, sizeof(sushi_lazy_index_source) - 1, "=lazy_globals") != 0) {
+			sushi_error("Failed to set up lazy globals: `%s'", sushi_error_to_string(state));
+			lua_settop(state, pending - 2);
+			return;
+		}
+		lua_pushvalue(state, pending);
+		lua_pushcfunction(state, sushi_lazy_global_resolve);
+		lua_pushliteral(state, "__index");
+		lua_rawget(state, meta);
+		lua_pushvalue(state, -1);
+		lua_setfield(state, LUA_REGISTRYINDEX, "_sushi_lazy_previous");
+		if(lua_istable(state, -1)) {
+			lua_pushcclosure(state, sushi_lazy_previous_table, 1);
+		}
+		lua_call(state, 3, 1);
+		lua_pushliteral(state, "__index");
+		lua_insert(state, -2);
+		lua_rawset(state, meta);
+		lua_pushvalue(state, meta);
+		lua_setfield(state, LUA_REGISTRYINDEX, "_sushi_lazy_metatable");
+		lua_pushvalue(state, pending);
+		lua_setfield(state, LUA_REGISTRYINDEX, "_sushi_lazy_globals");
+		lua_settop(state, pending);
+	}
+	lua_pushvalue(state, -2);
+	lua_setfield(state, -2, name);
+	lua_pop(state, 2);
+	lua_pushstring(state, name);
+	lua_pushnil(state);
+	lua_rawset(state, LUA_GLOBALSINDEX);
+}
+
+void sushi_resolve_lazy_globals(lua_State* state)
+{
+	lua_getfield(state, LUA_REGISTRYINDEX, "_sushi_lazy_globals");
+	if(lua_istable(state, -1) == 0) {
+		lua_pop(state, 1);
+		return;
+	}
+	int pending = lua_gettop(state);
+	lua_pushnil(state);
+	while(lua_next(state, pending) != 0) {
+		lua_pop(state, 1);
+		int key = lua_gettop(state);
+		sushi_lazy_global_produce(state, pending, key);
+		lua_settop(state, pending);
+		lua_pushnil(state);
+	}
+	lua_pop(state, 1);
+	sushi_lazy_globals_uninstall(state);
+}
+
+static int sushi_code_source_gc(lua_State* state)
+{
+	SushiCodeSource* source = (SushiCodeSource*)lua_touserdata(state, 1);
+	if(source != NULL && source->mapping != NULL) {
+		sushi_code_unmap(source->mapping, source->mappingSize);
+		source->mapping = NULL;
+		source->data = NULL;
+	}
+	return 0;
+}
+
+// Inflates compressed code on the first read of _code; the view then owns
+// the inflated copy.
+static int sushi_code_view_produce(SushiMappedView* view)
+{
+	SushiCodeSource* source = (SushiCodeSource*)view->owner;
+	if(source == NULL || source->data == NULL || source->size < 4) {
+		return 0;
+	}
+	unsigned char* codep = NULL;
+	unsigned long codeplen = 0;
+	if(source->format == SUSHI_CODE_DEFLATE) {
+		if(zbuf_inflate((unsigned char*)source->data+4, source->size-4, &codep, &codeplen) == 0) {
+			codep = NULL;
+		}
+	}
+	else if(source->format == SUSHI_CODE_LZ4) {
+		long lzlen = 0;
+		if(lz4_frame_decompress(source->data+4, source->size-4, &codep, &lzlen) == 0) {
+			codep = NULL;
+		}
+		codeplen = (unsigned long)lzlen;
+	}
+	if(codep == NULL) {
+		return 0;
+	}
+	view->data = codep;
+	view->size = (long)codeplen;
+	view->owner = codep;
+	view->release = free;
+	return 1;
+}
+
+static SushiCodeSource* sushi_push_code_source(lua_State* state, SushiCode* code, int format)
+{
+	SushiCodeSource* source;
+	if(code->mapping != NULL) {
+		source = (SushiCodeSource*)lua_newuserdata(state, sizeof(SushiCodeSource));
+		source->data = code->data;
+		source->mapping = code->mapping;
+		source->mappingSize = code->mappingSize;
+		code->data = NULL;
+		code->mapping = NULL;
+		code->mappingSize = 0;
+	}
+	else {
+		source = (SushiCodeSource*)lua_newuserdata(state, sizeof(SushiCodeSource) + (size_t)code->dataSize);
+		memcpy(source + 1, code->data, code->dataSize);
+		source->data = (const unsigned char*)(source + 1);
+		source->mapping = NULL;
+		source->mappingSize = 0;
+	}
+	source->size = code->dataSize;
+	source->format = format;
+	lua_newtable(state);
+	lua_pushcfunction(state, sushi_code_source_gc);
+	lua_setfield(state, -2, "__gc");
+	lua_setmetatable(state, -2);
+	return source;
+}
+
+// Sets _code to a view of the source, which is kept for the lifetime of the
+// state. Plain code is viewed in place; compressed code is inflated only
+// when _code is first read.
+static void sushi_set_code_global(lua_State* state, int sourceIndex)
+{
+	SushiCodeSource* source = (SushiCodeSource*)lua_touserdata(state, sourceIndex);
+	lua_getfield(state, LUA_REGISTRYINDEX, "_sushi_code_sources");
+	if(lua_istable(state, -1) == 0) {
+		lua_pop(state, 1);
+		lua_newtable(state);
+		lua_pushvalue(state, -1);
+		lua_setfield(state, LUA_REGISTRYINDEX, "_sushi_code_sources");
+	}
+	lua_pushvalue(state, sourceIndex);
+	lua_rawseti(state, -2, (int)lua_objlen(state, -2) + 1);
+	lua_pop(state, 1);
+	if(source->format == SUSHI_CODE_RAW) {
+		lib_util_push_mapped_view(state, source->data, (long)source->size, NULL, NULL);
+	}
+	else {
+		lib_util_push_produced_view(state, sushi_code_view_produce, NULL, source);
+	}
+	lua_setglobal(state, "_code");
+}
+
+static const char* sushi_code_inflate_reader(lua_State* state, void* data, size_t* size)
+{
+	SushiCodeReader* reader = (SushiCodeReader*)data;
+	unsigned char* out = NULL;
+	double t0 = timing_now();
+	zbuf_stream_consume_output(reader->stream, reader->pending);
+	reader->pending = 0;
+	while(reader->failed == 0 && zbuf_stream_get_output(reader->stream, &out) < 1 && reader->pos < reader->srclen) {
+		unsigned long n = reader->srclen - reader->pos;
+		if(n > SUSHI_CODE_READ_CHUNK) {
+			n = SUSHI_CODE_READ_CHUNK;
+		}
+		int mode = reader->pos + n == reader->srclen ? ZBUF_FINISH : ZBUF_FEED;
+		if(zbuf_stream_process(reader->stream, reader->src + reader->pos, n, mode) == 0) {
+			reader->failed = 1;
+		}
+		reader->pos += n;
+	}
+	reader->inflateTime += timing_now() - t0;
+	if(reader->failed) {
+		*size = 0;
+		return NULL;
+	}
+	reader->pending = zbuf_stream_get_output(reader->stream, &out);
+	if(reader->first < 0 && reader->pending > 0) {
+		reader->first = out[0];
+	}
+	*size = (size_t)reader->pending;
+	return reader->pending > 0 ? (const char*)out : NULL;
+}
+
+// Inflates deflate packed code straight into the parser in small chunks, so
+// that the unpacked program never exists in memory as a whole.
+static int sushi_load_deflated(lua_State* state, const unsigned char* src, unsigned long srclen, const char* fileName, int* isSource)
+{
+	SushiCodeReader reader;
+	memset(&reader, 0, sizeof(SushiCodeReader));
+	reader.stream = zbuf_stream_create_inflate(ZBUF_FORMAT_ZLIB);
+	if(reader.stream == NULL) {
+		lua_pushstring(state, "Failed to initialize decompression");
+		return -1;
+	}
+	reader.src = src;
+	reader.srclen = srclen;
+	reader.first = -1;
+	double t0 = timing_now();
+	int r = lua_load(state, sushi_code_inflate_reader, &reader, fileName);
+	// The parser pulls inflated data as it goes; the two are told apart by
+	// the time spent inside the reader.
+	timing_record("inflate", reader.inflateTime);
+	timing_record("parse", timing_now() - t0 - reader.inflateTime);
+	zbuf_stream_free(reader.stream);
+	if(reader.failed || reader.first < 0) {
+		lua_pop(state, 1);
+		lua_pushstring(state, "Corrupted compressed code");
+		return -1;
+	}
+	*isSource = reader.first != LUA_SIGNATURE[0];
+	return r;
+}
+
+// Loads one chunk of code. The stored bytes (as found in the program file
+// or archive) are the bytecode cache key; payload is what is unpacked.
+static int sushi_load_chunk(lua_State* state, const unsigned char* stored, unsigned long storedlen, const unsigned char* payload, unsigned long payloadlen, int format, const char* chunkName, int cacheBytecode)
+{
+	// Code that this process has already compiled (typically for another
+	// interpreter state) is loaded from the in-process code cache
+	double t0 = timing_now();
+	int pr = codecache_load(state, stored, storedlen, chunkName, format);
+	timing_add("code_cache_load", t0);
+	if(pr == 0) {
+		return 0;
+	}
+	// Programs that are not precompiled bytecode are loaded through the
+	// bytecode cache in the profile directory when possible. The cache is
+	// keyed on the code as stored, so a hit skips unpacking altogether.
+	// Code generated at run time is never cached, as it would only pile up.
+	int cacheable = bytecode_cache_enabled && cacheBytecode && (format != SUSHI_CODE_RAW || (payloadlen > 0 && payload[0] != LUA_SIGNATURE[0]));
+	if(cacheable) {
+		double t0 = timing_now();
+		int cr = bccache_load(state, profile_directory, stored, storedlen, chunkName);
+		timing_add("bytecode_cache_load", t0);
+		if(cr == 0) {
+			codecache_store(state, stored, storedlen, chunkName, format);
+			return 0;
+		}
+	}
+	int isSource = 1;
+	int lbr;
+	if(format == SUSHI_CODE_DEFLATE) {
+		lbr = sushi_load_deflated(state, payload, payloadlen, chunkName, &isSource);
+	}
+	else if(format == SUSHI_CODE_LZ4) {
+		unsigned char* lzp = NULL;
+		long lzlen = 0;
+		double t0 = timing_now();
+		int dr = lz4_frame_decompress(payload, payloadlen, &lzp, &lzlen);
+		timing_add("inflate", t0);
+		if(dr == 0 || lzlen < 1) {
+			lua_pushstring(state, "Corrupted compressed code");
+			return -1;
+		}
+		isSource = lzp[0] != LUA_SIGNATURE[0];
+		t0 = timing_now();
+		lbr = luaL_loadbuffer(state, (const char*)lzp, (size_t)lzlen, chunkName);
+		timing_add("parse", t0);
+		free(lzp);
+	}
+	else {
+		double t0 = timing_now();
+		lbr = luaL_loadbuffer(state, (const char*)payload, payloadlen, chunkName);
+		timing_add("parse", t0);
+	}
+	if(lbr == 0 && cacheable && isSource) {
+		double t0 = timing_now();
+		bccache_store(state, profile_directory, stored, storedlen, chunkName);
+		timing_add("bytecode_cache_store", t0);
+	}
+	if(lbr == 0 && isSource) {
+		codecache_store(state, stored, storedlen, chunkName, format);
+	}
+	return lbr;
+}
+
+typedef struct SushiArchive
+{
+	long count;
+	SappEntry* entries;
+	const char* fileName;
+	int cacheBytecode;
+} SushiArchive;
+
+static int sushi_archive_index(lua_State* state);
+
+static void sushi_archive_push_resolver(lua_State* state, lua_CFunction func, int nameIndex, const char* suffix)
+{
+	lua_pushvalue(state, lua_upvalueindex(1));
+	lua_pushvalue(state, lua_upvalueindex(2));
+	lua_pushvalue(state, lua_upvalueindex(3));
+	lua_pushvalue(state, nameIndex);
+	lua_pushstring(state, suffix);
+	lua_concat(state, 2);
+	lua_pushcclosure(state, func, 4);
+}
+
+static void sushi_archive_resolve(lua_State* state, int parent, int key, int nameIndex);
+
+// Makes the table on top of the stack resolve its members from the archive.
+// A table that already resolves members on its own gets its archive members
+// loaded right away instead.
+static void sushi_archive_attach_namespace(lua_State* state, int nameIndex)
+{
+	int value = lua_gettop(state);
+	if(lua_getmetatable(state, value) == 0) {
+		lua_newtable(state);
+		lua_pushvalue(state, -1);
+		lua_setmetatable(state, value);
+	}
+	lua_getfield(state, -1, "__index");
+	if(lua_isnil(state, -1)) {
+		lua_pop(state, 1);
+		sushi_archive_push_resolver(state, sushi_archive_index, nameIndex, ".");
+		lua_setfield(state, -2, "__index");
+		lua_pop(state, 1);
+		return;
+	}
+	lua_pop(state, 2);
+	size_t plen = 0;
+	const char* prefix = lua_tolstring(state, nameIndex, &plen);
+	lua_pushnil(state);
+	while(lua_next(state, lua_upvalueindex(3)) != 0) {
+		size_t len = 0;
+		const char* name = lua_type(state, -2) == LUA_TSTRING ? lua_tolstring(state, -2, &len) : NULL;
+		lua_pop(state, 1);
+		if(name == NULL || len <= plen + 1 || memcmp(name, prefix, plen) != 0 || name[plen] != '.' || memchr(name + plen + 1, '.', len - plen - 1) != NULL) {
+			continue;
+		}
+		lua_pushlstring(state, name + plen + 1, len - plen - 1);
+		lua_pushvalue(state, -2);
+		sushi_archive_resolve(state, value, lua_gettop(state) - 1, lua_gettop(state));
+		lua_remove(state, -2);
+		lua_rawset(state, value);
+	}
+}
+
+// Pushes the value of the archive member whose full name is at nameIndex,
+// running its chunk (once) if there is one. Upvalues: archive, code source
+// and the table of member names.
+static void sushi_archive_resolve(lua_State* state, int parent, int key, int nameIndex)
+{
+	SushiArchive* archive = (SushiArchive*)lua_touserdata(state, lua_upvalueindex(1));
+	lua_pushvalue(state, nameIndex);
+	lua_rawget(state, lua_upvalueindex(3));
+	if(lua_isnumber(state, -1)) {
+		long index = (long)lua_tonumber(state, -1);
+		lua_pop(state, 1);
+		lua_pushvalue(state, nameIndex);
+		lua_pushboolean(state, 0);
+		lua_rawset(state, lua_upvalueindex(3));
+		SappEntry* entry = &archive->entries[index];
+		lua_pushstring(state, archive->fileName);
+		lua_pushliteral(state, ":");
+		lua_pushvalue(state, nameIndex);
+		lua_concat(state, 3);
+		int format = (entry->flags & SAPP_FLAG_DEFLATE) ? SUSHI_CODE_DEFLATE : SUSHI_CODE_RAW;
+		if(sushi_load_chunk(state, entry->data, (unsigned long)entry->size, entry->data, (unsigned long)entry->size, format, lua_tostring(state, -1), archive->cacheBytecode) != 0) {
+			lua_error(state);
+		}
+		lua_remove(state, -2);
+		lua_call(state, 0, 1);
+		if(lua_isnil(state, -1)) {
+			lua_pop(state, 1);
+			lua_pushvalue(state, key);
+			lua_rawget(state, parent);
+		}
+	}
+	else {
+		lua_pop(state, 1);
+		lua_pushnil(state);
+	}
+	lua_pushvalue(state, nameIndex);
+	lua_pushliteral(state, ".");
+	lua_concat(state, 2);
+	lua_rawget(state, lua_upvalueindex(3));
+	int isNamespace = lua_toboolean(state, -1);
+	lua_pop(state, 1);
+	if(isNamespace == 0) {
+		return;
+	}
+	if(lua_isnil(state, -1)) {
+		lua_pop(state, 1);
+		lua_newtable(state);
+	}
+	if(lua_istable(state, -1)) {
+		sushi_archive_attach_namespace(state, nameIndex);
+	}
+}
+
+static int sushi_archive_global(lua_State* state)
+{
+	sushi_archive_resolve(state, LUA_GLOBALSINDEX, lua_upvalueindex(4), lua_upvalueindex(4));
+	return 1;
+}
+
+static int sushi_archive_index(lua_State* state)
+{
+	if(lua_type(state, 2) != LUA_TSTRING) {
+		lua_pushnil(state);
+		return 1;
+	}
+	lua_pushvalue(state, lua_upvalueindex(4));
+	lua_pushvalue(state, 2);
+	lua_concat(state, 2);
+	sushi_archive_resolve(state, 1, 2, 3);
+	if(lua_isnil(state, -1) == 0) {
+		lua_pushvalue(state, 2);
+		lua_pushvalue(state, -2);
+		lua_rawset(state, 1);
+	}
+	return 1;
+}
+
+static int sushi_archive_gc(lua_State* state)
+{
+	SushiArchive* archive = (SushiArchive*)lua_touserdata(state, 1);
+	if(archive != NULL && archive->entries != NULL) {
+		free(archive->entries);
+		archive->entries = NULL;
+	}
+	return 0;
+}
+
+// Loads a packed program archive: the unnamed chunk is loaded as the program
+// and every top level name in the archive becomes a lazy global.
+static int sushi_load_archive(lua_State* state, SushiCode* code, const char* fileName)
+{
+	int top = lua_gettop(state);
+	SushiCodeSource* source = sushi_push_code_source(state, code, SUSHI_CODE_RAW);
+	long count = 0;
+	SappEntry* entries = sapp_read_index(source->data, source->size, &count);
+	if(entries == NULL) {
+		lua_settop(state, top);
+		sushi_error("`%s': `Corrupted program archive'", fileName);
+		return -1;
+	}
+	SushiArchive* archive = (SushiArchive*)lua_newuserdata(state, sizeof(SushiArchive) + strlen(fileName) + 1);
+	archive->count = count;
+	archive->entries = entries;
+	archive->fileName = (const char*)(archive + 1);
+	archive->cacheBytecode = code->cacheBytecode;
+	strcpy((char*)(archive + 1), fileName);
+	lua_newtable(state);
+	lua_pushcfunction(state, sushi_archive_gc);
+	lua_setfield(state, -2, "__gc");
+	lua_setmetatable(state, -2);
+	lua_newtable(state);
+	int names = lua_gettop(state);
+	long program = -1;
+	long n;
+	for(n=0; n<count; n++) {
+		const char* name = entries[n].name;
+		long len = entries[n].namelen;
+		if(len == 0) {
+			program = n;
+			continue;
+		}
+		lua_pushlstring(state, name, len);
+		lua_pushnumber(state, n);
+		lua_rawset(state, names);
+		long i;
+		for(i=0; i<len; i++) {
+			if(name[i] == '.') {
+				lua_pushlstring(state, name, i + 1);
+				lua_pushboolean(state, 1);
+				lua_rawset(state, names);
+			}
+		}
+	}
+	if(program < 0) {
+		lua_settop(state, top);
+		sushi_error("`%s': `Program archive has no program chunk'", fileName);
+		return -1;
+	}
+	lua_newtable(state);
+	int seen = lua_gettop(state);
+	for(n=0; n<count; n++) {
+		const char* name = entries[n].name;
+		const char* dot = memchr(name, '.', entries[n].namelen);
+		long len = dot != NULL ? dot - name : entries[n].namelen;
+		if(len < 1) {
+			continue;
+		}
+		lua_pushlstring(state, name, len);
+		lua_pushvalue(state, -1);
+		lua_rawget(state, seen);
+		int defined = lua_toboolean(state, -1);
+		lua_pop(state, 1);
+		if(defined == 0) {
+			lua_pushvalue(state, -1);
+			lua_rawget(state, LUA_GLOBALSINDEX);
+			defined = lua_isnil(state, -1) == 0;
+			lua_pop(state, 1);
+		}
+		if(defined) {
+			lua_pop(state, 1);
+			continue;
+		}
+		lua_pushvalue(state, -1);
+		lua_pushboolean(state, 1);
+		lua_rawset(state, seen);
+		lua_pushvalue(state, top + 2);
+		lua_insert(state, -2);
+		lua_pushvalue(state, top + 1);
+		lua_insert(state, -2);
+		lua_pushvalue(state, names);
+		lua_insert(state, -2);
+		const char* global = lua_tostring(state, -1);
+		lua_pushcclosure(state, sushi_archive_global, 4);
+		sushi_set_lazy_global(state, global);
+	}
+	sushi_set_code_global(state, top + 1);
+	int lbr = sushi_load_chunk(state, entries[program].data, (unsigned long)entries[program].size, entries[program].data, (unsigned long)entries[program].size, (entries[program].flags & SAPP_FLAG_DEFLATE) ? SUSHI_CODE_DEFLATE : SUSHI_CODE_RAW, fileName, code->cacheBytecode);
+	if(lbr != 0) {
+		const char* error = sushi_error_to_string(state);
+		sushi_error("`%s': `%s'", fileName, error != NULL ? error : "Failed while processing code data");
+		lua_settop(state, top);
+		return -1;
+	}
+	lua_replace(state, top + 1);
+	lua_settop(state, top + 1);
+	lua_pushstring(state, fileName);
+	lua_setglobal(state, "_program");
+	return 0;
+}
+
 int sushi_load_code(lua_State* state, SushiCode* code)
 {
 	if(code == NULL) {
 		return -1;
 	}
-	int freecode = 0;
 	unsigned char* codep = code->data;
 	unsigned long codeplen = code->dataSize;
 	if(codep == NULL || codeplen < 4) {
@@ -464,26 +1410,18 @@ int sushi_load_code(lua_State* state, SushiCode* code)
 	if(fileName == NULL) {
 		fileName = "__code__";
 	}
-	if(codep[0] == 0x00 && codep[1] == 0x64 && codep[2] == 0x65 && codep[3] == 0x66) {
-		zbuf_inflate(codep+4, codeplen-4, &codep, &codeplen);
-		if(codep == NULL || codeplen < 1) {
-			return -1;
-		}
-		freecode = 1;
+	if(sapp_is_archive(codep, codeplen)) {
+		return sushi_load_archive(state, code, fileName);
 	}
-	int lbr = luaL_loadbuffer(state, (const char*)codep, codeplen, fileName);
-	if(lbr == 0) {
-		void* ptr = lua_newuserdata(state, sizeof(long) + (size_t)codeplen);
-		luaL_getmetatable(state, "_sushi_buffer");
-		lua_setmetatable(state, -2);
-		memcpy(ptr, &codeplen, sizeof(long));
-		memcpy(ptr + sizeof(long), codep, codeplen);
-		lua_setglobal(state, "_code");
+	int format = SUSHI_CODE_RAW;
+	if(codep[0] == 0x00 && codep[1] == 0x64 && codep[2] == 0x65 && codep[3] == 0x66) {
+		format = SUSHI_CODE_DEFLATE;
 	}
-	if(freecode) {
-		free(codep);
-		codep = NULL;
+	else if(codep[0] == 0x00 && codep[1] == 0x6c && codep[2] == 0x7a && codep[3] == 0x34) {
+		format = SUSHI_CODE_LZ4;
 	}
+	int skip = format == SUSHI_CODE_RAW ? 0 : 4;
+	int lbr = sushi_load_chunk(state, codep, codeplen, codep + skip, codeplen - skip, format, fileName, code->cacheBytecode);
 	if(lbr != 0) {
 		const char* error = sushi_error_to_string(state);
 		if(error == NULL || *error == 0) {
@@ -492,6 +1430,9 @@ int sushi_load_code(lua_State* state, SushiCode* code)
 		sushi_error("`%s': `%s'", fileName, error);
 		return -1;
 	}
+	sushi_push_code_source(state, code, format);
+	sushi_set_code_global(state, lua_gettop(state));
+	lua_pop(state, 1);
 	lua_pushstring(state, fileName);
 	lua_setglobal(state, "_program");
 	return 0;
@@ -499,13 +1440,18 @@ int sushi_load_code(lua_State* state, SushiCode* code)
 
 int sushi_execute_program(lua_State* state, SushiCode* code)
 {
-	struct timeval time1, time2, time3;
 	// NOTE: Arguments to the program are supplied via the global _args parameter
 	// that needs to be set prior to calling this function.
-	if(sushi_load_code(state, code) != 0) {
+	double t0 = timing_now();
+	int lr = sushi_load_code(state, code);
+	timing_add("load_code", t0);
+	if(lr != 0) {
 		return -1;
 	}
-	if(sushi_pcall(state, 0, 1) != LUA_OK) {
+	t0 = timing_now();
+	int pr = sushi_pcall(state, 0, 1);
+	timing_add("top_level_chunk", t0);
+	if(pr != LUA_OK) {
 		const char* errstr = sushi_error_to_string(state);
 		if(errstr != NULL) {
 			sushi_error("Execution failed: `%s'", errstr);
@@ -517,17 +1463,33 @@ int sushi_execute_program(lua_State* state, SushiCode* code)
 	}
 	int rv = lua_tonumber(state, lua_gettop(state));
 	lua_getglobal(state, "_main");
-	if(lua_isnil(state, lua_gettop(state)) == 0) {
-		lua_getglobal(state, "_args");
-		if(sushi_pcall(state, 1, 1) != LUA_OK) {
-			sushi_error("Error while executing the program: `%s'", sushi_error_to_string(state));
-			return -1;
-		}
-		rv = lua_tonumber(state, lua_gettop(state));
+	int hasMain = lua_isnil(state, lua_gettop(state)) == 0;
+	lua_pop(state, 1);
+	if(hasMain) {
+		rv = sushi_execute_main(state);
 	}
 	return rv;
 }
 
+int sushi_execute_main(lua_State* state)
+{
+	lua_getglobal(state, "_main");
+	if(lua_isnil(state, lua_gettop(state))) {
+		lua_pop(state, 1);
+		sushi_error("The program does not define a _main function.");
+		return -1;
+	}
+	lua_getglobal(state, "_args");
+	double t0 = timing_now();
+	int pr = sushi_pcall(state, 1, 1);
+	timing_add("main", t0);
+	if(pr != LUA_OK) {
+		sushi_error("Error while executing the program: `%s'", sushi_error_to_string(state));
+		return -1;
+	}
+	return lua_tonumber(state, lua_gettop(state));
+}
+
 static void _profiler_callback(void* data, lua_State* state, int samples, int vmstate)
 {
 	FILE* profilerFile = (FILE*)data;
@@ -30,25 +30,52 @@
 #include "lauxlib.h"
 #include "luajit.h"
 
+// When mapping is set, data points into a read-only file mapping that is
+// owned by the code object. sushi_load_code takes over such a mapping (to
+// serve the _code global later) and clears data and mapping in the code.
+// Only code with cacheBytecode set (programs read from a file or from the
+// executable) goes through the on-disk bytecode cache.
 typedef struct
 {
 	unsigned char* data;
 	unsigned long dataSize;
 	char* fileName;
+	void* mapping;
+	unsigned long mappingSize;
+	int cacheBytecode;
 }
 SushiCode;
 
+// Options for new interpreter states. A NULL terminated list of library
+// names limits the state to those libraries. A memory limit of zero means
+// the default limit (see sushi_set_default_memory_limit), and a non-zero
+// arena size backs the state with an arena of that size.
+typedef struct
+{
+	const char** libraries;
+	unsigned long memoryLimit;
+	unsigned long arenaSize;
+	int hugePages;
+}
+SushiStateOptions;
+
 void sushi_init_libraries();
 const char* sushi_get_profile_directory();
 void sushi_set_profile_directory(const char* dir);
+void sushi_set_bytecode_cache_enabled(int enabled);
 int sushi_pcall(lua_State* state, int nargs, int nret);
 void sushi_getglobal(lua_State* state, const char* name);
+void sushi_set_lazy_global(lua_State* state, const char* name);
+void sushi_resolve_lazy_globals(lua_State* state);
 const char* sushi_error_to_string(lua_State* state);
 void sushi_error(const char* fmt, ...);
 int sushi_get_error_count();
 int sushi_has_errors();
 int sushi_print_stacktrace(lua_State* state);
 lua_State* sushi_create_new_state();
+lua_State* sushi_create_new_state_with_libraries(const char** names);
+lua_State* sushi_create_new_state_with_options(const SushiStateOptions* options);
+void sushi_set_default_memory_limit(unsigned long limit);
 void sushi_set_executable_path(const char* path);
 const char* sushi_get_executable_path();
 char* sushi_get_real_path(const char* path);\
@@ -59,6 +86,7 @@ SushiCode* sushi_code_read_from_executable(const char* path);
 SushiCode* sushi_code_free(SushiCode* code);
 int sushi_load_code(lua_State* state, SushiCode* code);
 int sushi_execute_program(lua_State* state, SushiCode* code);
+int sushi_execute_main(lua_State* state);
 void* sushi_profiler_start(lua_State* state, const char* outputFile);
 void* sushi_profiler_stop(lua_State* state, void* profiler);
 
@@ -16,6 +16,18 @@ function info(message)
 	_io:write_to_stdout("[INFO:" .. thistest .. "] " .. message .. "\n")
 end
 
+function get_temporary_directory()
+	if temporary_directory == nil then
+		local base = _os:get_environment_variable("TMPDIR")
+		if base == nil or base == "" then
+			base = "/tmp"
+		end
+		temporary_directory = base .. "/sushi-test-" .. _os:get_system_time_milliseconds()
+		_io:create_directory(temporary_directory)
+	end
+	return temporary_directory
+end
+
 function execute(name, test)
 	thistest = name
 	local r = test()
@@ -62,6 +74,682 @@ function test_zlib()
 	return true
 end
 
+function test_zlib_stream()
+	local chunk = _util:convert_string_to_buffer("streaming compression chunk 0123456789 ")
+	local deflater = _util:create_deflate_stream(2, 9, 0)
+	local compressed = _util:allocate_buffer(65536)
+	local size = 0
+	for i = 1, 1000 do
+		local n = _util:feed_compression_stream(deflater, chunk, -1, compressed, size)
+		if n == nil then
+			error("feed_compression_stream failed")
+			return false
+		end
+		size = size + n
+	end
+	size = size + _util:finish_compression_stream(deflater, nil, 0, compressed, size)
+	_util:close_compression_stream(deflater)
+	if _util:get_buffer_byte(compressed, 0) ~= 31 or _util:get_buffer_byte(compressed, 1) ~= 139 then
+		error("deflate stream did not produce gzip framing")
+		return false
+	end
+	local inflater = _util:create_inflate_stream(3)
+	local window = _util:allocate_buffer(1000)
+	local total = 0
+	local n = _util:finish_compression_stream(inflater, compressed, size, window, 0)
+	while n ~= nil and n > 0 do
+		total = total + n
+		n = _util:finish_compression_stream(inflater, nil, 0, window, 0)
+	end
+	if n == nil or total ~= 1000 * _util:get_buffer_size(chunk) then
+		error("inflate stream restored " .. total .. " bytes")
+		return false
+	end
+	local truncated = _util:create_inflate_stream(0)
+	if _util:finish_compression_stream(truncated, _util:deflate(chunk), 10) ~= nil then
+		error("inflate stream accepted truncated input")
+		return false
+	end
+	local trailing = _util:convert_string_to_buffer(_util:convert_buffer_to_string(_util:deflate(chunk)) .. "junk")
+	if _util:finish_compression_stream(_util:create_inflate_stream(0), trailing) ~= nil then
+		error("inflate stream ignored data after the end of the stream")
+		return false
+	end
+	return true
+end
+
+function test_zlib_parallel()
+	local size = 1000000
+	local original = _util:allocate_buffer(size)
+	for i = 0, size - 1 do
+		_util:set_buffer_byte(original, i, 97 + (i * 7 + _math:floor(i / 1000)) % 26)
+	end
+	local zlibbed = _util:deflate_parallel(original, 4)
+	local restored = _util:inflate(zlibbed)
+	if restored == nil or _util:get_buffer_size(restored) ~= size or _util:convert_buffer_to_string(restored) ~= _util:convert_buffer_to_string(original) then
+		error("deflate_parallel output did not inflate to the original")
+		return false
+	end
+	local gzipped = _util:deflate_parallel(original, 3, 2, 9)
+	local inflater = _util:create_inflate_stream(2)
+	restored = _util:finish_compression_stream(inflater, gzipped)
+	if restored == nil or _util:convert_buffer_to_string(restored) ~= _util:convert_buffer_to_string(original) then
+		error("deflate_parallel gzip output did not inflate to the original")
+		return false
+	end
+	for format = 0, 2 do
+		local empty = _util:deflate_parallel(_util:convert_string_to_buffer(""), 2, format)
+		restored = empty and _util:finish_compression_stream(_util:create_inflate_stream(format), empty)
+		if restored == nil or _util:get_buffer_size(restored) ~= 0 then
+			error("deflate_parallel of empty input did not give a valid stream in format " .. format)
+			return false
+		end
+	end
+	info("parallel compressed_size: " .. _util:get_buffer_size(zlibbed))
+	return true
+end
+
+function test_lz4()
+	local size = 200000
+	local original = _util:allocate_buffer(size)
+	for i = 0, size - 1 do
+		_util:set_buffer_byte(original, i, 97 + (i * 7 + _math:floor(i / 1000)) % 26)
+	end
+	local frame = _util:lz4_compress(original)
+	if frame == nil or _util:get_buffer_size(frame) >= size then
+		error("lz4_compress did not compress")
+		return false
+	end
+	local restored = _util:lz4_decompress(frame)
+	if restored == nil or _util:convert_buffer_to_string(restored) ~= _util:convert_buffer_to_string(original) then
+		error("lz4_decompress did not restore the original")
+		return false
+	end
+	_util:set_buffer_byte(frame, 20, _util:get_buffer_byte(frame, 20) + 1)
+	if _util:lz4_decompress(frame) ~= nil then
+		error("lz4_decompress accepted a corrupted frame")
+		return false
+	end
+	local block = _util:lz4_compress_block(original)
+	restored = _util:lz4_decompress_block(block, size)
+	if restored == nil or _util:convert_buffer_to_string(restored) ~= _util:convert_buffer_to_string(original) then
+		error("lz4_decompress_block did not restore the original")
+		return false
+	end
+	local payload = _util:lz4_compress(_util:convert_string_to_buffer("return 1"))
+	local code = _util:allocate_buffer(4 + _util:get_buffer_size(payload))
+	_util:copy_buffer_bytes(_util:convert_string_to_buffer("\0lz4"), code, 0, 0, 4)
+	_util:copy_buffer_bytes(payload, code, 0, 4, _util:get_buffer_size(payload))
+	if _vm:prepare_interpreter(code) == nil then
+		error("lz4 compressed code could not be loaded")
+		return false
+	end
+	return true
+end
+
+function test_checksums()
+	if _util:crc32("123456789") ~= 3421780262 or _util:adler32("Wikipedia") ~= 300286872 then
+		error("checksum of a known vector was wrong")
+		return false
+	end
+	local size = 100000
+	local data = _util:allocate_buffer(size)
+	for i = 0, size - 1 do
+		_util:set_buffer_byte(data, i, (i * 31 + _math:floor(i / 7)) % 256)
+	end
+	local crc = _util:crc32(data, 0, 1000)
+	crc = _util:crc32(data, 1000, -1, crc)
+	local adler = _util:adler32(data, 0, 777)
+	adler = _util:adler32(data, 777, -1, adler)
+	if crc ~= _util:crc32(data) or adler ~= _util:adler32(data) then
+		error("incremental checksums did not match")
+		return false
+	end
+	return true
+end
+
+function test_zip_map()
+	local path = get_temporary_directory() .. "/zipmap.tmp"
+	local archive = _util:decode_hex("504b030414000000000000002150a265ef09070000000700000005000000732e74787473746f72656421504b03041400000008000000215007d66f900e000000b400000005000000642e7478744b494dcb492c494d5148193a0c00504b0102140314000000000000002150a265ef090700000007000000050000000000000000000000800100000000732e747874504b010214031400000008000000215007d66f900e000000b400000005000000000000000000000080012a000000642e747874504b05060000000002000200660000005b0000000000")
+	local fd = _io:open_file_for_writing(path)
+	_io:write_to_handle(fd, archive, _util:get_buffer_size(archive))
+	_io:close_handle(fd)
+	local map = _zip:map_open(path)
+	if map == nil or _zip:map_get_entry_count(map) ~= 2 or _zip:map_find_entry(map, "d.txt") ~= 1 or _zip:map_find_entry(map, "missing") ~= -1 then
+		error("map_open did not index the archive")
+		return false
+	end
+	local stored = _zip:map_read_entry(map, "s.txt")
+	if _util:is_mapped_view(stored) ~= true or _util:encode_hex(stored) ~= "73746f72656421" then
+		error("map_read_entry did not return a view of the stored entry")
+		return false
+	end
+	local expected = ""
+	for i = 1, 20 do
+		expected = expected .. "deflated "
+	end
+	local deflated = _zip:map_read_entry(map, 1)
+	if deflated == nil or _util:convert_buffer_to_string(deflated) ~= expected then
+		error("map_read_entry did not inflate the deflated entry")
+		return false
+	end
+	if _util:is_buffer(stored) ~= true or _util:get_buffer_size(stored) ~= 7 or #stored ~= 7 or stored[1] ~= 115 or _util:get_buffer_byte(stored, 6) ~= 33 then
+		error("buffer functions did not accept the mapped view")
+		return false
+	end
+	local copy = _util:allocate_buffer(3)
+	_util:copy_buffer_bytes(stored, copy, 2, 0, 3)
+	if _util:convert_buffer_to_string(copy) ~= "ore" or _util:convert_buffer_to_string(_util:inflate(_util:deflate(stored))) ~= "stored!" then
+		error("buffer functions did not read the mapped view")
+		return false
+	end
+	_zip:map_close(map)
+	if _util:get_mapped_view_size(stored) ~= 7 or _util:convert_buffer_to_string(_util:convert_mapped_view_to_buffer(stored)) ~= "stored!" then
+		error("mapped view did not outlive map_close")
+		return false
+	end
+	_io:remove_file(path)
+	return true
+end
+
+function test_zip_batch()
+	local path = get_temporary_directory() .. "/zipbatch.tmp"
+	local source = get_temporary_directory() .. "/zipbatch.src.tmp"
+	local text = _util:convert_string_to_buffer("file contents from disk")
+	local fd = _io:open_file_for_writing(source)
+	_io:write_to_handle(fd, text, _util:get_buffer_size(text))
+	_io:close_handle(fd)
+	local size = 300000
+	local data = _util:allocate_buffer(size)
+	for i = 0, size - 1 do
+		_util:set_buffer_byte(data, i, 97 + (i * 7 + _math:floor(i / 1000)) % 26)
+	end
+	local entries = {
+		{ name = "a/data.bin", data = data, level = 9 },
+		{ name = "a/file.txt", path = source },
+		{ name = "b/stored.bin", data = data, level = 0, mode = 33261, timestamp = 1600000000 },
+		{ name = "b/string.txt", data = "from a string" }
+	}
+	if _zip:write_archive(path, entries, 3) ~= true then
+		error("write_archive failed")
+		return false
+	end
+	local map = _zip:map_open(path)
+	if map == nil or _zip:map_get_entry_count(map) ~= 4 then
+		error("write_archive did not produce a readable archive")
+		return false
+	end
+	local name, csize, usize, mode = _zip:map_get_entry_info(map, 0)
+	if name ~= "a/data.bin" or usize ~= size or csize >= size then
+		error("write_archive did not compress the first entry")
+		return false
+	end
+	name, csize, usize, mode = _zip:map_get_entry_info(map, 2)
+	if csize ~= size or mode ~= 33261 or _util:is_mapped_view(_zip:map_read_entry(map, 2)) ~= true then
+		error("write_archive did not store the level 0 entry")
+		return false
+	end
+	local read = function(entry)
+		return _util:convert_buffer_to_string(_zip:map_read_entry(map, entry))
+	end
+	local original = _util:convert_buffer_to_string(data)
+	if read("a/data.bin") ~= original or read("b/stored.bin") ~= original or read("a/file.txt") ~= "file contents from disk" or read(3) ~= "from a string" then
+		error("write_archive entries did not read back")
+		return false
+	end
+	_zip:map_close(map)
+	if _zip:write_archive(path, { { name = "missing", path = source .. ".missing" } }) ~= false then
+		error("write_archive accepted a missing source file")
+		return false
+	end
+	if _zip:write_archive(path, { { name = 12, data = "numeric name" } }) ~= false then
+		error("write_archive accepted a non-string entry name")
+		return false
+	end
+	fd = _io:open_file_for_writing(source)
+	for i = 1, 4 do
+		_io:write_to_handle(fd, data, size)
+	end
+	_io:close_handle(fd)
+	entries = {
+		{ name = "large.bin", path = source },
+		{ name = "small.txt", data = "after the large entry" },
+		{ name = "large-stored.bin", path = source, level = 0 }
+	}
+	if _zip:write_archive(path, entries, 2) ~= true then
+		error("write_archive failed to stream a large file")
+		return false
+	end
+	map = _zip:map_open(path)
+	local large = original .. original .. original .. original
+	name, csize, usize = _zip:map_get_entry_info(map, 0)
+	if usize ~= size * 4 or csize >= usize or read(0) ~= large or read(1) ~= "after the large entry" or read(2) ~= large then
+		error("write_archive did not stream the large file entries")
+		return false
+	end
+	_zip:map_close(map)
+	_io:remove_file(source)
+	_io:remove_file(path)
+	return true
+end
+
+function test_timing_report()
+	local directory = get_temporary_directory()
+	local program = directory .. "/timed.lua"
+	local report = directory .. "/timing.json"
+	local fd = _io:open_file_for_writing(program)
+	_io:write_to_handle(fd, _util:convert_string_to_buffer("_vm:prepare_interpreter(_util:convert_string_to_buffer(\"x = 1\"))\nreturn 0\n"), -1)
+	_io:close_handle(fd)
+	local pid = _os:start_process(_vm:get_sushi_executable_path(), { program }, { "SUSHI_TIMING_OUTPUT=" .. report, "HOME=" .. directory })
+	if pid < 1 or _os:wait_for_process(pid) ~= 0 then
+		error("timed program did not run")
+		return false
+	end
+	local doc = _json:parse(_io:map_file(report))
+	_io:remove_file(report)
+	_io:remove_file(program)
+	if doc == nil or doc.version ~= _vm:get_sushi_version() or doc.total_us <= 0 then
+		error("timing report is not valid JSON")
+		return false
+	end
+	local counts = {}
+	for i = 1, #doc.phases do
+		counts[doc.phases[i].name] = doc.phases[i].count
+	end
+	if counts.create_state ~= 2 or counts.init_libraries ~= 1 or counts.load_code ~= 1 or counts.top_level_chunk ~= 1 then
+		error("timing report did not count the phases")
+		return false
+	end
+	return true
+end
+
+function test_zygote()
+	local directory = get_temporary_directory()
+	local program = directory .. "/served.lua"
+	local socket = directory .. "/zygote.sock"
+	local fd = _io:open_file_for_writing(program)
+	_io:write_to_handle(fd, _util:convert_string_to_buffer("function _main()\n"
+		.. "\tlocal input = _util:allocate_buffer(5)\n"
+		.. "\tif _io:read_from_handle(0, input) ~= 5 or _util:convert_buffer_to_string(input) ~= \"hello\" then return 1 end\n"
+		.. "\tif #_args ~= 2 or _args[1] ~= \"first\" or _args[2] ~= \"second\" then return 2 end\n"
+		.. "\tif _os:get_environment_variable(\"ZYGOTE_TEST\") ~= \"on\" then return 3 end\n"
+		.. "\treturn 42\n"
+		.. "end\n"), -1)
+	_io:close_handle(fd)
+	local exe = _vm:get_sushi_executable_path()
+	local server = _os:start_process(exe, { "-zygote", socket, program }, { "HOME=" .. directory })
+	local tries = 0
+	while _io:get_file_info(socket) == nil and tries < 250 do
+		_os:sleep_milliseconds(20)
+		tries = tries + 1
+	end
+	local pid, input, output, errors = _os:start_piped_process(exe, { "-connect", socket, "first", "second" }, { "ZYGOTE_TEST=on", "HOME=" .. directory })
+	_io:write_to_handle(input, _util:convert_string_to_buffer("hello"), 5)
+	_io:close_handle(input)
+	local rv = _os:wait_for_process(pid)
+	_io:close_handle(output)
+	_io:close_handle(errors)
+	_os:send_process_signal(server, 15)
+	_os:wait_for_process(server)
+	_io:remove_file(socket)
+	_io:remove_file(program)
+	if rv ~= 42 then
+		error("zygote request returned " .. rv)
+		return false
+	end
+	return true
+end
+
+function test_bytecode_cache()
+	local source = "local t = 0\n"
+	for i = 1, 1000 do
+		source = source .. "t = t + " .. i .. "\n"
+	end
+	-- the program also loads its own code as generated code, which must not
+	-- be cached
+	source = source .. "if _program ~= \"__code__\" and _vm:prepare_interpreter(_code) == nil then t = 0 end\n"
+	source = source .. "if t ~= 500500 then return 1 end\nreturn 0\n"
+	local directory = get_temporary_directory()
+	local program = directory .. "/cached.lua"
+	local profile = directory .. "/profile"
+	local fd = _io:open_file_for_writing(program)
+	_io:write_to_handle(fd, _util:convert_string_to_buffer(source), -1)
+	_io:close_handle(fd)
+	local environment = { "SUSHI_PROFILE_DIRECTORY=" .. profile, "HOME=" .. directory }
+	for run = 1, 2 do
+		local pid = _os:start_process(_vm:get_sushi_executable_path(), { program }, environment)
+		if pid < 1 or _os:wait_for_process(pid) ~= 0 then
+			error("cached program did not run")
+			return false
+		end
+	end
+	local files = {}
+	local dir = _io:open_directory(profile .. "/bytecode")
+	while dir ~= nil do
+		local name = _io:read_directory(dir)
+		if name == nil then
+			break
+		end
+		files[#files + 1] = name
+		_io:remove_file(profile .. "/bytecode/" .. name)
+	end
+	_io:remove_directory(profile .. "/bytecode")
+	_io:remove_directory(profile)
+	_io:remove_file(program)
+	if #files ~= 1 then
+		error("expected only the program in the bytecode cache, found " .. #files .. " files")
+		return false
+	end
+	return true
+end
+
+function test_lazy_code()
+	local prefix = "if _util:get_buffer_size(_code) ~= "
+	local suffix = " then error(\"wrong _code\") end\n"
+	local length = _util:get_buffer_size(_util:convert_string_to_buffer(prefix .. suffix)) + 2
+	local source = _util:convert_string_to_buffer(prefix .. length .. suffix)
+	if _vm:prepare_interpreter(source) == nil then
+		error("_code did not match the plain program")
+		return false
+	end
+	local plain = "local keys = _vm:get_table_keys(_g)\nlocal found = false\n"
+		.. "for i = 1, #keys do if keys[i] == \"_code\" then found = true end end\n"
+		.. "if found == false or _util:is_buffer(_code) ~= true or #_code < 1 then error(\"_code is not a plain global\") end\n"
+	if _vm:prepare_interpreter(_util:convert_string_to_buffer(plain)) == nil then
+		error("_code was not set as a plain global")
+		return false
+	end
+	local deflated = _util:deflate(source)
+	local code = _util:allocate_buffer(4 + _util:get_buffer_size(deflated))
+	_util:copy_buffer_bytes(_util:convert_string_to_buffer("\0def"), code, 0, 0, 4)
+	_util:copy_buffer_bytes(deflated, code, 0, 4, _util:get_buffer_size(deflated))
+	if _vm:prepare_interpreter(code) == nil then
+		error("_code did not match the deflated program")
+		return false
+	end
+	_util:set_buffer_byte(code, _util:get_buffer_size(code) - 3, 0)
+	if _vm:prepare_interpreter(code) ~= nil then
+		error("corrupted deflated program was loaded")
+		return false
+	end
+	return true
+end
+
+function test_program_archive()
+	local program = "if _loaded ~= 0 then error(\"eager load\") end\n"
+		.. "if app.Util.value ~= 1 or _loaded ~= 1 then error(\"app.Util\") end\n"
+		.. "if Top.x ~= 5 or _loaded ~= 2 then error(\"Top\") end\n"
+		.. "if app.sub.Thing.name ~= \"thing\" or _loaded ~= 3 then error(\"app.sub.Thing\") end\n"
+		.. "if app.Util.value ~= 1 or app.missing ~= nil or _loaded ~= 3 then error(\"reload\") end\n"
+	local archive = _vm:create_program_archive({
+		{ name = "", code = "_loaded = 0\n" .. program },
+		{ name = "app.Util", code = "_loaded = _loaded + 1 return { value = 1 }" },
+		{ name = "Top", code = "_loaded = _loaded + 1 Top = { x = 5 }", compress = true },
+		{ name = "app.sub.Thing", code = _util:convert_string_to_buffer("_loaded = _loaded + 1 return { name = \"thing\" }"), compress = true }
+	})
+	if archive == nil or _vm:prepare_interpreter(archive) == nil then
+		error("program archive did not load lazily")
+		return false
+	end
+	return true
+end
+
+function test_minimal_interpreter()
+	local probe = _util:convert_string_to_buffer("if _g._util == nil then error(\"_g._util\") end\n"
+		.. "if _util:get_buffer_size(_util:convert_string_to_buffer(\"abc\")) ~= 3 then error(\"_util\") end\n"
+		.. "if _json:encode(_json:parse(\"[]\")) ~= \"[]\" then error(\"_json\") end\n"
+		.. "if MINIMAL and (_io ~= nil or _net ~= nil or _zip ~= nil) then error(\"undeclared library\") end\n")
+	if _vm:prepare_interpreter(probe) == nil then
+		error("libraries were not loaded on demand")
+		return false
+	end
+	local minimal = _util:allocate_buffer(_util:get_buffer_size(probe) + 15)
+	_util:copy_buffer_bytes(_util:convert_string_to_buffer("MINIMAL = true\n"), minimal, 0, 0, 15)
+	_util:copy_buffer_bytes(probe, minimal, 0, 15, _util:get_buffer_size(probe))
+	if _vm:prepare_interpreter(minimal, { "_util", "_json" }) == nil then
+		error("minimal interpreter failed")
+		return false
+	end
+	if _vm:prepare_interpreter(minimal, { "_util", "_nonexistent" }) ~= nil then
+		error("unknown library was accepted")
+		return false
+	end
+	local strict = _util:convert_string_to_buffer("local keys, found = _vm:get_table_keys(_g), 0\n"
+		.. "for i = 1, #keys do if keys[i] == \"_io\" or keys[i] == \"_cbor\" then found = found + 1 end end\n"
+		.. "if found ~= 2 then error(\"libraries are not listed in _g\") end\n"
+		.. "_vm:set_metatable(_g, { __index = function() return nil end })\n"
+		.. "if _cbor:decode(_cbor:encode(5)) ~= 5 or _msgpack:decode(_msgpack:encode(6)) ~= 6 then error(\"_cbor\") end\n"
+		.. "if _io.get_file_info == nil then error(\"_io\") end\n")
+	if _vm:prepare_interpreter(strict) == nil then
+		error("libraries did not load under a user metatable on _g")
+		return false
+	end
+	return true
+end
+
+function test_memory_limits()
+	local stats = _vm:get_memory_statistics()
+	if stats == nil or stats.bytes < 1 or stats.allocations < stats.frees then
+		error("no statistics for the current interpreter")
+		return false
+	end
+	local grow = _util:convert_string_to_buffer("local t = {} for i = 1, 10000000 do t[i] = { i } end")
+	if _vm:prepare_interpreter(grow, nil, { memory_limit = 8 * 1024 * 1024 }) ~= nil then
+		error("memory limit was not enforced")
+		return false
+	end
+	local code = _util:convert_string_to_buffer("keep = {} for i = 1, 1000 do keep[i] = { i, \"v\" .. i } end")
+	local interpreter = _vm:prepare_interpreter(code, nil, { arena_size = 4 * 1024 * 1024 })
+	if interpreter == nil then
+		error("arena interpreter failed")
+		return false
+	end
+	stats = _vm:get_memory_statistics(interpreter)
+	if stats.arena_size < 4 * 1024 * 1024 or stats.arena_used < 1 or stats.peak_bytes < stats.bytes then
+		error("arena statistics were wrong")
+		return false
+	end
+	if _vm:set_memory_limit(stats.bytes * 2, interpreter) == false or _vm:get_memory_statistics(interpreter).limit ~= stats.bytes * 2 then
+		error("memory limit was not set")
+		return false
+	end
+	_vm:close_interpreter(interpreter)
+	return true
+end
+
+function test_embedded_resources()
+	local path = get_temporary_directory() .. "/embed.tmp"
+	local code = _util:convert_string_to_buffer("return 5")
+	local resources = _vm:create_program_archive({
+		{ name = "templates/page.html", code = "<html></html>" },
+		{ name = "config.json", code = "{\"compressed\": true, \"compressed\": true}", compress = true }
+	})
+	local prefix = _io:map_file(_vm:get_sushi_executable_path())
+	local fd = _io:open_file_for_writing(path)
+	_io:write_to_handle(fd, prefix, _util:get_buffer_size(prefix))
+	_io:close_handle(fd)
+	if _io:append_embedded_payload(path, code, resources) ~= true then
+		error("append_embedded_payload failed")
+		return false
+	end
+	_io:set_file_mode(path, 493)
+	local pid = _os:start_process(path, {}, {})
+	if pid == nil or _os:wait_for_process(pid) ~= 5 then
+		error("executable with an embedded payload did not run its code")
+		return false
+	end
+	local embed = _io:open_embedded_resources(path)
+	if embed == nil then
+		error("open_embedded_resources failed")
+		return false
+	end
+	local names = _io:get_embedded_resource_names(embed)
+	if #names ~= 2 or names[1] ~= "templates/page.html" or _io:read_embedded_resource(embed, "missing") ~= nil then
+		error("embedded resource index was wrong")
+		return false
+	end
+	local page = _io:read_embedded_resource(embed, "templates/page.html")
+	local config = _io:read_embedded_resource(embed, "config.json")
+	_io:close_embedded_resources(embed)
+	if _util:is_mapped_view(page) ~= true or _util:convert_buffer_to_string(_util:convert_mapped_view_to_buffer(page)) ~= "<html></html>" then
+		error("stored resource was not a view of the executable")
+		return false
+	end
+	if _util:convert_buffer_to_string(config) ~= "{\"compressed\": true, \"compressed\": true}" then
+		error("compressed resource did not unpack")
+		return false
+	end
+	_io:remove_file(path)
+	return true
+end
+
+function test_code_cache()
+	local code = _util:convert_string_to_buffer("counter = (counter or 0) + 1\n"
+		.. "function _main()\n"
+		.. "\tif counter ~= 1 or _args[1] ~= \"cached\" then return 1 end\n"
+		.. "\treturn 7\n"
+		.. "end\n")
+	local before = _vm:get_code_cache_statistics()
+	for i = 1, 4 do
+		if _vm:execute_program(code, "cached.lua", { "cached" }) ~= 7 then
+			error("program loaded through the code cache failed on run " .. i)
+			return false
+		end
+	end
+	-- the code is remembered on the first run, compiled into the cache on
+	-- the second and loaded from it on the other two
+	local after = _vm:get_code_cache_statistics()
+	if after.hits - before.hits < 2 or after.stores - before.stores < 1 or after.entries < 1 then
+		error("code cache was not hit: " .. (after.hits - before.hits) .. " hits, " .. (after.stores - before.stores) .. " stores")
+		return false
+	end
+	local broken = _util:convert_string_to_buffer("function _main( return 0 end")
+	for i = 1, 2 do
+		if _vm:prepare_interpreter(broken) ~= nil then
+			error("code with a syntax error was accepted on run " .. i)
+			return false
+		end
+	end
+	return true
+end
+
+function test_large_file()
+	local path = get_temporary_directory() .. "/large.tmp"
+	local offset = 5 * 1024 * 1024 * 1024
+	local fd = _io:open_file_for_writing(path)
+	if _io:set_current_position(fd, offset) ~= offset then
+		_io:close_handle(fd)
+		_io:remove_file(path)
+		info("sparse files are not supported here, skipping")
+		return true
+	end
+	_io:write_to_handle(fd, _util:convert_string_to_buffer("tail"), 4)
+	_io:close_handle(fd)
+	local size = _io:get_file_info(path)
+	if size ~= offset + 4 then
+		error("get_file_info truncated the size of a file over 4GB")
+		return false
+	end
+	fd = _io:open_file_for_reading(path)
+	local buffer = _util:allocate_buffer(4)
+	local pos = _io:set_current_position(fd, offset)
+	local n = _io:read_from_handle(fd, buffer)
+	local total = _io:get_size_for_handle(fd)
+	_io:close_handle(fd)
+	if pos ~= offset or n ~= 4 or total ~= offset + 4 or _util:convert_buffer_to_string(buffer) ~= "tail" then
+		error("seeking or reading past 4GB failed")
+		return false
+	end
+	local view = _io:map_file(path)
+	if view == nil or _util:get_mapped_view_size(view) ~= offset + 4 then
+		error("map_file did not map the whole file")
+		return false
+	end
+	if _util:crc32(view, offset, 4) ~= _util:crc32("tail") or _util:convert_to_integer(offset + 0.5) ~= offset then
+		error("offsets past 4GB were truncated")
+		return false
+	end
+	local expected = _util:crc32(view)
+	local deflater = _util:create_deflate_stream(0, 1, 0)
+	local compressed = _util:feed_compression_stream(deflater, view)
+	local rest = _util:finish_compression_stream(deflater)
+	_util:close_compression_stream(deflater)
+	if compressed == nil or rest == nil then
+		error("compression stream failed on a view over 4GB")
+		return false
+	end
+	compressed = _util:convert_string_to_buffer(_util:convert_buffer_to_string(compressed) .. _util:convert_buffer_to_string(rest))
+	local inflater = _util:create_inflate_stream(0)
+	local piece = _util:allocate_buffer(65536)
+	local window = _util:allocate_buffer(1024 * 1024)
+	local csize = _util:get_buffer_size(compressed)
+	local consumed = 0
+	local total = 0
+	local crc = 0
+	while consumed < csize do
+		local n = csize - consumed
+		if n > 65536 then
+			n = 65536
+		end
+		_util:copy_buffer_bytes(compressed, piece, consumed, 0, n)
+		consumed = consumed + n
+		local r
+		if consumed < csize then
+			r = _util:feed_compression_stream(inflater, piece, n, window, 0)
+		else
+			r = _util:finish_compression_stream(inflater, piece, n, window, 0)
+		end
+		while r ~= nil and r > 0 do
+			total = total + r
+			crc = _util:crc32(window, 0, r, crc)
+			r = _util:feed_compression_stream(inflater, nil, 0, window, 0)
+		end
+		if r == nil then
+			break
+		end
+	end
+	_util:close_compression_stream(inflater)
+	if total ~= offset + 4 or crc ~= expected then
+		error("compression stream round trip of a view over 4GB restored " .. total .. " bytes")
+		return false
+	end
+	view = nil
+	_vm:run_garbage_collector()
+	local archive = get_temporary_directory() .. "/large.zip"
+	if _zip:write_archive(archive, { { name = "large.bin", path = path, level = 1 } }) ~= true then
+		error("write_archive failed on a file over 4GB")
+		return false
+	end
+	local map = _zip:map_open(archive)
+	local name, zsize, usize = _zip:map_get_entry_info(map, 0)
+	_zip:map_close(map)
+	if usize ~= offset + 4 or zsize >= usize then
+		error("write_archive recorded " .. usize .. " bytes for a file over 4GB")
+		return false
+	end
+	local unzip = _zip:read_open(archive)
+	if _zip:read_open_file(unzip, "large.bin") ~= 1 then
+		error("read_open_file failed on an entry over 4GB")
+		return false
+	end
+	total = 0
+	crc = 0
+	local n = _zip:read_get_file_data(unzip, window)
+	while n > 0 do
+		total = total + n
+		crc = _util:crc32(window, 0, n, crc)
+		n = _zip:read_get_file_data(unzip, window)
+	end
+	if n < 0 or total ~= offset + 4 or crc ~= expected or _zip:read_close_file(unzip) ~= 1 then
+		error("write_archive entry over 4GB did not read back")
+		return false
+	end
+	_zip:read_close(unzip)
+	_io:remove_file(archive)
+	_io:remove_file(path)
+	return true
+end
+
 function test_bcrypt()
 	local factor = 12
 	local original = "florentinoortegaIII"
@@ -234,11 +922,526 @@ function test_udp_socket()
 	return true
 end
 
+function test_string_search()
+	local str = "alpha,beta;gamma\0delta,epsilon"
+	if _util:get_index_of_character(str, 0, 0) ~= 16 then
+		error("get_index_of_character did not find NUL")
+		return false
+	end
+	if _util:get_index_of_substring(str, "delta", 0) ~= 17 then
+		error("get_index_of_substring did not search past NUL")
+		return false
+	end
+	if _util:get_index_of_substring(str, "delta", 0, 20) ~= -1 then
+		error("get_index_of_substring ignored end bound")
+		return false
+	end
+	local long = ""
+	for i = 1, 100 do
+		long = long .. "abcdefghij"
+	end
+	long = long .. "needle" .. "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx"
+	if _util:get_index_of_substring(long, "needle", 3) ~= 1000 then
+		error("get_index_of_substring failed on long input")
+		return false
+	end
+	if _util:get_index_of_any_character(str, ";\0", 0) ~= 10 then
+		error("get_index_of_any_character is incorrect")
+		return false
+	end
+	local buffer = _util:convert_string_to_buffer(str)
+	if _util:get_buffer_index_of_byte(buffer, 59, 0) ~= 10 then
+		error("get_buffer_index_of_byte is incorrect")
+		return false
+	end
+	if _util:get_buffer_index_of_bytes(buffer, "epsilon", 5) ~= 23 then
+		error("get_buffer_index_of_bytes is incorrect")
+		return false
+	end
+	if _util:get_buffer_index_of_any_byte(buffer, ",;", 11) ~= 22 then
+		error("get_buffer_index_of_any_byte is incorrect")
+		return false
+	end
+	local parts = _util:split_string("a,b;;c", ",;")
+	if #parts ~= 4 or parts[1] ~= "a" or parts[2] ~= "b" or parts[3] ~= "" or parts[4] ~= "c" then
+		error("split_string is incorrect")
+		return false
+	end
+	local lines = _util:split_buffer(_util:convert_string_to_buffer("one\ntwo\nthree"), "\n", 4)
+	if #lines ~= 2 or lines[1] ~= "two" or lines[2] ~= "three" then
+		error("split_buffer is incorrect")
+		return false
+	end
+	return true
+end
+
+function test_utf8()
+	local str = ""
+	for i = 1, 40 do
+		str = str .. "a\195\164\226\130\172"
+	end
+	if _util:get_utf8_character_count(str) ~= 120 then
+		error("get_utf8_character_count is incorrect")
+		return false
+	end
+	if not _util:is_valid_utf8(str) or _util:is_valid_utf8("a\192\128") then
+		error("is_valid_utf8 is incorrect")
+		return false
+	end
+	for i = 0, 117 do
+		local expected = "a"
+		local r = i % 3
+		if r == 1 then
+			expected = "\195\164"
+		elseif r == 2 then
+			expected = "\226\130\172"
+		end
+		if _util:get_substring(str, i, i + 1) ~= expected then
+			error("get_substring is incorrect at " .. i)
+			return false
+		end
+	end
+	if _util:get_substring(str, 117, 200) ~= "a\195\164\226\130\172" then
+		error("get_substring is incorrect at end of string")
+		return false
+	end
+	local latin1 = _util:convert_string_to_buffer("caf\233 \255")
+	if _util:convert_buffer_ascii_to_string(latin1) ~= "caf\195\169 \195\191" then
+		error("convert_buffer_ascii_to_string is incorrect")
+		return false
+	end
+	return true
+end
+
+function test_case_and_trim()
+	if _util:change_string_to_lowercase("Content-Type: Text/HTML; Charset=UTF-8") ~= "content-type: text/html; charset=utf-8" then
+		error("change_string_to_lowercase is incorrect")
+		return false
+	end
+	if _util:change_string_to_uppercase("abcdefghijklmnopqrstuvwxyz[`{") ~= "ABCDEFGHIJKLMNOPQRSTUVWXYZ[`{" then
+		error("change_string_to_uppercase is incorrect")
+		return false
+	end
+	if _util:compare_string_ignore_case("Content-Length", "content-LENGTH") ~= 0 or _util:compare_string_ignore_case("abc", "abd") ~= -1 then
+		error("compare_string_ignore_case is incorrect")
+		return false
+	end
+	if not _util:string_starts_with_ignore_case("Accept-Encoding: gzip", "accept-encoding") then
+		error("string_starts_with_ignore_case is incorrect")
+		return false
+	end
+	if _util:trim_string(" \t  padded value \r\n") ~= "padded value" then
+		error("trim_string is incorrect")
+		return false
+	end
+	local buffer = _util:convert_string_to_buffer("  GET /Index.HTML  ")
+	local s, e = _util:get_trimmed_range(buffer)
+	if s ~= 2 or e ~= 17 then
+		error("get_trimmed_range is incorrect")
+		return false
+	end
+	_util:change_buffer_to_lowercase(buffer, s, e)
+	if _util:convert_buffer_to_string(buffer) ~= "  get /index.html  " then
+		error("change_buffer_to_lowercase is incorrect")
+		return false
+	end
+	if not _util:buffer_starts_with(buffer, "GET", 2, true) or _util:compare_buffer_ignore_case(buffer, "GET", 2, 5) ~= 0 then
+		error("buffer comparison is incorrect")
+		return false
+	end
+	return true
+end
+
+function test_encoding()
+	local vectors = { "", "f", "fo", "foo", "foob", "fooba", "foobar" }
+	local expected = { "", "Zg==", "Zm8=", "Zm9v", "Zm9vYg==", "Zm9vYmE=", "Zm9vYmFy" }
+	for i = 1, #vectors do
+		if _util:encode_base64(vectors[i]) ~= expected[i] then
+			error("encode_base64 is incorrect for `" .. vectors[i] .. "'")
+			return false
+		end
+		local decoded = _util:decode_base64(expected[i])
+		if decoded == nil or _util:convert_buffer_to_string(decoded) ~= vectors[i] then
+			error("decode_base64 is incorrect for `" .. expected[i] .. "'")
+			return false
+		end
+	end
+	local binary = _util:convert_string_to_buffer("\251\255\191\0\1")
+	if _util:encode_base64url(binary) ~= "-_-_AAE" or _util:encode_base64url(binary, true) ~= "-_-_AAE=" then
+		error("encode_base64url is incorrect")
+		return false
+	end
+	if _util:convert_buffer_to_string(_util:decode_base64url("-_-_AAE")) ~= "\251\255\191\0\1" then
+		error("decode_base64url is incorrect")
+		return false
+	end
+	if _util:decode_base64("Zm9v!mFy") ~= nil or _util:decode_base64("Zh==") ~= nil then
+		error("decode_base64 accepted invalid input")
+		return false
+	end
+	-- inputs long enough for the vectorized loops; every three bytes encode
+	-- on their own, so the expected text is built from three byte pieces
+	local long = _util:allocate_buffer(256)
+	local piece = _util:allocate_buffer(3)
+	local pieces = ""
+	local urlpieces = ""
+	for i = 0, 255 do
+		_util:set_buffer_byte(long, i, (i * 37 + 11) % 256)
+	end
+	for i = 0, 254, 3 do
+		_util:copy_buffer_bytes(long, piece, i, 0, 3)
+		pieces = pieces .. _util:encode_base64(piece)
+		urlpieces = urlpieces .. _util:encode_base64url(piece)
+	end
+	local head = _util:allocate_buffer(255)
+	local tail = _util:allocate_buffer(1)
+	_util:copy_buffer_bytes(long, head, 0, 0, 255)
+	_util:copy_buffer_bytes(long, tail, 255, 0, 1)
+	local encoded = _util:encode_base64(long)
+	if _util:encode_base64(head) ~= pieces or encoded ~= pieces .. _util:encode_base64(tail) then
+		error("encode_base64 is incorrect for long input")
+		return false
+	end
+	local urlencoded = _util:encode_base64url(long)
+	if urlencoded ~= urlpieces .. _util:encode_base64url(tail) then
+		error("encode_base64url is incorrect for long input")
+		return false
+	end
+	local original = _util:convert_buffer_to_string(long)
+	if _util:convert_buffer_to_string(_util:decode_base64(encoded)) ~= original or _util:convert_buffer_to_string(_util:decode_base64url(urlencoded)) ~= original then
+		error("base64 decoding is incorrect for long input")
+		return false
+	end
+	if _util:decode_base64("QUJDREVGR0hJSktMTU5P!FJTVFVWV1hZWg==") ~= nil or _util:decode_base64url(pieces) ~= nil then
+		error("base64 decoding accepted invalid long input")
+		return false
+	end
+	local target = _util:allocate_buffer(8)
+	if _util:decode_base64("Zm9vYmFy", target, 2) ~= 6 or _util:get_buffer_byte(target, 2) ~= 102 or _util:get_buffer_byte(target, 7) ~= 114 then
+		error("decode_base64 into buffer is incorrect")
+		return false
+	end
+	local hex = _util:encode_hex("0123456789abcdef\0\255\16")
+	if hex ~= "3031323334353637383961626364656600ff10" then
+		error("encode_hex is incorrect: " .. hex)
+		return false
+	end
+	if _util:convert_buffer_to_string(_util:decode_hex("00FF10aB")) ~= "\0\255\16\171" or _util:decode_hex("0g") ~= nil then
+		error("decode_hex is incorrect")
+		return false
+	end
+	return true
+end
+
+function test_numbers()
+	local floats = { 1.5, 2, -0.25, 0.1, 1e20, 1e-20, 1234.5 }
+	local expected = { "1.5", "2.0", "-0.25", "0.1", "100000000000000000000.0", "0.0", "1234.5" }
+	for i = 1, #floats do
+		if _util:create_string_for_float(floats[i]) ~= expected[i] then
+			error("create_string_for_float is incorrect for `" .. expected[i] .. "'")
+			return false
+		end
+	end
+	if _util:create_string_for_double_with_decimals(2.675, 2) ~= "2.67" or _util:create_string_for_double_with_decimals(0.125, 2) ~= "0.12" then
+		error("create_string_for_double_with_decimals does not round like printf")
+		return false
+	end
+	if _util:create_string_for_double_with_decimals(20, 0) ~= "20" or _util:create_string_for_double_with_decimals(-1.5, 3) ~= "-1.5" then
+		error("create_string_for_double_with_decimals trims incorrectly")
+		return false
+	end
+	if _util:create_decimal_string_for_integer(-9007199254740991) ~= "-9007199254740991" or _util:create_decimal_string_for_integer(0) ~= "0" then
+		error("create_decimal_string_for_integer is incorrect")
+		return false
+	end
+	local shortest = { 0.1, 0.3, 100, 1e21, 5e-324, -2.5, 1.7976931348623157e308 }
+	local sexpected = { "0.1", "0.3", "100.0", "1e21", "5e-324", "-2.5", "1.7976931348623157e308" }
+	for i = 1, #shortest do
+		local str = _util:create_shortest_string_for_double(shortest[i])
+		if str ~= sexpected[i] or _util:to_number(str) ~= shortest[i] then
+			error("create_shortest_string_for_double is incorrect for `" .. sexpected[i] .. "'")
+			return false
+		end
+	end
+	if _util:to_number("12.5e-1") ~= 1.25 or _util:to_number("-42") ~= -42 or _util:to_number(" 0x10 ") ~= 16 or _util:to_number("12x") ~= 0 then
+		error("to_number is incorrect")
+		return false
+	end
+	return true
+end
+
+function test_json()
+	local doc = _json:parse(" {\"b\": [1, 2.5, -3e2, true, false], \"a\": {\"s\": \"x\\n\\u00e9\\ud83d\\ude00\"}, \"e\": [], \"o\": {}} ")
+	if doc == nil or doc.b[1] ~= 1 or doc.b[2] ~= 2.5 or doc.b[3] ~= -300 or doc.b[4] ~= true or doc.b[5] ~= false then
+		error("parse returned incorrect values")
+		return false
+	end
+	if doc.a.s ~= "x\n\195\169\240\159\152\128" then
+		error("parse decoded string escapes incorrectly")
+		return false
+	end
+	if _json:encode(doc.e) ~= "[]" or _json:encode(doc.o) ~= "{}" or _json:encode(doc.b) ~= "[1,2.5,-300,true,false]" then
+		error("encode did not preserve array and object types")
+		return false
+	end
+	local ordered = _json:parse("{\"z\":1,\"y\":null,\"x\":{\"b\":2,\"a\":3}}", true)
+	local keys = _json:get_object_keys(ordered)
+	if #keys ~= 3 or keys[1] ~= "z" or keys[2] ~= "y" or keys[3] ~= "x" then
+		error("get_object_keys did not preserve key order")
+		return false
+	end
+	if _json:encode(ordered) ~= "{\"z\":1,\"y\":null,\"x\":{\"b\":2,\"a\":3}}" then
+		error("encode did not preserve key order")
+		return false
+	end
+	ordered.z = nil
+	ordered.w = 4
+	if _json:encode(_json:parse("{\"a\":1,\"b\":2,\"a\":3}", true)) ~= "{\"a\":3,\"b\":2}" or _json:encode(ordered) ~= "{\"y\":null,\"x\":{\"b\":2,\"a\":3},\"w\":4}" then
+		error("encode wrote a duplicate or removed name")
+		return false
+	end
+	if _json:encode({ "a\"b\\c\1", 0.1 }) ~= "[\"a\\\"b\\\\c\\u0001\",0.1]" then
+		error("encode escaped strings incorrectly")
+		return false
+	end
+	if _json:encode({ 3000000000, -4294967296, 9007199254740992, 2.5 }) ~= "[3000000000,-4294967296,9007199254740992,2.5]" then
+		error("encode did not write large integers as integers")
+		return false
+	end
+	local wide = {}
+	wide[3000000000] = true
+	if _json:encode(wide) ~= "{\"3000000000\":true}" then
+		error("encode did not write a large integer key as an integer")
+		return false
+	end
+	local big = _json:parse("[12345678901234567890, 7]", false, true)
+	if big[1] ~= "12345678901234567890" or big[2] ~= 7 then
+		error("parse did not keep large integers exact")
+		return false
+	end
+	local buffer = _json:encode_to_buffer({ k = "v" })
+	if _util:convert_buffer_to_string(buffer) ~= "{\"k\":\"v\"}" then
+		error("encode_to_buffer is incorrect")
+		return false
+	end
+	if _json:parse(buffer).k ~= "v" then
+		error("parse from buffer is incorrect")
+		return false
+	end
+	local invalid = { "", "[1,]", "{\"a\" 1}", "[01]", "\"abc", "\"\\ud800\"", "[1] x", "tru" }
+	for i = 1, #invalid do
+		local v, err = _json:parse(invalid[i])
+		if v ~= nil or err == nil then
+			error("parse accepted invalid input `" .. invalid[i] .. "'")
+			return false
+		end
+	end
+	local cyclic = {}
+	cyclic.self = cyclic
+	if _json:encode(cyclic) ~= nil then
+		error("encode accepted a cyclic table")
+		return false
+	end
+	return true
+end
+
+function test_msgpack()
+	local value = { name = "sushi", count = 300, ratio = 0.5, negative = -70000, big = 4294967296, flags = { true, false }, empty = _json:mark_as_array({}) }
+	local codecs = { _msgpack, _cbor }
+	local truncated = { "a56865", "656865" }
+	for i = 1, #codecs do
+		local codec = codecs[i]
+		local encoded = codec:encode(value)
+		local decoded, offset = codec:decode(encoded)
+		if decoded == nil or offset ~= _util:get_buffer_size(encoded) then
+			error("decode failed for codec " .. i)
+			return false
+		end
+		if decoded.name ~= "sushi" or decoded.count ~= 300 or decoded.ratio ~= 0.5 or decoded.negative ~= -70000 or decoded.big ~= 4294967296 or decoded.flags[1] ~= true or decoded.flags[2] ~= false then
+			error("decoded values are incorrect for codec " .. i)
+			return false
+		end
+		if _json:encode(decoded.empty) ~= "[]" then
+			error("empty array lost its type for codec " .. i)
+			return false
+		end
+		local partial, status = codec:decode(_util:decode_hex(truncated[i]))
+		if partial ~= nil or status ~= -1 then
+			error("truncated input was not reported as incomplete for codec " .. i)
+			return false
+		end
+	end
+	local target = _util:allocate_buffer(32)
+	local n1 = _msgpack:encode_to_buffer({ 1, 1.5, _util:convert_string_to_buffer("\0\255") }, target, 0)
+	local n2 = _msgpack:encode_to_buffer("ab", target, n1)
+	if n1 ~= 15 or n2 ~= 3 or _util:get_substring(_util:encode_hex(target), 0, 36) ~= "9301cb3ff8000000000000c40200ffa26162" then
+		error("encode_to_buffer wrote incorrect bytes")
+		return false
+	end
+	local first, next = _msgpack:decode(target, 0)
+	local second, last = _msgpack:decode(target, next)
+	if first[1] ~= 1 or first[2] ~= 1.5 or _util:get_buffer_size(first[3]) ~= 2 or second ~= "ab" or last ~= 18 then
+		error("streaming decode of concatenated messages failed")
+		return false
+	end
+	if _msgpack:encode_to_buffer("this string does not fit", _util:allocate_buffer(4), 0) ~= -1 then
+		error("encode_to_buffer did not detect overflow")
+		return false
+	end
+	local handle = _io:open_directory(".")
+	if _msgpack:encode({ "x", { handle } }) ~= nil or _cbor:encode({ handle }) ~= nil then
+		error("encode accepted a userdata that is not a buffer")
+		return false
+	end
+	if _util:convert_buffer_to_string(_cbor:encode({ -1, 24, "a" })) ~= "\131\32\24\24\97\97" then
+		error("cbor encoding is incorrect")
+		return false
+	end
+	local indefinite = _cbor:decode(_util:convert_string_to_buffer("\159\1\127\97\97\97\98\255\249\60\0\255"))
+	if indefinite == nil or indefinite[1] ~= 1 or indefinite[2] ~= "ab" or indefinite[3] ~= 1 then
+		error("cbor indefinite length decoding is incorrect")
+		return false
+	end
+	return true
+end
+
+function test_serialize()
+	local shared = { "x" }
+	local value = { list = { 1, -2, 0.5, 4294967296, "name", "name" }, shared = shared, again = shared, flag = true, data = _util:convert_string_to_buffer("\0\1\2") }
+	value.self = value
+	local encoded = _vm:serialize_object(value)
+	local decoded = _vm:unserialize_object(encoded)
+	if decoded == nil or decoded.self ~= decoded or decoded.shared ~= decoded.again or decoded.shared[1] ~= "x" or decoded.flag ~= true then
+		error("serialize_object did not preserve the object graph")
+		return false
+	end
+	local list = decoded.list
+	if list[1] ~= 1 or list[2] ~= -2 or list[3] ~= 0.5 or list[4] ~= 4294967296 or list[5] ~= "name" or list[6] ~= "name" or _util:get_buffer_byte(decoded.data, 2) ~= 2 then
+		error("serialize_object did not preserve values")
+		return false
+	end
+	local records = {}
+	for i = 1, 100 do
+		records[i] = { identifier = i, description = "record" }
+	end
+	local buffer = _vm:serialize_object_to_buffer(records)
+	if _util:get_buffer_size(buffer) > 1500 or _vm:unserialize_object(buffer)[100].identifier ~= 100 then
+		error("serialize_object_to_buffer did not intern repeated strings")
+		return false
+	end
+	local counter = 10
+	local fn = function(n) return counter + n end
+	local restored = _vm:unserialize_object(_vm:serialize_object(fn))
+	if restored(5) ~= 15 then
+		error("serialize_object did not preserve function upvalues")
+		return false
+	end
+	local constant = { "constant" }
+	local withConstants = _vm:unserialize_object(_vm:serialize_object({ ref = constant }, { constant }), { constant })
+	if withConstants.ref ~= constant then
+		error("serialize_object did not resolve constants")
+		return false
+	end
+	local legacy = _vm:unserialize_object(_util:decode_hex("8e05020f00000004010000006103000000000000f03f"))
+	if legacy == nil or legacy.a ~= 1 then
+		error("unserialize_object could not read the version 1 format")
+		return false
+	end
+	value.data = nil
+	local old = _vm:serialize_object(value, nil, 1)
+	decoded = _vm:unserialize_object(old)
+	if _util:get_byte_from_string(old, 0) ~= 142 or decoded == nil or decoded.self ~= decoded or decoded.shared ~= decoded.again or decoded.list[4] ~= 4294967296 then
+		error("serialize_object did not write the version 1 format")
+		return false
+	end
+	return true
+end
+
+function test_serialize_closures()
+	local closures = {}
+	for i = 1, 100000 do
+		local value = { i }
+		closures[i] = function() return value[1] end
+	end
+	local decoded = _vm:unserialize_object(_vm:serialize_object(closures))
+	for i = 1, 100000 do
+		if decoded[i]() ~= i then
+			error("closure " .. i .. " came back with the wrong upvalue")
+			return false
+		end
+	end
+	return true
+end
+
+function test_serialize_stream()
+	local path = get_temporary_directory() .. "/stream.tmp"
+	local records = {}
+	for i = 1, 20000 do
+		records[i] = { identifier = i, description = "record", payload = _util:convert_string_to_buffer("0123456789") }
+	end
+	records[20001] = records[1]
+	for pass = 1, 2 do
+		local compress = pass == 2
+		local fd = _io:open_file_for_writing(path)
+		local written = _vm:serialize_object_to_handle(fd, records, nil, compress)
+		local trailer = _vm:serialize_object_to_handle(fd, "next", nil, compress)
+		_io:close_handle(fd)
+		if written <= 0 or trailer <= 0 then
+			error("serialize_object_to_handle failed")
+			return false
+		end
+		fd = _io:open_file_for_reading(path)
+		local decoded = _vm:unserialize_object_from_handle(fd)
+		local following = _vm:unserialize_object_from_handle(fd)
+		_io:close_handle(fd)
+		if decoded == nil or decoded[20000].identifier ~= 20000 or decoded[20001] ~= decoded[1] or _util:get_buffer_size(decoded[5].payload) ~= 10 then
+			error("unserialize_object_from_handle did not restore the object")
+			return false
+		end
+		if following ~= "next" then
+			error("unserialize_object_from_handle read past the end of the object")
+			return false
+		end
+	end
+	_io:remove_file(path)
+	return true
+end
+
 execute("test_global", test_global)
 execute("test_zlib", test_zlib)
+execute("test_zlib_stream", test_zlib_stream)
+execute("test_zlib_parallel", test_zlib_parallel)
+execute("test_lz4", test_lz4)
+execute("test_checksums", test_checksums)
+execute("test_zip_map", test_zip_map)
+execute("test_zip_batch", test_zip_batch)
+execute("test_bytecode_cache", test_bytecode_cache)
+execute("test_timing_report", test_timing_report)
+execute("test_zygote", test_zygote)
+execute("test_lazy_code", test_lazy_code)
+execute("test_program_archive", test_program_archive)
+execute("test_embedded_resources", test_embedded_resources)
+execute("test_minimal_interpreter", test_minimal_interpreter)
+execute("test_memory_limits", test_memory_limits)
+execute("test_large_file", test_large_file)
+execute("test_code_cache", test_code_cache)
 execute("test_bcrypt", test_bcrypt)
 execute("test_image", test_image)
 execute("test_math", test_math)
 execute("test_udp_socket", test_udp_socket)
+execute("test_string_search", test_string_search)
+execute("test_utf8", test_utf8)
+execute("test_case_and_trim", test_case_and_trim)
+execute("test_encoding", test_encoding)
+execute("test_numbers", test_numbers)
+execute("test_json", test_json)
+execute("test_msgpack", test_msgpack)
+execute("test_serialize", test_serialize)
+execute("test_serialize_closures", test_serialize_closures)
+execute("test_serialize_stream", test_serialize_stream)
+
+if temporary_directory ~= nil then
+	_io:remove_directory(temporary_directory)
+end
 
 return rv
@@ -0,0 +1,170 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef SUSHI_SUPPORT_WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <pthread.h>
+#endif
+#include "timing.h"
+
+#define TIMING_MAX_PHASES 32
+
+typedef struct
+{
+	const char* name;
+	long count;
+	double total;
+}
+TimingPhase;
+
+static TimingPhase phases[TIMING_MAX_PHASES];
+static int phase_count = 0;
+static double origin = -1;
+static const char* output = NULL;
+static int report_registered = 0;
+static volatile int enabled = 0;
+#ifndef SUSHI_SUPPORT_WIN32
+static pthread_mutex_t phases_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void timing_lock(void)
+{
+#ifndef SUSHI_SUPPORT_WIN32
+	pthread_mutex_lock(&phases_lock);
+#endif
+}
+
+static void timing_unlock(void)
+{
+#ifndef SUSHI_SUPPORT_WIN32
+	pthread_mutex_unlock(&phases_lock);
+#endif
+}
+
+// Returns a monotonic time stamp in microseconds
+double timing_now()
+{
+	double v;
+#ifdef SUSHI_SUPPORT_WIN32
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	if(frequency.QuadPart == 0) {
+		QueryPerformanceFrequency(&frequency);
+	}
+	QueryPerformanceCounter(&counter);
+	v = (double)counter.QuadPart * 1000000.0 / (double)frequency.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	v = (double)ts.tv_sec * 1000000.0 + (double)ts.tv_nsec / 1000.0;
+#endif
+	return v;
+}
+
+// Sets the origin of the total reported; called before any threads exist
+void timing_start()
+{
+	origin = timing_now();
+}
+
+void timing_add(const char* phase, double start)
+{
+	timing_record(phase, timing_now() - start);
+}
+
+void timing_record(const char* phase, double elapsed)
+{
+	if(enabled == 0) {
+		return;
+	}
+	timing_lock();
+	int n;
+	for(n=0; n<phase_count; n++) {
+		if(phases[n].name == phase || strcmp(phases[n].name, phase) == 0) {
+			break;
+		}
+	}
+	if(n == phase_count) {
+		if(phase_count >= TIMING_MAX_PHASES) {
+			timing_unlock();
+			return;
+		}
+		phases[n].name = phase;
+		phases[n].count = 0;
+		phases[n].total = 0;
+		phase_count++;
+	}
+	phases[n].count++;
+	phases[n].total += elapsed;
+	timing_unlock();
+}
+
+void timing_set_output(const char* path)
+{
+	if(path == NULL || *path == 0) {
+		return;
+	}
+	output = path;
+	if(origin < 0) {
+		origin = timing_now();
+	}
+	enabled = 1;
+	if(report_registered == 0) {
+		atexit(timing_report);
+		report_registered = 1;
+	}
+}
+
+void timing_report()
+{
+	if(output == NULL) {
+		return;
+	}
+	FILE* fp = stderr;
+	if(strcmp(output, "-") != 0) {
+		fp = fopen(output, "a");
+		if(fp == NULL) {
+			fprintf(stderr, "[sushi:error] Failed to write to timing output file: `%s'\n", output);
+			return;
+		}
+	}
+	timing_lock();
+	double total = origin < 0 ? 0 : timing_now() - origin;
+	fprintf(fp, "{\"version\":\"%s\",\"total_us\":%.1f,\"phases\":[", SUSHI_VERSION, total);
+	int n;
+	for(n=0; n<phase_count; n++) {
+		fprintf(fp, "%s{\"name\":\"%s\",\"count\":%ld,\"us\":%.1f}", n > 0 ? "," : "", phases[n].name, phases[n].count, phases[n].total);
+	}
+	fprintf(fp, "]}\n");
+	timing_unlock();
+	if(fp != stderr) {
+		fclose(fp);
+	}
+	output = NULL;
+}
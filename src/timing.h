@@ -0,0 +1,43 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TIMING_H
+#define TIMING_H
+
+// Startup phase timing. Phases are recorded only once an output has been
+// set (before that a phase costs one monotonic clock read), and recording
+// is serialized so that threads creating interpreter states may report
+// concurrently. The report is a single JSON object listing, in order of
+// first occurrence, how many times each phase ran and the total time spent
+// in it. Phases nest: "load_code", for example, includes "inflate" and
+// "parse".
+
+void timing_start();
+double timing_now();
+void timing_add(const char* phase, double start);
+void timing_record(const char* phase, double elapsed);
+void timing_set_output(const char* path);
+void timing_report();
+
+#endif
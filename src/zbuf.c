@@ -22,19 +22,46 @@
  * SOFTWARE.
  */
 
+#include <stddef.h>
+#include "zbuf.h"
+
 #ifdef SUSHI_SUPPORT_ZLIB
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include "zlib.h"
+#ifndef SUSHI_SUPPORT_WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
-static void zbuf_append(unsigned char* srcbuf, unsigned long srclen, unsigned char** dstbuf, unsigned long* dstlen)
+struct ZbufStream
 {
-	unsigned origlen = *dstlen;
-	unsigned long nlen = *dstlen + srclen;
-	*dstbuf = realloc(*dstbuf, nlen);
-	memcpy(*dstbuf + origlen, srcbuf, srclen);
-	*dstlen = nlen;
+	z_stream strm;
+	int deflating;
+	int finished;
+	unsigned char* out;
+	unsigned long outlen;
+	unsigned long outpos;
+	unsigned long outcap;
+};
+
+static int zbuf_reserve(unsigned char** dstbuf, unsigned long* dstcap, unsigned long used, unsigned long need)
+{
+	if(*dstcap - used >= need) {
+		return 1;
+	}
+	unsigned long ncap = *dstcap > 0 ? *dstcap * 2 : 16384;
+	while(ncap - used < need) {
+		ncap *= 2;
+	}
+	unsigned char* nbuf = realloc(*dstbuf, ncap);
+	if(nbuf == NULL) {
+		return 0;
+	}
+	*dstbuf = nbuf;
+	*dstcap = ncap;
+	return 1;
 }
 
 static void zbuf_free(unsigned char** dstbuf, unsigned long *dstlen)
@@ -46,7 +73,17 @@ static void zbuf_free(unsigned char** dstbuf, unsigned long *dstlen)
 	*dstlen = 0L;
 }
 
-int zbuf_deflate(unsigned char* srcbuf, unsigned long srclen, unsigned char** dstbuf, unsigned long* dstlen)
+// zlib counts input and output in 32-bit uInt, so larger buffers are fed
+// to it in pieces of at most ZBUF_CHUNK_SIZE.
+
+#define ZBUF_CHUNK_SIZE 0x40000000UL
+
+static uInt zbuf_chunk(unsigned long len)
+{
+	return len > ZBUF_CHUNK_SIZE ? (uInt)ZBUF_CHUNK_SIZE : (uInt)len;
+}
+
+int zbuf_deflate_limit(unsigned char* srcbuf, unsigned long srclen, unsigned long maxlen, unsigned char** dstbuf, unsigned long* dstlen)
 {
 	if(srcbuf == NULL || srclen < 1 || dstbuf == NULL || dstlen == NULL) {
 		return 0;
@@ -60,28 +97,54 @@ int zbuf_deflate(unsigned char* srcbuf, unsigned long srclen, unsigned char** ds
 	if(deflateInit(&strm, Z_DEFAULT_COMPRESSION) != Z_OK) {
 		return 0;
 	}
-	strm.avail_in = srclen;
+	// deflateBound is enough for the whole output; it is only used as the
+	// first allocation for inputs that fit in a single piece
+	unsigned long cap = 0;
+	unsigned long bound = deflateBound(&strm, srclen);
+	unsigned long inleft = srclen;
 	strm.next_in = srcbuf;
-	while(1) {
-		int outbufsize = 16384;
-		unsigned char outbuf[outbufsize];
-		strm.avail_out = outbufsize;
-		strm.next_out = outbuf;
-		if(deflate(&strm, Z_FINISH) == Z_STREAM_ERROR) {
+	strm.avail_in = 0;
+	int ret = Z_OK;
+	while(ret != Z_STREAM_END) {
+		if(strm.avail_in == 0 && inleft > 0) {
+			strm.avail_in = zbuf_chunk(inleft);
+			inleft -= strm.avail_in;
+		}
+		if(*dstlen > maxlen) {
+			deflateEnd(&strm);
+			zbuf_free(dstbuf, dstlen);
+			return ZBUF_TOO_LARGE;
+		}
+		if(zbuf_reserve(dstbuf, &cap, *dstlen, bound < ZBUF_CHUNK_SIZE ? bound : 16384) == 0) {
 			deflateEnd(&strm);
 			zbuf_free(dstbuf, dstlen);
 			return 0;
 		}
-		zbuf_append(outbuf, outbufsize - strm.avail_out, dstbuf, dstlen);
-		if(strm.avail_out > 0) {
-			break;
+		uInt room = zbuf_chunk(cap - *dstlen);
+		strm.next_out = *dstbuf + *dstlen;
+		strm.avail_out = room;
+		ret = deflate(&strm, inleft == 0 ? Z_FINISH : Z_NO_FLUSH);
+		if(ret == Z_STREAM_ERROR) {
+			deflateEnd(&strm);
+			zbuf_free(dstbuf, dstlen);
+			return 0;
 		}
+		*dstlen += room - strm.avail_out;
 	}
 	deflateEnd(&strm);
+	if(*dstlen > maxlen) {
+		zbuf_free(dstbuf, dstlen);
+		return ZBUF_TOO_LARGE;
+	}
 	return 1;
 }
 
-int zbuf_inflate(unsigned char* srcbuf, unsigned long srclen, unsigned char** dstbuf, unsigned long* dstlen)
+int zbuf_deflate(unsigned char* srcbuf, unsigned long srclen, unsigned char** dstbuf, unsigned long* dstlen)
+{
+	return zbuf_deflate_limit(srcbuf, srclen, (unsigned long)-1, dstbuf, dstlen);
+}
+
+int zbuf_inflate_limit(unsigned char* srcbuf, unsigned long srclen, unsigned long maxlen, unsigned char** dstbuf, unsigned long* dstlen)
 {
 	if(srcbuf == NULL || srclen < 1 || dstbuf == NULL || dstlen == NULL) {
 		return 0;
@@ -95,28 +158,437 @@ int zbuf_inflate(unsigned char* srcbuf, unsigned long srclen, unsigned char** ds
 	if(inflateInit(&strm) != Z_OK) {
 		return 0;
 	}
-	strm.avail_in = srclen;
+	unsigned long inleft = srclen;
 	strm.next_in = srcbuf;
+	strm.avail_in = 0;
+	unsigned long cap = 0;
 	while(1) {
-		int outbufsize = 16384;
-		unsigned char outbuf[outbufsize];
-		strm.avail_out = outbufsize;
-		strm.next_out = outbuf;
+		if(strm.avail_in == 0 && inleft > 0) {
+			strm.avail_in = zbuf_chunk(inleft);
+			inleft -= strm.avail_in;
+		}
+		if(*dstlen > maxlen) {
+			inflateEnd(&strm);
+			zbuf_free(dstbuf, dstlen);
+			return ZBUF_TOO_LARGE;
+		}
+		if(zbuf_reserve(dstbuf, &cap, *dstlen, srclen < 16384 ? 16384 : zbuf_chunk(srclen)) == 0) {
+			inflateEnd(&strm);
+			zbuf_free(dstbuf, dstlen);
+			return 0;
+		}
+		uInt room = zbuf_chunk(cap - *dstlen);
+		strm.next_out = *dstbuf + *dstlen;
+		strm.avail_out = room;
 		int ret = inflate(&strm, Z_NO_FLUSH);
-		if(ret < 0) {
+		if(ret < 0 && ret != Z_BUF_ERROR) {
 			inflateEnd(&strm);
 			zbuf_free(dstbuf, dstlen);
 			return 0;
 		}
-		zbuf_append(outbuf, outbufsize - strm.avail_out, dstbuf, dstlen);
-		if(strm.avail_out > 0) {
+		*dstlen += room - strm.avail_out;
+		if(ret == Z_STREAM_END || (strm.avail_out > 0 && strm.avail_in == 0 && inleft == 0)) {
 			break;
 		}
 	}
 	inflateEnd(&strm);
+	if(*dstlen > maxlen) {
+		zbuf_free(dstbuf, dstlen);
+		return ZBUF_TOO_LARGE;
+	}
 	return 1;
 }
 
+int zbuf_inflate(unsigned char* srcbuf, unsigned long srclen, unsigned char** dstbuf, unsigned long* dstlen)
+{
+	return zbuf_inflate_limit(srcbuf, srclen, (unsigned long)-1, dstbuf, dstlen);
+}
+
+static int zbuf_window_bits(int format)
+{
+	if(format == ZBUF_FORMAT_RAW) {
+		return -MAX_WBITS;
+	}
+	if(format == ZBUF_FORMAT_GZIP) {
+		return MAX_WBITS + 16;
+	}
+	if(format == ZBUF_FORMAT_AUTO) {
+		return MAX_WBITS + 32;
+	}
+	return MAX_WBITS;
+}
+
+// Parallel compression follows the approach of pigz: the input is cut into
+// ZBUF_BLOCK_SIZE blocks that are compressed independently as raw deflate,
+// each primed with the last 32 KB of the preceding input as its dictionary
+// and ended with a sync flush so the pieces concatenate into one stream.
+// Checksums are computed per block and merged with the *_combine functions.
+
+#define ZBUF_BLOCK_SIZE (128 * 1024)
+#define ZBUF_DICT_SIZE 32768
+
+typedef struct ZbufBlock
+{
+	unsigned char* out;
+	unsigned long outlen;
+	unsigned long check;
+	int error;
+} ZbufBlock;
+
+typedef struct ZbufJob
+{
+	unsigned char* src;
+	unsigned long srclen;
+	int format;
+	int level;
+	long nblocks;
+	long next;
+	ZbufBlock* blocks;
+#ifndef SUSHI_SUPPORT_WIN32
+	pthread_mutex_t lock;
+#endif
+} ZbufJob;
+
+static void zbuf_compress_block(ZbufJob* job, long index)
+{
+	ZbufBlock* block = &job->blocks[index];
+	unsigned long offset = (unsigned long)index * ZBUF_BLOCK_SIZE;
+	unsigned long len = job->srclen - offset;
+	if(len > ZBUF_BLOCK_SIZE) {
+		len = ZBUF_BLOCK_SIZE;
+	}
+	int last = index == job->nblocks - 1;
+	if(job->format == ZBUF_FORMAT_GZIP) {
+		block->check = crc32(0L, job->src + offset, len);
+	}
+	else {
+		block->check = adler32(1L, job->src + offset, len);
+	}
+	z_stream strm;
+	memset(&strm, 0, sizeof(z_stream));
+	if(deflateInit2(&strm, job->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		block->error = 1;
+		return;
+	}
+	if(offset > 0) {
+		unsigned long dict = offset < ZBUF_DICT_SIZE ? offset : ZBUF_DICT_SIZE;
+		deflateSetDictionary(&strm, job->src + offset - dict, dict);
+	}
+	unsigned long cap = deflateBound(&strm, len) + 16;
+	block->out = malloc(cap);
+	if(block->out == NULL) {
+		deflateEnd(&strm);
+		block->error = 1;
+		return;
+	}
+	strm.next_in = job->src + offset;
+	strm.avail_in = len;
+	while(1) {
+		strm.next_out = block->out + block->outlen;
+		strm.avail_out = cap - block->outlen;
+		int ret = deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+		block->outlen = cap - strm.avail_out;
+		if(ret == Z_STREAM_ERROR) {
+			block->error = 1;
+			break;
+		}
+		if(strm.avail_out > 0 && (last == 0 || ret == Z_STREAM_END)) {
+			break;
+		}
+		if(zbuf_reserve(&block->out, &cap, block->outlen, 16384) == 0) {
+			block->error = 1;
+			break;
+		}
+	}
+	deflateEnd(&strm);
+}
+
+static void* zbuf_compress_worker(void* arg)
+{
+	ZbufJob* job = (ZbufJob*)arg;
+	while(1) {
+		long index;
+#ifndef SUSHI_SUPPORT_WIN32
+		pthread_mutex_lock(&job->lock);
+#endif
+		index = job->next++;
+#ifndef SUSHI_SUPPORT_WIN32
+		pthread_mutex_unlock(&job->lock);
+#endif
+		if(index >= job->nblocks) {
+			break;
+		}
+		zbuf_compress_block(job, index);
+	}
+	return NULL;
+}
+
+static void zbuf_run_workers(ZbufJob* job, int threads)
+{
+#ifndef SUSHI_SUPPORT_WIN32
+	pthread_t workers[64];
+	int started = 0;
+	pthread_mutex_init(&job->lock, NULL);
+	while(started < threads - 1 && started < 64) {
+		if(pthread_create(&workers[started], NULL, zbuf_compress_worker, job) != 0) {
+			break;
+		}
+		started++;
+	}
+	zbuf_compress_worker(job);
+	while(started > 0) {
+		pthread_join(workers[--started], NULL);
+	}
+	pthread_mutex_destroy(&job->lock);
+#else
+	zbuf_compress_worker(job);
+#endif
+}
+
+static unsigned long zbuf_write_header(unsigned char* dst, int format, int level)
+{
+	if(format == ZBUF_FORMAT_GZIP) {
+		unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, level >= 9 ? 2 : level == 1 ? 4 : 0, 3 };
+		memcpy(dst, header, 10);
+		return 10;
+	}
+	if(format == ZBUF_FORMAT_ZLIB) {
+		int flevel = level == 1 ? 0 : level >= 2 && level <= 5 ? 1 : level >= 7 ? 3 : 2;
+		unsigned int head = (0x78 << 8) | (flevel << 6);
+		head += 31 - head % 31;
+		dst[0] = head >> 8;
+		dst[1] = head & 0xff;
+		return 2;
+	}
+	return 0;
+}
+
+static int zbuf_get_default_thread_count()
+{
+#ifndef SUSHI_SUPPORT_WIN32
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if(n > 0) {
+		return (int)n;
+	}
+#endif
+	return 1;
+}
+
+int zbuf_deflate_parallel(unsigned char* srcbuf, unsigned long srclen, int format, int level, int threads, unsigned char** dstbuf, unsigned long* dstlen)
+{
+	if((srcbuf == NULL && srclen > 0) || dstbuf == NULL || dstlen == NULL || format == ZBUF_FORMAT_AUTO || level < -1 || level > 9) {
+		return 0;
+	}
+	*dstbuf = NULL;
+	*dstlen = 0;
+	ZbufJob job;
+	memset(&job, 0, sizeof(ZbufJob));
+	job.src = srcbuf;
+	job.srclen = srclen;
+	job.format = format;
+	job.level = level;
+	// empty input still gets one (empty) final block for a valid stream
+	job.nblocks = srclen > 0 ? (long)((srclen + ZBUF_BLOCK_SIZE - 1) / ZBUF_BLOCK_SIZE) : 1;
+	job.blocks = (ZbufBlock*)calloc(job.nblocks, sizeof(ZbufBlock));
+	if(job.blocks == NULL) {
+		return 0;
+	}
+	if(threads < 1) {
+		threads = zbuf_get_default_thread_count();
+	}
+	if(threads > job.nblocks) {
+		threads = (int)job.nblocks;
+	}
+	zbuf_run_workers(&job, threads);
+	int error = 0;
+	unsigned long total = 18;
+	long n;
+	for(n=0; n<job.nblocks; n++) {
+		error |= job.blocks[n].error;
+		total += job.blocks[n].outlen;
+	}
+	if(error == 0) {
+		*dstbuf = malloc(total);
+	}
+	if(*dstbuf != NULL) {
+		unsigned char* p = *dstbuf + zbuf_write_header(*dstbuf, format, level);
+		unsigned long check = job.blocks[0].check;
+		for(n=0; n<job.nblocks; n++) {
+			memcpy(p, job.blocks[n].out, job.blocks[n].outlen);
+			p += job.blocks[n].outlen;
+			if(n > 0) {
+				unsigned long len = n == job.nblocks - 1 ? srclen - (unsigned long)n * ZBUF_BLOCK_SIZE : ZBUF_BLOCK_SIZE;
+				if(format == ZBUF_FORMAT_GZIP) {
+					check = crc32_combine(check, job.blocks[n].check, (z_off_t)len);
+				}
+				else {
+					check = adler32_combine(check, job.blocks[n].check, (z_off_t)len);
+				}
+			}
+		}
+		if(format == ZBUF_FORMAT_GZIP) {
+			int i;
+			for(i=0; i<4; i++) {
+				*p++ = (check >> (i * 8)) & 0xff;
+			}
+			for(i=0; i<4; i++) {
+				*p++ = (srclen >> (i * 8)) & 0xff;
+			}
+		}
+		else if(format == ZBUF_FORMAT_ZLIB) {
+			int i;
+			for(i=3; i>=0; i--) {
+				*p++ = (check >> (i * 8)) & 0xff;
+			}
+		}
+		*dstlen = p - *dstbuf;
+	}
+	for(n=0; n<job.nblocks; n++) {
+		free(job.blocks[n].out);
+	}
+	free(job.blocks);
+	return *dstbuf != NULL;
+}
+
+static ZbufStream* zbuf_stream_new(int deflating)
+{
+	ZbufStream* v = (ZbufStream*)calloc(1, sizeof(ZbufStream));
+	if(v == NULL) {
+		return NULL;
+	}
+	v->strm.zalloc = Z_NULL;
+	v->strm.zfree = Z_NULL;
+	v->strm.opaque = Z_NULL;
+	v->deflating = deflating;
+	return v;
+}
+
+ZbufStream* zbuf_stream_create_deflate(int format, int level, int strategy)
+{
+	if(format == ZBUF_FORMAT_AUTO || level < -1 || level > 9 || strategy < 0 || strategy > Z_FIXED) {
+		return NULL;
+	}
+	ZbufStream* v = zbuf_stream_new(1);
+	if(v == NULL) {
+		return NULL;
+	}
+	if(deflateInit2(&v->strm, level, Z_DEFLATED, zbuf_window_bits(format), 8, strategy) != Z_OK) {
+		free(v);
+		return NULL;
+	}
+	return v;
+}
+
+ZbufStream* zbuf_stream_create_inflate(int format)
+{
+	ZbufStream* v = zbuf_stream_new(0);
+	if(v == NULL) {
+		return NULL;
+	}
+	if(inflateInit2(&v->strm, zbuf_window_bits(format)) != Z_OK) {
+		free(v);
+		return NULL;
+	}
+	return v;
+}
+
+int zbuf_stream_process(ZbufStream* stream, const unsigned char* srcbuf, unsigned long srclen, int mode)
+{
+	if(stream == NULL || (stream->finished && srclen > 0)) {
+		return 0;
+	}
+	// consumed output is only dropped once it outweighs what is still
+	// pending, so draining a large backlog in small pieces stays linear
+	if(stream->outpos > 0 && stream->outpos >= stream->outlen - stream->outpos) {
+		memmove(stream->out, stream->out + stream->outpos, stream->outlen - stream->outpos);
+		stream->outlen -= stream->outpos;
+		stream->outpos = 0;
+	}
+	if(stream->finished) {
+		return 1;
+	}
+	unsigned long inleft = srclen;
+	stream->strm.next_in = (unsigned char*)srcbuf;
+	stream->strm.avail_in = 0;
+	int flush = Z_NO_FLUSH;
+	if(mode == ZBUF_FLUSH) {
+		flush = Z_SYNC_FLUSH;
+	}
+	else if(mode == ZBUF_FINISH) {
+		flush = stream->deflating ? Z_FINISH : Z_SYNC_FLUSH;
+	}
+	while(1) {
+		if(stream->strm.avail_in == 0 && inleft > 0) {
+			stream->strm.avail_in = zbuf_chunk(inleft);
+			inleft -= stream->strm.avail_in;
+		}
+		if(zbuf_reserve(&stream->out, &stream->outcap, stream->outlen, 16384) == 0) {
+			return 0;
+		}
+		uInt avail = zbuf_chunk(stream->outcap - stream->outlen);
+		stream->strm.next_out = stream->out + stream->outlen;
+		stream->strm.avail_out = avail;
+		// the flush mode only applies once the last piece of input is in
+		int ret = stream->deflating ? deflate(&stream->strm, inleft == 0 ? flush : Z_NO_FLUSH) : inflate(&stream->strm, inleft == 0 ? flush : Z_NO_FLUSH);
+		stream->outlen += avail - stream->strm.avail_out;
+		if(ret == Z_STREAM_END) {
+			stream->finished = 1;
+			break;
+		}
+		if(ret != Z_OK && ret != Z_BUF_ERROR) {
+			return 0;
+		}
+		if(stream->strm.avail_out > 0 && inleft == 0 && (stream->strm.avail_in == 0 || ret == Z_BUF_ERROR)) {
+			break;
+		}
+	}
+	// anything after the end of a compressed stream is an error rather than
+	// silently dropped; the output up to the end stays pending
+	unsigned long unused = inleft + stream->strm.avail_in;
+	stream->strm.next_in = NULL;
+	stream->strm.avail_in = 0;
+	if(unused > 0) {
+		return 0;
+	}
+	if(mode == ZBUF_FINISH && stream->finished == 0) {
+		return 0;
+	}
+	return 1;
+}
+
+unsigned long zbuf_stream_get_output(ZbufStream* stream, unsigned char** ptr)
+{
+	*ptr = stream->out + stream->outpos;
+	return stream->outlen - stream->outpos;
+}
+
+void zbuf_stream_consume_output(ZbufStream* stream, unsigned long count)
+{
+	if(count > stream->outlen - stream->outpos) {
+		count = stream->outlen - stream->outpos;
+	}
+	stream->outpos += count;
+	if(stream->outpos == stream->outlen) {
+		stream->outpos = 0;
+		stream->outlen = 0;
+	}
+}
+
+void zbuf_stream_free(ZbufStream* stream)
+{
+	if(stream == NULL) {
+		return;
+	}
+	if(stream->deflating) {
+		deflateEnd(&stream->strm);
+	}
+	else {
+		inflateEnd(&stream->strm);
+	}
+	free(stream->out);
+	free(stream);
+}
+
 #else
 
 int zbuf_deflate(unsigned char* srcbuf, unsigned long srclen, unsigned char** dstbuf, unsigned long* dstlen)
@@ -129,4 +601,48 @@ int zbuf_inflate(unsigned char* srcbuf, unsigned long srclen, unsigned char** ds
 	return 0;
 }
 
+int zbuf_deflate_limit(unsigned char* srcbuf, unsigned long srclen, unsigned long maxlen, unsigned char** dstbuf, unsigned long* dstlen)
+{
+	return 0;
+}
+
+int zbuf_inflate_limit(unsigned char* srcbuf, unsigned long srclen, unsigned long maxlen, unsigned char** dstbuf, unsigned long* dstlen)
+{
+	return 0;
+}
+
+int zbuf_deflate_parallel(unsigned char* srcbuf, unsigned long srclen, int format, int level, int threads, unsigned char** dstbuf, unsigned long* dstlen)
+{
+	return 0;
+}
+
+ZbufStream* zbuf_stream_create_deflate(int format, int level, int strategy)
+{
+	return NULL;
+}
+
+ZbufStream* zbuf_stream_create_inflate(int format)
+{
+	return NULL;
+}
+
+int zbuf_stream_process(ZbufStream* stream, const unsigned char* srcbuf, unsigned long srclen, int mode)
+{
+	return 0;
+}
+
+unsigned long zbuf_stream_get_output(ZbufStream* stream, unsigned char** ptr)
+{
+	*ptr = NULL;
+	return 0;
+}
+
+void zbuf_stream_consume_output(ZbufStream* stream, unsigned long count)
+{
+}
+
+void zbuf_stream_free(ZbufStream* stream)
+{
+}
+
 #endif
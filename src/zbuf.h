@@ -28,4 +28,31 @@
 int zbuf_deflate(unsigned char* srcbuf, unsigned long srclen, unsigned char** dstbuf, unsigned long* dstlen);
 int zbuf_inflate(unsigned char* srcbuf, unsigned long srclen, unsigned char** dstbuf, unsigned long* dstlen);
 
+// As above, but give up with ZBUF_TOO_LARGE as soon as the output grows
+// beyond maxlen bytes.
+#define ZBUF_TOO_LARGE -1
+
+int zbuf_deflate_limit(unsigned char* srcbuf, unsigned long srclen, unsigned long maxlen, unsigned char** dstbuf, unsigned long* dstlen);
+int zbuf_inflate_limit(unsigned char* srcbuf, unsigned long srclen, unsigned long maxlen, unsigned char** dstbuf, unsigned long* dstlen);
+
+#define ZBUF_FORMAT_ZLIB 0
+#define ZBUF_FORMAT_RAW 1
+#define ZBUF_FORMAT_GZIP 2
+#define ZBUF_FORMAT_AUTO 3
+
+int zbuf_deflate_parallel(unsigned char* srcbuf, unsigned long srclen, int format, int level, int threads, unsigned char** dstbuf, unsigned long* dstlen);
+
+#define ZBUF_FEED 0
+#define ZBUF_FLUSH 1
+#define ZBUF_FINISH 2
+
+typedef struct ZbufStream ZbufStream;
+
+ZbufStream* zbuf_stream_create_deflate(int format, int level, int strategy);
+ZbufStream* zbuf_stream_create_inflate(int format);
+int zbuf_stream_process(ZbufStream* stream, const unsigned char* srcbuf, unsigned long srclen, int mode);
+unsigned long zbuf_stream_get_output(ZbufStream* stream, unsigned char** ptr);
+void zbuf_stream_consume_output(ZbufStream* stream, unsigned long count);
+void zbuf_stream_free(ZbufStream* stream);
+
 #endif
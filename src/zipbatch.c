@@ -0,0 +1,652 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "zlib.h"
+#include "zipbatch.h"
+#ifndef SUSHI_SUPPORT_WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#if defined(SUSHI_SUPPORT_LINUX) || defined(SUSHI_SUPPORT_MACOS)
+# define ZIPBATCH_VERSIONMADEBY 0x031e
+#else
+# define ZIPBATCH_VERSIONMADEBY 0x001e
+#endif
+
+#ifdef SUSHI_SUPPORT_WIN32
+# define zipbatch_stat_t struct _stat64
+# define zipbatch_stat _stat64
+# define zipbatch_seek _fseeki64
+#else
+# define zipbatch_stat_t struct stat
+# define zipbatch_stat stat
+# define zipbatch_seek fseeko
+#endif
+
+#define ZIPBATCH_MAX32 0xffffffffUL
+#define ZIPBATCH_MAX16 0xffffUL
+#define ZIPBATCH_DEFAULT_MODE 0100644
+#define ZIPBATCH_MAX_THREADS 64
+#define ZIPBATCH_STREAM_THRESHOLD 0x100000
+#define ZIPBATCH_STREAM_CHUNK 0x10000
+
+typedef struct ZipbatchResult
+{
+	unsigned char* input;
+	unsigned char* buffer;
+	const unsigned char* out;
+	uint64_t outlen;
+	uint64_t usize;
+	unsigned long crc;
+	int method;
+	unsigned int mode;
+	long timestamp;
+	int error;
+	int done;
+	int stream;
+} ZipbatchResult;
+
+typedef struct ZipbatchJob
+{
+	ZipbatchEntry* entries;
+	ZipbatchResult* results;
+	long count;
+	long next;
+	long written;
+	long window;
+	int failed;
+#ifndef SUSHI_SUPPORT_WIN32
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+} ZipbatchJob;
+
+typedef struct ZipbatchRecord
+{
+	uint64_t offset;
+	unsigned int time;
+	unsigned int date;
+} ZipbatchRecord;
+
+static int zipbatch_stat_file(const char* path, ZipbatchResult* result)
+{
+	zipbatch_stat_t st;
+	if(zipbatch_stat(path, &st) != 0) {
+		return 0;
+	}
+	if(result->timestamp < 0) {
+		result->timestamp = (long)st.st_mtime;
+	}
+	if(result->mode == (unsigned int)-1) {
+		result->mode = (unsigned int)st.st_mode & 0xffff;
+	}
+	result->usize = (uint64_t)st.st_size;
+	return 1;
+}
+
+static int zipbatch_read_file(const char* path, ZipbatchResult* result)
+{
+	FILE* fp = fopen(path, "rb");
+	if(fp == NULL) {
+		return 0;
+	}
+	uint64_t size = result->usize;
+	result->input = malloc(size > 0 ? (size_t)size : 1);
+	if(result->input == NULL) {
+		fclose(fp);
+		return 0;
+	}
+	uint64_t got = 0;
+	while(got < size) {
+		size_t n = fread(result->input + got, 1, (size_t)(size - got), fp);
+		if(n == 0) {
+			break;
+		}
+		got += n;
+	}
+	fclose(fp);
+	return got == size;
+}
+
+static uint64_t zipbatch_deflate_bound(uint64_t len)
+{
+	return len + (len >> 12) + (len >> 14) + (len >> 25) + 64;
+}
+
+static int zipbatch_deflate(const unsigned char* src, uint64_t len, int level, ZipbatchResult* result)
+{
+	z_stream strm;
+	memset(&strm, 0, sizeof(z_stream));
+	if(deflateInit2(&strm, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return 0;
+	}
+	uint64_t cap = zipbatch_deflate_bound(len);
+	result->buffer = malloc((size_t)cap);
+	if(result->buffer == NULL) {
+		deflateEnd(&strm);
+		return 0;
+	}
+	uint64_t consumed = 0;
+	int ret = Z_OK;
+	while(ret != Z_STREAM_END) {
+		uInt chunk = len - consumed > 0x40000000 ? 0x40000000 : (uInt)(len - consumed);
+		strm.next_in = (Bytef*)src + consumed;
+		strm.avail_in = chunk;
+		uint64_t room = cap - result->outlen;
+		strm.next_out = result->buffer + result->outlen;
+		strm.avail_out = room > 0x40000000 ? 0x40000000 : (uInt)room;
+		uInt before = strm.avail_out;
+		ret = deflate(&strm, consumed + chunk == len ? Z_FINISH : Z_NO_FLUSH);
+		consumed += chunk - strm.avail_in;
+		result->outlen += before - strm.avail_out;
+		if(ret == Z_STREAM_ERROR || (ret == Z_BUF_ERROR && result->outlen == cap)) {
+			deflateEnd(&strm);
+			return 0;
+		}
+	}
+	deflateEnd(&strm);
+	result->out = result->buffer;
+	return 1;
+}
+
+static void zipbatch_process(ZipbatchJob* job, long index)
+{
+	ZipbatchEntry* entry = &job->entries[index];
+	ZipbatchResult* result = &job->results[index];
+	result->timestamp = entry->timestamp;
+	result->mode = entry->mode < 0 ? (unsigned int)-1 : (unsigned int)entry->mode & 0xffff;
+	const unsigned char* src = entry->data;
+	result->usize = entry->size;
+	if(entry->path != NULL) {
+		if(zipbatch_stat_file(entry->path, result) == 0) {
+			result->error = 1;
+			return;
+		}
+		// Large files are left to the writer thread, which streams them
+		// into the archive without holding the whole content in memory
+		if(result->usize >= ZIPBATCH_STREAM_THRESHOLD) {
+			result->stream = 1;
+			return;
+		}
+		if(zipbatch_read_file(entry->path, result) == 0) {
+			result->error = 1;
+			return;
+		}
+		src = result->input;
+	}
+	if(result->timestamp < 0) {
+		result->timestamp = (long)time(NULL);
+	}
+	if(result->mode == (unsigned int)-1) {
+		result->mode = ZIPBATCH_DEFAULT_MODE;
+	}
+	size_t crclen = 0;
+	unsigned long crc = crc32_z(0L, Z_NULL, 0);
+	while(crclen < result->usize) {
+		size_t n = result->usize - crclen > 0x40000000 ? 0x40000000 : (size_t)(result->usize - crclen);
+		crc = crc32_z(crc, src + crclen, n);
+		crclen += n;
+	}
+	result->crc = crc;
+	if(entry->level != 0 && result->usize > 0) {
+		if(zipbatch_deflate(src, result->usize, entry->level, result) == 0) {
+			result->error = 1;
+			return;
+		}
+		if(result->outlen < result->usize) {
+			result->method = Z_DEFLATED;
+			return;
+		}
+		// Incompressible content is stored instead
+		free(result->buffer);
+		result->buffer = NULL;
+	}
+	result->method = 0;
+	result->out = src;
+	result->outlen = result->usize;
+}
+
+static void zipbatch_release(ZipbatchResult* result)
+{
+	free(result->input);
+	free(result->buffer);
+	result->input = NULL;
+	result->buffer = NULL;
+	result->out = NULL;
+}
+
+#ifndef SUSHI_SUPPORT_WIN32
+static void* zipbatch_worker(void* arg)
+{
+	ZipbatchJob* job = (ZipbatchJob*)arg;
+	while(1) {
+		pthread_mutex_lock(&job->lock);
+		while(job->failed == 0 && job->next < job->count && job->next >= job->written + job->window) {
+			pthread_cond_wait(&job->cond, &job->lock);
+		}
+		if(job->failed || job->next >= job->count) {
+			pthread_mutex_unlock(&job->lock);
+			break;
+		}
+		long index = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		zipbatch_process(job, index);
+		pthread_mutex_lock(&job->lock);
+		job->results[index].done = 1;
+		pthread_cond_broadcast(&job->cond);
+		pthread_mutex_unlock(&job->lock);
+	}
+	return NULL;
+}
+#endif
+
+static int zipbatch_wait(ZipbatchJob* job, long index)
+{
+#ifndef SUSHI_SUPPORT_WIN32
+	pthread_mutex_lock(&job->lock);
+	while(job->results[index].done == 0) {
+		pthread_cond_wait(&job->cond, &job->lock);
+	}
+	pthread_mutex_unlock(&job->lock);
+#else
+	zipbatch_process(job, index);
+#endif
+	return job->results[index].error == 0;
+}
+
+static void zipbatch_advance(ZipbatchJob* job, int failed)
+{
+#ifndef SUSHI_SUPPORT_WIN32
+	pthread_mutex_lock(&job->lock);
+	job->written++;
+	if(failed) {
+		job->failed = 1;
+	}
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+#else
+	job->written++;
+#endif
+}
+
+static int zipbatch_get_default_thread_count()
+{
+#ifndef SUSHI_SUPPORT_WIN32
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if(n > 0) {
+		return (int)n;
+	}
+#endif
+	return 1;
+}
+
+static unsigned char* zipbatch_put16(unsigned char* p, unsigned long v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	return p + 2;
+}
+
+static unsigned char* zipbatch_put32(unsigned char* p, unsigned long v)
+{
+	p = zipbatch_put16(p, v & 0xffff);
+	return zipbatch_put16(p, (v >> 16) & 0xffff);
+}
+
+static unsigned char* zipbatch_put64(unsigned char* p, uint64_t v)
+{
+	p = zipbatch_put32(p, (unsigned long)(v & 0xffffffff));
+	return zipbatch_put32(p, (unsigned long)(v >> 32));
+}
+
+static void zipbatch_dos_time(long timestamp, ZipbatchRecord* record)
+{
+	time_t tt = (time_t)timestamp;
+#ifdef SUSHI_SUPPORT_WIN32
+	struct tm* tmv = localtime(&tt);
+#else
+	struct tm tm;
+	struct tm* tmv = localtime_r(&tt, &tm);
+#endif
+	if(tmv == NULL || tmv->tm_year < 80) {
+		record->date = (1 << 5) | 1;
+		record->time = 0;
+		return;
+	}
+	record->date = ((tmv->tm_year - 80) << 9) | ((tmv->tm_mon + 1) << 5) | tmv->tm_mday;
+	record->time = (tmv->tm_hour << 11) | (tmv->tm_min << 5) | (tmv->tm_sec / 2);
+}
+
+static int zipbatch_write_all(FILE* fp, const void* data, uint64_t len, uint64_t* offset)
+{
+	const unsigned char* p = (const unsigned char*)data;
+	uint64_t done = 0;
+	while(done < len) {
+		size_t n = fwrite(p + done, 1, (size_t)(len - done), fp);
+		if(n == 0) {
+			return 0;
+		}
+		done += n;
+	}
+	*offset += len;
+	return 1;
+}
+
+static int zipbatch_write_local_header(FILE* fp, ZipbatchEntry* entry, ZipbatchResult* result, ZipbatchRecord* record, int zip64, uint64_t* offset)
+{
+	unsigned char header[30 + 20];
+	size_t namelen = strlen(entry->name);
+	unsigned char* p = zipbatch_put32(header, 0x04034b50);
+	p = zipbatch_put16(p, zip64 ? 45 : 20);
+	p = zipbatch_put16(p, 0x0800);
+	p = zipbatch_put16(p, result->method);
+	p = zipbatch_put16(p, record->time);
+	p = zipbatch_put16(p, record->date);
+	p = zipbatch_put32(p, result->crc);
+	p = zipbatch_put32(p, zip64 ? ZIPBATCH_MAX32 : (unsigned long)result->outlen);
+	p = zipbatch_put32(p, zip64 ? ZIPBATCH_MAX32 : (unsigned long)result->usize);
+	p = zipbatch_put16(p, namelen);
+	p = zipbatch_put16(p, zip64 ? 20 : 0);
+	if(zipbatch_write_all(fp, header, 30, offset) == 0 || zipbatch_write_all(fp, entry->name, namelen, offset) == 0) {
+		return 0;
+	}
+	if(zip64) {
+		p = zipbatch_put16(p, 0x0001);
+		p = zipbatch_put16(p, 16);
+		p = zipbatch_put64(p, result->usize);
+		p = zipbatch_put64(p, result->outlen);
+		if(zipbatch_write_all(fp, header + 30, 20, offset) == 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int zipbatch_write_local(FILE* fp, ZipbatchEntry* entry, ZipbatchResult* result, ZipbatchRecord* record, uint64_t* offset)
+{
+	int zip64 = result->usize >= ZIPBATCH_MAX32 || result->outlen >= ZIPBATCH_MAX32;
+	record->offset = *offset;
+	zipbatch_dos_time(result->timestamp, record);
+	if(zipbatch_write_local_header(fp, entry, result, record, zip64, offset) == 0) {
+		return 0;
+	}
+	return zipbatch_write_all(fp, result->out, result->outlen, offset);
+}
+
+static int zipbatch_stream_data(FILE* fp, FILE* in, ZipbatchEntry* entry, ZipbatchResult* result, uint64_t* offset)
+{
+	unsigned char input[ZIPBATCH_STREAM_CHUNK];
+	unsigned char output[ZIPBATCH_STREAM_CHUNK];
+	z_stream strm;
+	memset(&strm, 0, sizeof(z_stream));
+	if(result->method == Z_DEFLATED && deflateInit2(&strm, entry->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return 0;
+	}
+	int ok = 1;
+	uint64_t consumed = 0;
+	unsigned long crc = crc32_z(0L, Z_NULL, 0);
+	while(ok && consumed < result->usize) {
+		size_t want = result->usize - consumed > ZIPBATCH_STREAM_CHUNK ? ZIPBATCH_STREAM_CHUNK : (size_t)(result->usize - consumed);
+		size_t n = fread(input, 1, want, in);
+		if(n == 0) {
+			ok = 0;
+			break;
+		}
+		consumed += n;
+		crc = crc32_z(crc, input, n);
+		if(result->method != Z_DEFLATED) {
+			ok = zipbatch_write_all(fp, input, n, offset);
+			continue;
+		}
+		strm.next_in = input;
+		strm.avail_in = (uInt)n;
+		do {
+			strm.next_out = output;
+			strm.avail_out = sizeof(output);
+			if(deflate(&strm, consumed == result->usize ? Z_FINISH : Z_NO_FLUSH) == Z_STREAM_ERROR) {
+				ok = 0;
+				break;
+			}
+			ok = zipbatch_write_all(fp, output, sizeof(output) - strm.avail_out, offset);
+		}
+		while(ok && strm.avail_out == 0);
+	}
+	if(result->method == Z_DEFLATED) {
+		deflateEnd(&strm);
+	}
+	result->crc = crc;
+	return ok;
+}
+
+// Writes an entry that is too large to be buffered by reading and
+// compressing its source file in chunks. The local header is written
+// with placeholder values first and rewritten once the checksum and
+// sizes are known; the deflated form is kept even if it came out
+// slightly larger than the content.
+static int zipbatch_write_stream(FILE* fp, ZipbatchEntry* entry, ZipbatchResult* result, ZipbatchRecord* record, uint64_t* offset)
+{
+	if(result->timestamp < 0) {
+		result->timestamp = (long)time(NULL);
+	}
+	if(result->mode == (unsigned int)-1) {
+		result->mode = ZIPBATCH_DEFAULT_MODE;
+	}
+	result->method = entry->level != 0 ? Z_DEFLATED : 0;
+	uint64_t bound = result->method == Z_DEFLATED ? zipbatch_deflate_bound(result->usize) : result->usize;
+	int zip64 = result->usize >= ZIPBATCH_MAX32 || bound >= ZIPBATCH_MAX32;
+	FILE* in = fopen(entry->path, "rb");
+	if(in == NULL) {
+		return 0;
+	}
+	record->offset = *offset;
+	zipbatch_dos_time(result->timestamp, record);
+	int ok = zipbatch_write_local_header(fp, entry, result, record, zip64, offset);
+	uint64_t start = *offset;
+	if(ok) {
+		ok = zipbatch_stream_data(fp, in, entry, result, offset);
+	}
+	fclose(in);
+	if(ok == 0) {
+		return 0;
+	}
+	result->outlen = *offset - start;
+	uint64_t rewrite = record->offset;
+	if(fflush(fp) != 0 || zipbatch_seek(fp, (long long)record->offset, SEEK_SET) != 0) {
+		return 0;
+	}
+	if(zipbatch_write_local_header(fp, entry, result, record, zip64, &rewrite) == 0) {
+		return 0;
+	}
+	return fflush(fp) == 0 && zipbatch_seek(fp, (long long)*offset, SEEK_SET) == 0;
+}
+
+static int zipbatch_write_central(FILE* fp, ZipbatchEntry* entry, ZipbatchResult* result, ZipbatchRecord* record, uint64_t* offset)
+{
+	unsigned char header[46 + 28];
+	unsigned char* extra = header + 46;
+	size_t namelen = strlen(entry->name);
+	unsigned char* e = zipbatch_put16(extra, 0x0001);
+	e += 2;
+	if(result->usize >= ZIPBATCH_MAX32) {
+		e = zipbatch_put64(e, result->usize);
+	}
+	if(result->outlen >= ZIPBATCH_MAX32) {
+		e = zipbatch_put64(e, result->outlen);
+	}
+	if(record->offset >= ZIPBATCH_MAX32) {
+		e = zipbatch_put64(e, record->offset);
+	}
+	unsigned long extralen = e - extra;
+	if(extralen == 4) {
+		extralen = 0;
+	}
+	else {
+		zipbatch_put16(extra + 2, extralen - 4);
+	}
+	unsigned char* p = zipbatch_put32(header, 0x02014b50);
+	p = zipbatch_put16(p, ZIPBATCH_VERSIONMADEBY);
+	p = zipbatch_put16(p, extralen > 0 ? 45 : 20);
+	p = zipbatch_put16(p, 0x0800);
+	p = zipbatch_put16(p, result->method);
+	p = zipbatch_put16(p, record->time);
+	p = zipbatch_put16(p, record->date);
+	p = zipbatch_put32(p, result->crc);
+	p = zipbatch_put32(p, result->outlen >= ZIPBATCH_MAX32 ? ZIPBATCH_MAX32 : (unsigned long)result->outlen);
+	p = zipbatch_put32(p, result->usize >= ZIPBATCH_MAX32 ? ZIPBATCH_MAX32 : (unsigned long)result->usize);
+	p = zipbatch_put16(p, namelen);
+	p = zipbatch_put16(p, extralen);
+	p = zipbatch_put16(p, 0);
+	p = zipbatch_put16(p, 0);
+	p = zipbatch_put16(p, 0);
+	p = zipbatch_put32(p, (unsigned long)result->mode << 16);
+	p = zipbatch_put32(p, record->offset >= ZIPBATCH_MAX32 ? ZIPBATCH_MAX32 : (unsigned long)record->offset);
+	if(zipbatch_write_all(fp, header, 46, offset) == 0 || zipbatch_write_all(fp, entry->name, namelen, offset) == 0) {
+		return 0;
+	}
+	return zipbatch_write_all(fp, extra, extralen, offset);
+}
+
+static int zipbatch_write_end(FILE* fp, long count, uint64_t cdoffset, uint64_t cdsize, uint64_t* offset)
+{
+	unsigned char record[56 + 20 + 22];
+	unsigned char* p = record;
+	if((uint64_t)count >= ZIPBATCH_MAX16 || cdoffset >= ZIPBATCH_MAX32 || cdsize >= ZIPBATCH_MAX32) {
+		uint64_t eocd64 = *offset;
+		p = zipbatch_put32(p, 0x06064b50);
+		p = zipbatch_put64(p, 44);
+		p = zipbatch_put16(p, ZIPBATCH_VERSIONMADEBY);
+		p = zipbatch_put16(p, 45);
+		p = zipbatch_put32(p, 0);
+		p = zipbatch_put32(p, 0);
+		p = zipbatch_put64(p, (uint64_t)count);
+		p = zipbatch_put64(p, (uint64_t)count);
+		p = zipbatch_put64(p, cdsize);
+		p = zipbatch_put64(p, cdoffset);
+		p = zipbatch_put32(p, 0x07064b50);
+		p = zipbatch_put32(p, 0);
+		p = zipbatch_put64(p, eocd64);
+		p = zipbatch_put32(p, 1);
+	}
+	p = zipbatch_put32(p, 0x06054b50);
+	p = zipbatch_put16(p, 0);
+	p = zipbatch_put16(p, 0);
+	p = zipbatch_put16(p, (uint64_t)count >= ZIPBATCH_MAX16 ? ZIPBATCH_MAX16 : (unsigned long)count);
+	p = zipbatch_put16(p, (uint64_t)count >= ZIPBATCH_MAX16 ? ZIPBATCH_MAX16 : (unsigned long)count);
+	p = zipbatch_put32(p, cdsize >= ZIPBATCH_MAX32 ? ZIPBATCH_MAX32 : (unsigned long)cdsize);
+	p = zipbatch_put32(p, cdoffset >= ZIPBATCH_MAX32 ? ZIPBATCH_MAX32 : (unsigned long)cdoffset);
+	p = zipbatch_put16(p, 0);
+	return zipbatch_write_all(fp, record, p - record, offset);
+}
+
+int zipbatch_write(const char* path, ZipbatchEntry* entries, long count, int threads)
+{
+	if(path == NULL || (entries == NULL && count > 0) || count < 0) {
+		return 0;
+	}
+	FILE* fp = fopen(path, "wb");
+	if(fp == NULL) {
+		return 0;
+	}
+	if(threads < 1) {
+		threads = zipbatch_get_default_thread_count();
+	}
+	if(threads > ZIPBATCH_MAX_THREADS) {
+		threads = ZIPBATCH_MAX_THREADS;
+	}
+	ZipbatchJob job;
+	memset(&job, 0, sizeof(ZipbatchJob));
+	job.entries = entries;
+	job.count = count;
+	job.window = threads * 2;
+	job.results = calloc(count > 0 ? count : 1, sizeof(ZipbatchResult));
+	ZipbatchRecord* records = malloc((count > 0 ? count : 1) * sizeof(ZipbatchRecord));
+	if(job.results == NULL || records == NULL) {
+		free(job.results);
+		free(records);
+		fclose(fp);
+		return 0;
+	}
+#ifndef SUSHI_SUPPORT_WIN32
+	pthread_t workers[ZIPBATCH_MAX_THREADS];
+	int started = 0;
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+	while(started < threads) {
+		if(pthread_create(&workers[started], NULL, zipbatch_worker, &job) != 0) {
+			break;
+		}
+		started++;
+	}
+	if(started < 1) {
+		job.failed = 1;
+	}
+#endif
+	int ok = job.failed == 0;
+	uint64_t offset = 0;
+	long n;
+	for(n=0; n<count && ok; n++) {
+		ok = zipbatch_wait(&job, n);
+		if(ok && job.results[n].stream) {
+			ok = zipbatch_write_stream(fp, &entries[n], &job.results[n], &records[n], &offset);
+		}
+		else if(ok) {
+			ok = zipbatch_write_local(fp, &entries[n], &job.results[n], &records[n], &offset);
+		}
+		zipbatch_release(&job.results[n]);
+		zipbatch_advance(&job, ok == 0);
+	}
+#ifndef SUSHI_SUPPORT_WIN32
+	while(started > 0) {
+		pthread_join(workers[--started], NULL);
+	}
+	pthread_mutex_destroy(&job.lock);
+	pthread_cond_destroy(&job.cond);
+#endif
+	for(n=0; n<count; n++) {
+		zipbatch_release(&job.results[n]);
+	}
+	uint64_t cdoffset = offset;
+	for(n=0; n<count && ok; n++) {
+		ok = zipbatch_write_central(fp, &entries[n], &job.results[n], &records[n], &offset);
+	}
+	if(ok) {
+		ok = zipbatch_write_end(fp, count, cdoffset, offset - cdoffset, &offset);
+	}
+	if(fclose(fp) != 0) {
+		ok = 0;
+	}
+	free(job.results);
+	free(records);
+	if(ok == 0) {
+		remove(path);
+	}
+	return ok;
+}
@@ -0,0 +1,59 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef ZIPBATCH_H
+#define ZIPBATCH_H
+
+#include <stdint.h>
+
+/*
+ * Writes a complete zip archive from a list of entries in one call. Entry
+ * contents are compressed concurrently on a pool of worker threads while the
+ * calling thread writes the finished entries to the archive in list order.
+ * Zip64 records are emitted for any entry, offset or count that needs them.
+ */
+
+typedef struct ZipbatchEntry
+{
+	const char* name;
+	const char* path;
+	const unsigned char* data;
+	uint64_t size;
+	int level;
+	long mode;
+	long timestamp;
+} ZipbatchEntry;
+
+/*
+ * Each entry takes its content either from the file at "path" or from
+ * "data"/"size". A level of 0 stores the entry uncompressed, -1 selects the
+ * zlib default. A negative mode or timestamp is taken from the source file
+ * (or defaults for in-memory data). A threads value below 1 uses one thread
+ * per processor. Files of a megabyte or more are streamed into the archive in
+ * chunks rather than read into memory. Returns 1 on success and 0 on failure.
+ */
+
+int zipbatch_write(const char* path, ZipbatchEntry* entries, long count, int threads);
+
+#endif
@@ -0,0 +1,275 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "zlib.h"
+#include "zipmap.h"
+
+struct Zipmap
+{
+	MappedFile* file;
+	const unsigned char* data;
+	uint64_t size;
+	ZipmapEntry* entries;
+	long count;
+	MappedFileIndex index;
+};
+
+static unsigned int zipmap_read16(const unsigned char* p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t zipmap_read32(const unsigned char* p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t zipmap_read64(const unsigned char* p)
+{
+	return (uint64_t)zipmap_read32(p) | ((uint64_t)zipmap_read32(p + 4) << 32);
+}
+
+void zipmap_close(Zipmap* map)
+{
+	if(map == NULL) {
+		return;
+	}
+	mappedfile_release(map->file);
+	mappedfile_index_free(&map->index);
+	free(map->entries);
+	free(map);
+}
+
+// Locates the central directory from the end of central directory record,
+// following the zip64 locator when the classic record is saturated.
+static int zipmap_find_directory(Zipmap* map, uint64_t* offset, uint64_t* count)
+{
+	const unsigned char* data = map->data;
+	uint64_t pos = map->size - 22;
+	uint64_t stop = map->size > 22 + 65535 ? map->size - 22 - 65535 : 0;
+	while(1) {
+		if(zipmap_read32(data + pos) == 0x06054b50) {
+			break;
+		}
+		if(pos == stop) {
+			return 0;
+		}
+		pos--;
+	}
+	*count = zipmap_read16(data + pos + 10);
+	*offset = zipmap_read32(data + pos + 16);
+	if(pos >= 20 && zipmap_read32(data + pos - 20) == 0x07064b50) {
+		uint64_t eocd64 = zipmap_read64(data + pos - 20 + 8);
+		if(eocd64 > map->size - 56 || zipmap_read32(data + eocd64) != 0x06064b50) {
+			return 0;
+		}
+		*count = zipmap_read64(data + eocd64 + 32);
+		*offset = zipmap_read64(data + eocd64 + 48);
+	}
+	return *offset < map->size;
+}
+
+static void zipmap_read_zip64_extra(ZipmapEntry* entry, const unsigned char* extra, unsigned int extralen, int needUsize, int needCsize, int needOffset)
+{
+	unsigned int pos = 0;
+	while(pos + 4 <= extralen) {
+		unsigned int id = zipmap_read16(extra + pos);
+		unsigned int len = zipmap_read16(extra + pos + 2);
+		if(pos + 4 + len > extralen) {
+			return;
+		}
+		if(id == 0x0001) {
+			const unsigned char* p = extra + pos + 4;
+			const unsigned char* end = p + len;
+			if(needUsize && p + 8 <= end) {
+				entry->uncompressedSize = zipmap_read64(p);
+				p += 8;
+			}
+			if(needCsize && p + 8 <= end) {
+				entry->compressedSize = zipmap_read64(p);
+				p += 8;
+			}
+			if(needOffset && p + 8 <= end) {
+				entry->localOffset = zipmap_read64(p);
+			}
+			return;
+		}
+		pos += 4 + len;
+	}
+}
+
+static int zipmap_build_index(Zipmap* map, uint64_t offset, uint64_t count)
+{
+	// each central directory record takes at least 46 bytes
+	if(count > (map->size - offset) / 46) {
+		return 0;
+	}
+	map->entries = (ZipmapEntry*)calloc(count > 0 ? count : 1, sizeof(ZipmapEntry));
+	if(map->entries == NULL || mappedfile_index_init(&map->index, (long)count) == 0) {
+		return 0;
+	}
+	const unsigned char* p = map->data + offset;
+	const unsigned char* end = map->data + map->size;
+	uint64_t n;
+	for(n=0; n<count; n++) {
+		if(end - p < 46 || zipmap_read32(p) != 0x02014b50) {
+			return 0;
+		}
+		unsigned int namelen = zipmap_read16(p + 28);
+		unsigned int extralen = zipmap_read16(p + 30);
+		unsigned int commentlen = zipmap_read16(p + 32);
+		if((uint64_t)(end - p) < 46 + (uint64_t)namelen + extralen + commentlen) {
+			return 0;
+		}
+		ZipmapEntry* entry = &map->entries[n];
+		entry->flags = zipmap_read16(p + 8);
+		entry->method = zipmap_read16(p + 10);
+		entry->crc = zipmap_read32(p + 16);
+		entry->compressedSize = zipmap_read32(p + 20);
+		entry->uncompressedSize = zipmap_read32(p + 24);
+		entry->mode = zipmap_read32(p + 38) >> 16 & 0xffff;
+		entry->localOffset = zipmap_read32(p + 42);
+		entry->name = (const char*)p + 46;
+		entry->namelen = namelen;
+		zipmap_read_zip64_extra(entry, p + 46 + namelen, extralen, entry->uncompressedSize == 0xffffffffU, entry->compressedSize == 0xffffffffU, entry->localOffset == 0xffffffffU);
+		mappedfile_index_add(&map->index, entry->name, namelen, (long)n);
+		p += 46 + namelen + extralen + commentlen;
+	}
+	map->count = (long)count;
+	return 1;
+}
+
+Zipmap* zipmap_open(const char* path)
+{
+	Zipmap* map = (Zipmap*)calloc(1, sizeof(Zipmap));
+	if(map == NULL) {
+		return NULL;
+	}
+	map->file = mappedfile_open(path, 22);
+	if(map->file == NULL) {
+		free(map);
+		return NULL;
+	}
+	map->data = map->file->data;
+	map->size = map->file->size;
+	uint64_t offset = 0;
+	uint64_t count = 0;
+	if(zipmap_find_directory(map, &offset, &count) == 0 || zipmap_build_index(map, offset, count) == 0) {
+		zipmap_close(map);
+		return NULL;
+	}
+	return map;
+}
+
+MappedFile* zipmap_get_file(Zipmap* map)
+{
+	return map->file;
+}
+
+long zipmap_get_entry_count(Zipmap* map)
+{
+	return map->count;
+}
+
+ZipmapEntry* zipmap_get_entry(Zipmap* map, long index)
+{
+	if(index < 0 || index >= map->count) {
+		return NULL;
+	}
+	return &map->entries[index];
+}
+
+long zipmap_find(Zipmap* map, const char* name, long namelen)
+{
+	return mappedfile_index_find(&map->index, name, namelen);
+}
+
+const unsigned char* zipmap_get_entry_data(Zipmap* map, long index)
+{
+	ZipmapEntry* entry = zipmap_get_entry(map, index);
+	if(entry == NULL || (entry->flags & 1) != 0 || entry->localOffset > map->size - 30) {
+		return NULL;
+	}
+	const unsigned char* p = map->data + entry->localOffset;
+	if(zipmap_read32(p) != 0x04034b50) {
+		return NULL;
+	}
+	uint64_t start = entry->localOffset + 30 + zipmap_read16(p + 26) + zipmap_read16(p + 28);
+	if(start > map->size || entry->compressedSize > map->size - start) {
+		return NULL;
+	}
+	return map->data + start;
+}
+
+int zipmap_extract(Zipmap* map, long index, unsigned char* dst)
+{
+	ZipmapEntry* entry = zipmap_get_entry(map, index);
+	const unsigned char* src = zipmap_get_entry_data(map, index);
+	if(src == NULL) {
+		return 0;
+	}
+	if(entry->method == ZIPMAP_STORED) {
+		if(entry->compressedSize != entry->uncompressedSize) {
+			return 0;
+		}
+		memcpy(dst, src, (size_t)entry->uncompressedSize);
+	}
+	else if(entry->method == ZIPMAP_DEFLATED) {
+		z_stream strm;
+		memset(&strm, 0, sizeof(z_stream));
+		if(inflateInit2(&strm, -MAX_WBITS) != Z_OK) {
+			return 0;
+		}
+		// feed in pieces so that entries over 4 GB fit the 32-bit counters
+		uint64_t inLeft = entry->compressedSize;
+		uint64_t outLeft = entry->uncompressedSize;
+		int r = Z_OK;
+		strm.next_in = (unsigned char*)src;
+		strm.next_out = dst;
+		while(r == Z_OK) {
+			if(strm.avail_in == 0) {
+				strm.avail_in = inLeft > 0x40000000 ? 0x40000000 : (uInt)inLeft;
+				inLeft -= strm.avail_in;
+			}
+			if(strm.avail_out == 0) {
+				strm.avail_out = outLeft > 0x40000000 ? 0x40000000 : (uInt)outLeft;
+				outLeft -= strm.avail_out;
+			}
+			r = inflate(&strm, Z_FINISH);
+			if(r == Z_BUF_ERROR && ((strm.avail_in == 0 && inLeft > 0) || (strm.avail_out == 0 && outLeft > 0))) {
+				r = Z_OK;
+			}
+		}
+		inflateEnd(&strm);
+		if(r != Z_STREAM_END || strm.avail_out != 0 || outLeft != 0) {
+			return 0;
+		}
+	}
+	else {
+		return 0;
+	}
+	return crc32_z(0L, dst, (z_size_t)entry->uncompressedSize) == entry->crc;
+}
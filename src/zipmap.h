@@ -0,0 +1,66 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef ZIPMAP_H
+#define ZIPMAP_H
+
+#include <stdint.h>
+#include "mappedfile.h"
+
+/*
+ * Read-only access to a zip archive through a memory mapping of the whole
+ * file. The central directory is parsed once on open (including zip64
+ * records) into an entry array with a hash index on entry names.
+ */
+
+#define ZIPMAP_STORED 0
+#define ZIPMAP_DEFLATED 8
+
+typedef struct ZipmapEntry
+{
+	const char* name;
+	int namelen;
+	int method;
+	int flags;
+	unsigned int mode;
+	unsigned long crc;
+	uint64_t compressedSize;
+	uint64_t uncompressedSize;
+	uint64_t localOffset;
+} ZipmapEntry;
+
+typedef struct Zipmap Zipmap;
+
+// Entry data points into the mapped file; a reference to it taken with
+// mappedfile_retain keeps that data valid after the Zipmap is closed.
+Zipmap* zipmap_open(const char* path);
+void zipmap_close(Zipmap* map);
+MappedFile* zipmap_get_file(Zipmap* map);
+long zipmap_get_entry_count(Zipmap* map);
+ZipmapEntry* zipmap_get_entry(Zipmap* map, long index);
+long zipmap_find(Zipmap* map, const char* name, long namelen);
+const unsigned char* zipmap_get_entry_data(Zipmap* map, long index);
+int zipmap_extract(Zipmap* map, long index, unsigned char* dst);
+
+#endif
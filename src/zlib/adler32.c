@@ -6,6 +6,7 @@
 /* @(#) $Id$ */
 
 #include "zutil.h"
+#include "zsimd.h"
 
 local uLong adler32_combine_ OF((uLong adler1, uLong adler2, z_off64_t len2));
 
@@ -87,6 +88,16 @@ uLong ZEXPORT adler32_z(adler, buf, len)
     if (buf == Z_NULL)
         return 1L;
 
+#ifdef ZSIMD_X86
+    if (len >= ZSIMD_ADLER32_MIN) {
+        int features = zsimd_cpu_features();
+        if (features & ZSIMD_AVX2)
+            return zsimd_adler32_avx2(adler | (sum2 << 16), buf, len);
+        if (features & ZSIMD_SSSE3)
+            return zsimd_adler32_ssse3(adler | (sum2 << 16), buf, len);
+    }
+#endif /* ZSIMD_X86 */
+
     /* in case short lengths are provided, keep it somewhat fast */
     if (len < 16) {
         while (len--) {
@@ -29,6 +29,7 @@
 #endif /* MAKECRCH */
 
 #include "zutil.h"      /* for STDC and FAR definitions */
+#include "zsimd.h"
 
 /* Definitions for doing the crc four data bytes at a time. */
 #if !defined(NOBYFOUR) && defined(Z_U4)
@@ -211,6 +212,17 @@ unsigned long ZEXPORT crc32_z(crc, buf, len)
         make_crc_table();
 #endif /* DYNAMIC_CRC_TABLE */
 
+#ifdef ZSIMD_X86
+    if (len >= ZSIMD_CRC32_MIN && (zsimd_cpu_features() & ZSIMD_PCLMUL)) {
+        z_size_t chunk = len & ~(z_size_t)15;
+        crc = zsimd_crc32_pclmul(crc ^ 0xffffffffUL, buf, chunk) ^ 0xffffffffUL;
+        buf += chunk;
+        len -= chunk;
+        if (len == 0)
+            return crc;
+    }
+#endif /* ZSIMD_X86 */
+
 #ifdef BYFOUR
     if (sizeof(void *) == sizeof(ptrdiff_t)) {
         z_crc_t endian;
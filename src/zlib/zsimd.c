@@ -0,0 +1,222 @@
+/* zsimd.c -- SIMD crc32 and adler32 kernels with runtime CPU dispatch
+ * For conditions of distribution and use, see copyright notice in zlib.h
+ *
+ * The CRC-32 kernel folds 64 bytes per iteration with carry-less
+ * multiplication and finishes with a Barrett reduction, following Intel's
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ * Instruction" (Gopal et al., 2009) with the bit-reflected constants for
+ * the zlib polynomial. The Adler-32 kernels compute the byte sums with
+ * PSADBW and the position-weighted sums with PMADDUBSW over 32-byte blocks,
+ * reducing modulo BASE once per NMAX bytes just like the scalar code.
+ */
+
+#include "zsimd.h"
+
+#ifdef ZSIMD_X86
+
+#include <stdint.h>
+#include <immintrin.h>
+
+#define BASE 65521U
+#define NMAX 5552
+
+static int zsimd_features = -1;
+
+int ZLIB_INTERNAL zsimd_cpu_features()
+{
+    int f = zsimd_features;
+    if (f < 0) {
+        f = 0;
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+            f |= ZSIMD_PCLMUL;
+        if (__builtin_cpu_supports("ssse3"))
+            f |= ZSIMD_SSSE3;
+        if (__builtin_cpu_supports("avx2"))
+            f |= ZSIMD_AVX2;
+        zsimd_features = f;
+    }
+    return f;
+}
+
+/* ========================================================================= */
+__attribute__((target("pclmul,sse4.1")))
+uLong ZLIB_INTERNAL zsimd_crc32_pclmul(crc, buf, len)
+    uLong crc;
+    const unsigned char FAR *buf;
+    z_size_t len;
+{
+    /* x^(4*128+64), x^(4*128), x^(128+64), x^128, x^64 mod P, and the
+       Barrett constants mu and P', all bit-reflected */
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4ULL, 0x01c6e41596ULL };
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0ULL, 0x00ccaa009eULL };
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124ULL, 0 };
+    static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641ULL, 0x01f7011641ULL };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, mask;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 16));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 32));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 48));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)(uint32_t)crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    buf += 64;
+    len -= 64;
+
+    /* fold four lanes in parallel, 64 bytes at a time */
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(buf + 0)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(buf + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(buf + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(buf + 48)));
+        buf += 64;
+        len -= 64;
+    }
+
+    /* fold the four lanes into one */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* fold the remaining 16-byte blocks */
+    while (len >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)buf));
+        buf += 16;
+        len -= 16;
+    }
+
+    /* reduce 128 bits to 64 */
+    mask = _mm_setr_epi32(~0, 0, ~0, 0);
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, mask);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, mask);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uLong)(uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+/* ========================================================================= */
+local uLong zsimd_adler32_tail(s1, s2, buf, len)
+    uLong s1;
+    uLong s2;
+    const Bytef *buf;
+    z_size_t len;
+{
+    while (len--) {
+        s1 += *buf++;
+        s2 += s1;
+    }
+    return (s1 % BASE) | ((s2 % BASE) << 16);
+}
+
+__attribute__((target("ssse3")))
+uLong ZLIB_INTERNAL zsimd_adler32_ssse3(adler, buf, len)
+    uLong adler;
+    const Bytef *buf;
+    z_size_t len;
+{
+    uint32_t s1 = adler & 0xffff;
+    uint32_t s2 = (adler >> 16) & 0xffff;
+    const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+
+    while (len >= 32) {
+        z_size_t blocks = (len < NMAX ? len : NMAX) / 32;
+        __m128i v_ps = zero, v_s1 = zero, v_s2 = zero;
+        len -= blocks * 32;
+        /* s1 contributes once per byte of this run */
+        s2 += s1 * (uint32_t)(blocks * 32);
+        while (blocks--) {
+            __m128i b1 = _mm_loadu_si128((const __m128i *)buf);
+            __m128i b2 = _mm_loadu_si128((const __m128i *)(buf + 16));
+            v_ps = _mm_add_epi32(v_ps, v_s1);
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(b1, zero));
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(b2, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(b1, tap1), ones));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(b2, tap2), ones));
+            buf += 32;
+        }
+        v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(2, 3, 0, 1)));
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+        s1 += (uint32_t)_mm_cvtsi128_si32(v_s1);
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+        s2 += (uint32_t)_mm_cvtsi128_si32(v_s2);
+        s1 %= BASE;
+        s2 %= BASE;
+    }
+    return zsimd_adler32_tail(s1, s2, buf, len);
+}
+
+__attribute__((target("avx2")))
+uLong ZLIB_INTERNAL zsimd_adler32_avx2(adler, buf, len)
+    uLong adler;
+    const Bytef *buf;
+    z_size_t len;
+{
+    uint32_t s1 = adler & 0xffff;
+    uint32_t s2 = (adler >> 16) & 0xffff;
+    const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+        16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+
+    while (len >= 32) {
+        z_size_t blocks = (len < NMAX ? len : NMAX) / 32;
+        __m256i v_ps = zero, v_s1 = zero, v_s2 = zero;
+        __m128i h1, h2;
+        len -= blocks * 32;
+        s2 += s1 * (uint32_t)(blocks * 32);
+        while (blocks--) {
+            __m256i b = _mm256_loadu_si256((const __m256i *)buf);
+            v_ps = _mm256_add_epi32(v_ps, v_s1);
+            v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(b, zero));
+            v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(b, tap), ones));
+            buf += 32;
+        }
+        v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+        h1 = _mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1));
+        h1 = _mm_add_epi32(h1, _mm_shuffle_epi32(h1, _MM_SHUFFLE(2, 3, 0, 1)));
+        h1 = _mm_add_epi32(h1, _mm_shuffle_epi32(h1, _MM_SHUFFLE(1, 0, 3, 2)));
+        s1 += (uint32_t)_mm_cvtsi128_si32(h1);
+        h2 = _mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1));
+        h2 = _mm_add_epi32(h2, _mm_shuffle_epi32(h2, _MM_SHUFFLE(2, 3, 0, 1)));
+        h2 = _mm_add_epi32(h2, _mm_shuffle_epi32(h2, _MM_SHUFFLE(1, 0, 3, 2)));
+        s2 += (uint32_t)_mm_cvtsi128_si32(h2);
+        s1 %= BASE;
+        s2 %= BASE;
+    }
+    return zsimd_adler32_tail(s1, s2, buf, len);
+}
+
+#endif /* ZSIMD_X86 */
@@ -0,0 +1,34 @@
+/* zsimd.h -- SIMD crc32 and adler32 kernels with runtime CPU dispatch
+ * For conditions of distribution and use, see copyright notice in zlib.h
+ */
+
+#ifndef ZSIMD_H
+#define ZSIMD_H
+
+#include "zutil.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(NO_ZSIMD)
+#  define ZSIMD_X86
+#endif
+
+#ifdef ZSIMD_X86
+
+#define ZSIMD_PCLMUL 1
+#define ZSIMD_SSSE3 2
+#define ZSIMD_AVX2 4
+
+/* minimum input sizes below which the table-driven code is faster */
+#define ZSIMD_CRC32_MIN 64
+#define ZSIMD_ADLER32_MIN 64
+
+int ZLIB_INTERNAL zsimd_cpu_features OF((void));
+
+/* crc is the raw (pre-inverted) register; len >= 64 and a multiple of 16 */
+uLong ZLIB_INTERNAL zsimd_crc32_pclmul OF((uLong crc, const unsigned char FAR *buf, z_size_t len));
+
+uLong ZLIB_INTERNAL zsimd_adler32_ssse3 OF((uLong adler, const Bytef *buf, z_size_t len));
+uLong ZLIB_INTERNAL zsimd_adler32_avx2 OF((uLong adler, const Bytef *buf, z_size_t len));
+
+#endif /* ZSIMD_X86 */
+
+#endif /* ZSIMD_H */
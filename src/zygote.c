@@ -0,0 +1,536 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef SUSHI_SUPPORT_LINUX
+// for struct ucred
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include "zygote.h"
+
+#if defined(SUSHI_SUPPORT_LINUX) || defined(SUSHI_SUPPORT_MACOS)
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define ZYGOTE_MAGIC "SZG1"
+#define ZYGOTE_HEADER_SIZE 8
+#define ZYGOTE_MAX_REQUEST_SIZE (64 * 1024 * 1024)
+
+extern char **environ;
+
+typedef struct
+{
+	char* payload;
+	char* cwd;
+	int argc;
+	char** argv;
+	char** envp;
+	int fds[3];
+	int nfds;
+}
+ZygoteRequest;
+
+static volatile pid_t zygote_client_target = 0;
+
+static int zygote_write_all(int fd, const void* data, size_t size)
+{
+	const char* p = (const char*)data;
+	while(size > 0) {
+		ssize_t r = write(fd, p, size);
+		if(r < 0 && errno == EINTR) {
+			continue;
+		}
+		if(r <= 0) {
+			return -1;
+		}
+		p += r;
+		size -= r;
+	}
+	return 0;
+}
+
+static int zygote_read_all(int fd, void* data, size_t size)
+{
+	char* p = (char*)data;
+	while(size > 0) {
+		ssize_t r = read(fd, p, size);
+		if(r < 0 && errno == EINTR) {
+			continue;
+		}
+		if(r <= 0) {
+			return -1;
+		}
+		p += r;
+		size -= r;
+	}
+	return 0;
+}
+
+static int zygote_set_address(struct sockaddr_un* addr, const char* socketPath)
+{
+	if(socketPath == NULL || strlen(socketPath) >= sizeof(addr->sun_path)) {
+		sushi_error("Invalid zygote socket path: `%s'", socketPath ? socketPath : "");
+		return -1;
+	}
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, socketPath);
+	return 0;
+}
+
+static int zygote_open_connection(const char* socketPath)
+{
+	struct sockaddr_un addr;
+	if(zygote_set_address(&addr, socketPath) != 0) {
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0) {
+		return -1;
+	}
+	if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int zygote_listen(const char* socketPath)
+{
+	struct sockaddr_un addr;
+	if(zygote_set_address(&addr, socketPath) != 0) {
+		return -1;
+	}
+	// A socket file that nobody answers on is left over from a previous
+	// server and can be replaced. Anything else is not ours to remove.
+	struct stat st;
+	if(lstat(socketPath, &st) == 0) {
+		int existing = zygote_open_connection(socketPath);
+		if(existing >= 0) {
+			close(existing);
+			sushi_error("A zygote is already listening on `%s'", socketPath);
+			return -1;
+		}
+		if(S_ISSOCK(st.st_mode) == 0 || unlink(socketPath) != 0) {
+			sushi_error("Cannot replace existing file: `%s'", socketPath);
+			return -1;
+		}
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0) {
+		sushi_error("Failed to create zygote socket: %s", strerror(errno));
+		return -1;
+	}
+	mode_t mask = umask(077);
+	int br = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+	umask(mask);
+	if(br != 0 || listen(fd, 128) != 0) {
+		sushi_error("Failed to listen on `%s': %s", socketPath, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void zygote_free_request(ZygoteRequest* request)
+{
+	int n;
+	for(n=0; n<request->nfds; n++) {
+		close(request->fds[n]);
+	}
+	request->nfds = 0;
+	free(request->payload);
+	free(request->argv);
+	free(request->envp);
+	request->payload = NULL;
+	request->argv = NULL;
+	request->envp = NULL;
+}
+
+// On failure the caller releases whatever was received with
+// zygote_free_request.
+static int zygote_receive_request(int conn, ZygoteRequest* request)
+{
+	char header[ZYGOTE_HEADER_SIZE];
+	char control[CMSG_SPACE(sizeof(int) * 3)];
+	struct iovec iov;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	iov.iov_base = header;
+	iov.iov_len = ZYGOTE_HEADER_SIZE;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t r;
+	do {
+		r = recvmsg(conn, &msg, 0);
+	}
+	while(r < 0 && errno == EINTR);
+	if(r <= 0) {
+		return -1;
+	}
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if(cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		// Take ownership of every descriptor passed, even a wrong number of them
+		request->nfds = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+		if(request->nfds > 3) {
+			request->nfds = 3;
+		}
+		memcpy(request->fds, CMSG_DATA(cmsg), sizeof(int) * request->nfds);
+	}
+	if(request->nfds != 3 || (msg.msg_flags & MSG_CTRUNC) != 0) {
+		return -1;
+	}
+	if(r < ZYGOTE_HEADER_SIZE && zygote_read_all(conn, header + r, ZYGOTE_HEADER_SIZE - r) != 0) {
+		return -1;
+	}
+	if(memcmp(header, ZYGOTE_MAGIC, 4) != 0) {
+		return -1;
+	}
+	uint32_t size;
+	memcpy(&size, header + 4, 4);
+	if(size < 8 || size > ZYGOTE_MAX_REQUEST_SIZE) {
+		return -1;
+	}
+	char* payload = (char*)malloc(size + 1);
+	request->payload = payload;
+	if(payload == NULL || zygote_read_all(conn, payload, size) != 0) {
+		return -1;
+	}
+	payload[size] = 0;
+	uint32_t argc, envc;
+	memcpy(&argc, payload, 4);
+	memcpy(&envc, payload + 4, 4);
+	if(argc > size || envc > size) {
+		return -1;
+	}
+	request->argc = (int)argc;
+	request->argv = (char**)malloc(sizeof(char*) * (argc + 1));
+	request->envp = (char**)malloc(sizeof(char*) * (envc + 1));
+	if(request->argv == NULL || request->envp == NULL) {
+		return -1;
+	}
+	char* p = payload + 8;
+	char* end = payload + size;
+	uint32_t n;
+	for(n=0; n<1+argc+envc; n++) {
+		if(p >= end) {
+			return -1;
+		}
+		if(n == 0) {
+			request->cwd = p;
+		}
+		else if(n <= argc) {
+			request->argv[n-1] = p;
+		}
+		else {
+			request->envp[n-1-argc] = p;
+		}
+		p += strlen(p) + 1;
+	}
+	request->argv[argc] = NULL;
+	request->envp[envc] = NULL;
+	return 0;
+}
+
+// Only processes of the user running the zygote may use it. The socket is
+// created accessible to that user alone, but its directory may not be.
+static int zygote_check_peer(int conn)
+{
+	uid_t uid;
+#if defined(SUSHI_SUPPORT_LINUX)
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if(getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+		return -1;
+	}
+	uid = cred.uid;
+#else
+	gid_t gid;
+	if(getpeereid(conn, &uid, &gid) != 0) {
+		return -1;
+	}
+#endif
+	return uid == geteuid() ? 0 : -1;
+}
+
+static int zygote_run_request(lua_State* state, int conn)
+{
+	ZygoteRequest request;
+	memset(&request, 0, sizeof(request));
+	if(zygote_receive_request(conn, &request) != 0) {
+		zygote_free_request(&request);
+		return -1;
+	}
+	int n;
+	for(n=0; n<3; n++) {
+		if(request.fds[n] != n) {
+			dup2(request.fds[n], n);
+		}
+	}
+	for(n=0; n<3; n++) {
+		if(request.fds[n] > 2) {
+			close(request.fds[n]);
+		}
+	}
+	request.nfds = 0;
+	// Buffering was decided by what the server's own stdout was connected to
+	setvbuf(stdout, NULL, isatty(1) ? _IOLBF : _IOFBF, BUFSIZ);
+	environ = request.envp;
+	int32_t pid = (int32_t)getpid();
+	if(zygote_write_all(conn, &pid, 4) != 0) {
+		return -1;
+	}
+	int rv = -1;
+	if(chdir(request.cwd) != 0) {
+		sushi_error("Failed to change directory: `%s'", request.cwd);
+	}
+	else {
+		lua_createtable(state, request.argc, 0);
+		for(n=0; n<request.argc; n++) {
+			lua_pushnumber(state, n + 1);
+			lua_pushstring(state, request.argv[n]);
+			lua_rawset(state, -3);
+		}
+		lua_setglobal(state, "_args");
+		rv = sushi_execute_main(state);
+	}
+	fflush(stdout);
+	fflush(stderr);
+	int32_t status = (int32_t)rv;
+	zygote_write_all(conn, &status, 4);
+	return rv;
+}
+
+int zygote_serve(const char* socketPath, SushiCode* code)
+{
+	lua_State* state = sushi_create_new_state();
+	if(state == NULL) {
+		return -1;
+	}
+	lua_createtable(state, 0, 0);
+	lua_setglobal(state, "_args");
+	if(sushi_load_code(state, code) != 0) {
+		return -1;
+	}
+	if(sushi_pcall(state, 0, 0) != LUA_OK) {
+		sushi_error("Execution failed: `%s'", sushi_error_to_string(state));
+		return -1;
+	}
+	lua_getglobal(state, "_main");
+	if(lua_isnil(state, -1)) {
+		sushi_error("The program does not define a _main function and cannot be served from a zygote.");
+		return -1;
+	}
+	lua_pop(state, 1);
+	// An optional _warmup function lets the program exercise its hot paths
+	// once, so that every fork starts with the traces already compiled.
+	lua_getglobal(state, "_warmup");
+	if(lua_isfunction(state, -1)) {
+		if(sushi_pcall(state, 0, 0) != LUA_OK) {
+			sushi_error("Warmup failed: `%s'", sushi_error_to_string(state));
+			lua_pop(state, 1);
+		}
+	}
+	else {
+		lua_pop(state, 1);
+	}
+	lua_gc(state, LUA_GCCOLLECT, 0);
+	int fd = zygote_listen(socketPath);
+	if(fd < 0) {
+		return -1;
+	}
+	signal(SIGCHLD, SIG_IGN);
+	while(1) {
+		int conn = accept(fd, NULL, NULL);
+		if(conn < 0) {
+			if(errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			sushi_error("Failed to accept zygote connection: %s", strerror(errno));
+			break;
+		}
+		if(zygote_check_peer(conn) != 0) {
+			sushi_error("Rejected a zygote connection from another user.");
+			close(conn);
+			continue;
+		}
+		fflush(NULL);
+		pid_t pid = fork();
+		if(pid == 0) {
+			close(fd);
+			// The server may run with job control signals ignored; the
+			// program gets the dispositions of a normally started process.
+			signal(SIGCHLD, SIG_DFL);
+			signal(SIGINT, SIG_DFL);
+			signal(SIGTERM, SIG_DFL);
+			signal(SIGHUP, SIG_DFL);
+			signal(SIGQUIT, SIG_DFL);
+			_exit(zygote_run_request(state, conn));
+		}
+		if(pid < 0) {
+			sushi_error("Failed to fork zygote: %s", strerror(errno));
+		}
+		close(conn);
+	}
+	close(fd);
+	return -1;
+}
+
+static void zygote_forward_signal(int sig)
+{
+	if(zygote_client_target > 0) {
+		kill(zygote_client_target, sig);
+	}
+}
+
+static char* zygote_append_string(char* p, const char* str)
+{
+	size_t len = strlen(str) + 1;
+	memcpy(p, str, len);
+	return p + len;
+}
+
+int zygote_connect(const char* socketPath, int argc, const char** argv, int argcReserved)
+{
+	char cwd[PATH_MAX+1];
+	if(getcwd(cwd, PATH_MAX) == NULL) {
+		sushi_error("Failed to get the current directory.");
+		return -1;
+	}
+	uint32_t nargs = argc > argcReserved ? argc - argcReserved : 0;
+	uint32_t nenv = 0;
+	size_t size = 8 + strlen(cwd) + 1;
+	int n;
+	for(n=argcReserved; n<argc; n++) {
+		size += strlen(argv[n]) + 1;
+	}
+	for(n=0; environ[n] != NULL; n++) {
+		size += strlen(environ[n]) + 1;
+		nenv++;
+	}
+	if(size > ZYGOTE_MAX_REQUEST_SIZE) {
+		sushi_error("Zygote request is too large.");
+		return -1;
+	}
+	char* request = (char*)malloc(ZYGOTE_HEADER_SIZE + size);
+	if(request == NULL) {
+		return -1;
+	}
+	uint32_t sz32 = (uint32_t)size;
+	memcpy(request, ZYGOTE_MAGIC, 4);
+	memcpy(request + 4, &sz32, 4);
+	memcpy(request + 8, &nargs, 4);
+	memcpy(request + 12, &nenv, 4);
+	char* p = zygote_append_string(request + 16, cwd);
+	for(n=argcReserved; n<argc; n++) {
+		p = zygote_append_string(p, argv[n]);
+	}
+	for(n=0; n<(int)nenv; n++) {
+		p = zygote_append_string(p, environ[n]);
+	}
+	signal(SIGPIPE, SIG_IGN);
+	int fd = zygote_open_connection(socketPath);
+	if(fd < 0) {
+		sushi_error("Failed to connect to zygote: `%s'", socketPath);
+		free(request);
+		return -1;
+	}
+	int fds[3] = { 0, 1, 2 };
+	char control[CMSG_SPACE(sizeof(fds))];
+	memset(control, 0, sizeof(control));
+	struct iovec iov;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = request;
+	iov.iov_len = ZYGOTE_HEADER_SIZE;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	ssize_t r;
+	do {
+		r = sendmsg(fd, &msg, 0);
+	}
+	while(r < 0 && errno == EINTR);
+	int wr = r == ZYGOTE_HEADER_SIZE ? zygote_write_all(fd, request + ZYGOTE_HEADER_SIZE, size) : -1;
+	free(request);
+	if(wr != 0) {
+		sushi_error("Failed to send request to zygote: `%s'", socketPath);
+		close(fd);
+		return -1;
+	}
+	int32_t pid;
+	if(zygote_read_all(fd, &pid, 4) != 0) {
+		sushi_error("Zygote did not accept the request: `%s'", socketPath);
+		close(fd);
+		return -1;
+	}
+	zygote_client_target = (pid_t)pid;
+	signal(SIGINT, zygote_forward_signal);
+	signal(SIGTERM, zygote_forward_signal);
+	signal(SIGHUP, zygote_forward_signal);
+	signal(SIGQUIT, zygote_forward_signal);
+	int32_t status;
+	if(zygote_read_all(fd, &status, 4) != 0) {
+		sushi_error("The program terminated abnormally.");
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return (int)status;
+}
+
+#else
+
+int zygote_serve(const char* socketPath, SushiCode* code)
+{
+	sushi_error("Zygote mode is not supported on this platform.");
+	return -1;
+}
+
+int zygote_connect(const char* socketPath, int argc, const char** argv, int argcReserved)
+{
+	sushi_error("Zygote mode is not supported on this platform.");
+	return -1;
+}
+
+#endif
@@ -0,0 +1,49 @@
+
+/*
+ * This file is part of SushiVM
+ * Copyright (c) 2019-2021 J42 Pte Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include "sushi.h"
+
+/*
+ * Zygote mode keeps a process with the program already loaded (libraries
+ * initialized, code compiled, top level chunk executed) listening on a Unix
+ * domain socket. Each client connection is served by a fork of that process
+ * which takes over the argv, environment, working directory and standard
+ * file descriptors of the client and then calls the _main function of the
+ * program. The exit code of the program is passed back to the client.
+ *
+ * A request starts with "SZG1" and the 32 bit (native endian) length of the
+ * remainder, sent together with the client's fds 0, 1 and 2 (SCM_RIGHTS).
+ * The remainder holds the 32 bit argument and environment counts followed by
+ * NUL terminated strings: the working directory, the arguments and the
+ * environment. The server replies with the 32 bit process id of the fork and,
+ * once the program finishes, its 32 bit exit code.
+ */
+
+int zygote_serve(const char* socketPath, SushiCode* code);
+int zygote_connect(const char* socketPath, int argc, const char** argv, int argcReserved);
+
+#endif